@@ -116,6 +116,26 @@
  * connect to running servers it is STRONGLY recommended to only create or remove
  * this file prior to a system reboot or container restart.
  *
+ * A socket server reads requests several at a time while a client keeps
+ * it busy.  Each connection holds a receive buffer of one max_msg_size
+ * request, growing to as many as 16 of them (but no more than 256KiB,
+ * unless one request is bigger) while a burst is being read, and going
+ * back to one when the burst is over.
+ *
+ * @par Tracing
+ * When built with sys/sdt.h available (see ./configure --disable-tracepoints)
+ * the IPC code carries static tracepoints for tools like perf, bpftrace or
+ * SystemTap.  They sit in the "libqb" provider and do nothing unless a tracer
+ * is attached.  Each one passes the connection description (the service
+ * name on the client side), the message id and the message size:
+ * - ipcc_request_send: a client wrote a request.
+ * - ipcs_request_recv: the server took a request to process it.
+ * - ipcs_response_send: the server wrote a response.
+ * - ipcs_event_send: the server wrote an event.
+ * - ipcc_event_recv: a client read an event.
+ * - ipcs_flow_control: the server switched flow control; the id is the
+ *   new state and the size is 0.
+ *
  * @par Client API
  * @copydoc qbipcc.h
  * @see qbipcc.h
@@ -61,6 +61,22 @@ enum qb_ipc_type {
 #define QB_IPC_MSG_AUTHENTICATE -1
 #define QB_IPC_MSG_NEW_EVENT_SOCK -2
 #define QB_IPC_MSG_DISCONNECT -3
+#define QB_IPC_MSG_LARGE -4
+#define QB_IPC_MSG_EVENT_FILTER -5
+
+/**
+ * Most ranges an event subscription can have.
+ * @see qb_ipcc_event_subscribe()
+ */
+#define QB_IPC_EVENT_RANGES_MAX 16
+
+/**
+ * Event ids from first to last, both included.
+ */
+struct qb_ipc_event_range {
+	int32_t first;
+	int32_t last;
+};
 
 /* *INDENT-OFF* */
 #ifdef __cplusplus
@@ -110,6 +110,62 @@ qb_ipcc_connect_async(const char *name, size_t max_msg_size, int *connect_fd);
 int
 qb_ipcc_connect_continue(struct qb_ipcc_connection * c);
 
+/**
+ * Connection parameters for qb_ipcc_connect_2().
+ *
+ * Each direction of the connection gets its own buffer size, so a
+ * client that sends small requests but receives large responses (or
+ * never subscribes to events) does not pay for three equally sized
+ * buffers.  A size of 0 falls back to max_msg_size.
+ */
+struct qb_ipcc_connect_params {
+	size_t max_msg_size;		/**< default for any size left at 0 */
+	size_t max_request_size;	/**< largest request the client sends */
+	size_t max_response_size;	/**< largest response the client expects */
+	size_t max_event_size;		/**< largest event the client expects */
+	size_t max_large_msg_size;	/**< largest message sent out of band,
+					     0 disables */
+	size_t max_hipri_msg_size;	/**< largest message sent with
+					     QB_IPCC_SEND_HIGH, 0 disables */
+};
+
+/**
+ * Create a connection to an IPC service with per-direction buffer sizes.
+ *
+ * @param name name of the service.
+ * @param params buffer sizes to negotiate with the server.
+ * @return NULL (error: see errno) or a connection object.
+ *
+ * @note The server may enforce larger sizes (see
+ * qb_ipcs_enforce_buffer_size()).  A server that predates per-direction
+ * sizes uses the largest of the requested sizes for every direction.
+ * @note With shared memory IPC the event buffer is only created once the
+ * server sends the first event.
+ * @note Messages that do not fit a buffer but are no bigger than
+ * max_large_msg_size are passed in a separate shared file, if the server
+ * allows it (see qb_ipcs_large_msg_max_set()).  The receive buffer handed
+ * to qb_ipcc_recv() or qb_ipcc_event_recv() must then be big enough for
+ * the whole message.
+ */
+qb_ipcc_connection_t*
+qb_ipcc_connect_2(const char *name,
+		  const struct qb_ipcc_connect_params *params);
+
+/**
+ * Asynchronously connect to an IPC service with per-direction buffer sizes.
+ *
+ * @param name name of the service.
+ * @param params buffer sizes to negotiate with the server.
+ * @param connect_fd return FD to continue connection with
+ * @return NULL (error: see errno) or a connection object.
+ *
+ * @see qb_ipcc_connect_async() qb_ipcc_connect_2()
+ */
+qb_ipcc_connection_t *
+qb_ipcc_connect_async_2(const char *name,
+			const struct qb_ipcc_connect_params *params,
+			int *connect_fd);
+
 /**
  * Test kernel dgram socket buffers to verify the largest size up
  * to the max_msg_size value a single msg can be. Rounds down to the
@@ -127,6 +183,10 @@ qb_ipcc_verify_dgram_max_msg_size(size_t max_msg_size);
 /**
  * Disconnect an IPC connection.
  *
+ * In thread-safe mode (see qb_ipcc_threadsafe_set()) the calls still
+ * waiting for a response return -ENOTCONN; this waits for them to
+ * return before the connection is freed.
+ *
  * @param c connection instance
  */
 void qb_ipcc_disconnect(qb_ipcc_connection_t* c);
@@ -187,6 +247,58 @@ ssize_t qb_ipcc_send(qb_ipcc_connection_t* c, const void *msg_ptr,
  */
 ssize_t qb_ipcc_sendv(qb_ipcc_connection_t* c, const struct iovec* iov,
 	size_t iov_len);
+
+/**
+ * Which request lane a message is sent on.
+ */
+enum qb_ipcc_send_priority {
+	QB_IPCC_SEND_NORMAL,	/**< the ordinary request buffer */
+	QB_IPCC_SEND_HIGH,	/**< the high priority request buffer */
+};
+
+/**
+ * Send a message, optionally on the high priority lane.
+ *
+ * A connection made with qb_ipcc_connect_2() and a non-zero
+ * max_hipri_msg_size gets a second, separate request buffer.  The server
+ * always handles whatever is waiting there before it takes the next
+ * message from the ordinary request buffer, and it does so even while
+ * it has flow control switched on, so a small control message (a cancel
+ * or a health check, say) does not have to queue up behind a backlog
+ * of bulk requests.
+ *
+ * @param c connection instance
+ * @param msg_ptr pointer to a message to send
+ * @param msg_len the size of the message
+ * @param prio QB_IPCC_SEND_NORMAL or QB_IPCC_SEND_HIGH
+ * @return (size sent, -errno == error)
+ * @retval -ENOTSUP QB_IPCC_SEND_HIGH but the server did not grant a
+ * high priority lane
+ * @retval -EBUSY QB_IPCC_SEND_HIGH in thread-safe mode
+ *
+ * @note Responses still come back on the one response channel, so the
+ * response to a high priority request can overtake the responses to
+ * requests sent earlier.  That is why high priority sends are refused
+ * in thread-safe mode (see qb_ipcc_threadsafe_set()), which matches
+ * responses to requests by order.
+ * @note With QB_IPCC_SEND_NORMAL this is the same as qb_ipcc_send().
+ */
+ssize_t qb_ipcc_send_prio(qb_ipcc_connection_t *c, const void *msg_ptr,
+			  size_t msg_len, enum qb_ipcc_send_priority prio);
+
+/**
+ * Send a message (iovec), optionally on the high priority lane.
+ *
+ * @param c connection instance
+ * @param iov pointer to an iovec struct to send
+ * @param iov_len the number of iovecs used
+ * @param prio QB_IPCC_SEND_NORMAL or QB_IPCC_SEND_HIGH
+ * @return (size sent, -errno == error)
+ *
+ * @see qb_ipcc_send_prio()
+ */
+ssize_t qb_ipcc_sendv_prio(qb_ipcc_connection_t *c, const struct iovec *iov,
+			   size_t iov_len, enum qb_ipcc_send_priority prio);
 /**
  * Receive a response.
  *
@@ -280,11 +392,136 @@ int32_t qb_ipcc_is_connected(qb_ipcc_connection_t *c);
  * important for the client side to know the buffer size in use
  * so the client can successfully retrieve large server events.
  *
+ * @note For connections made with qb_ipcc_connect_2() this is the
+ * event buffer size.
+ *
  * @param c connection instance
  * @retval connection size in bytes or -error code
  */
 int32_t qb_ipcc_get_buffer_size(qb_ipcc_connection_t * c);
 
+/**
+ * Busy-poll counters of a client connection.
+ * @see qb_ipcc_busy_poll_stats_get()
+ */
+struct qb_ipcc_busy_poll_stats {
+	uint64_t polls;	/**< receives that started by spinning */
+	uint64_t hits;	/**< spins that saw the response arrive */
+};
+
+/**
+ * Spin for a response before sleeping.
+ *
+ * When set, qb_ipcc_recv() and qb_ipcc_sendv_recv() watch the response
+ * channel for up to usec microseconds before falling back to the usual
+ * blocking wait.  This trades CPU time for latency and is only worth it
+ * when the client has a core to itself.
+ *
+ * @param c connection instance
+ * @param usec how long to spin, 0 (the default) disables busy polling.
+ * @return 0 or -errno
+ */
+int32_t qb_ipcc_busy_poll_set(qb_ipcc_connection_t *c, uint32_t usec);
+
+/**
+ * Get the busy-poll counters of a connection.
+ *
+ * @param c connection instance
+ * @param stats (out) the counters
+ * @param clear_after_read clear the counters after reading them
+ * @return 0 or -errno
+ */
+int32_t qb_ipcc_busy_poll_stats_get(qb_ipcc_connection_t *c,
+				    struct qb_ipcc_busy_poll_stats *stats,
+				    int32_t clear_after_read);
+
+/**
+ * Let several threads share the connection.
+ *
+ * Once enabled, qb_ipcc_sendv_recv() may be called from any number of
+ * threads at once: requests are sent one after the other and every
+ * thread gets back the response to its own request, while waiting for
+ * responses happens in parallel.  Responses are matched to requests by
+ * order (the n-th response answers the n-th request), so the server must
+ * answer every request with exactly one response, in the order the
+ * requests came in.  qb_ipcs_workers_set() keeps that order.  A server
+ * that skips or repeats a response hands every later caller somebody
+ * else's; if the response ids tell which request they answer, use
+ * qb_ipcc_threadsafe_match_set() to catch that.
+ *
+ * qb_ipcc_send(), qb_ipcc_sendv() and qb_ipcc_recv() return -EBUSY in
+ * this mode.  qb_ipcc_event_recv() is not affected, but should only be
+ * called from one thread at a time.
+ *
+ * If a call times out, the response to its request is thrown away when
+ * it arrives.  Going back to single-threaded mode takes in the responses
+ * that have arrived for such calls and fails with -EBUSY while any are
+ * still to come, so try again later.
+ *
+ * @param c connection instance
+ * @param enable QB_TRUE to enable, QB_FALSE to go back to single-threaded
+ * @return 0, -EBUSY if disabling while calls are in progress or responses
+ *         to timed out calls are still to come, or -errno
+ */
+int32_t qb_ipcc_threadsafe_set(qb_ipcc_connection_t *c, int32_t enable);
+
+/**
+ * Tells whether a response answers a request, by their ids.
+ *
+ * @param request_id the id of the request
+ * @param response_id the id of the response
+ * @return QB_TRUE if it does
+ */
+typedef int32_t (*qb_ipcc_response_match_fn)(int32_t request_id,
+					      int32_t response_id);
+
+/**
+ * Match responses to requests by id in thread-safe mode.
+ *
+ * Each response goes to the oldest waiting call whose request it
+ * matches.  The calls before that one fail with -ENOMSG, as the server
+ * has skipped their responses, and a response that matches no call is
+ * dropped and logged.  Requests with ids that match the same responses
+ * are still told apart by order.
+ *
+ * @note A response that does not go to the oldest call is copied into
+ * the buffer of its caller, and fails with -EMSGSIZE if it does not fit.
+ * @note Only while thread-safe mode is on, see qb_ipcc_threadsafe_set().
+ *
+ * @param c connection instance
+ * @param match the match function, NULL to go back to matching by order
+ * @return 0, -EINVAL if not in thread-safe mode
+ */
+int32_t qb_ipcc_threadsafe_match_set(qb_ipcc_connection_t *c,
+				     qb_ipcc_response_match_fn match);
+
+/**
+ * Only receive the events with these ids.
+ *
+ * The server checks the id (the first field of the event's
+ * qb_ipc_response_header) of every event it sends on this connection
+ * and drops those outside all of the ranges before they are copied or
+ * the client is woken up; to the server it looks as if they had been
+ * sent.  Events the server sent before it got the subscription may still
+ * arrive.
+ *
+ * The subscription is sent as a request but has no response, so it can
+ * be changed at any time, also in thread-safe mode.
+ *
+ * @note Only for connections made with qb_ipcc_connect_2() or
+ * qb_ipcc_connect_async_2().
+ *
+ * @param c connection instance
+ * @param ranges event ids to receive
+ * @param num_ranges number of ranges, up to QB_IPC_EVENT_RANGES_MAX;
+ *        0 receives every event again (the default).
+ * @return 0, -ENOTSUP if the server can't filter events for this
+ *         connection, or -errno
+ */
+int32_t qb_ipcc_event_subscribe(qb_ipcc_connection_t *c,
+				const struct qb_ipc_event_range *ranges,
+				uint32_t num_ranges);
+
 /* *INDENT-OFF* */
 #ifdef __cplusplus
 }
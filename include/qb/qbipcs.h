@@ -91,6 +91,76 @@ struct qb_ipcs_connection_stats_2 {
 	uint32_t event_q_length;
 };
 
+/**
+ * Number of buckets in a #qb_ipcs_latency_histogram.
+ */
+#define QB_IPCS_LATENCY_BUCKETS 40
+
+/**
+ * Most request ids a qb_ipcs_msg_handlers_set() table can span.
+ */
+#define QB_IPCS_MSG_HANDLERS_SPAN 4096
+
+/**
+ * Log-bucketed latency histogram.
+ *
+ * buckets[0] counts samples below 2ns, buckets[i] counts samples in
+ * [2^i, 2^(i+1)) nanoseconds and the last bucket also counts everything
+ * longer than that.
+ */
+struct qb_ipcs_latency_histogram {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[QB_IPCS_LATENCY_BUCKETS];
+};
+
+/**
+ * Connection statistics with latency histograms.
+ *
+ * - queue_latency: from when the server saw a request waiting to when
+ *   msg_process was called for it (including time spent waiting for a
+ *   worker thread, see qb_ipcs_workers_set()).
+ * - process_latency: time spent in msg_process.
+ * - event_latency: time taken to write an event to the client, the same
+ *   for events sent straight away and events queued by msg_process
+ *   running on a worker thread.
+ * - event_queue_latency: how long an event queued by a worker thread
+ *   waited for the main loop to send it.  Events sent straight away
+ *   don't wait and don't show up here.
+ *
+ * Neither covers the client reading the event, which the server can't
+ * see.
+ */
+struct qb_ipcs_connection_stats_3 {
+	int32_t client_pid;
+	uint64_t requests;
+	uint64_t responses;
+	uint64_t events;
+	uint64_t send_retries;
+	uint64_t recv_retries;
+	int32_t flow_control_state;
+	uint64_t flow_control_count;
+	uint32_t event_q_length;
+	struct qb_ipcs_latency_histogram queue_latency;
+	struct qb_ipcs_latency_histogram process_latency;
+	struct qb_ipcs_latency_histogram event_latency;
+	struct qb_ipcs_latency_histogram event_queue_latency;
+};
+
+/**
+ * Service statistics with the latency histograms of all its connections,
+ * including those already closed.
+ */
+struct qb_ipcs_stats_2 {
+	uint32_t active_connections;
+	uint32_t closed_connections;
+	struct qb_ipcs_latency_histogram queue_latency;
+	struct qb_ipcs_latency_histogram process_latency;
+	struct qb_ipcs_latency_histogram event_latency;
+	struct qb_ipcs_latency_histogram event_queue_latency;
+};
+
 typedef int32_t (*qb_ipcs_dispatch_fn_t) (int32_t fd, int32_t revents,
 					  void *data);
 
@@ -145,6 +215,9 @@ struct qb_ipcs_poll_handlers {
  * the accept callback returns 0, that does not guarantee the
  * create and closed callback functions will follow.
  * @note you can call qb_ipcs_connection_auth_set() within this function.
+ * @note Return -EINPROGRESS to make the decision later, e.g. after asking
+ * another process; the client waits until
+ * qb_ipcs_connection_accept_complete() is called for the connection.
  */
 typedef int32_t (*qb_ipcs_connection_accept_fn) (qb_ipcs_connection_t *c,
 						 uid_t uid, gid_t gid);
@@ -191,6 +264,33 @@ struct qb_ipcs_service_handlers {
 	qb_ipcs_connection_destroyed_fn connection_destroyed;
 };
 
+/**
+ * A request handler for qb_ipcs_msg_handlers_set().
+ *
+ * min_size and max_size bound hdr.size, so they include the
+ * qb_ipc_request_header; a max_size of 0 means no limit.
+ */
+struct qb_ipcs_msg_handler {
+	int32_t id;
+	uint32_t min_size;
+	uint32_t max_size;
+	qb_ipcs_msg_process_fn fn;
+};
+
+/**
+ * Statistics of one request id.
+ *
+ * - count, bytes: requests handled and their total size.
+ * - total_ns: time spent in the handler.
+ * - rejected: requests refused for being too small or too large.
+ */
+struct qb_ipcs_msg_stats {
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t rejected;
+};
+
 /**
  * Create a new IPC server.
  *
@@ -420,6 +520,19 @@ struct qb_ipcs_connection_stats_2*
 qb_ipcs_connection_stats_get_2(qb_ipcs_connection_t *c,
 			       int32_t clear_after_read);
 
+/**
+ * Get (and allocate) the connection statistics, including latency
+ * histograms.
+ *
+ * @param clear_after_read clear stats after copying them into stats
+ * @param c connection instance
+ * @retval NULL if no memory or invalid connection
+ * @retval allocated statistics structure (user must free it).
+ */
+struct qb_ipcs_connection_stats_3*
+qb_ipcs_connection_stats_get_3(qb_ipcs_connection_t *c,
+			       int32_t clear_after_read);
+
 /**
  * Get the service statistics.
  *
@@ -432,6 +545,33 @@ int32_t qb_ipcs_stats_get(qb_ipcs_service_t* pt,
 			  struct qb_ipcs_stats* stats,
 			  int32_t clear_after_read);
 
+/**
+ * Get the service statistics, including latency histograms.
+ *
+ * @note clear_after_read does not reset active_connections.
+ *
+ * @param stats (out) the statistics structure
+ * @param clear_after_read clear stats after copying them into stats
+ * @param pt service instance
+ * @return 0 == ok; -errno to indicate a failure
+ */
+int32_t qb_ipcs_stats_get_2(qb_ipcs_service_t* pt,
+			    struct qb_ipcs_stats_2* stats,
+			    int32_t clear_after_read);
+
+/**
+ * Estimate a percentile from a latency histogram.
+ *
+ * The result is the upper bound of the bucket the percentile falls in,
+ * but never more than the longest latency seen.
+ *
+ * @param h the histogram
+ * @param percentile between 0 and 100 (e.g. 99.9)
+ * @return latency in nanoseconds (0 if the histogram is empty)
+ */
+uint64_t qb_ipcs_latency_percentile_get(
+	const struct qb_ipcs_latency_histogram *h, float percentile);
+
 /**
  * Get the first connection.
  *
@@ -465,15 +605,37 @@ qb_ipcs_connection_t * qb_ipcs_connection_next_get(qb_ipcs_service_t* pt,
  *
  * @see chmod() chown()
  * @note this must be called within the qb_ipcs_connection_accept_fn()
- * callback.
+ * callback, or before qb_ipcs_connection_accept_complete() if the
+ * decision was deferred.
  */
 void qb_ipcs_connection_auth_set(qb_ipcs_connection_t *conn, uid_t uid,
 				 gid_t gid, mode_t mode);
 
+/**
+ * Finish a connection whose qb_ipcs_connection_accept_fn() returned
+ * -EINPROGRESS.
+ *
+ * The connection is then set up (or refused) exactly as if the accept
+ * callback had returned result, including the created callback.  It has
+ * to be called once for every deferred connection, from the thread
+ * running the service's loop, and also after qb_ipcs_destroy(), in which
+ * case the client is refused.
+ *
+ * @param conn connection instance
+ * @param result 0 to accept or -errno to refuse (sent back to the client)
+ * @return 0 if the connection was set up, -errno otherwise; -EINVAL if
+ * the accept wasn't deferred.
+ */
+int32_t qb_ipcs_connection_accept_complete(qb_ipcs_connection_t *conn,
+					   int32_t result);
+
 /**
  * Retrieve the connection ipc buffer size. This reflects the
  * largest size msg that can be sent or received.
  *
+ * @note Clients connecting with qb_ipcc_connect_2() may negotiate a
+ * different size for each direction; this returns the response size.
+ *
  * @param conn connection instance
  * @return msg size in bytes, negative value on error.
  */
@@ -491,6 +653,147 @@ int32_t qb_ipcs_connection_get_buffer_size(qb_ipcs_connection_t *conn);
  */
 void qb_ipcs_enforce_buffer_size(qb_ipcs_service_t *s, uint32_t max_buf_size);
 
+/**
+ * Accept messages larger than the connection buffers.
+ *
+ * Clients that ask for it (see qb_ipcc_connect_params) may then exchange
+ * messages of up to max_size bytes.  Such a message is written to a
+ * separate shared file and only a small descriptor goes through the
+ * buffer; on the server side msg_process() gets the mapped file directly.
+ *
+ * @note Only available where connections have their own directory
+ * (Linux); elsewhere clients are told large messages are not supported.
+ *
+ * @param s ipc server instance
+ * @param max_size largest message in bytes, 0 (the default) disables.
+ */
+void qb_ipcs_large_msg_max_set(qb_ipcs_service_t *s, uint32_t max_size);
+
+/**
+ * Run msg_process() on a pool of worker threads.
+ *
+ * Each request is copied off the connection and handed to the next free
+ * worker, so one expensive request no longer holds up every other client
+ * on the loop.  Responses and events sent from msg_process() are kept and
+ * only sent from the loop thread, in the order the requests were received
+ * on each connection.  A connection with max_in_flight requests queued or
+ * running is flow controlled until some of them are answered.
+ * Requests on the high priority lane (see qb_ipcc_send_prio()) skip the
+ * queue: msg_process() runs for them on the loop thread as they come in,
+ * flow control or not, and their responses are sent straight away.
+ *
+ * @note In this mode msg_process() must not call anything but
+ * qb_ipcs_response_send(), qb_ipcs_response_sendv(), qb_ipcs_event_send(),
+ * qb_ipcs_event_sendv() and the connection getters; their return value is
+ * the size queued, and its own return value is ignored.
+ * @note Must be called before qb_ipcs_run().
+ *
+ * @param s ipc server instance
+ * @param num_threads number of worker threads, 0 (the default) runs
+ *        msg_process() on the loop thread.
+ * @param max_in_flight requests per connection before flow control kicks in,
+ *        ignored when num_threads is 0.
+ * @return 0 or -errno
+ */
+int32_t qb_ipcs_workers_set(qb_ipcs_service_t *s, uint32_t num_threads,
+			    uint32_t max_in_flight);
+
+/**
+ * Let shared memory clients wake the server through one shared doorbell.
+ *
+ * Normally every shm client writes a byte to its own socket for each
+ * request and the server polls one socket per client.  In doorbell mode
+ * a client marks its connection in a bitmap shared by the whole service
+ * and only rings the doorbell if its mark was not set already; the
+ * server wakes up once, then dispatches just the connections that are
+ * marked.  The cost of a wakeup follows the number of busy clients,
+ * not the number of connected ones.
+ *
+ * Clients connected with qb_ipcc_connect_2() or qb_ipcc_connect_async_2()
+ * get a slot while there is one free; any others keep notifying the
+ * server through their own socket.  The per-client socket is still
+ * polled, but only so the server notices a client going away.
+ *
+ * @note The bitmap is writable by every doorbell client of the service.
+ * Any one of them can keep clearing the bits of the others, and the
+ * server then never looks at their requests: it can starve them for as
+ * long as it likes, not just delay them.  Every client sharing the
+ * doorbell must be trusted; don't enable it for a service that accepts
+ * clients which aren't.
+ * @note Only for QB_IPC_SHM services.  Must be called before
+ * qb_ipcs_run().
+ *
+ * @param s ipc server instance
+ * @param max_connections number of doorbell slots, 0 (the default)
+ *        disables it.
+ * @return 0, -ENOTSUP if the service is not shared memory, or -errno
+ */
+int32_t qb_ipcs_doorbell_set(qb_ipcs_service_t *s, uint32_t max_connections);
+
+/**
+ * Release the resources of closed connections in the background.
+ *
+ * Once a connection is gone its buffers still have to be unmapped and
+ * their files, as well as the connection's directory, removed.  That is
+ * normally done right away.  With this set, the work is queued instead
+ * and done from a QB_LOOP_LOW job, at most max_per_iteration connections
+ * each time the job runs, so many clients going away at once doesn't
+ * stall the requests of the others.  The connection stops being
+ * dispatched and the connection_closed/connection_destroyed callbacks
+ * are called as before.
+ *
+ * @note qb_ipcs_destroy() finishes whatever is still queued.
+ *
+ * @param s ipc server instance
+ * @param max_per_iteration connections released per job run, 0 (the
+ *        default) releases them straight away.
+ * @return 0 or -errno
+ */
+int32_t qb_ipcs_deferred_teardown_set(qb_ipcs_service_t *s,
+				      uint32_t max_per_iteration);
+
+/**
+ * Dispatch requests to a handler per request id.
+ *
+ * Each request is looked up by hdr.id in a table indexed by id.  If its
+ * size is outside the handler's bounds it is refused without calling the
+ * handler: the client gets a bare qb_ipc_response_header with the
+ * request's id and an error of -EINVAL.  Ids without a handler go to
+ * msg_process, or are refused with -ENOSYS if the service has none.
+ * Handlers are called in place of msg_process, with the same arguments,
+ * and the same rules apply to them (see qb_ipcs_workers_set()).
+ *
+ * Count, size and handler time are kept per id, see
+ * qb_ipcs_msg_stats_get().
+ *
+ * @note The ids must be at least QB_IPC_MSG_USER_START and no more than
+ * QB_IPCS_MSG_HANDLERS_SPAN apart, as the table covers every id from
+ * the lowest to the highest.
+ * @note Must be called before qb_ipcs_run().
+ *
+ * @param s ipc server instance
+ * @param handlers the handlers, copied
+ * @param num_handlers number of handlers, 0 removes the table
+ * @return 0, -EEXIST for an id given twice, -E2BIG if the ids are too
+ *         far apart, or -errno
+ */
+int32_t qb_ipcs_msg_handlers_set(qb_ipcs_service_t *s,
+				 const struct qb_ipcs_msg_handler *handlers,
+				 uint32_t num_handlers);
+
+/**
+ * Get the statistics of one request id.
+ *
+ * @param s ipc server instance
+ * @param id request id given to qb_ipcs_msg_handlers_set()
+ * @param stats (out) the statistics structure
+ * @param clear_after_read clear stats after copying them into stats
+ * @return 0, -ENOENT if there is no handler for id, or -errno
+ */
+int32_t qb_ipcs_msg_stats_get(qb_ipcs_service_t *s, int32_t id,
+			      struct qb_ipcs_msg_stats *stats,
+			      int32_t clear_after_read);
+
 /* *INDENT-OFF* */
 #ifdef __cplusplus
 }
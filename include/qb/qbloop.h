@@ -69,6 +69,43 @@ enum qb_loop_priority {
 	QB_LOOP_HIGH = 2,
 };
 
+/**
+ * Or into the events of qb_loop_poll_add() or qb_loop_poll_mod() to
+ * have the descriptor reported when it becomes ready rather than for as
+ * long as it stays ready.  The dispatch function must then drain it
+ * (read or write until EAGAIN) or it won't be called again.
+ * Honoured by the epoll and io_uring poll drivers; elsewhere the
+ * descriptor stays level triggered.
+ */
+#define QB_LOOP_POLL_EDGE_TRIGGERED	0x40000000
+
+/**
+ * Loop statistics, see qb_loop_stats_get().
+ */
+struct qb_loop_stats {
+	uint64_t job_allocs;	/**< job items allocated from the heap */
+	uint64_t job_reuses;	/**< job items taken from the item cache */
+	uint32_t job_cached;	/**< job items in the item cache now */
+	uint64_t timer_allocs;	/**< timer items allocated from the heap */
+	uint64_t timer_reuses;	/**< timer items taken from the item cache */
+	uint32_t timer_cached;	/**< timer items in the item cache now */
+	uint32_t item_cache_max;	/**< cap on each item cache */
+	/** jobs, timers and poll events dispatched, per priority */
+	uint64_t level_dispatched[3];
+	/** how long the pending work of each priority has waited for its turn */
+	uint64_t level_wait_ns[3];
+	/** the longest wait seen on each priority */
+	uint64_t level_wait_max_ns[3];
+};
+
+/**
+ * How the loop shares its passes between the priority levels.
+ */
+enum qb_loop_scheduler {
+	QB_LOOP_SCHED_ROTATE = 0,	/**< lower levels join in turn (default) */
+	QB_LOOP_SCHED_WEIGHTED = 1,	/**< every level gets its quantum each pass */
+};
+
 /**
  * An opaque data type representing the main loop.
  */
@@ -78,6 +115,23 @@ typedef uint64_t qb_loop_timer_handle;
 
 typedef void *qb_loop_signal_handle;
 
+/**
+ * How a loop keeps its timers.
+ */
+enum qb_loop_timer_backend {
+	QB_LOOP_TIMER_HEAP = 0,	/**< binary heap, O(log n) add/del (default) */
+	QB_LOOP_TIMER_WHEEL = 1,	/**< hierarchical wheel, O(1) add/del */
+};
+
+/**
+ * What a periodic timer does about the periods it missed while the
+ * loop was busy.
+ */
+enum qb_loop_timer_overrun {
+	QB_LOOP_TIMER_OVERRUN_CATCH_UP = 0,	/**< dispatch every missed period */
+	QB_LOOP_TIMER_OVERRUN_SKIP = 1,	/**< drop missed periods, keep the phase */
+};
+
 typedef int32_t (*qb_loop_poll_dispatch_fn) (int32_t fd, int32_t revents, void *data);
 typedef void (*qb_loop_job_dispatch_fn)(void *data);
 typedef void (*qb_loop_timer_dispatch_fn)(void *data);
@@ -110,6 +164,65 @@ void qb_loop_stop(qb_loop_t *l);
  */
 void qb_loop_run(qb_loop_t *l);
 
+/**
+ * Get the loop statistics.
+ *
+ * @param l pointer to the loop instance
+ * @param stats (out) the statistics
+ * @return status (0 == ok, -errno == failure)
+ */
+int32_t qb_loop_stats_get(qb_loop_t *l, struct qb_loop_stats *stats);
+
+/**
+ * Choose how the loop shares its passes between the priority levels.
+ *
+ * Each pass of the loop polls for events and then runs up to a
+ * quantum of the pending items of each level, from high to low.
+ * QB_LOOP_SCHED_ROTATE, the default, runs the high level on every pass
+ * but lets the medium and low levels join in turn, so a flood of high
+ * priority work leaves the low level a third of the passes.
+ * QB_LOOP_SCHED_WEIGHTED runs every level with pending work on every
+ * pass, so the quanta set with qb_loop_level_quantum_set() weigh the
+ * levels against each other (weighted round robin) and low priority
+ * work waits at most one pass however busy the higher levels are.
+ *
+ * @param l pointer to the loop instance
+ * @param scheduler QB_LOOP_SCHED_ROTATE or QB_LOOP_SCHED_WEIGHTED
+ * @retval 0 ok
+ * @retval -EINVAL unknown scheduler
+ */
+int32_t qb_loop_scheduler_set(qb_loop_t *l, enum qb_loop_scheduler scheduler);
+
+/**
+ * Set how many items of a priority level the loop runs per pass.
+ *
+ * The default is 4 for every level.  Larger quanta dispatch more
+ * work between two polls, smaller ones keep the loop responsive.
+ *
+ * @param l pointer to the loop instance
+ * @param p the priority
+ * @param quantum most items to run per pass, at least 1
+ * @return status (0 == ok, -errno == failure)
+ */
+int32_t qb_loop_level_quantum_set(qb_loop_t *l, enum qb_loop_priority p,
+				  uint32_t quantum);
+
+/**
+ * Limit the number of freed job and timer items the loop keeps for reuse.
+ *
+ * Jobs and timers are recycled through per-loop caches rather than
+ * being allocated and freed each time.  Each cache holds up to @p max
+ * items (1024 by default); 0 turns the caching off.
+ *
+ * @note jobs added with qb_loop_job_add_threadsafe() are always
+ * allocated from the heap, they only end up in the cache once done.
+ *
+ * @param l pointer to the loop instance
+ * @param max most items to keep in each cache
+ * @return status (0 == ok, -errno == failure)
+ */
+int32_t qb_loop_item_cache_max_set(qb_loop_t *l, uint32_t max);
+
 
 /**
  * Add a job to the mainloop.
@@ -129,6 +242,30 @@ int32_t qb_loop_job_add(qb_loop_t *l,
 			qb_loop_job_dispatch_fn dispatch_fn);
 
 
+/**
+ * Add a job to the mainloop from any thread.
+ *
+ * Unlike qb_loop_job_add() this may be called from a thread other than
+ * the one running the loop (as well as from the loop thread).  A loop
+ * waiting for events is woken up, and the job runs on the loop thread,
+ * after the jobs that were added before it from the same thread.
+ *
+ * @note it is a one-shot job.
+ * @note qb_loop_job_del() only finds the job once the loop has picked
+ * it up.
+ *
+ * @param l pointer to the loop instance
+ * @param p the priority
+ * @param data user data passed into the dispatch function
+ * @param dispatch_fn callback function
+ * @return 0 once the job is queued (even if waking the loop failed,
+ *         which is only logged), -errno if it couldn't be queued
+ */
+int32_t qb_loop_job_add_threadsafe(qb_loop_t *l,
+				   enum qb_loop_priority p,
+				   void *data,
+				   qb_loop_job_dispatch_fn dispatch_fn);
+
 /**
  * Delete a job from the mainloop.
  *
@@ -167,6 +304,67 @@ int32_t qb_loop_timer_add(qb_loop_t *l,
 			  qb_loop_timer_dispatch_fn dispatch_fn,
 			  qb_loop_timer_handle * timer_handle_out);
 
+/**
+ * Add a timer that may fire anywhere within a window.
+ * @note it is a one-shot job.
+ *
+ * The timer expires no earlier than nsec_duration and no later than
+ * nsec_duration + nsec_slack from now.  The loop sleeps until the
+ * earliest such deadline among its timers and then expires every timer
+ * whose window has opened, so timers with overlapping windows share a
+ * single wakeup instead of waking the loop one by one.  A slack of 0
+ * is the same as qb_loop_timer_add().
+ *
+ * @param l pointer to the loop instance
+ * @param p the priority
+ * @param nsec_duration nano-secs in the future to run the dispatch, at
+ *        the earliest.
+ * @param nsec_slack nano-secs the dispatch may be deferred by.
+ * @param data user data passed into the dispatch function
+ * @param dispatch_fn callback function
+ * @param timer_handle_out handle to delete the timer if needed.
+ * @return status (0 == ok, -errno == failure)
+ */
+int32_t qb_loop_timer_add_with_slack(qb_loop_t *l,
+				     enum qb_loop_priority p,
+				     uint64_t nsec_duration,
+				     uint64_t nsec_slack,
+				     void *data,
+				     qb_loop_timer_dispatch_fn dispatch_fn,
+				     qb_loop_timer_handle * timer_handle_out);
+
+/**
+ * Add a timer that fires every nsec_period until it is deleted.
+ *
+ * The first dispatch is nsec_period from now and each following one
+ * is due exactly a period after the previous due time, so the time
+ * spent waiting for and running the dispatch does not make the timer
+ * drift.  The same handle stays valid for the life of the timer,
+ * qb_loop_timer_del() stops it, also from within its own callback.
+ *
+ * When the loop falls behind by more than a period, the timer either
+ * dispatches once per loop iteration until it has caught up with the
+ * missed periods (QB_LOOP_TIMER_OVERRUN_CATCH_UP), or skips them and
+ * fires next on the first due time still ahead
+ * (QB_LOOP_TIMER_OVERRUN_SKIP).
+ *
+ * @param l pointer to the loop instance
+ * @param p the priority
+ * @param nsec_period nano-secs between dispatches, must not be 0.
+ * @param overrun what to do about missed periods
+ * @param data user data passed into the dispatch function
+ * @param dispatch_fn callback function
+ * @param timer_handle_out handle to delete the timer.
+ * @return status (0 == ok, -errno == failure)
+ */
+int32_t qb_loop_timer_add_periodic(qb_loop_t *l,
+				   enum qb_loop_priority p,
+				   uint64_t nsec_period,
+				   enum qb_loop_timer_overrun overrun,
+				   void *data,
+				   qb_loop_timer_dispatch_fn dispatch_fn,
+				   qb_loop_timer_handle * timer_handle_out);
+
 /**
  * Delete a timer that is still outstanding.
  *
@@ -208,6 +406,47 @@ uint64_t qb_loop_timer_expire_time_get(struct qb_loop *l, qb_loop_timer_handle t
  */
 uint64_t qb_loop_timer_expire_time_remaining(struct qb_loop *l, qb_loop_timer_handle th);
 
+/**
+ * Choose how the loop keeps its timers.
+ *
+ * The timer wheel makes adding and deleting a timer O(1) and expires
+ * the timers due in the same millisecond as a batch, which pays off
+ * with large numbers of timeouts that are mostly deleted before they
+ * expire.  Its timers expire at the first millisecond boundary after
+ * their expiration time, so up to a millisecond later than with the
+ * heap.  Timer handles and the other qb_loop_timer_* functions behave
+ * the same with either backend.
+ *
+ * @note this has to be done before any timer is added to the loop.
+ *
+ * @param l pointer to the loop instance
+ * @param backend QB_LOOP_TIMER_HEAP or QB_LOOP_TIMER_WHEEL
+ * @retval 0 ok
+ * @retval -EBUSY the loop has outstanding timers
+ * @retval -EINVAL unknown backend
+ */
+int32_t qb_loop_timer_backend_set(qb_loop_t *l,
+				  enum qb_loop_timer_backend backend);
+
+/**
+ * Have the loop sleep until exactly the next timer expiration.
+ *
+ * By default the loop waits for its next timer with millisecond
+ * resolution, rounded up, so timers of less than a millisecond fire a
+ * millisecond or two late.  With high resolution waits the loop sleeps
+ * for the nanosecond duration left, using epoll_pwait2(), a timerfd or
+ * an io_uring timeout depending on the poll driver, which suits sub
+ * millisecond timers without spinning the loop.  Drivers without a
+ * nanosecond wait keep rounding up to milliseconds, and wheel backend
+ * timers keep their millisecond ticks.
+ *
+ * @param l pointer to the loop instance
+ * @param enabled QB_TRUE for nanosecond waits, QB_FALSE for the default
+ * @retval 0 ok
+ * @retval -EINVAL no loop
+ */
+int32_t qb_loop_timer_hires_set(qb_loop_t *l, int32_t enabled);
+
 /**
  * Set a callback to receive events on file descriptors
  * getting low.
@@ -225,7 +464,8 @@ int32_t qb_loop_poll_low_fds_event_set(qb_loop_t *l,
  * @param l pointer to the loop instance
  * @param p the priority
  * @param fd file descriptor.
- * @param events (POLLIN|POLLOUT) etc ....
+ * @param events (POLLIN|POLLOUT) etc ...., optionally with
+ *        QB_LOOP_POLL_EDGE_TRIGGERED
  * @param data user data passed into the dispatch function
  * @param dispatch_fn callback function
  * @return status (0 == ok, -errno == failure)
@@ -243,7 +483,8 @@ int32_t qb_loop_poll_add(qb_loop_t *l,
  * @param l pointer to the loop instance
  * @param p the priority
  * @param fd file descriptor.
- * @param events (POLLIN|POLLOUT) etc ....
+ * @param events (POLLIN|POLLOUT) etc ...., optionally with
+ *        QB_LOOP_POLL_EDGE_TRIGGERED
  * @param data user data passed into the dispatch function
  * @param dispatch_fn callback function
  * @return status (0 == ok, -errno == failure)
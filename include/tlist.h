@@ -35,20 +35,53 @@ typedef void *timer_handle;
 
 static int64_t timerlist_hertz;
 
+/*
+ * Hierarchical timer wheel, an alternative to the heap.
+ *
+ * Level 0 has one slot per tick; every slot of level n covers a whole
+ * turn of level n - 1 and is cascaded into the lower levels when the
+ * wheel clock gets to it.  Adding and deleting a timer is O(1); timers
+ * expire at the first tick boundary after their expire time.
+ */
+#define TIMERLIST_WHEEL_BITS	6
+#define TIMERLIST_WHEEL_SIZE	(1 << TIMERLIST_WHEEL_BITS)
+#define TIMERLIST_WHEEL_MASK	(TIMERLIST_WHEEL_SIZE - 1)
+#define TIMERLIST_WHEEL_DEPTH	6
+#define TIMERLIST_WHEEL_TICK_NS	QB_TIME_NS_IN_MSEC
+
+struct timerlist_wheel {
+	uint64_t clk;		/* next tick to process */
+	uint64_t occupied[TIMERLIST_WHEEL_DEPTH];
+	struct qb_list_head slots[TIMERLIST_WHEEL_DEPTH][TIMERLIST_WHEEL_SIZE];
+};
+
 struct timerlist {
 	struct timerlist_timer **heap_entries;
 	size_t allocated;
 	size_t size;
 	pthread_mutex_t list_mutex;
+	struct timerlist_wheel *wheel;	/* NULL: use the heap */
+	struct timerlist_timer *cache;	/* freed timers kept for reuse */
+	size_t cache_len;
+	size_t cache_max;
+	uint64_t allocs;
+	uint64_t reuses;
 };
 
 struct timerlist_timer {
 	uint64_t expire_time;
+	uint64_t slack;		/* may expire up to this much later */
 	int32_t is_absolute_timer;
+	int32_t is_periodic;	/* kept by the owner across expirations */
 	void (*timer_fn) (void *data);
 	void *data;
 	timer_handle handle_addr;
 	size_t heap_pos;
+	struct qb_list_head wheel_list;
+	uint64_t wheel_tick;
+	uint8_t wheel_level;
+	uint8_t wheel_slot;
+	struct timerlist_timer *cache_next;
 };
 
 /*
@@ -94,13 +127,31 @@ timerlist_heap_entry_get(struct timerlist *timerlist, size_t item_pos)
 	return (timerlist->heap_entries[item_pos]);
 }
 
+/*
+ * The latest a timer may expire.  The heap is ordered by it, so the
+ * loop sleeps until the first deadline and then expires every timer
+ * at the top whose expire time has passed, which coalesces timers
+ * with overlapping slack windows into one wakeup.
+ */
+static inline uint64_t
+timerlist_timer_deadline(const struct timerlist_timer *timer)
+{
+
+	if (timer->slack > UINT64_MAX - timer->expire_time) {
+		return (UINT64_MAX);
+	}
+	return (timer->expire_time + timer->slack);
+}
+
 static inline int
 timerlist_entry_cmp(const struct timerlist_timer *t1, const struct timerlist_timer *t2)
 {
+	uint64_t d1 = timerlist_timer_deadline(t1);
+	uint64_t d2 = timerlist_timer_deadline(t2);
 
-	if (t1->expire_time == t2->expire_time) {
+	if (d1 == d2) {
 		return (0);
-	} else if (t1->expire_time < t2->expire_time) {
+	} else if (d1 < d2) {
 		return (-1);
 	} else {
 		return (1);
@@ -252,6 +303,255 @@ timerlist_debug_is_valid_heap(struct timerlist *timerlist)
 	return (1);
 }
 
+/*
+ * Timer wheel helper functions
+ */
+static inline uint32_t
+timerlist_wheel_first_slot(uint64_t occupied, uint32_t start)
+{
+	uint64_t bits;
+
+	bits = start ? (occupied >> start) | (occupied << (64 - start)) :
+	    occupied;
+#if defined(__GNUC__)
+	return (__builtin_ctzll(bits));
+#else
+	uint32_t i;
+
+	for (i = 0; (bits & 1) == 0; i++) {
+		bits >>= 1;
+	}
+	return (i);
+#endif
+}
+
+/*
+ * The wheel tick a timer expires on: the first one after its expire
+ * time, or with slack the roundest one within its window, so timers
+ * with overlapping windows tend to share a slot and expire together.
+ */
+static inline uint64_t
+timerlist_wheel_tick_pick(const struct timerlist_timer *timer)
+{
+	uint64_t first = timer->expire_time / TIMERLIST_WHEEL_TICK_NS + 1;
+	uint64_t last = timerlist_timer_deadline(timer) / TIMERLIST_WHEEL_TICK_NS + 1;
+	uint64_t tick;
+	int32_t bit;
+
+	for (bit = 63; bit > 0 && last > first; bit--) {
+		tick = last & ~((1ULL << bit) - 1);
+		if (tick >= first) {
+			return (tick);
+		}
+	}
+	return (first);
+}
+
+static inline void
+timerlist_wheel_insert(struct timerlist_wheel *wheel, struct timerlist_timer *timer)
+{
+	uint64_t tick = timer->wheel_tick;
+	uint64_t delta;
+	uint32_t level;
+	uint32_t slot;
+
+	if (tick < wheel->clk) {
+		tick = wheel->clk;
+	}
+	delta = tick - wheel->clk;
+
+	for (level = 0; level < TIMERLIST_WHEEL_DEPTH - 1; level++) {
+		if (delta < (1ULL << ((level + 1) * TIMERLIST_WHEEL_BITS))) {
+			break;
+		}
+	}
+	if (delta >= (1ULL << (TIMERLIST_WHEEL_DEPTH * TIMERLIST_WHEEL_BITS))) {
+		/*
+		 * Beyond the reach of the wheel: park the timer in the furthest
+		 * slot, it is inserted again once it gets there
+		 */
+		tick = wheel->clk +
+		    (1ULL << (TIMERLIST_WHEEL_DEPTH * TIMERLIST_WHEEL_BITS)) - 1;
+	}
+
+	slot = (tick >> (level * TIMERLIST_WHEEL_BITS)) & TIMERLIST_WHEEL_MASK;
+	timer->wheel_level = level;
+	timer->wheel_slot = slot;
+	qb_list_add_tail(&timer->wheel_list, &wheel->slots[level][slot]);
+	wheel->occupied[level] |= (1ULL << slot);
+}
+
+static inline void
+timerlist_wheel_remove(struct timerlist_wheel *wheel, struct timerlist_timer *timer)
+{
+	qb_list_del(&timer->wheel_list);
+	if (qb_list_empty(&wheel->slots[timer->wheel_level][timer->wheel_slot])) {
+		wheel->occupied[timer->wheel_level] &= ~(1ULL << timer->wheel_slot);
+	}
+}
+
+/*
+ * Move the whole slot onto list, leaving it empty
+ */
+static inline void
+timerlist_wheel_slot_take(struct timerlist_wheel *wheel, uint32_t level,
+			  uint32_t slot, struct qb_list_head *list)
+{
+	struct qb_list_head *head = &wheel->slots[level][slot];
+
+	qb_list_init(list);
+	if (!qb_list_empty(head)) {
+		list->next = head->next;
+		list->prev = head->prev;
+		list->next->prev = list;
+		list->prev->next = list;
+		qb_list_init(head);
+	}
+	wheel->occupied[level] &= ~(1ULL << slot);
+}
+
+static inline void
+timerlist_wheel_cascade(struct timerlist_wheel *wheel)
+{
+	struct qb_list_head list;
+	struct timerlist_timer *timer;
+	struct timerlist_timer *tmp;
+	uint32_t level;
+	uint32_t slot;
+
+	for (level = 1; level < TIMERLIST_WHEEL_DEPTH; level++) {
+		slot = (wheel->clk >> (level * TIMERLIST_WHEEL_BITS)) &
+		    TIMERLIST_WHEEL_MASK;
+
+		timerlist_wheel_slot_take(wheel, level, slot, &list);
+		qb_list_for_each_entry_safe(timer, tmp, &list, wheel_list) {
+			qb_list_del(&timer->wheel_list);
+			timerlist_wheel_insert(wheel, timer);
+		}
+		if (slot != 0) {
+			break;
+		}
+	}
+}
+
+/*
+ * Lowest tick at which the wheel may have something to do.  Exact for
+ * timers on level 0, the next cascade of their slot for the others.
+ */
+static inline uint64_t
+timerlist_wheel_next_tick(struct timerlist_wheel *wheel)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t tick;
+	uint64_t base;
+	uint32_t shift;
+	uint32_t start;
+	uint32_t level;
+
+	for (level = 0; level < TIMERLIST_WHEEL_DEPTH; level++) {
+		if (wheel->occupied[level] == 0) {
+			continue;
+		}
+		shift = level * TIMERLIST_WHEEL_BITS;
+		base = wheel->clk >> shift;
+
+		/*
+		 * The current slot of an upper level was already cascaded,
+		 * unless the clock sits right on its boundary
+		 */
+		if ((wheel->clk & ((1ULL << shift) - 1)) != 0) {
+			base++;
+		}
+		start = base & TIMERLIST_WHEEL_MASK;
+		tick = (base + timerlist_wheel_first_slot(wheel->occupied[level],
+		    start)) << shift;
+		if (tick < next) {
+			next = tick;
+		}
+	}
+
+	return (next);
+}
+
+static inline void
+timerlist_wheel_destroy(struct timerlist_wheel *wheel)
+{
+	struct timerlist_timer *timer;
+	struct timerlist_timer *tmp;
+	uint32_t level;
+	uint32_t slot;
+
+	for (level = 0; level < TIMERLIST_WHEEL_DEPTH; level++) {
+		for (slot = 0; slot < TIMERLIST_WHEEL_SIZE; slot++) {
+			qb_list_for_each_entry_safe(timer, tmp,
+			    &wheel->slots[level][slot], wheel_list) {
+				free(timer);
+			}
+		}
+	}
+	free(wheel);
+}
+
+/*
+ * Timer allocation, recycling up to cache_max freed timers
+ */
+static inline struct timerlist_timer *
+timerlist_timer_alloc(struct timerlist *timerlist)
+{
+	struct timerlist_timer *timer = NULL;
+
+	if (pthread_mutex_lock(&timerlist->list_mutex) == 0) {
+		timer = timerlist->cache;
+		if (timer) {
+			timerlist->cache = timer->cache_next;
+			timerlist->cache_len--;
+			timerlist->reuses++;
+		} else {
+			timerlist->allocs++;
+		}
+		pthread_mutex_unlock(&timerlist->list_mutex);
+	}
+	if (timer == NULL) {
+		timer = malloc(sizeof(struct timerlist_timer));
+	}
+	return (timer);
+}
+
+/*
+ * Called with list_mutex held
+ */
+static inline void
+timerlist_timer_release(struct timerlist *timerlist, struct timerlist_timer *timer)
+{
+	if (timerlist->cache_len >= timerlist->cache_max) {
+		free(timer);
+		return;
+	}
+	timer->cache_next = timerlist->cache;
+	timerlist->cache = timer;
+	timerlist->cache_len++;
+}
+
+static inline int32_t
+timerlist_cache_max_set(struct timerlist *timerlist, size_t cache_max)
+{
+	struct timerlist_timer *timer;
+	int32_t res;
+
+	if ( (res=pthread_mutex_lock(&timerlist->list_mutex))) {
+		return -res;
+	}
+	timerlist->cache_max = cache_max;
+	while (timerlist->cache_len > cache_max) {
+		timer = timerlist->cache;
+		timerlist->cache = timer->cache_next;
+		timerlist->cache_len--;
+		free(timer);
+	}
+	pthread_mutex_unlock(&timerlist->list_mutex);
+	return (0);
+}
+
 /*
  * Main functions implementation
  */
@@ -267,16 +567,94 @@ static inline void timerlist_init(struct timerlist *timerlist)
 
 static inline void timerlist_destroy(struct timerlist *timerlist)
 {
+	struct timerlist_timer *timer;
 	size_t zi;
 
 	pthread_mutex_destroy(&timerlist->list_mutex);
 
+	while ((timer = timerlist->cache) != NULL) {
+		timerlist->cache = timer->cache_next;
+		free(timer);
+	}
+	timerlist->cache_len = 0;
+
+	if (timerlist->wheel) {
+		/* frees the timers as well, the heap is empty */
+		timerlist_wheel_destroy(timerlist->wheel);
+		timerlist->wheel = NULL;
+		timerlist->size = 0;
+	}
 	for (zi = 0; zi < timerlist->size; zi++) {
 		free(timerlist->heap_entries[zi]);
 	}
 	free(timerlist->heap_entries);
 }
 
+/*
+ * Switch an empty timerlist from the heap to a timer wheel
+ */
+static inline int32_t timerlist_wheel_enable(struct timerlist *timerlist)
+{
+	struct timerlist_wheel *wheel;
+	uint32_t level;
+	uint32_t slot;
+	int32_t res;
+
+	if ( (res=pthread_mutex_lock(&timerlist->list_mutex))) {
+		return -res;
+	}
+	if (timerlist->wheel) {
+		goto cleanup;
+	}
+	if (timerlist->size > 0) {
+		res = -EBUSY;
+		goto cleanup;
+	}
+
+	wheel = malloc(sizeof(struct timerlist_wheel));
+	if (wheel == NULL) {
+		res = -ENOMEM;
+		goto cleanup;
+	}
+	for (level = 0; level < TIMERLIST_WHEEL_DEPTH; level++) {
+		wheel->occupied[level] = 0;
+		for (slot = 0; slot < TIMERLIST_WHEEL_SIZE; slot++) {
+			qb_list_init(&wheel->slots[level][slot]);
+		}
+	}
+	wheel->clk = qb_util_nano_current_get() / TIMERLIST_WHEEL_TICK_NS;
+	timerlist->wheel = wheel;
+
+cleanup:
+	pthread_mutex_unlock(&timerlist->list_mutex);
+	return res;
+}
+
+/*
+ * Switch an empty timerlist back to the heap
+ */
+static inline int32_t timerlist_wheel_disable(struct timerlist *timerlist)
+{
+	int32_t res;
+
+	if ( (res=pthread_mutex_lock(&timerlist->list_mutex))) {
+		return -res;
+	}
+	if (timerlist->wheel == NULL) {
+		goto cleanup;
+	}
+	if (timerlist->size > 0) {
+		res = -EBUSY;
+		goto cleanup;
+	}
+	timerlist_wheel_destroy(timerlist->wheel);
+	timerlist->wheel = NULL;
+
+cleanup:
+	pthread_mutex_unlock(&timerlist->list_mutex);
+	return res;
+}
+
 static inline int32_t timerlist_add(struct timerlist *timerlist,
 				 struct timerlist_timer *timer)
 {
@@ -288,6 +666,13 @@ static inline int32_t timerlist_add(struct timerlist *timerlist,
 		return -res;
 	}
 
+	if (timerlist->wheel) {
+		timer->wheel_tick = timerlist_wheel_tick_pick(timer);
+		timerlist_wheel_insert(timerlist->wheel, timer);
+		timerlist->size++;
+		goto cleanup;
+	}
+
 	/*
 	 * Check that heap array is large enough
 	 */
@@ -316,24 +701,27 @@ cleanup:
 	return res;
 }
 
-static inline int32_t timerlist_add_duration(struct timerlist *timerlist,
+static inline int32_t timerlist_add_relative(struct timerlist *timerlist,
 					 void (*timer_fn) (void *data),
 					 void *data,
 					 uint64_t nano_duration,
+					 uint64_t nano_slack,
+					 int32_t is_periodic,
 					 timer_handle * handle)
 {
 	int res;
 	struct timerlist_timer *timer;
 
-	timer =
-	    (struct timerlist_timer *)malloc(sizeof(struct timerlist_timer));
+	timer = timerlist_timer_alloc(timerlist);
 
 	if (timer == NULL) {
 		return -ENOMEM;
 	}
 
 	timer->expire_time = qb_util_nano_current_get() + nano_duration;
+	timer->slack = nano_slack;
 	timer->is_absolute_timer = QB_FALSE;
+	timer->is_periodic = is_periodic;
 	timer->data = data;
 	timer->timer_fn = timer_fn;
 	timer->handle_addr = handle;
@@ -347,6 +735,73 @@ static inline int32_t timerlist_add_duration(struct timerlist *timerlist,
 	return (0);
 }
 
+static inline int32_t timerlist_add_duration_slack(struct timerlist *timerlist,
+					 void (*timer_fn) (void *data),
+					 void *data,
+					 uint64_t nano_duration,
+					 uint64_t nano_slack,
+					 timer_handle * handle)
+{
+	return (timerlist_add_relative(timerlist, timer_fn, data,
+				       nano_duration, nano_slack, QB_FALSE,
+				       handle));
+}
+
+static inline int32_t timerlist_add_duration(struct timerlist *timerlist,
+					 void (*timer_fn) (void *data),
+					 void *data,
+					 uint64_t nano_duration,
+					 timer_handle * handle)
+{
+	return (timerlist_add_duration_slack(timerlist, timer_fn, data,
+					     nano_duration, 0, handle));
+}
+
+/*
+ * A periodic timer is not released when it expires: the handle stays
+ * valid and the owner puts it back with timerlist_rearm() or gives it
+ * up with timerlist_release().
+ */
+static inline int32_t timerlist_add_periodic(struct timerlist *timerlist,
+					 void (*timer_fn) (void *data),
+					 void *data,
+					 uint64_t nano_period,
+					 timer_handle * handle)
+{
+	return (timerlist_add_relative(timerlist, timer_fn, data,
+				       nano_period, 0, QB_TRUE, handle));
+}
+
+/*
+ * Insert an expired periodic timer again, to expire at expire_time
+ */
+static inline int32_t timerlist_rearm(struct timerlist *timerlist,
+				   timer_handle _timer_handle,
+				   uint64_t expire_time)
+{
+	struct timerlist_timer *timer = (struct timerlist_timer *)_timer_handle;
+
+	timer->expire_time = expire_time;
+	return (timerlist_add(timerlist, timer));
+}
+
+/*
+ * Give up an expired periodic timer instead of rearming it
+ */
+static inline void timerlist_release(struct timerlist *timerlist,
+				     timer_handle _timer_handle)
+{
+	struct timerlist_timer *timer = (struct timerlist_timer *)_timer_handle;
+
+	if (pthread_mutex_lock(&timerlist->list_mutex) != 0) {
+		free(timer);
+		return;
+	}
+	memset(timer->handle_addr, 0, sizeof(struct timerlist_timer *));
+	timerlist_timer_release(timerlist, timer);
+	pthread_mutex_unlock(&timerlist->list_mutex);
+}
+
 static inline int32_t timerlist_del(struct timerlist *timerlist,
 				 timer_handle _timer_handle)
 {
@@ -359,8 +814,13 @@ static inline int32_t timerlist_del(struct timerlist *timerlist,
 
 	memset(timer->handle_addr, 0, sizeof(struct timerlist_timer *));
 
-	timerlist_heap_delete(timerlist, timer);
-	free(timer);
+	if (timerlist->wheel) {
+		timerlist_wheel_remove(timerlist->wheel, timer);
+		timerlist->size--;
+	} else {
+		timerlist_heap_delete(timerlist, timer);
+	}
+	timerlist_timer_release(timerlist, timer);
 
 	pthread_mutex_unlock(&timerlist->list_mutex);
 	return 0;
@@ -381,9 +841,15 @@ static inline void timerlist_pre_dispatch(struct timerlist *timerlist,
 {
 	struct timerlist_timer *timer = (struct timerlist_timer *)_timer_handle;
 
-	memset(timer->handle_addr, 0, sizeof(struct timerlist_timer *));
+	if (!timer->is_periodic) {
+		memset(timer->handle_addr, 0, sizeof(struct timerlist_timer *));
+	}
 
-	timerlist_heap_delete(timerlist, timer);
+	if (timerlist->wheel) {
+		timerlist->size--;
+	} else {
+		timerlist_heap_delete(timerlist, timer);
+	}
 }
 
 static inline void timerlist_post_dispatch(struct timerlist *timerlist,
@@ -391,7 +857,9 @@ static inline void timerlist_post_dispatch(struct timerlist *timerlist,
 {
 	struct timerlist_timer *timer = (struct timerlist_timer *)_timer_handle;
 
-	free(timer);
+	if (!timer->is_periodic) {
+		timerlist_timer_release(timerlist, timer);
+	}
 }
 
 /*
@@ -402,6 +870,7 @@ static inline uint64_t timerlist_msec_duration_to_expire(struct timerlist *timer
 	struct timerlist_timer *timer_from_list;
 	volatile uint64_t current_time;
 	volatile uint64_t msec_duration_to_expire;
+	uint64_t next_tick;
 
 	/*
 	 * There is really no reasonable value to return when mutex lock fails
@@ -419,6 +888,22 @@ static inline uint64_t timerlist_msec_duration_to_expire(struct timerlist *timer
 		return (-1);
 	}
 
+	if (timerlist->wheel) {
+		next_tick = timerlist_wheel_next_tick(timerlist->wheel);
+		pthread_mutex_unlock(&timerlist->list_mutex);
+
+		current_time = qb_util_nano_current_get();
+		if (next_tick * TIMERLIST_WHEEL_TICK_NS <= current_time) {
+			return (0);
+		}
+		/*
+		 * Round up, waking before the tick boundary would find
+		 * nothing to expire
+		 */
+		return ((next_tick * TIMERLIST_WHEEL_TICK_NS - current_time +
+		    QB_TIME_NS_IN_MSEC - 1) / QB_TIME_NS_IN_MSEC);
+	}
+
 	timer_from_list = timerlist_heap_entry_get(timerlist, 0);
 
 	/*
@@ -435,16 +920,120 @@ static inline uint64_t timerlist_msec_duration_to_expire(struct timerlist *timer
 	/*
 	 * timer at head of list is expired, zero msecs required
 	 */
-	if (timer_from_list->expire_time < current_time) {
+	if (timerlist_timer_deadline(timer_from_list) < current_time) {
 		return (0);
 	}
 
 	msec_duration_to_expire =
-	    ((timer_from_list->expire_time -
+	    ((timerlist_timer_deadline(timer_from_list) -
 	      current_time) / QB_TIME_NS_IN_MSEC) + (1000 / timerlist_hertz);
 	return (msec_duration_to_expire);
 }
 
+/*
+ * returns the number of nsec until the next timer will expire, for
+ * waits that can sleep with nanosecond resolution
+ */
+static inline uint64_t timerlist_nsec_duration_to_expire(struct timerlist *timerlist)
+{
+	struct timerlist_timer *timer_from_list;
+	uint64_t current_time;
+	uint64_t expire_time;
+
+	if (pthread_mutex_lock(&timerlist->list_mutex)) {
+		return (-1);
+	}
+
+	if (timerlist->size == 0) {
+		pthread_mutex_unlock(&timerlist->list_mutex);
+
+		return (-1);
+	}
+
+	if (timerlist->wheel) {
+		/*
+		 * Nothing expires between tick boundaries
+		 */
+		expire_time = timerlist_wheel_next_tick(timerlist->wheel) *
+		    TIMERLIST_WHEEL_TICK_NS;
+		pthread_mutex_unlock(&timerlist->list_mutex);
+		current_time = qb_util_nano_current_get();
+	} else {
+		timer_from_list = timerlist_heap_entry_get(timerlist, 0);
+		expire_time = timerlist_timer_deadline(timer_from_list);
+		pthread_mutex_unlock(&timerlist->list_mutex);
+
+		if (timer_from_list->is_absolute_timer) {
+			current_time = qb_util_nano_from_epoch_get();
+		} else {
+			current_time = qb_util_nano_current_get();
+		}
+	}
+
+	if (expire_time <= current_time) {
+		return (0);
+	}
+	return (expire_time - current_time);
+}
+
+/*
+ * Runs the wheel clock up to the current time, expiring the timers of
+ * each level 0 slot as a batch.  Called with list_mutex held.
+ */
+static inline void timerlist_wheel_expire(struct timerlist *timerlist,
+					  uint64_t current_time)
+{
+	struct timerlist_wheel *wheel = timerlist->wheel;
+	struct timerlist_timer *timer;
+	struct timerlist_timer *tmp;
+	struct qb_list_head list;
+	uint64_t now_tick = current_time / TIMERLIST_WHEEL_TICK_NS;
+	uint64_t next;
+	uint64_t later;
+	uint32_t slot;
+
+	while (wheel->clk <= now_tick) {
+		if (timerlist->size == 0) {
+			wheel->clk = now_tick + 1;
+			break;
+		}
+
+		slot = wheel->clk & TIMERLIST_WHEEL_MASK;
+		if (slot == 0) {
+			timerlist_wheel_cascade(wheel);
+		}
+
+		timerlist_wheel_slot_take(wheel, 0, slot, &list);
+		qb_list_for_each_entry_safe(timer, tmp, &list, wheel_list) {
+			qb_list_del(&timer->wheel_list);
+			if (timer->wheel_tick > wheel->clk) {
+				/* parked beyond the reach of the wheel */
+				timerlist_wheel_insert(wheel, timer);
+				continue;
+			}
+
+			timerlist_pre_dispatch(timerlist, timer);
+
+			timer->timer_fn(timer->data);
+
+			timerlist_post_dispatch(timerlist, timer);
+		}
+
+		/*
+		 * Skip the empty slots up to the next occupied one, but stop
+		 * at the end of the turn to cascade
+		 */
+		later = wheel->occupied[0] & ~((2ULL << slot) - 1);
+		if (slot == TIMERLIST_WHEEL_MASK || later == 0) {
+			next = (wheel->clk | TIMERLIST_WHEEL_MASK) + 1;
+		} else {
+			next = (wheel->clk & ~(uint64_t)TIMERLIST_WHEEL_MASK) +
+			    timerlist_wheel_first_slot(later, 0);
+		}
+		wheel->clk = QB_MIN(next, now_tick + 1);
+	}
+}
+
 /*
  * Expires any timers that should be expired
  */
@@ -463,6 +1052,12 @@ static inline int32_t timerlist_expire(struct timerlist *timerlist)
 		return -res;
 	}
 
+	if (timerlist->wheel) {
+		timerlist_wheel_expire(timerlist, current_monotonic_time);
+		pthread_mutex_unlock(&timerlist->list_mutex);
+		return (0);
+	}
+
 	while (timerlist->size > 0) {
 		timer = timerlist_heap_entry_get(timerlist, 0);
 
@@ -471,6 +1066,10 @@ static inline int32_t timerlist_expire(struct timerlist *timerlist)
 		     is_absolute_timer ? current_time_from_epoch :
 		     current_monotonic_time);
 
+		/*
+		 * The top has the earliest deadline; it and whatever comes
+		 * up behind it expire as soon as their window has opened.
+		 */
 		if (timer->expire_time < current_time) {
 
 			timerlist_pre_dispatch(timerlist, timer);
@@ -22,6 +22,7 @@
 
 #include <qb/qbarray.h>
 #include <qb/qbutil.h>
+#include "util_int.h"
 
 /* The highest ARRAY_INDEX_BITS_BINS bits of the array index are the
  * number of the bin containing the indicated element, while the
@@ -47,6 +48,9 @@ struct qb_array {
 	size_t autogrow_elements;
 	qb_thread_lock_t *grow_lock;
 	qb_array_new_bin_cb_fn new_bin_cb;
+	uint32_t *free_slots;	/* stack of indices handed back by the user */
+	size_t free_count;
+	size_t free_allocated;
 };
 
 qb_array_t *
@@ -239,6 +243,52 @@ qb_array_grow(struct qb_array * a, size_t max_elements)
 	return rc;
 }
 
+int32_t
+qb_array_free_slot_put(struct qb_array *a, int32_t idx)
+{
+	uint32_t *free_slots;
+	size_t new_size;
+	int32_t rc = 0;
+
+	if (a == NULL || idx < 0) {
+		return -EINVAL;
+	}
+
+	(void)qb_thread_lock(a->grow_lock);
+	if (a->free_count == a->free_allocated) {
+		new_size = QB_MAX(a->free_allocated * 2, MAX_ELEMENTS_PER_BIN);
+		free_slots = realloc(a->free_slots, new_size * sizeof(uint32_t));
+		if (free_slots == NULL) {
+			rc = -ENOMEM;
+			goto unlock;
+		}
+		a->free_slots = free_slots;
+		a->free_allocated = new_size;
+	}
+	a->free_slots[a->free_count++] = idx;
+
+unlock:
+	(void)qb_thread_unlock(a->grow_lock);
+	return rc;
+}
+
+int32_t
+qb_array_free_slot_get(struct qb_array *a)
+{
+	int32_t idx = -ENOENT;
+
+	if (a == NULL) {
+		return -EINVAL;
+	}
+
+	(void)qb_thread_lock(a->grow_lock);
+	if (a->free_count > 0) {
+		idx = a->free_slots[--a->free_count];
+	}
+	(void)qb_thread_unlock(a->grow_lock);
+	return idx;
+}
+
 void
 qb_array_free(struct qb_array *a)
 {
@@ -253,6 +303,7 @@ qb_array_free(struct qb_array *a)
 		free(a->bin[i]);
 	}
 	free(a->bin);
+	free(a->free_slots);
 	(void)qb_thread_lock_destroy(a->grow_lock);
 	free(a);
 }
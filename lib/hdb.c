@@ -22,6 +22,7 @@
 
 #include <qb/qbhdb.h>
 #include <qb/qbatomic.h>
+#include "util_int.h"
 
 enum QB_HDB_HANDLE_STATE {
 	QB_HDB_HANDLE_STATE_EMPTY,
@@ -69,17 +70,16 @@ qb_hdb_handle_create(struct qb_hdb *hdb, int32_t instance_size,
 
 	qb_hdb_create_first_run(hdb);
 
-	handle_count = qb_atomic_int_get(&hdb->handle_count);
-	for (handle = 0; handle < handle_count; handle++) {
-		if (qb_array_index(hdb->handles, handle, (void**)&entry) == 0 &&
-		    entry->state == QB_HDB_HANDLE_STATE_EMPTY) {
-			found = QB_TRUE;
-			qb_atomic_int_inc(&entry->ref_count);
-			break;
-		}
+	handle = qb_array_free_slot_get(hdb->handles);
+	if (handle >= 0 &&
+	    qb_array_index(hdb->handles, handle, (void**)&entry) == 0 &&
+	    entry->state == QB_HDB_HANDLE_STATE_EMPTY) {
+		found = QB_TRUE;
+		qb_atomic_int_inc(&entry->ref_count);
 	}
 
 	if (found == QB_FALSE) {
+		handle_count = qb_atomic_int_get(&hdb->handle_count);
 		res = qb_array_grow(hdb->handles, handle_count + 1U);
 		if (res != 0) {
 			return res;
@@ -92,10 +92,13 @@ qb_hdb_handle_create(struct qb_hdb *hdb, int32_t instance_size,
 		/* NB: qb_array_grow above guarantees that handle_count
 		       will not overflow INT32_MAX */
 		qb_atomic_int_inc((int32_t *)&hdb->handle_count);
+		handle = handle_count;
 	}
 
 	instance = malloc(instance_size);
 	if (instance == 0) {
+		entry->ref_count = 0;
+		(void)qb_array_free_slot_put(hdb->handles, handle);
 		return -ENOMEM;
 	}
 
@@ -189,6 +192,7 @@ qb_hdb_handle_put(struct qb_hdb * hdb, qb_handle_t handle_in)
 		}
 		free(entry->instance);
 		memset(entry, 0, sizeof(struct qb_hdb_handle));
+		(void)qb_array_free_slot_put(hdb->handles, handle);
 	}
 	return (0);
 }
@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "os_base.h"
+#include <poll.h>
+#include <strings.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "util_int.h"
+#include "ipc_int.h"
+#include <qb/qbdefs.h>
+#include <qb/qbatomic.h>
+#include <qb/qbipcs.h>
+#include <qb/qbutil.h>
+
+/*
+ * Instead of writing a byte to its own setup socket for every request,
+ * a shm client sets its bit in a bitmap shared by the whole service and
+ * rings the doorbell (a datagram socket the server polls) only when the
+ * bit was clear.  One wakeup of the server then covers every client that
+ * has something queued, however many others are connected.
+ *
+ * The server clears a bit before it reads the connection's ring and the
+ * client sets it after writing to the ring, so a request never goes
+ * unnoticed.  The setup socket stays in the loop, but only to notice the
+ * client going away; the client no longer writes to it.
+ *
+ * Nothing stops a client from clearing bits that aren't its own, which
+ * hides the other clients' requests from the server indefinitely; the
+ * doorbell is only for services whose clients are all trusted.
+ */
+
+#define DOORBELL_BITS 32
+
+struct qb_ipcs_doorbell {
+	uint32_t max_connections;
+	uint32_t words;
+	int32_t *bitmap;		/* shared with the clients */
+	int32_t bitmap_fd;
+	int32_t sock[2];		/* [0] the server polls, [1] clients ring */
+	struct qb_ipcs_connection **conns;
+	uint32_t next_slot;
+	int32_t started;
+};
+
+struct qb_ipcc_doorbell {
+	int32_t *bitmap;
+	size_t map_len;
+	int32_t *word;
+	int32_t bit;
+	int32_t sock;
+};
+
+/*
+ * Set bit, returns whether it was set already.
+ */
+static int32_t
+_bit_set(volatile int32_t *word, int32_t bit)
+{
+	int32_t old;
+
+	do {
+		old = qb_atomic_int_get(word);
+		if (old & bit) {
+			return QB_TRUE;
+		}
+	} while (!qb_atomic_int_compare_and_exchange(word, old, old | bit));
+	return QB_FALSE;
+}
+
+static int32_t
+_bits_take(volatile int32_t *word)
+{
+	int32_t old;
+
+	do {
+		old = qb_atomic_int_get(word);
+		if (old == 0) {
+			return 0;
+		}
+	} while (!qb_atomic_int_compare_and_exchange(word, old, 0));
+	return old;
+}
+
+static int32_t
+_ring(int32_t sock)
+{
+	char one = 1;
+
+	if (send(sock, &one, 1, MSG_DONTWAIT | MSG_NOSIGNAL) == 1) {
+		return 0;
+	}
+	/* a full doorbell has been rung plenty */
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return 0;
+	}
+	return -errno;
+}
+
+/*
+ * service functions
+ * --------------------------------------------------------
+ */
+int32_t
+qb_ipcs_doorbell_set(struct qb_ipcs_service *s, uint32_t max_connections)
+{
+	struct qb_ipcs_doorbell *d;
+
+	if (s == NULL) {
+		return -EINVAL;
+	}
+	if (s->type != QB_IPC_SHM) {
+		return -ENOTSUP;
+	}
+	if (s->doorbell && s->doorbell->started) {
+		return -EBUSY;
+	}
+	if (max_connections == 0) {
+		free(s->doorbell);
+		s->doorbell = NULL;
+		return 0;
+	}
+	if (s->doorbell == NULL) {
+		d = calloc(1, sizeof(struct qb_ipcs_doorbell));
+		if (d == NULL) {
+			return -ENOMEM;
+		}
+		d->bitmap_fd = -1;
+		d->sock[0] = -1;
+		d->sock[1] = -1;
+		s->doorbell = d;
+	}
+	s->doorbell->max_connections = max_connections;
+	return 0;
+}
+
+static void
+_doorbell_conn_dispatch(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_service *s = c->service;
+	int32_t hi_pending;
+	int32_t pending;
+
+	if (c->state != QB_IPCS_CONNECTION_ESTABLISHED) {
+		return;
+	}
+	qb_ipcs_connection_ref(c);
+	hi_pending = (c->request_hi.max_msg_size > 0 &&
+		      s->funcs.q_len_get(&c->request_hi) > 0);
+	pending = (s->funcs.q_len_get(&c->request) > 0);
+	/*
+	 * Flow controlled requests are left alone; qb_ipcs_flowcontrol_set()
+	 * rings again once they may be read.
+	 */
+	if (hi_pending || (pending && !c->work_fc)) {
+		(void)qb_ipcs_dispatch_connection_request(c->setup.u.us.sock,
+							  POLLIN, c);
+	}
+	if (c->state == QB_IPCS_CONNECTION_ESTABLISHED) {
+		hi_pending = (c->request_hi.max_msg_size > 0 &&
+			      s->funcs.q_len_get(&c->request_hi) > 0);
+		pending = (s->funcs.q_len_get(&c->request) > 0 &&
+			   !c->fc_enabled && !c->work_fc);
+		if (hi_pending || pending) {
+			/* more than one dispatch takes, come back later */
+			qb_ipcs_doorbell_ring(c);
+		}
+	}
+	qb_ipcs_connection_unref(c);
+}
+
+static int32_t
+_doorbell_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	struct qb_ipcs_service *s = data;
+	struct qb_ipcs_doorbell *d = s->doorbell;
+	char buf[64];
+	uint32_t bits;
+	uint32_t i;
+	int32_t bit;
+
+	if (revents & POLLNVAL) {
+		return -EINVAL;
+	}
+	/* the bell only says "look", the bitmap says where */
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+		continue;
+	}
+	for (i = 0; i < d->words && d->started; i++) {
+		bits = _bits_take(&d->bitmap[i]);
+		while (bits) {
+			bit = ffs(bits) - 1;
+			bits &= ~(1U << bit);
+			if (d->conns[i * DOORBELL_BITS + bit]) {
+				_doorbell_conn_dispatch(
+					d->conns[i * DOORBELL_BITS + bit]);
+			}
+		}
+	}
+	return 0;
+}
+
+int32_t
+qb_ipcs_doorbell_start(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_doorbell *d = s->doorbell;
+	char path[PATH_MAX];
+	char name[NAME_MAX];
+	size_t len;
+	int32_t res;
+
+	d->words = (d->max_connections + DOORBELL_BITS - 1) / DOORBELL_BITS;
+	len = d->words * sizeof(int32_t);
+	d->conns = calloc(d->words * DOORBELL_BITS,
+			  sizeof(struct qb_ipcs_connection *));
+	if (d->conns == NULL) {
+		return -ENOMEM;
+	}
+
+	/* nothing but the clients we hand the descriptor to needs a name */
+	snprintf(name, NAME_MAX, "doorbell-%d-%s", s->pid, s->name);
+	d->bitmap_fd = qb_sys_mmap_file_open(path, name, len,
+					     O_CREAT | O_TRUNC | O_RDWR);
+	if (d->bitmap_fd < 0) {
+		res = d->bitmap_fd;
+		goto cleanup_conns;
+	}
+	(void)unlink(path);
+	d->bitmap = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 d->bitmap_fd, 0);
+	if (d->bitmap == MAP_FAILED) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't map doorbell bitmap");
+		goto cleanup_fd;
+	}
+	memset(d->bitmap, 0, len);
+
+	if (socketpair(PF_UNIX, SOCK_DGRAM, 0, d->sock) == -1) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't create doorbell");
+		goto cleanup_map;
+	}
+	(void)qb_sys_fd_nonblock_cloexec_set(d->sock[0]);
+	(void)qb_sys_fd_nonblock_cloexec_set(d->sock[1]);
+
+	res = s->poll_fns.dispatch_add(s->poll_priority, d->sock[0],
+				       POLLIN | POLLPRI | POLLNVAL,
+				       s, _doorbell_dispatch);
+	if (res < 0) {
+		goto cleanup_sock;
+	}
+	d->next_slot = 0;
+	d->started = QB_TRUE;
+	return 0;
+
+cleanup_sock:
+	close(d->sock[0]);
+	close(d->sock[1]);
+	d->sock[0] = -1;
+	d->sock[1] = -1;
+cleanup_map:
+	munmap(d->bitmap, len);
+	d->bitmap = NULL;
+cleanup_fd:
+	close(d->bitmap_fd);
+	d->bitmap_fd = -1;
+cleanup_conns:
+	free(d->conns);
+	d->conns = NULL;
+	return res;
+}
+
+void
+qb_ipcs_doorbell_stop(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_doorbell *d = s->doorbell;
+
+	if (d == NULL) {
+		return;
+	}
+	if (d->started) {
+		(void)s->poll_fns.dispatch_del(d->sock[0]);
+		close(d->sock[0]);
+		close(d->sock[1]);
+		munmap(d->bitmap, d->words * sizeof(int32_t));
+		close(d->bitmap_fd);
+		free(d->conns);
+	}
+	free(d);
+	s->doorbell = NULL;
+}
+
+/*
+ * Give the connection a slot, if there is one free.  fds gets what the
+ * client needs to ring it.
+ */
+int32_t
+qb_ipcs_doorbell_attach(struct qb_ipcs_connection *c, int32_t *fds)
+{
+	struct qb_ipcs_doorbell *d = c->service->doorbell;
+	uint32_t slots;
+	uint32_t i;
+	uint32_t slot;
+
+	if (d == NULL || !d->started) {
+		return -ENOTSUP;
+	}
+	slots = d->max_connections;
+	for (i = 0; i < slots; i++) {
+		slot = (d->next_slot + i) % slots;
+		if (d->conns[slot] == NULL) {
+			break;
+		}
+	}
+	if (i == slots) {
+		/* not fatal, the client notifies through its setup socket */
+		return -ENOSPC;
+	}
+	d->next_slot = (slot + 1) % slots;
+	/* a bit left over from the last owner only costs a look */
+	d->conns[slot] = c;
+	c->doorbell_slot = slot + 1;
+	qb_util_log(LOG_DEBUG, "doorbell slot %u given to %s",
+		    slot, c->description);
+	fds[0] = d->bitmap_fd;
+	fds[1] = d->sock[1];
+	return 0;
+}
+
+void
+qb_ipcs_doorbell_detach(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_doorbell *d = c->service->doorbell;
+
+	if (c->doorbell_slot == 0 || d == NULL || !d->started) {
+		return;
+	}
+	d->conns[c->doorbell_slot - 1] = NULL;
+	c->doorbell_slot = 0;
+}
+
+void
+qb_ipcs_doorbell_ring(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_doorbell *d = c->service->doorbell;
+	uint32_t slot = c->doorbell_slot - 1;
+	int32_t res;
+
+	if (c->doorbell_slot == 0 || d == NULL || !d->started) {
+		return;
+	}
+	if (_bit_set(&d->bitmap[slot / DOORBELL_BITS],
+		     1U << (slot % DOORBELL_BITS))) {
+		return;
+	}
+	res = _ring(d->sock[1]);
+	if (res < 0) {
+		errno = -res;
+		qb_util_perror(LOG_WARNING, "couldn't ring doorbell");
+	}
+}
+
+/*
+ * client functions
+ * --------------------------------------------------------
+ */
+int32_t
+qb_ipcc_doorbell_open(struct qb_ipcc_connection *c, uint32_t slot,
+		      int32_t *fds)
+{
+	struct qb_ipcc_doorbell *d;
+	struct stat st;
+	int32_t res;
+
+	d = calloc(1, sizeof(struct qb_ipcc_doorbell));
+	if (d == NULL) {
+		return -ENOMEM;
+	}
+	if (fstat(fds[0], &st) == -1) {
+		res = -errno;
+		goto cleanup;
+	}
+	d->map_len = st.st_size;
+	if (slot == 0 || (slot - 1) / DOORBELL_BITS >=
+	    d->map_len / sizeof(int32_t)) {
+		res = -EINVAL;
+		goto cleanup;
+	}
+	d->bitmap = mmap(NULL, d->map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fds[0], 0);
+	if (d->bitmap == MAP_FAILED) {
+		res = -errno;
+		goto cleanup;
+	}
+	close(fds[0]);
+	slot--;
+	d->word = &d->bitmap[slot / DOORBELL_BITS];
+	d->bit = 1U << (slot % DOORBELL_BITS);
+	d->sock = fds[1];
+	(void)qb_sys_fd_nonblock_cloexec_set(d->sock);
+	c->doorbell = d;
+	return 0;
+
+cleanup:
+	errno = -res;
+	qb_util_perror(LOG_ERR, "couldn't open doorbell");
+	close(fds[0]);
+	close(fds[1]);
+	free(d);
+	return res;
+}
+
+void
+qb_ipcc_doorbell_close(struct qb_ipcc_connection *c)
+{
+	if (c->doorbell == NULL) {
+		return;
+	}
+	munmap(c->doorbell->bitmap, c->doorbell->map_len);
+	close(c->doorbell->sock);
+	free(c->doorbell);
+	c->doorbell = NULL;
+}
+
+int32_t
+qb_ipcc_doorbell_ring(struct qb_ipcc_connection *c)
+{
+	int32_t res;
+
+	if (_bit_set(c->doorbell->word, c->doorbell->bit)) {
+		return 0;
+	}
+	res = _ring(c->doorbell->sock);
+	if (res == -ECONNREFUSED) {
+		res = -ENOTCONN;
+	}
+	return res;
+}
@@ -25,12 +25,16 @@
 #include "os_base.h"
 
 #include <dirent.h>
+#include <qb/qbdefs.h>
 #include <qb/qblist.h>
 #include <qb/qbloop.h>
 #include <qb/qbipcc.h>
 #include <qb/qbipcs.h>
 #include <qb/qbipc_common.h>
 #include <qb/qbrb.h>
+#ifdef HAVE_SDT_TRACEPOINTS
+#include <sys/sdt.h>
+#endif /* HAVE_SDT_TRACEPOINTS */
 
 #define QB_IPC_MAX_WAIT_MS 2000
 
@@ -42,9 +46,37 @@ SEND CONN REQ ->
 	<-	SEND ACCEPT(with details)/DENY
 */
 
+/*
+ * The connection request and response can carry optional trailing fields.
+ * Older peers only know the layout up to the *_BASE_SIZE below, so the
+ * trailing part is only sent when the peer asked for it; its presence is
+ * signalled by hdr.size and anything not received reads as zero.
+ */
 struct qb_ipc_connection_request {
 	struct qb_ipc_request_header hdr;
 	uint32_t max_msg_size;
+	/* optional */
+	uint32_t request_size;
+	uint32_t response_size;
+	uint32_t event_size;
+	uint32_t large_msg_size;
+	uint32_t hipri_size;
+	uint32_t doorbell;	/* client can ring the service doorbell */
+} __attribute__ ((aligned(8)));
+
+#define QB_IPC_CONNECTION_REQUEST_BASE_SIZE \
+	QB_ROUNDUP(offsetof(struct qb_ipc_connection_request, request_size), 8)
+
+/*
+ * Sent in place of a message that does not fit the ring/socket buffer.
+ * The payload sits in the file 'name' (created from the connection's
+ * large_msg_template); the receiver maps it, unlinks it and unmaps it
+ * once the message has been consumed.
+ */
+struct qb_ipc_large_msg {
+	struct qb_ipc_response_header hdr;
+	uint32_t size;
+	char name[NAME_MAX];
 } __attribute__ ((aligned(8)));
 
 struct qb_ipc_event_connection_request {
@@ -60,22 +92,45 @@ struct qb_ipc_connection_response {
 	char request[PATH_MAX];
 	char response[PATH_MAX];
 	char event[PATH_MAX];
+	/* optional */
+	uint32_t request_size;
+	uint32_t response_size;
+	uint32_t event_size;
+	uint32_t large_msg_size;
+	uint32_t hipri_size;
+	uint32_t doorbell_slot;	/* slot + 1, 0 == none; fds come with it */
+	uint32_t event_ranges_max;	/* 0 == can't filter events */
+} __attribute__ ((aligned(8)));
+
+struct qb_ipc_event_filter_request {
+	struct qb_ipc_request_header hdr;
+	uint32_t num_ranges;
+	struct qb_ipc_event_range ranges[QB_IPC_EVENT_RANGES_MAX];
 } __attribute__ ((aligned(8)));
 
+#define QB_IPC_CONNECTION_RESPONSE_BASE_SIZE \
+	offsetof(struct qb_ipc_connection_response, request_size)
+
 struct qb_ipcc_connection;
 
+struct qb_ipc_us_batch;
+
 struct qb_ipc_one_way {
 	size_t max_msg_size;
 	enum qb_ipc_type type;
+	uint32_t recv_hint;	/* messages the reader is about to take */
+	uint32_t recv_buffered;	/* received but not yet reclaimed */
 	union {
 		struct {
 			int32_t sock;
 			char *sock_name;
 			void* shared_data;
 			char shared_file_name[NAME_MAX];
+			struct qb_ipc_us_batch *batch;
 		} us;
 		struct {
 			qb_ringbuffer_t *rb;
+			char rb_name[NAME_MAX];
 		} shm;
 	} u;
 };
@@ -86,8 +141,13 @@ struct qb_ipcc_funcs {
 	ssize_t (*sendv)(struct qb_ipc_one_way *one_way, const struct iovec *iov, size_t iov_len);
 	void (*disconnect)(struct qb_ipcc_connection* c);
 	int32_t (*fc_get)(struct qb_ipc_one_way *one_way);
+	int32_t (*event_open)(struct qb_ipcc_connection *c);
+	ssize_t (*data_pending)(struct qb_ipc_one_way *one_way);
 };
 
+struct qb_ipcc_mt;
+struct qb_ipcc_doorbell;
+
 struct qb_ipcc_connection {
 	char name[NAME_MAX];
 	int32_t needs_sock_for_poll;
@@ -97,18 +157,29 @@ struct qb_ipcc_connection {
 	struct qb_ipc_one_way request;
 	struct qb_ipc_one_way response;
 	struct qb_ipc_one_way event;
+	struct qb_ipc_one_way request_hi;	/* max_msg_size 0 == none */
 	struct qb_ipcc_funcs funcs;
 	struct qb_ipc_request_header *receive_buf;
 	uint32_t fc_enable_max;
 	int32_t is_connected;
 	void * context;
 	uid_t euid;
+	uint32_t busy_poll_usec;
+	struct qb_ipcc_busy_poll_stats busy_poll_stats;
+	uint32_t large_msg_max;
+	char large_msg_template[NAME_MAX];
+	struct qb_ipcc_mt *mt;
+	struct qb_ipcc_doorbell *doorbell;
+	uint32_t event_ranges_max;
 };
 
 int32_t qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
-				 struct qb_ipc_connection_response *r);
+				 struct qb_ipc_connection_response *r,
+				 const struct qb_ipcc_connect_params *params);
 int qb_ipcc_setup_connect_continue(struct qb_ipcc_connection *c, struct qb_ipc_connection_response *response);
 ssize_t qb_ipc_us_send(struct qb_ipc_one_way *one_way, const void *msg, size_t len);
+ssize_t qb_ipc_us_send_fds(struct qb_ipc_one_way *one_way, const void *msg,
+			   size_t len, const int32_t *fds, int32_t nfds);
 ssize_t qb_ipc_us_recv(struct qb_ipc_one_way *one_way, void *msg, size_t len, int32_t timeout);
 int32_t qb_ipc_us_ready(struct qb_ipc_one_way *ow_data, struct qb_ipc_one_way *ow_conn,
 			int32_t ms_timeout, int32_t events);
@@ -120,6 +191,7 @@ int32_t qb_ipcc_shm_connect(struct qb_ipcc_connection *c, struct qb_ipc_connecti
 
 struct qb_ipcs_service;
 struct qb_ipcs_connection;
+struct qb_ipcs_doorbell;
 
 struct qb_ipcs_funcs {
 	int32_t (*connect)(struct qb_ipcs_service *s, struct qb_ipcs_connection *c,
@@ -132,12 +204,16 @@ struct qb_ipcs_funcs {
 	ssize_t (*sendv)(struct qb_ipc_one_way *one_way, const struct iovec* iov, size_t iov_len);
 	void (*fc_set)(struct qb_ipc_one_way *one_way, int32_t fc_enable);
 	ssize_t (*q_len_get)(struct qb_ipc_one_way *one_way);
+	int32_t (*event_open)(struct qb_ipcs_connection *c);
 };
 
 struct qb_ipcs_service {
 	enum qb_ipc_type type;
 	char name[NAME_MAX];
 	uint32_t max_buffer_size;
+	uint32_t large_msg_max;
+	struct qb_ipcs_workers *workers;
+	struct qb_ipcs_doorbell *doorbell;
 	int32_t service_id;
 	int32_t ref_count;
 	pid_t pid;
@@ -151,11 +227,28 @@ struct qb_ipcs_service {
 
 	struct qb_list_head connections;
 	struct qb_list_head list;
-	struct qb_ipcs_stats stats;
+	struct qb_ipcs_stats_2 stats;
+
+	/* connections waiting for their resources to be released */
+	struct qb_list_head reap_list;
+	uint32_t reap_batch;
+	int32_t reap_scheduled;
+
+	/* qb_ipcs_msg_handlers_set(): handler of id is msg_table[id - msg_id_base] */
+	struct qb_ipcs_msg_entry *msg_table;
+	int32_t msg_id_base;
+	uint32_t msg_table_len;
 
 	void *context;
 };
 
+struct qb_ipcs_msg_entry {
+	qb_ipcs_msg_process_fn fn;	/* NULL == no handler */
+	uint32_t min_size;
+	uint32_t max_size;
+	struct qb_ipcs_msg_stats stats;
+};
+
 enum qb_ipcs_connection_state {
 	QB_IPCS_CONNECTION_INACTIVE,
 	QB_IPCS_CONNECTION_ACTIVE,
@@ -182,6 +275,7 @@ struct qb_ipcs_connection {
 	struct qb_ipc_one_way request;
 	struct qb_ipc_one_way response;
 	struct qb_ipc_one_way event;
+	struct qb_ipc_one_way request_hi;	/* max_msg_size 0 == none */
 	struct qb_ipcs_service *service;
 	struct qb_list_head list;
 	struct qb_ipc_request_header *receive_buf;
@@ -189,8 +283,23 @@ struct qb_ipcs_connection {
 	int32_t fc_enabled;
 	int32_t poll_events;
 	int32_t outstanding_notifiers;
+	int32_t notifications_held;	/* read ahead while flow controlled */
 	char description[CONNECTION_DESCRIPTION];
-	struct qb_ipcs_connection_stats_2 stats;
+	struct qb_ipcs_connection_stats_3 stats;
+	uint64_t request_ready_ns;
+	uint32_t large_msg_max;
+	char large_msg_template[NAME_MAX];
+	uint32_t work_in_flight;
+	uint32_t work_seq;
+	uint32_t work_flush_seq;
+	int32_t work_fc;
+	int32_t work_retry_pending;
+	struct qb_list_head work_done;
+	int32_t request_kick_pending;
+	uint32_t doorbell_slot;	/* slot + 1, 0 == notified through setup */
+	struct qb_ipc_connection_request *accept_req;	/* accept deferred */
+	uint32_t event_ranges_len;	/* 0 == every event */
+	struct qb_ipc_event_range event_ranges[QB_IPC_EVENT_RANGES_MAX];
 };
 
 void qb_ipcs_us_init(struct qb_ipcs_service *s);
@@ -212,4 +321,92 @@ int use_filesystem_sockets(void);
 
 void remove_tempdir(const char *name);
 
+int32_t qb_ipc_large_msg_template_set(char *tmpl, const char *sibling);
+int32_t qb_ipc_large_msg_create(const char *tmpl,
+				const struct iovec *iov, size_t iov_len,
+				size_t size, struct qb_ipc_large_msg *msg);
+ssize_t qb_ipc_large_msg_map(const char *tmpl,
+			     const struct qb_ipc_large_msg *msg,
+			     size_t max_size, void **data);
+void qb_ipc_large_msg_cleanup(const char *tmpl);
+
+void qb_ipcs_flowcontrol_set(struct qb_ipcs_connection *c, int32_t fc_enable);
+int32_t qb_ipcs_dispatch_descriptor_modify(struct qb_ipcs_connection *c);
+void qb_ipcs_work_fc_poll_events_set(struct qb_ipcs_connection *c);
+
+enum qb_ipcs_latency {
+	QB_IPCS_LATENCY_QUEUE,
+	QB_IPCS_LATENCY_PROCESS,
+	QB_IPCS_LATENCY_EVENT,
+	QB_IPCS_LATENCY_EVENT_QUEUE,
+};
+void qb_ipcs_latency_add(struct qb_ipcs_connection *c,
+			 enum qb_ipcs_latency which, uint64_t ns);
+ssize_t qb_ipcs_event_sendv_since(struct qb_ipcs_connection *c,
+				  const struct iovec *iov, size_t iov_len,
+				  uint64_t since_ns);
+
+int32_t qb_ipcs_msg_lookup(struct qb_ipcs_connection *c,
+			   struct qb_ipc_request_header *hdr,
+			   struct qb_ipcs_msg_entry **entry);
+int32_t qb_ipcs_msg_call(struct qb_ipcs_connection *c,
+			 struct qb_ipcs_msg_entry *entry, int32_t error,
+			 void *msg, size_t size);
+void qb_ipcs_msg_account(struct qb_ipcs_msg_entry *entry, size_t size,
+			 uint64_t ns);
+
+int32_t qb_ipcs_workers_start(struct qb_ipcs_service *s);
+void qb_ipcs_workers_stop(struct qb_ipcs_service *s);
+int32_t qb_ipcs_work_queue(struct qb_ipcs_connection *c, void *msg,
+			   size_t size, size_t map_len,
+			   struct qb_ipcs_msg_entry *entry, int32_t error);
+int32_t qb_ipcs_work_running(struct qb_ipcs_connection *c);
+ssize_t qb_ipcs_work_output_add(struct qb_ipcs_connection *c,
+				const struct iovec *iov, size_t iov_len,
+				int32_t is_event);
+
+int32_t qb_ipcs_doorbell_start(struct qb_ipcs_service *s);
+void qb_ipcs_doorbell_stop(struct qb_ipcs_service *s);
+int32_t qb_ipcs_doorbell_attach(struct qb_ipcs_connection *c, int32_t *fds);
+void qb_ipcs_doorbell_detach(struct qb_ipcs_connection *c);
+void qb_ipcs_doorbell_ring(struct qb_ipcs_connection *c);
+int32_t qb_ipcc_doorbell_open(struct qb_ipcc_connection *c, uint32_t slot,
+			      int32_t *fds);
+void qb_ipcc_doorbell_close(struct qb_ipcc_connection *c);
+int32_t qb_ipcc_doorbell_ring(struct qb_ipcc_connection *c);
+
+/*
+ * Static tracepoints, listed in the IPC overview (docs/mainpage.h).
+ * Without sys/sdt.h they compile to nothing, arguments included.
+ * desc is a char array, which sys/sdt.h cannot take the type of.
+ */
+#ifdef HAVE_SDT_TRACEPOINTS
+#define QB_IPC_TRACE(probe, desc, id, size) \
+	DTRACE_PROBE3(libqb, probe, (const char *)(desc), id, size)
+#else
+#define QB_IPC_TRACE(probe, desc, id, size) do { } while (0)
+#endif /* HAVE_SDT_TRACEPOINTS */
+
+static inline int32_t
+qb_ipc_msg_id(const void *msg, size_t len)
+{
+	int32_t id;
+
+	if (len < sizeof(int32_t)) {
+		return -1;
+	}
+	/* msg need not be aligned */
+	memcpy(&id, msg, sizeof(id));
+	return id;
+}
+
+static inline int32_t
+qb_ipc_iov_msg_id(const struct iovec *iov, size_t iov_len)
+{
+	if (iov_len == 0) {
+		return -1;
+	}
+	return qb_ipc_msg_id(iov[0].iov_base, iov[0].iov_len);
+}
+
 #endif /* QB_IPC_INT_H_DEFINED */
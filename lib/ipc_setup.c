@@ -43,6 +43,10 @@
 #include "util_int.h"
 #include "ipc_int.h"
 
+#if defined(SCM_RIGHTS) && !(defined(QB_SOLARIS) && !defined(_XPG4_2))
+#define QB_IPC_PASS_FDS 1
+#endif
+
 struct ipc_auth_ugp {
 	uid_t uid;
 	gid_t gid;
@@ -62,11 +66,15 @@ struct ipc_auth_data {
 
 	size_t processed;
 	size_t len;
+	size_t max_len;
 
-#ifdef SO_PASSCRED
-	char *cmsg_cred;
-#endif
+	char *cmsg;
+	size_t cmsg_len;
 
+	/* descriptors passed along with the message */
+	int32_t fds[2];
+	int32_t nfds;
+	int32_t max_fds;
 };
 
 static int32_t qb_ipcs_us_connection_acceptor(int fd, int revent, void *data);
@@ -103,6 +111,92 @@ retry_send:
 	return processed;
 }
 
+/*
+ * Like qb_ipc_us_send(), but hand the peer copies of fds along with
+ * the message.
+ */
+ssize_t
+qb_ipc_us_send_fds(struct qb_ipc_one_way *one_way, const void *msg,
+		   size_t len, const int32_t *fds, int32_t nfds)
+{
+#ifdef QB_IPC_PASS_FDS
+	struct msghdr msg_send;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char *cmsg_buf;
+	ssize_t result;
+
+	cmsg_buf = calloc(1, CMSG_SPACE(nfds * sizeof(int)));
+	if (cmsg_buf == NULL) {
+		return -ENOMEM;
+	}
+	iov.iov_base = (void *)msg;
+	iov.iov_len = len;
+	memset(&msg_send, 0, sizeof(msg_send));
+	msg_send.msg_iov = &iov;
+	msg_send.msg_iovlen = 1;
+	msg_send.msg_control = cmsg_buf;
+	msg_send.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg_send);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	do {
+		result = sendmsg(one_way->u.us.sock, &msg_send, MSG_NOSIGNAL);
+	} while (result == -1 && errno == EAGAIN);
+	free(cmsg_buf);
+	if (result == -1) {
+		return -errno;
+	}
+	if (result < len) {
+		/* the descriptors went with the first part */
+		result += qb_ipc_us_send(one_way, (const char *)msg + result,
+					 len - result);
+	}
+	return result;
+#else
+	return -ENOTSUP;
+#endif /* QB_IPC_PASS_FDS */
+}
+
+/*
+ * Keep any descriptors that came with what was just received; the
+ * control buffer is reused by the next recvmsg().
+ */
+static void
+_auth_data_fds_take(struct ipc_auth_data *data)
+{
+#ifdef QB_IPC_PASS_FDS
+	struct cmsghdr *cmsg;
+	int32_t n;
+	int32_t i;
+	int fd;
+
+	if (data->max_fds == 0 || data->msg_recv.msg_controllen == 0) {
+		return;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&data->msg_recv); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&data->msg_recv, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),
+			       sizeof(int));
+			if (data->nfds < data->max_fds) {
+				data->fds[data->nfds++] = fd;
+			} else {
+				close(fd);
+			}
+		}
+	}
+#endif /* QB_IPC_PASS_FDS */
+}
+
 static ssize_t
 qb_ipc_us_recv_msghdr(struct ipc_auth_data *data)
 {
@@ -131,7 +225,20 @@ retry_recv:
 		return -ENOTCONN;
 	}
 
+	_auth_data_fds_take(data);
 	data->processed += result;
+	if (data->processed == data->len && data->len < data->max_len) {
+		/*
+		 * The base part of the message is in; if the peer
+		 * sent the optional trailing fields too, keep reading.
+		 */
+		struct qb_ipc_request_header *hdr =
+			(struct qb_ipc_request_header *)&data->msg;
+
+		if (hdr->size > data->len) {
+			data->len = QB_MIN(hdr->size, data->max_len);
+		}
+	}
 	if (data->processed != data->len) {
 		goto retry_recv;
 	}
@@ -404,14 +511,16 @@ destroy_ipc_auth_data(struct ipc_auth_data *data)
 		qb_ipcs_unref(data->s);
 	}
 
-#ifdef SO_PASSCRED
-	free(data->cmsg_cred);
-#endif
+	free(data->cmsg);
 	free(data);
 }
 
+/*
+ * max_fds is how many descriptors the peer may pass along, anything
+ * beyond that is closed (by the kernel if there is no room for it).
+ */
 static struct ipc_auth_data *
-init_ipc_auth_data(int sock, size_t len)
+init_ipc_auth_data(int sock, size_t len, size_t max_len, int32_t max_fds)
 {
 	struct ipc_auth_data *data = calloc(1, sizeof(struct ipc_auth_data));
 
@@ -425,14 +534,23 @@ init_ipc_auth_data(int sock, size_t len)
 	data->msg_recv.msg_namelen = 0;
 
 #ifdef SO_PASSCRED
-	data->cmsg_cred = calloc(1, CMSG_SPACE(sizeof(struct ucred)));
-	if (data->cmsg_cred == NULL) {
-		destroy_ipc_auth_data(data);
-		return NULL;
+	data->cmsg_len += CMSG_SPACE(sizeof(struct ucred));
+#endif
+#ifdef QB_IPC_PASS_FDS
+	data->max_fds = QB_MIN(max_fds, 2);
+	if (data->max_fds > 0) {
+		data->cmsg_len += CMSG_SPACE(data->max_fds * sizeof(int));
 	}
-	data->msg_recv.msg_control = (void *)data->cmsg_cred;
-	data->msg_recv.msg_controllen = CMSG_SPACE(sizeof(struct ucred));
 #endif
+	if (data->cmsg_len > 0) {
+		data->cmsg = calloc(1, data->cmsg_len);
+		if (data->cmsg == NULL) {
+			destroy_ipc_auth_data(data);
+			return NULL;
+		}
+		data->msg_recv.msg_control = (void *)data->cmsg;
+		data->msg_recv.msg_controllen = data->cmsg_len;
+	}
 #if defined(QB_SOLARIS) && !defined(_XPG4_2)
 	data->msg_recv.msg_accrights = 0;
 	data->msg_recv.msg_accrightslen = 0;
@@ -441,6 +559,7 @@ init_ipc_auth_data(int sock, size_t len)
 #endif /* QB_SOLARIS */
 
 	data->len = len;
+	data->max_len = max_len;
 	data->iov_recv.iov_base = (void *)&data->msg;
 	data->iov_recv.iov_len = data->len;
 	data->sock = sock;
@@ -450,7 +569,8 @@ init_ipc_auth_data(int sock, size_t len)
 
 int32_t
 qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
-			 struct qb_ipc_connection_response *r)
+			 struct qb_ipc_connection_response *r,
+			 const struct qb_ipcc_connect_params *params)
 {
 	int32_t res;
 	struct qb_ipc_connection_request request;
@@ -475,8 +595,30 @@ qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
 
 	memset(&request, 0, sizeof(request));
 	request.hdr.id = QB_IPC_MSG_AUTHENTICATE;
-	request.hdr.size = sizeof(request);
+	request.hdr.size = QB_IPC_CONNECTION_REQUEST_BASE_SIZE;
 	request.max_msg_size = c->setup.max_msg_size;
+	if (params) {
+		/*
+		 * Nothing from the server has arrived yet, so the trailing
+		 * fields go to every server. One that predates them reads
+		 * only the base request and leaves the rest on the setup
+		 * socket, where it is drained like liveness (socket) or
+		 * notification (shm) bytes: a few spurious wakeups and
+		 * "Nothing in q" warnings, the connection itself is fine.
+		 * check_ipc's legacy_reader tests play such a server.
+		 */
+		request.hdr.size = sizeof(request);
+		request.request_size = params->max_request_size;
+		request.response_size = params->max_response_size;
+		request.event_size = params->max_event_size;
+		request.large_msg_size = QB_MIN(params->max_large_msg_size,
+						UINT32_MAX);
+		request.hipri_size = QB_MIN(params->max_hipri_msg_size,
+					    UINT32_MAX);
+#ifdef QB_IPC_PASS_FDS
+		request.doorbell = QB_TRUE;
+#endif
+	}
 	res = qb_ipc_us_send(&c->setup, &request, request.hdr.size);
 	if (res < 0) {
 		qb_ipcc_us_sock_close(c->setup.u.us.sock);
@@ -500,7 +642,9 @@ int qb_ipcc_setup_connect_continue(struct qb_ipcc_connection *c, struct qb_ipc_c
 #ifdef QB_LINUX
 	int off = 0;
 #endif
-	data = init_ipc_auth_data(c->setup.u.us.sock, sizeof(struct qb_ipc_connection_response));
+	data = init_ipc_auth_data(c->setup.u.us.sock,
+				  QB_IPC_CONNECTION_RESPONSE_BASE_SIZE,
+				  sizeof(struct qb_ipc_connection_response), 2);
 	if (data == NULL) {
 		qb_ipcc_us_sock_close(c->setup.u.us.sock);
 		return -ENOMEM;
@@ -530,16 +674,32 @@ retry:
 		return res;
 	}
 
-	memcpy(r, &data->msg.res, sizeof(struct qb_ipc_connection_response));
+	memset(r, 0, sizeof(struct qb_ipc_connection_response));
+	memcpy(r, &data->msg.res, data->len);
 
 	qb_ipc_auth_creds(data);
 	c->egid = data->ugp.gid;
 	c->euid = data->ugp.uid;
 	c->server_pid = data->ugp.pid;
 
+	res = r->hdr.error;
+	if (res == 0 && r->doorbell_slot) {
+		if (data->nfds == 2) {
+			/* the descriptors are the doorbell's now */
+			res = qb_ipcc_doorbell_open(c, r->doorbell_slot,
+						    data->fds);
+			data->nfds = 0;
+		} else {
+			qb_util_log(LOG_ERR, "doorbell granted but not passed");
+			res = -EPROTO;
+		}
+	}
+	while (data->nfds > 0) {
+		close(data->fds[--data->nfds]);
+	}
 	destroy_ipc_auth_data(data);
 
-	return r->hdr.error;
+	return res;
 }
 
 /*
@@ -658,6 +818,116 @@ qb_ipcs_us_withdraw(struct qb_ipcs_service * s)
 	return 0;
 }
 
+static int32_t
+new_connection_finish(struct qb_ipcs_connection *c, int32_t res,
+		      const struct qb_ipc_connection_request *req, size_t len)
+{
+	struct qb_ipcs_service *s = c->service;
+	int32_t sock = c->setup.u.us.sock;
+	int32_t res2 = 0;
+	int32_t sizes_negotiated = (len > QB_IPC_CONNECTION_REQUEST_BASE_SIZE);
+	struct qb_ipc_connection_response response;
+	int32_t doorbell_fds[2];
+
+	memset(&response, 0, sizeof(response));
+	if (res != 0) {
+		goto send_response;
+	}
+
+	qb_util_log(LOG_DEBUG, "IPC credentials authenticated (%s)",
+		    c->description);
+
+	if (s->funcs.connect) {
+		res = s->funcs.connect(s, c, &response);
+		if (res != 0) {
+			goto send_response;
+		}
+	}
+	if (sizes_negotiated && req->large_msg_size > 0 &&
+	    s->large_msg_max > 0 &&
+	    qb_ipc_large_msg_template_set(c->large_msg_template,
+					  response.request) == 0) {
+		c->large_msg_max = QB_MIN(req->large_msg_size,
+					  s->large_msg_max);
+	}
+#ifdef QB_IPC_PASS_FDS
+	if (sizes_negotiated && req->doorbell && s->doorbell) {
+		/* without a free slot the client just notifies the old way */
+		(void)qb_ipcs_doorbell_attach(c, doorbell_fds);
+	}
+#endif
+	/*
+	 * The connection is good, add it to the active connection list
+	 */
+	c->state = QB_IPCS_CONNECTION_ACTIVE;
+	qb_list_add(&c->list, &s->connections);
+
+send_response:
+	response.hdr.id = QB_IPC_MSG_AUTHENTICATE;
+	response.hdr.size = QB_IPC_CONNECTION_RESPONSE_BASE_SIZE;
+	response.hdr.error = res;
+	if (sizes_negotiated) {
+		response.hdr.size = sizeof(response);
+	}
+	if (res == 0) {
+		response.connection = (intptr_t) c;
+		response.connection_type = s->type;
+		response.max_msg_size = QB_MAX(c->request.max_msg_size,
+					       QB_MAX(c->response.max_msg_size,
+						      c->event.max_msg_size));
+		response.request_size = c->request.max_msg_size;
+		response.response_size = c->response.max_msg_size;
+		response.event_size = c->event.max_msg_size;
+		response.large_msg_size = c->large_msg_max;
+		response.hipri_size = c->request_hi.max_msg_size;
+		response.doorbell_slot = c->doorbell_slot;
+		response.event_ranges_max = QB_IPC_EVENT_RANGES_MAX;
+		s->stats.active_connections++;
+	}
+
+	if (res == 0 && c->doorbell_slot) {
+		res2 = qb_ipc_us_send_fds(&c->setup, &response,
+					  response.hdr.size, doorbell_fds, 2);
+	} else {
+		res2 = qb_ipc_us_send(&c->setup, &response, response.hdr.size);
+	}
+	if (res == 0 && res2 != response.hdr.size) {
+		res = res2;
+	}
+
+	if (res == 0) {
+		qb_ipcs_connection_ref(c);
+		if (s->serv_fns.connection_created) {
+			s->serv_fns.connection_created(c);
+		}
+		if (c->state == QB_IPCS_CONNECTION_ACTIVE) {
+			c->state = QB_IPCS_CONNECTION_ESTABLISHED;
+		}
+		qb_ipcs_connection_unref(c);
+	} else {
+		if (res == -EACCES) {
+			qb_util_log(LOG_INFO, "IPC connection credentials rejected (%s)",
+				    c->description);
+		} else if (res == -EAGAIN) {
+			qb_util_log(LOG_INFO, "IPC connection not ready (%s)",
+				    c->description);
+		} else {
+			qb_util_perror(LOG_INFO, "IPC connection setup failed (%s)",
+				       c->description);
+			errno = -res;
+		}
+
+		if (c->state == QB_IPCS_CONNECTION_INACTIVE) {
+			/* This removes the initial alloc ref */
+			qb_ipcs_connection_unref(c);
+		        qb_ipcc_us_sock_close(sock);
+		} else {
+			qb_ipcs_disconnect(c);
+		}
+	}
+	return res;
+}
+
 static int32_t
 handle_new_connection(struct qb_ipcs_service *s,
 		      int32_t auth_result,
@@ -667,9 +937,8 @@ handle_new_connection(struct qb_ipcs_service *s,
 	struct qb_ipcs_connection *c = NULL;
 	struct qb_ipc_connection_request *req = msg;
 	int32_t res = auth_result;
-	int32_t res2 = 0;
 	uint32_t max_buffer_size = QB_MAX(req->max_msg_size, s->max_buffer_size);
-	struct qb_ipc_connection_response response;
+	int32_t sizes_negotiated = (len > QB_IPC_CONNECTION_REQUEST_BASE_SIZE);
 	const char suffix[] = "/qb";
 	int desc_len;
 
@@ -679,42 +948,60 @@ handle_new_connection(struct qb_ipcs_service *s,
 		return -ENOMEM;
 	}
 
-	c->receive_buf = calloc(1, max_buffer_size);
+	c->request.max_msg_size = max_buffer_size;
+	c->response.max_msg_size = max_buffer_size;
+	c->event.max_msg_size = max_buffer_size;
+	if (sizes_negotiated) {
+		if (req->request_size) {
+			c->request.max_msg_size =
+				QB_MAX(req->request_size, s->max_buffer_size);
+		}
+		if (req->response_size) {
+			c->response.max_msg_size =
+				QB_MAX(req->response_size, s->max_buffer_size);
+		}
+		if (req->event_size) {
+			c->event.max_msg_size =
+				QB_MAX(req->event_size, s->max_buffer_size);
+		}
+		/* the transport drops the lane again if it can't do it */
+		if (req->hipri_size >= sizeof(struct qb_ipc_request_header)) {
+			c->request_hi.max_msg_size =
+				QB_MIN(req->hipri_size, c->request.max_msg_size);
+		}
+	}
+
+	c->receive_buf = calloc(1, c->request.max_msg_size);
 	if (c->receive_buf == NULL) {
 		free(c);
 		qb_ipcc_us_sock_close(sock);
 		return -ENOMEM;
 	}
 	c->setup.u.us.sock = sock;
-	c->request.max_msg_size = max_buffer_size;
-	c->response.max_msg_size = max_buffer_size;
-	c->event.max_msg_size = max_buffer_size;
 	c->pid = ugp->pid;
 	c->auth.uid = c->euid = ugp->uid;
 	c->auth.gid = c->egid = ugp->gid;
 	c->auth.mode = 0600;
 	c->stats.client_pid = ugp->pid;
 
-	memset(&response, 0, sizeof(response));
-
 #if defined(QB_LINUX) || defined(QB_CYGWIN)
 	desc_len = snprintf(c->description, CONNECTION_DESCRIPTION - sizeof suffix,
 			    "/dev/shm/qb-%d-%d-%d-XXXXXX", s->pid, ugp->pid, c->setup.u.us.sock);
 	if (desc_len < 0) {
 		res = -errno;
-		goto send_response;
+		goto finish;
 	}
 	if (desc_len >= CONNECTION_DESCRIPTION - sizeof suffix) {
 		res = -ENAMETOOLONG;
-		goto send_response;
+		goto finish;
 	}
 	if (mkdtemp(c->description) == NULL) {
 		res = -errno;
-		goto send_response;
+		goto finish;
 	}
 	if (chmod(c->description, 0770)) {
 		res = -errno;
-		goto send_response;
+		goto finish;
 	}
 	/* chown may fail if not root, but log it */
 	if (chown(c->description, c->auth.uid, c->auth.gid) != 0) {
@@ -729,98 +1016,90 @@ handle_new_connection(struct qb_ipcs_service *s,
 			    "%d-%d-%d", s->pid, ugp->pid, c->setup.u.us.sock);
 	if (desc_len < 0) {
 		res = -errno;
-		goto send_response;
+		goto finish;
 	}
 	if (desc_len >= CONNECTION_DESCRIPTION) {
 		res = -ENAMETOOLONG;
-		goto send_response;
+		goto finish;
 	}
 #endif
 
-
-
 	if (auth_result == 0 && c->service->serv_fns.connection_accept) {
 		res = c->service->serv_fns.connection_accept(c,
 							     c->euid, c->egid);
 	}
-	if (res != 0) {
-		goto send_response;
+	if (auth_result == 0 && res == -EINPROGRESS) {
+		/*
+		 * The client waits on the setup socket until
+		 * qb_ipcs_connection_accept_complete() answers it.
+		 */
+		c->accept_req = calloc(1, sizeof(struct qb_ipc_connection_request));
+		if (c->accept_req == NULL) {
+			res = -ENOMEM;
+			goto finish;
+		}
+		memcpy(c->accept_req, req, len);
+		c->accept_req->hdr.size = len;
+		qb_util_log(LOG_DEBUG, "IPC connection accept deferred (%s)",
+			    c->description);
+		return 0;
 	}
 
-	qb_util_log(LOG_DEBUG, "IPC credentials authenticated (%s)",
-		    c->description);
+finish:
+	return new_connection_finish(c, res, req, len);
+}
 
-	if (s->funcs.connect) {
-		res = s->funcs.connect(s, c, &response);
-		if (res != 0) {
-			goto send_response;
-		}
-	}
-	/*
-	 * The connection is good, add it to the active connection list
-	 */
-	c->state = QB_IPCS_CONNECTION_ACTIVE;
-	qb_list_add(&c->list, &s->connections);
+/*
+ * Called once the request is in (or the socket gave up): hand the
+ * connection on and let go of the auth state.
+ */
+static void
+auth_done(struct ipc_auth_data *data, int32_t res)
+{
+#ifdef SO_PASSCRED
+	int res1;
+	int off = 0;
 
-send_response:
-	response.hdr.id = QB_IPC_MSG_AUTHENTICATE;
-	response.hdr.size = sizeof(response);
-	response.hdr.error = res;
-	if (res == 0) {
-		response.connection = (intptr_t) c;
-		response.connection_type = s->type;
-		response.max_msg_size = c->request.max_msg_size;
-		s->stats.active_connections++;
+	res1 = setsockopt(data->sock, SOL_SOCKET, SO_PASSCRED, &off, sizeof(off));
+	if (res1 != 0) {
+		int err = errno;
+		close(data->sock);
+		destroy_ipc_auth_data(data);
+		errno = err;
+		return;
 	}
+#endif
 
-	res2 = qb_ipc_us_send(&c->setup, &response, response.hdr.size);
-	if (res == 0 && res2 != response.hdr.size) {
-		res = res2;
+	if (res < 0) {
+		close(data->sock);
+	} else if (data->msg.req.hdr.id == QB_IPC_MSG_AUTHENTICATE) {
+		(void)handle_new_connection(data->s, res, data->sock, &data->msg, data->len, &data->ugp);
+	} else {
+		close(data->sock);
 	}
+	destroy_ipc_auth_data(data);
+}
 
-	if (res == 0) {
-		qb_ipcs_connection_ref(c);
-		if (s->serv_fns.connection_created) {
-			s->serv_fns.connection_created(c);
-		}
-		if (c->state == QB_IPCS_CONNECTION_ACTIVE) {
-			c->state = QB_IPCS_CONNECTION_ESTABLISHED;
-		}
-		qb_ipcs_connection_unref(c);
-	} else {
-		if (res == -EACCES) {
-			qb_util_log(LOG_INFO, "IPC connection credentials rejected (%s)",
-				    c->description);
-		} else if (res == -EAGAIN) {
-			qb_util_log(LOG_INFO, "IPC connection not ready (%s)",
-				    c->description);
-		} else {
-			qb_util_perror(LOG_INFO, "IPC connection setup failed (%s)",
-				       c->description);
-			errno = -res;
-		}
+static int32_t
+auth_recv(struct ipc_auth_data *data)
+{
+	int32_t res;
 
-		if (c->state == QB_IPCS_CONNECTION_INACTIVE) {
-			/* This removes the initial alloc ref */
-			qb_ipcs_connection_unref(c);
-		        qb_ipcc_us_sock_close(sock);
-		} else {
-			qb_ipcs_disconnect(c);
-		}
+	res = qb_ipc_us_recv_msghdr(data);
+	if (res == -EAGAIN) {
+		return res;
 	}
-	return res;
+	if (res != data->len) {
+		return -EIO;
+	}
+	return qb_ipc_auth_creds(data);
 }
 
 static int32_t
 process_auth(int32_t fd, int32_t revents, void *d)
 {
 	struct ipc_auth_data *data = (struct ipc_auth_data *) d;
-
 	int32_t res = 0;
-	int res1;
-#ifdef SO_PASSCRED
-	int off = 0;
-#endif
 
 	if (data->s->server_sock == -1) {
 		qb_util_log(LOG_DEBUG, "Closing fd (%d) for server shutdown", fd);
@@ -842,40 +1121,15 @@ process_auth(int32_t fd, int32_t revents, void *d)
 		return 0;
 	}
 
-	res = qb_ipc_us_recv_msghdr(data);
+	res = auth_recv(data);
 	if (res == -EAGAIN) {
 		/* yield to mainloop, Let mainloop call us again */
 		return 0;
 	}
 
-	if (res != data->len) {
-		res = -EIO;
-		goto cleanup_and_return;
-	}
-
-	res = qb_ipc_auth_creds(data);
-
 cleanup_and_return:
-#ifdef SO_PASSCRED
-	res1 = setsockopt(data->sock, SOL_SOCKET, SO_PASSCRED, &off, sizeof(off));
-	if (res1 != 0) {
-		int err = errno;
-		close(data->sock);
-		errno = err;
-		return res;
-	}
-#endif
-
 	(void)data->s->poll_fns.dispatch_del(data->sock);
-
-	if (res < 0) {
-		close(data->sock);
-	} else if (data->msg.req.hdr.id == QB_IPC_MSG_AUTHENTICATE) {
-		(void)handle_new_connection(data->s, res, data->sock, &data->msg, data->len, &data->ugp);
-	} else {
-		close(data->sock);
-	}
-	destroy_ipc_auth_data(data);
+	auth_done(data, res);
 
 	return 1;
 }
@@ -890,7 +1144,8 @@ qb_ipcs_uc_recv_and_auth(int32_t sock, struct qb_ipcs_service *s)
 	int on = 1;
 #endif
 
-	data = init_ipc_auth_data(sock, sizeof(struct qb_ipc_connection_request));
+	data = init_ipc_auth_data(sock, QB_IPC_CONNECTION_REQUEST_BASE_SIZE,
+				  sizeof(struct qb_ipc_connection_request), 0);
 	if (data == NULL) {
 		close(sock);
 		/* -ENOMEM */
@@ -904,10 +1159,22 @@ qb_ipcs_uc_recv_and_auth(int32_t sock, struct qb_ipcs_service *s)
 	res1 = setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
 	if (res1 != 0) {
 		close(sock);
+		destroy_ipc_auth_data(data);
 		return;
 	}
 #endif
 
+	/*
+	 * Clients send the request straight after connect(), so by the
+	 * time a backlog is being drained it's usually already here and
+	 * there is no need to go round the poll loop for it.
+	 */
+	res = auth_recv(data);
+	if (res != -EAGAIN) {
+		auth_done(data, res);
+		return;
+	}
+
 	res = s->poll_fns.dispatch_add(s->poll_priority,
 	                               data->sock,
 	                               POLLIN | POLLPRI | POLLNVAL,
@@ -927,7 +1194,8 @@ qb_ipcs_us_connection_acceptor(int fd, int revent, void *data)
 	int32_t new_fd;
 	struct qb_ipcs_service *s = (struct qb_ipcs_service *)data;
 	int32_t res;
-	socklen_t addrlen = sizeof(struct sockaddr_un);
+	int32_t accepted;
+	socklen_t addrlen;
 
 	if (revent & (POLLNVAL | POLLHUP | POLLERR)) {
 		/*
@@ -936,38 +1204,70 @@ qb_ipcs_us_connection_acceptor(int fd, int revent, void *data)
 		return -1;
 	}
 
+	/*
+	 * Drain the backlog, but leave the rest of the loop a look in
+	 * if clients keep coming.
+	 */
+	for (accepted = 0; accepted < SERVER_BACKLOG; accepted++) {
 retry_accept:
-	errno = 0;
-	new_fd = accept(fd, (struct sockaddr *)&un_addr, &addrlen);
-	if (new_fd == -1 && errno == EINTR) {
-		goto retry_accept;
-	}
+		errno = 0;
+		addrlen = sizeof(struct sockaddr_un);
+		new_fd = accept(fd, (struct sockaddr *)&un_addr, &addrlen);
+		if (new_fd == -1 && errno == EINTR) {
+			goto retry_accept;
+		}
+		if (new_fd == -1 && accepted > 0 &&
+		    (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
 
-	if (new_fd == -1 && errno == EBADF) {
-		qb_util_perror(LOG_ERR,
-			       "Could not accept client connection from fd:%d",
-			       fd);
-		return -1;
-	}
-	if (new_fd == -1) {
-		qb_util_perror(LOG_ERR, "Could not accept client connection");
-		/* This is an error, but -1 would indicate disconnect
-		 * from the poll loop
-		 */
-		return 0;
+		if (new_fd == -1 && errno == EBADF) {
+			qb_util_perror(LOG_ERR,
+				       "Could not accept client connection from fd:%d",
+				       fd);
+			return -1;
+		}
+		if (new_fd == -1) {
+			qb_util_perror(LOG_ERR, "Could not accept client connection");
+			/* This is an error, but -1 would indicate disconnect
+			 * from the poll loop
+			 */
+			return 0;
+		}
+
+		res = qb_sys_fd_nonblock_cloexec_set(new_fd);
+		if (res < 0) {
+			close(new_fd);
+			continue;
+		}
+
+		qb_ipcs_uc_recv_and_auth(new_fd, s);
+		if (s->server_sock == -1) {
+			/* a callback withdrew the service */
+			break;
+		}
 	}
+	return 0;
+}
 
-	res = qb_sys_fd_nonblock_cloexec_set(new_fd);
-	if (res < 0) {
-		close(new_fd);
-		/* This is an error, but -1 would indicate disconnect
-		 * from the poll loop
-		 */
-		return 0;
+int32_t
+qb_ipcs_connection_accept_complete(qb_ipcs_connection_t *c, int32_t result)
+{
+	struct qb_ipc_connection_request *req;
+	int32_t res;
+
+	if (c == NULL || c->accept_req == NULL || result == -EINPROGRESS) {
+		return -EINVAL;
 	}
+	req = c->accept_req;
+	c->accept_req = NULL;
 
-	qb_ipcs_uc_recv_and_auth(new_fd, s);
-	return 0;
+	if (result == 0 && c->service->server_sock == -1) {
+		result = -ESHUTDOWN;
+	}
+	res = new_connection_finish(c, result, req, req->hdr.size);
+	free(req);
+	return res;
 }
 
 void remove_tempdir(const char *name)
@@ -987,3 +1287,147 @@ void remove_tempdir(const char *name)
 	}
 #endif
 }
+
+/*
+ * Large messages are written to files next to the connection's other
+ * shared files, so they need an absolute name to hang off; without the
+ * per-connection directory they are not offered.
+ */
+int32_t
+qb_ipc_large_msg_template_set(char *tmpl, const char *sibling)
+{
+	int32_t len;
+
+	if (sibling[0] != '/') {
+		return -ENOTSUP;
+	}
+	len = snprintf(tmpl, NAME_MAX, "%s-large-XXXXXX", sibling);
+	if (len < 0 || len >= NAME_MAX) {
+		tmpl[0] = '\0';
+		return -ENAMETOOLONG;
+	}
+	return 0;
+}
+
+int32_t
+qb_ipc_large_msg_create(const char *tmpl,
+			const struct iovec *iov, size_t iov_len,
+			size_t size, struct qb_ipc_large_msg *msg)
+{
+	char path[PATH_MAX];
+	char *data;
+	char *pos;
+	int32_t fd;
+	int32_t i;
+
+	fd = qb_sys_mmap_file_open(path, tmpl, size, O_CREAT | O_RDWR);
+	if (fd < 0) {
+		return fd;
+	}
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		int32_t res = -errno;
+
+		qb_util_perror(LOG_ERR, "couldn't mmap large message %s", path);
+		close(fd);
+		unlink(path);
+		return res;
+	}
+	pos = data;
+	for (i = 0; i < iov_len; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	munmap(data, size);
+	close(fd);
+
+	memset(msg, 0, sizeof(*msg));
+	msg->hdr.id = QB_IPC_MSG_LARGE;
+	msg->hdr.size = sizeof(*msg);
+	msg->size = size;
+	(void)strlcpy(msg->name, path, NAME_MAX);
+	return 0;
+}
+
+ssize_t
+qb_ipc_large_msg_map(const char *tmpl, const struct qb_ipc_large_msg *msg,
+		     size_t max_size, void **data)
+{
+	const char *slash = strrchr(tmpl, '/');
+	struct stat st;
+	size_t prefix_len;
+	int32_t fd;
+	ssize_t res;
+
+	/*
+	 * The name comes from the peer: it has to be one of ours, in the
+	 * connection directory, and not a link to somewhere else.
+	 */
+	prefix_len = strlen(tmpl) - strlen("XXXXXX");
+	if (memchr(msg->name, '\0', NAME_MAX) == NULL ||
+	    strncmp(msg->name, tmpl, prefix_len) != 0 ||
+	    strrchr(msg->name, '/') != msg->name + (slash - tmpl)) {
+		return -EINVAL;
+	}
+	if (msg->size == 0 || msg->size > max_size) {
+		return -EMSGSIZE;
+	}
+
+	fd = open(msg->name, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't open large message %s",
+			       msg->name);
+		return res;
+	}
+	/* the file goes away once the last mapping does */
+	unlink(msg->name);
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size < msg->size) {
+		close(fd);
+		return -EBADMSG;
+	}
+	*data = mmap(NULL, msg->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (*data == MAP_FAILED) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	close(fd);
+	return msg->size;
+}
+
+/*
+ * Remove large message files that were sent but never picked up.
+ */
+void
+qb_ipc_large_msg_cleanup(const char *tmpl)
+{
+	char dirname[PATH_MAX];
+	char path[PATH_MAX];
+	const char *slash = strrchr(tmpl, '/');
+	const char *prefix;
+	size_t prefix_len;
+	struct dirent *entry;
+	DIR *dir;
+
+	if (slash == NULL || slash - tmpl >= sizeof(dirname)) {
+		return;
+	}
+	memcpy(dirname, tmpl, slash - tmpl);
+	dirname[slash - tmpl] = '\0';
+	prefix = slash + 1;
+	prefix_len = strlen(prefix) - strlen("XXXXXX");
+
+	dir = opendir(dirname);
+	if (dir == NULL) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, prefix, prefix_len) == 0) {
+			snprintf(path, PATH_MAX, "%s/%s", dirname, entry->d_name);
+			(void)unlink(path);
+		}
+	}
+	closedir(dir);
+}
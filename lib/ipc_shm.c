@@ -74,6 +74,15 @@ qb_ipcc_shm_disconnect(struct qb_ipcc_connection *c)
 	if (rb_destructor == qb_rb_force_close) {
 		qb_util_log(LOG_DEBUG,
 			    "FORCE closing server sockets\n");
+		if (c->event.u.shm.rb == NULL) {
+			/* the server may have created it without us ever
+			 * getting an event; open it so it gets tidied up too.
+			 */
+			c->event.u.shm.rb = qb_rb_open(c->event.u.shm.rb_name,
+						       c->event.max_msg_size,
+						       QB_RB_FLAG_SHARED_PROCESS,
+						       0);
+		}
 	}
 
 	qb_ipcc_us_sock_close(c->setup.u.us.sock);
@@ -81,6 +90,7 @@ qb_ipcc_shm_disconnect(struct qb_ipcc_connection *c)
 	rb_destructor(qb_rb_lastref_and_ret(&c->request.u.shm.rb));
 	rb_destructor(qb_rb_lastref_and_ret(&c->response.u.shm.rb));
 	rb_destructor(qb_rb_lastref_and_ret(&c->event.u.shm.rb));
+	rb_destructor(qb_rb_lastref_and_ret(&c->request_hi.u.shm.rb));
 }
 
 static ssize_t
@@ -187,6 +197,43 @@ qb_ipc_shm_q_len_get(struct qb_ipc_one_way *one_way)
 	return qb_rb_chunks_used(one_way->u.shm.rb);
 }
 
+/*
+ * Compares the write and read pointers in the shared header directly, so
+ * unlike qb_rb_chunks_used() it never needs a syscall (sysv semaphores).
+ */
+static ssize_t
+qb_ipcc_shm_data_pending(struct qb_ipc_one_way *one_way)
+{
+	if (one_way->u.shm.rb == NULL) {
+		return -ENOTCONN;
+	}
+	return qb_rb_space_used(one_way->u.shm.rb);
+}
+
+/*
+ * The event ring is created by the server when it sends the first event
+ * and opened by the client when it is told about that event, so clients
+ * that never get events do not cost a buffer.
+ */
+static int32_t
+qb_ipcc_shm_event_open(struct qb_ipcc_connection *c)
+{
+	if (c->event.u.shm.rb) {
+		return 0;
+	}
+	c->event.u.shm.rb = qb_rb_open(c->event.u.shm.rb_name,
+				       c->event.max_msg_size,
+				       QB_RB_FLAG_SHARED_PROCESS, 0);
+	if (c->event.u.shm.rb == NULL) {
+		if (errno == ENOENT) {
+			return -EAGAIN;
+		}
+		qb_util_perror(LOG_ERR, "qb_rb_open:EVENT");
+		return -errno;
+	}
+	return 0;
+}
+
 int32_t
 qb_ipcc_shm_connect(struct qb_ipcc_connection * c,
 		    struct qb_ipc_connection_response * response)
@@ -198,6 +245,8 @@ qb_ipcc_shm_connect(struct qb_ipcc_connection * c,
 	c->funcs.recv = qb_ipc_shm_recv;
 	c->funcs.fc_get = qb_ipc_shm_fc_get;
 	c->funcs.disconnect = qb_ipcc_shm_disconnect;
+	c->funcs.event_open = qb_ipcc_shm_event_open;
+	c->funcs.data_pending = qb_ipcc_shm_data_pending;
 	c->needs_sock_for_poll = QB_TRUE;
 
 	if (strlen(c->name) > (NAME_MAX - 20)) {
@@ -223,14 +272,20 @@ qb_ipcc_shm_connect(struct qb_ipcc_connection * c,
 		qb_util_perror(LOG_ERR, "qb_rb_open:RESPONSE");
 		goto cleanup_request;
 	}
-	c->event.u.shm.rb = qb_rb_open(response->event,
-				       c->response.max_msg_size,
-				       QB_RB_FLAG_SHARED_PROCESS, 0);
-
-	if (c->event.u.shm.rb == NULL) {
-		res = -errno;
-		qb_util_perror(LOG_ERR, "qb_rb_open:EVENT");
-		goto cleanup_request_response;
+	(void)strlcpy(c->event.u.shm.rb_name, response->event, NAME_MAX);
+
+	if (c->request_hi.max_msg_size > 0) {
+		snprintf(c->request_hi.u.shm.rb_name, NAME_MAX, "%s-hi",
+			 response->request);
+		c->request_hi.u.shm.rb = qb_rb_open(c->request_hi.u.shm.rb_name,
+						    c->request_hi.max_msg_size,
+						    QB_RB_FLAG_SHARED_PROCESS,
+						    sizeof(int32_t));
+		if (c->request_hi.u.shm.rb == NULL) {
+			res = -errno;
+			qb_util_perror(LOG_ERR, "qb_rb_open:REQUEST-HI");
+			goto cleanup_request_response;
+		}
 	}
 	return 0;
 
@@ -271,6 +326,8 @@ qb_ipcs_shm_disconnect(struct qb_ipcs_connection *c)
 	sa.sa_flags = 0;
 	sigaction(SIGBUS, &sa, &old_sa);
 
+	qb_ipcs_doorbell_detach(c);
+
 	if (setjmp(sigbus_jmpbuf) == 1) {
 		goto end_disconnect;
 	}
@@ -286,6 +343,9 @@ qb_ipcs_shm_disconnect(struct qb_ipcs_connection *c)
 		if (c->request.u.shm.rb) {
 			qb_rb_close(qb_rb_lastref_and_ret(&c->request.u.shm.rb));
 		}
+		if (c->request_hi.u.shm.rb) {
+			qb_rb_close(qb_rb_lastref_and_ret(&c->request_hi.u.shm.rb));
+		}
 	}
 
 	if (c->state == QB_IPCS_CONNECTION_ESTABLISHED ||
@@ -336,6 +396,15 @@ cleanup:
 	return res;
 }
 
+static int32_t
+qb_ipcs_shm_event_open(struct qb_ipcs_connection *c)
+{
+	if (c->event.u.shm.rb) {
+		return 0;
+	}
+	return qb_ipcs_shm_rb_open(c, &c->event, c->event.u.shm.rb_name);
+}
+
 static int32_t
 qb_ipcs_shm_connect(struct qb_ipcs_service *s,
 		    struct qb_ipcs_connection *c,
@@ -374,10 +443,17 @@ qb_ipcs_shm_connect(struct qb_ipcs_service *s,
 		goto cleanup_request;
 	}
 
-	res = qb_ipcs_shm_rb_open(c, &c->event,
-				  r->event);
-	if (res != 0) {
-		goto cleanup_request_response;
+	/* the event ring is created on first use */
+	(void)strlcpy(c->event.u.shm.rb_name, r->event, NAME_MAX);
+
+	if (c->request_hi.max_msg_size > 0) {
+		snprintf(c->request_hi.u.shm.rb_name, NAME_MAX, "%s-hi",
+			 r->request);
+		if (qb_ipcs_shm_rb_open(c, &c->request_hi,
+					c->request_hi.u.shm.rb_name) != 0) {
+			/* not fatal, the client just won't get the lane */
+			c->request_hi.max_msg_size = 0;
+		}
 	}
 
 	res = s->poll_fns.dispatch_add(s->poll_priority,
@@ -388,16 +464,14 @@ qb_ipcs_shm_connect(struct qb_ipcs_service *s,
 		qb_util_log(LOG_ERR,
 			    "Error adding socket to mainloop (%s).",
 			    c->description);
-		goto cleanup_request_response_event;
+		goto cleanup_request_response;
 	}
 
 	r->hdr.error = 0;
 	return 0;
 
-cleanup_request_response_event:
-	qb_rb_close(qb_rb_lastref_and_ret(&c->event.u.shm.rb));
-
 cleanup_request_response:
+	qb_rb_close(qb_rb_lastref_and_ret(&c->request_hi.u.shm.rb));
 	qb_rb_close(qb_rb_lastref_and_ret(&c->response.u.shm.rb));
 
 cleanup_request:
@@ -425,6 +499,7 @@ qb_ipcs_shm_init(struct qb_ipcs_service *s)
 
 	s->funcs.fc_set = qb_ipc_shm_fc_set;
 	s->funcs.q_len_get = qb_ipc_shm_q_len_get;
+	s->funcs.event_open = qb_ipcs_shm_event_open;
 
 	s->needs_sock_for_poll = QB_TRUE;
 }
@@ -40,7 +40,7 @@ struct ipc_us_control {
 	int32_t sent;
 	int32_t flow_control;
 };
-#define SHM_CONTROL_SIZE (3 * sizeof(struct ipc_us_control))
+#define SHM_CONTROL_SIZE (4 * sizeof(struct ipc_us_control))
 
 int use_filesystem_sockets(void)
 {
@@ -380,6 +380,12 @@ qb_ipcc_us_disconnect(struct qb_ipcc_connection *c)
 			snprintf(sock_name,PATH_MAX,"%s-%s",base_name,"response");
 			qb_util_log(LOG_DEBUG, "unlink sock_name=%s",sock_name);
 			unlink(sock_name);
+			snprintf(sock_name,PATH_MAX,"%s-%s",base_name,"request-hi");
+			qb_util_log(LOG_DEBUG, "unlink sock_name=%s",sock_name);
+			unlink(sock_name);
+			snprintf(sock_name,PATH_MAX,"%s-%s",base_name,"request-hi-tx");
+			qb_util_log(LOG_DEBUG, "unlink sock_name=%s",sock_name);
+			unlink(sock_name);
 			free(base_name);
 		}
 	}
@@ -390,6 +396,9 @@ qb_ipcc_us_disconnect(struct qb_ipcc_connection *c)
 	qb_ipcc_us_sock_close(c->event.u.us.sock);
 	qb_ipcc_us_sock_close(c->request.u.us.sock);
 	qb_ipcc_us_sock_close(c->setup.u.us.sock);
+	if (c->request_hi.max_msg_size > 0) {
+		qb_ipcc_us_sock_close(c->request_hi.u.us.sock);
+	}
 }
 
 static ssize_t
@@ -408,6 +417,7 @@ qb_ipc_socket_send(struct qb_ipc_one_way *one_way,
 		}
 	}
 
+	/* a no-op wherever MSG_NOSIGNAL or SO_NOSIGPIPE does the job */
 	qb_sigpipe_ctl(QB_SIGPIPE_IGNORE);
 	rc = send(one_way->u.us.sock, msg_ptr, msg_len, MSG_NOSIGNAL);
 	if (rc == -1) {
@@ -431,25 +441,29 @@ qb_ipc_socket_sendv(struct qb_ipc_one_way *one_way, const struct iovec *iov,
 {
 	int32_t rc;
 	struct ipc_us_control *ctl;
+	struct msghdr msg;
 	ctl = (struct ipc_us_control *)one_way->u.us.shared_data;
 
-	qb_sigpipe_ctl(QB_SIGPIPE_IGNORE);
-
 	if (one_way->u.us.sock_name) {
 		rc = _finish_connecting(one_way);
 		if (rc < 0) {
 			qb_util_perror(LOG_ERR, "socket connect-on-sendv");
-			qb_sigpipe_ctl(QB_SIGPIPE_DEFAULT);
 			return rc;
 		}
 	}
 
-	rc = writev(one_way->u.us.sock, iov, iov_len);
+	/* sendmsg() rather than writev() so MSG_NOSIGNAL applies */
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iov_len;
+
+	qb_sigpipe_ctl(QB_SIGPIPE_IGNORE);
+	rc = sendmsg(one_way->u.us.sock, &msg, MSG_NOSIGNAL);
 
 	if (rc == -1) {
 		rc = -errno;
 		if (errno != EAGAIN && errno != ENOBUFS) {
-			qb_util_perror(LOG_DEBUG, "socket_sendv:writev %d",
+			qb_util_perror(LOG_DEBUG, "socket_sendv:sendmsg %d",
 				       one_way->u.us.sock);
 		}
 	}
@@ -462,86 +476,300 @@ qb_ipc_socket_sendv(struct qb_ipc_one_way *one_way, const struct iovec *iov,
 	return rc;
 }
 
+static int32_t
+_us_recv_error(int32_t err)
+{
+	if (use_filesystem_sockets()) {
+		if (err == ECONNRESET || err == EPIPE) {
+			return -ENOTCONN;
+		}
+	}
+	return -err;
+}
+
+/*
+ * Wait for more to read after EAGAIN.
+ * Returns 0 to try again, -ETIMEDOUT once timeout has run out.
+ */
+static int32_t
+_us_recv_wait(struct qb_ipc_one_way *one_way, int32_t timeout,
+	      int32_t *time_waited)
+{
+	int32_t time_to_wait = timeout;
+	int32_t res;
+
+	if (timeout == -1) {
+		time_to_wait = 1000;
+	} else if (*time_waited >= timeout) {
+		return -ETIMEDOUT;
+	}
+	res = qb_ipc_us_ready(one_way, NULL, time_to_wait, POLLIN);
+	if (qb_ipc_us_sock_error_is_disconnected(res)) {
+		return res;
+	}
+	*time_waited += time_to_wait;
+	return 0;
+}
+
 /*
  * recv a message of unknown size.
+ *
+ * These are datagram sockets, so one recv gets the whole message.
  */
 static ssize_t
 qb_ipc_us_recv_at_most(struct qb_ipc_one_way *one_way,
 		       void *msg, size_t len, int32_t timeout)
 {
-	int32_t result;
-	int32_t final_rc = 0;
-	int32_t to_recv = 0;
-	char *data = msg;
+	ssize_t result;
+	int32_t res;
 	struct ipc_us_control *ctl = NULL;
 	int32_t time_waited = 0;
-	int32_t time_to_wait = timeout;
+	struct msghdr msg_recv;
+	struct iovec iov;
 
-	if (timeout == -1) {
-		time_to_wait = 1000;
+	iov.iov_base = msg;
+	iov.iov_len = len;
+	memset(&msg_recv, 0, sizeof(msg_recv));
+	msg_recv.msg_iov = &iov;
+	msg_recv.msg_iovlen = 1;
+
+	do {
+		result = recvmsg(one_way->u.us.sock, &msg_recv, MSG_DONTWAIT);
+		if (result == -1) {
+			if (errno != EAGAIN) {
+				return _us_recv_error(errno);
+			}
+			res = _us_recv_wait(one_way, timeout, &time_waited);
+			if (res < 0) {
+				return res;
+			}
+		}
+	} while (result == -1);
+
+	if (result == 0) {
+		qb_util_log(LOG_DEBUG, "recv == 0 -> ENOTCONN");
+		return -ENOTCONN;
 	}
 
-	qb_sigpipe_ctl(QB_SIGPIPE_IGNORE);
+	ctl = (struct ipc_us_control *)one_way->u.us.shared_data;
+	if (ctl) {
+		(void)qb_atomic_int_dec_and_test(&ctl->sent);
+	}
+
+	if (msg_recv.msg_flags & MSG_TRUNC) {
+		qb_util_log(LOG_ERR,
+			    "dropped message larger than the %zu byte buffer",
+			    len);
+		return -ENOBUFS;
+	}
+	return result;
+}
+
+/*
+ * Server side: requests are read from the socket several at a time into
+ * a buffer owned by the connection, then handed out one by one through
+ * peek/reclaim.  No more are read than the caller says it is about to
+ * take (recv_hint), so normally the batch is used up by the end of a
+ * dispatch and anything else stays in the socket, keeping it readable.
+ * If the caller stops early, recv_buffered tells it what is left.
+ *
+ * Every slot is max_msg_size bytes.  A connection starts with one slot
+ * (what a plain receive buffer would cost), grows to as many as it is
+ * asked to read at once, up to IPC_US_BATCH_MAX slots or
+ * IPC_US_BATCH_BYTES, and goes back to one once it has read a single
+ * message at a time IPC_US_BATCH_IDLE times in a row, so only busy
+ * clients hold a bigger buffer.
+ */
+#define IPC_US_BATCH_MAX 16
+#define IPC_US_BATCH_BYTES (256 * 1024)
+#define IPC_US_BATCH_IDLE 8
+
+struct qb_ipc_us_batch {
+	uint32_t slots;
+	uint32_t max_slots;
+	uint32_t single_reads;
+	uint32_t count;
+	uint32_t next;
+	size_t slot_size;
+	char *buf;
+	ssize_t len[IPC_US_BATCH_MAX];
+	struct iovec iov[IPC_US_BATCH_MAX];
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[IPC_US_BATCH_MAX];
+#endif /* HAVE_RECVMMSG */
+};
 
-retry_peek:
-	result = recv(one_way->u.us.sock, data,
-		      sizeof(struct qb_ipc_request_header),
-		      MSG_NOSIGNAL | MSG_PEEK);
+static struct qb_ipc_us_batch *
+_us_batch_alloc(struct qb_ipc_one_way *one_way)
+{
+	struct qb_ipc_us_batch *b;
 
-	if (result == -1) {
+	b = calloc(1, sizeof(struct qb_ipc_us_batch));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->slot_size = one_way->max_msg_size;
+#ifdef HAVE_RECVMMSG
+	b->max_slots = QB_MIN(IPC_US_BATCH_MAX,
+			      QB_MAX(IPC_US_BATCH_BYTES / b->slot_size, 1));
+#else
+	b->max_slots = 1;
+#endif /* HAVE_RECVMMSG */
+	b->slots = 1;
+	b->buf = malloc(b->slot_size);
+	if (b->buf == NULL) {
+		free(b);
+		return NULL;
+	}
+	return b;
+}
 
-		if (errno != EAGAIN) {
-			final_rc = -errno;
-			if (use_filesystem_sockets()) {
-				if (errno == ECONNRESET || errno == EPIPE) {
-					final_rc = -ENOTCONN;
-				}
+/*
+ * Make room for as many messages as are wanted, or give the room back
+ * once they come one at a time.  Only while the batch is used up.
+ */
+static void
+_us_batch_resize(struct qb_ipc_us_batch *b, uint32_t want)
+{
+	uint32_t slots = b->slots;
+	char *buf;
+
+	if (want > b->slots) {
+		slots = want;
+	}
+	if (want > 1) {
+		b->single_reads = 0;
+	} else if (b->slots > 1 && ++b->single_reads >= IPC_US_BATCH_IDLE) {
+		slots = 1;
+	}
+	if (slots == b->slots) {
+		return;
+	}
+	buf = realloc(b->buf, slots * b->slot_size);
+	if (buf == NULL) {
+		/* make do with what we have */
+		return;
+	}
+	b->buf = buf;
+	b->slots = slots;
+	b->single_reads = 0;
+}
+
+static void
+_us_batch_free(struct qb_ipc_one_way *one_way)
+{
+	if (one_way->u.us.batch) {
+		free(one_way->u.us.batch->buf);
+		free(one_way->u.us.batch);
+		one_way->u.us.batch = NULL;
+	}
+	one_way->recv_buffered = 0;
+}
+
+static ssize_t
+_us_batch_recv(struct qb_ipc_one_way *one_way, struct qb_ipc_us_batch *b,
+	       uint32_t want)
+{
+	ssize_t res;
+	uint32_t i;
+
+	for (i = 0; i < want; i++) {
+		b->iov[i].iov_base = b->buf + i * b->slot_size;
+		b->iov[i].iov_len = b->slot_size;
+	}
+#ifdef HAVE_RECVMMSG
+	memset(b->msgs, 0, want * sizeof(struct mmsghdr));
+	for (i = 0; i < want; i++) {
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	res = recvmmsg(one_way->u.us.sock, b->msgs, want, MSG_DONTWAIT, NULL);
+	for (i = 0; i < res; i++) {
+		b->len[i] = b->msgs[i].msg_len;
+		if (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			b->len[i] = -EMSGSIZE;
+		}
+	}
+#else
+	{
+		struct msghdr msg_recv;
+
+		memset(&msg_recv, 0, sizeof(msg_recv));
+		msg_recv.msg_iov = &b->iov[0];
+		msg_recv.msg_iovlen = 1;
+		res = recvmsg(one_way->u.us.sock, &msg_recv, MSG_DONTWAIT);
+		if (res >= 0) {
+			b->len[0] = res;
+			if (msg_recv.msg_flags & MSG_TRUNC) {
+				b->len[0] = -EMSGSIZE;
 			}
-			goto cleanup_sigpipe;
+			res = 1;
 		}
+	}
+#endif /* HAVE_RECVMMSG */
+	return res;
+}
 
-		/* check to see if we have enough time left to try again */
-		if (time_waited < timeout || timeout == -1) {
-			result = qb_ipc_us_ready(one_way, NULL, time_to_wait, POLLIN);
-			if (qb_ipc_us_sock_error_is_disconnected(result)) {
-				final_rc = result;
-				goto cleanup_sigpipe;
-			}
-			time_waited += time_to_wait;
-			goto retry_peek;
-		} else if (time_waited >= timeout) {
-			final_rc = -ETIMEDOUT;
-			goto cleanup_sigpipe;
+static ssize_t
+qb_ipc_us_peek(struct qb_ipc_one_way *one_way, void **data_out,
+	       int32_t timeout)
+{
+	struct qb_ipc_us_batch *b = one_way->u.us.batch;
+	ssize_t res;
+	int32_t time_waited = 0;
+
+	if (b == NULL) {
+		b = _us_batch_alloc(one_way);
+		if (b == NULL) {
+			return -ENOMEM;
 		}
+		one_way->u.us.batch = b;
 	}
-	if (result >= sizeof(struct qb_ipc_request_header)) {
-		struct qb_ipc_request_header *hdr = NULL;
-		hdr = (struct qb_ipc_request_header *)msg;
-		to_recv = hdr->size;
+
+	if (b->next == b->count) {
+		_us_batch_resize(b, QB_MIN(QB_MAX(one_way->recv_hint, 1),
+					   b->max_slots));
+		do {
+			res = _us_batch_recv(one_way, b,
+					     QB_MIN(QB_MAX(one_way->recv_hint, 1),
+						    b->slots));
+			if (res == -1) {
+				if (errno != EAGAIN) {
+					return _us_recv_error(errno);
+				}
+				res = _us_recv_wait(one_way, timeout,
+						    &time_waited);
+				if (res < 0) {
+					return res;
+				}
+				res = -1;
+			}
+		} while (res == -1);
+		b->count = res;
+		b->next = 0;
+		one_way->recv_buffered = res;
 	}
 
-	result = recv(one_way->u.us.sock, data, to_recv,
-		      MSG_NOSIGNAL | MSG_WAITALL);
-	if (result == -1) {
-		final_rc = -errno;
-		goto cleanup_sigpipe;
-	} else if (result == 0) {
-		qb_util_log(LOG_DEBUG, "recv == 0 -> ENOTCONN");
+	*data_out = b->buf + b->next * b->slot_size;
+	return b->len[b->next];
+}
 
-		final_rc = -ENOTCONN;
-		goto cleanup_sigpipe;
-	}
+static void
+qb_ipc_us_reclaim(struct qb_ipc_one_way *one_way)
+{
+	struct qb_ipc_us_batch *b = one_way->u.us.batch;
+	struct ipc_us_control *ctl;
 
-	final_rc = result;
+	if (b == NULL || b->next == b->count) {
+		return;
+	}
+	b->next++;
+	one_way->recv_buffered--;
 
 	ctl = (struct ipc_us_control *)one_way->u.us.shared_data;
 	if (ctl) {
 		(void)qb_atomic_int_dec_and_test(&ctl->sent);
 	}
-
-cleanup_sigpipe:
-	qb_sigpipe_ctl(QB_SIGPIPE_DEFAULT);
-	return final_rc;
 }
 
 static void
@@ -588,6 +816,7 @@ qb_ipcc_us_connect(struct qb_ipcc_connection * c,
 	c->funcs.recv = qb_ipc_us_recv_at_most;
 	c->funcs.fc_get = qb_ipc_us_fc_get;
 	c->funcs.disconnect = qb_ipcc_us_disconnect;
+	c->funcs.data_pending = qb_ipc_us_q_len_get;
 
 	fd_hdr = qb_sys_mmap_file_open(path, r->request,
 				       SHM_CONTROL_SIZE, O_RDWR);
@@ -609,23 +838,39 @@ qb_ipcc_us_connect(struct qb_ipcc_connection * c,
 	c->request.u.us.shared_data = shm_ptr;
 	c->response.u.us.shared_data = shm_ptr + sizeof(struct ipc_us_control);
 	c->event.u.us.shared_data =  shm_ptr + (2 * sizeof(struct ipc_us_control));
+	c->request_hi.u.us.shared_data = shm_ptr + (3 * sizeof(struct ipc_us_control));
 
 	close(fd_hdr);
 	fd_hdr = -1;
 
+	/* requests go out and responses come in on the same socket */
 	res = qb_ipc_dgram_sock_connect(r->response, "response", "request",
-					r->max_msg_size, &c->request.u.us.sock, c->egid);
+					QB_MAX(c->request.max_msg_size,
+					       c->response.max_msg_size),
+					&c->request.u.us.sock, c->egid);
 	if (res != 0) {
 		goto cleanup_hdr;
 	}
 	c->response.u.us.sock = c->request.u.us.sock;
 
 	res = qb_ipc_dgram_sock_connect(r->response, "event", "event-tx",
-					r->max_msg_size, &c->event.u.us.sock, c->egid);
+					c->event.max_msg_size,
+					&c->event.u.us.sock, c->egid);
 	if (res != 0) {
 		goto cleanup_hdr;
 	}
 
+	if (c->request_hi.max_msg_size > 0) {
+		res = qb_ipc_dgram_sock_connect(r->response, "request-hi-tx",
+						"request-hi",
+						c->request_hi.max_msg_size,
+						&c->request_hi.u.us.sock,
+						c->egid);
+		if (res != 0) {
+			goto cleanup_hdr;
+		}
+	}
+
 	return 0;
 
 cleanup_hdr:
@@ -714,6 +959,22 @@ _sock_add_to_mainloop(struct qb_ipcs_connection *c)
 		(void)c->service->poll_fns.dispatch_del(c->request.u.us.sock);
 		return res;
 	}
+
+	if (c->request_hi.max_msg_size > 0) {
+		res = c->service->poll_fns.dispatch_add(c->service->poll_priority,
+							c->request_hi.u.us.sock,
+							POLLIN | POLLPRI | POLLNVAL,
+							c,
+							qb_ipcs_dispatch_connection_request);
+		if (res < 0) {
+			qb_util_log(LOG_ERR,
+				    "Error adding high priority socket to mainloop (%s).",
+				    c->description);
+			(void)c->service->poll_fns.dispatch_del(c->request.u.us.sock);
+			(void)c->service->poll_fns.dispatch_del(c->setup.u.us.sock);
+			return res;
+		}
+	}
 	return res;
 }
 
@@ -722,6 +983,9 @@ _sock_rm_from_mainloop(struct qb_ipcs_connection *c)
 {
 	(void)c->service->poll_fns.dispatch_del(c->request.u.us.sock);
 	(void)c->service->poll_fns.dispatch_del(c->setup.u.us.sock);
+	if (c->request_hi.max_msg_size > 0) {
+		(void)c->service->poll_fns.dispatch_del(c->request_hi.u.us.sock);
+	}
 }
 
 static void
@@ -767,12 +1031,21 @@ qb_ipcs_us_disconnect(struct qb_ipcs_connection *c)
 				snprintf(sock_name,PATH_MAX,"%s-%s",base_name,"response");
 				qb_util_log(LOG_DEBUG, "unlink sock_name=%s",sock_name);
 				unlink(sock_name);
+				snprintf(sock_name,PATH_MAX,"%s-%s",base_name,"request-hi");
+				qb_util_log(LOG_DEBUG, "unlink sock_name=%s",sock_name);
+				unlink(sock_name);
+				snprintf(sock_name,PATH_MAX,"%s-%s",base_name,"request-hi-tx");
+				qb_util_log(LOG_DEBUG, "unlink sock_name=%s",sock_name);
+				unlink(sock_name);
 				free(base_name);
 			}
 		}
 		qb_ipcc_us_sock_close(c->setup.u.us.sock);
 		qb_ipcc_us_sock_close(c->request.u.us.sock);
 		qb_ipcc_us_sock_close(c->event.u.us.sock);
+		if (c->request_hi.max_msg_size > 0) {
+			qb_ipcc_us_sock_close(c->request_hi.u.us.sock);
+		}
 	}
 	if (c->state == QB_IPCS_CONNECTION_SHUTTING_DOWN ||
 	    c->state == QB_IPCS_CONNECTION_ACTIVE) {
@@ -781,6 +1054,8 @@ qb_ipcs_us_disconnect(struct qb_ipcs_connection *c)
 
 
 	}
+	_us_batch_free(&c->request);
+	_us_batch_free(&c->request_hi);
 	remove_tempdir(c->description);
 }
 
@@ -840,6 +1115,7 @@ qb_ipcs_us_connect(struct qb_ipcs_service *s,
 	c->request.u.us.shared_data = shm_ptr;
 	c->response.u.us.shared_data = shm_ptr + sizeof(struct ipc_us_control);
 	c->event.u.us.shared_data =  shm_ptr + (2 * sizeof(struct ipc_us_control));
+	c->request_hi.u.us.shared_data = shm_ptr + (3 * sizeof(struct ipc_us_control));
 
 	ctl = (struct ipc_us_control *)c->request.u.us.shared_data;
 	ctl->sent = 0;
@@ -850,6 +1126,9 @@ qb_ipcs_us_connect(struct qb_ipcs_service *s,
 	ctl = (struct ipc_us_control *)c->event.u.us.shared_data;
 	ctl->sent = 0;
 	ctl->flow_control = 0;
+	ctl = (struct ipc_us_control *)c->request_hi.u.us.shared_data;
+	ctl->sent = 0;
+	ctl->flow_control = 0;
 
 	close(fd_hdr);
 	fd_hdr = -1;
@@ -861,7 +1140,9 @@ qb_ipcs_us_connect(struct qb_ipcs_service *s,
 		goto cleanup_hdr;
 	}
 
-	res = set_sock_size(c->request.u.us.sock, c->request.max_msg_size);
+	res = set_sock_size(c->request.u.us.sock,
+			    QB_MAX(c->request.max_msg_size,
+				   c->response.max_msg_size));
 	if (res != 0) {
 		goto cleanup_hdr;
 	}
@@ -897,6 +1178,26 @@ qb_ipcs_us_connect(struct qb_ipcs_service *s,
 		goto cleanup_hdr;
 	}
 
+	/* high priority request channel, dropped again if it can't be set up */
+	if (c->request_hi.max_msg_size > 0) {
+		res = qb_ipc_dgram_sock_setup(r->response, "request-hi",
+					      &c->request_hi.u.us.sock,
+					      c->egid);
+		if (res == 0) {
+			res = set_sock_size(c->request_hi.u.us.sock,
+					    c->request_hi.max_msg_size);
+			if (res != 0) {
+				qb_ipcc_us_sock_close(c->request_hi.u.us.sock);
+			}
+		}
+		if (res != 0) {
+			qb_util_perror(LOG_WARNING,
+				       "no high priority channel (%s)",
+				       c->description);
+			c->request_hi.max_msg_size = 0;
+		}
+	}
+
 	res = _sock_add_to_mainloop(c);
 	if (res < 0) {
 		goto cleanup_hdr;
@@ -923,8 +1224,8 @@ qb_ipcs_us_init(struct qb_ipcs_service *s)
 	s->funcs.disconnect = qb_ipcs_us_disconnect;
 
 	s->funcs.recv = qb_ipc_us_recv_at_most;
-	s->funcs.peek = NULL;
-	s->funcs.reclaim = NULL;
+	s->funcs.peek = qb_ipc_us_peek;
+	s->funcs.reclaim = qb_ipc_us_reclaim;
 	s->funcs.send = qb_ipc_socket_send;
 	s->funcs.sendv = qb_ipc_socket_sendv;
 
@@ -0,0 +1,535 @@
+/*
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "os_base.h"
+#include <poll.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "util_int.h"
+#include "ipc_int.h"
+#include <qb/qbdefs.h>
+#include <qb/qbipcs.h>
+#include <qb/qbutil.h>
+
+/*
+ * Requests are copied off the ring and queued for a pool of threads that
+ * run msg_process().  Anything msg_process() sends is kept with the
+ * request and only sent once the request comes back to the loop thread,
+ * in the order the requests were received on their connection.
+ */
+
+struct ipcs_work_output {
+	struct qb_list_head list;
+	struct qb_ipcs_connection *c;
+	int32_t is_event;
+	uint64_t since_ns;
+	size_t size;
+	char data[];
+};
+
+struct ipcs_work {
+	struct qb_list_head list;
+	struct qb_ipcs_connection *c;
+	uint32_t seq;
+	struct qb_list_head outputs;
+	void *msg;
+	size_t size;
+	size_t map_len;		/* msg is a large message mapping */
+	struct qb_ipcs_msg_entry *entry;
+	int32_t error;		/* refuse the request with this */
+	uint64_t ready_ns;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+struct qb_ipcs_workers {
+	uint32_t num_threads;
+	uint32_t max_in_flight;
+	pthread_t *threads;
+	uint32_t started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct qb_list_head queue;
+	struct qb_list_head done;
+	int32_t pipe_fds[2];
+	int32_t stopping;
+};
+
+static pthread_key_t work_key;
+static pthread_once_t work_key_once = PTHREAD_ONCE_INIT;
+
+static void
+_work_key_create(void)
+{
+	(void)pthread_key_create(&work_key, NULL);
+}
+
+static void
+_work_free(struct ipcs_work *work)
+{
+	struct ipcs_work_output *out;
+	struct ipcs_work_output *tmp;
+
+	qb_list_for_each_entry_safe(out, tmp, &work->outputs, list) {
+		qb_list_del(&out->list);
+		qb_ipcs_connection_unref(out->c);
+		free(out);
+	}
+	if (work->map_len) {
+		munmap(work->msg, work->map_len);
+	} else {
+		free(work->msg);
+	}
+	qb_ipcs_connection_unref(work->c);
+	free(work);
+}
+
+static void *
+_worker_thread(void *arg)
+{
+	struct qb_ipcs_service *s = arg;
+	struct qb_ipcs_workers *w = s->workers;
+	struct ipcs_work *work;
+	char one = 1;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (qb_list_empty(&w->queue) && !w->stopping) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (w->stopping) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		work = qb_list_first_entry(&w->queue, struct ipcs_work, list);
+		qb_list_del(&work->list);
+		pthread_mutex_unlock(&w->lock);
+
+		(void)pthread_setspecific(work_key, work);
+		work->start_ns = qb_util_nano_current_get();
+		(void)qb_ipcs_msg_call(work->c, work->entry, work->error,
+				       work->msg, work->size);
+		work->end_ns = qb_util_nano_current_get();
+		(void)pthread_setspecific(work_key, NULL);
+
+		pthread_mutex_lock(&w->lock);
+		qb_list_add_tail(&work->list, &w->done);
+		pthread_mutex_unlock(&w->lock);
+
+		/* a full pipe already has a wakeup pending */
+		if (write(w->pipe_fds[1], &one, 1) < 0 && errno != EAGAIN) {
+			qb_util_perror(LOG_WARNING, "couldn't wake up ipc loop");
+		}
+	}
+	return NULL;
+}
+
+static void
+_work_fc_set(struct qb_ipcs_connection *c, int32_t fc_enable)
+{
+	c->work_fc = fc_enable;
+	qb_ipcs_flowcontrol_set(c, fc_enable);
+	/* stop polling for requests we are not going to read anyway */
+	qb_ipcs_work_fc_poll_events_set(c);
+	(void)qb_ipcs_dispatch_descriptor_modify(c);
+}
+
+static void _work_flush(struct qb_ipcs_connection *c);
+
+static void
+_work_flush_job(void *data)
+{
+	struct qb_ipcs_connection *c = data;
+
+	c->work_retry_pending = QB_FALSE;
+	_work_flush(c);
+	qb_ipcs_connection_unref(c);
+}
+
+/*
+ * Send what msg_process() produced for the request.
+ * Returns -EAGAIN if the rest has to wait for the client to make room.
+ */
+static int32_t
+_work_outputs_send(struct ipcs_work *work)
+{
+	struct ipcs_work_output *out;
+	struct ipcs_work_output *tmp;
+	ssize_t res;
+
+	qb_list_for_each_entry_safe(out, tmp, &work->outputs, list) {
+		if (out->c->state == QB_IPCS_CONNECTION_ESTABLISHED ||
+		    out->c->state == QB_IPCS_CONNECTION_ACTIVE) {
+			if (out->is_event) {
+				struct iovec iov;
+
+				iov.iov_base = out->data;
+				iov.iov_len = out->size;
+				res = qb_ipcs_event_sendv_since(out->c, &iov, 1,
+								out->since_ns);
+			} else {
+				res = qb_ipcs_response_send(out->c, out->data,
+							    out->size);
+			}
+			if (res == -EAGAIN) {
+				return res;
+			} else if (res < 0) {
+				errno = -res;
+				qb_util_perror(LOG_DEBUG,
+					       "dropping worker reply (%s)",
+					       out->c->description);
+			}
+		}
+		qb_list_del(&out->list);
+		qb_ipcs_connection_unref(out->c);
+		free(out);
+	}
+	return 0;
+}
+
+static void
+_work_flush(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_workers *w = c->service->workers;
+	struct ipcs_work *work;
+
+	if (w == NULL) {
+		/* the workers are gone and so is everything they had */
+		return;
+	}
+	qb_ipcs_connection_ref(c);
+	while (!qb_list_empty(&c->work_done)) {
+		work = qb_list_first_entry(&c->work_done, struct ipcs_work, list);
+		if (work->seq != c->work_flush_seq) {
+			break;
+		}
+		if (_work_outputs_send(work) == -EAGAIN) {
+			if (!c->work_retry_pending &&
+			    c->service->poll_fns.job_add) {
+				qb_ipcs_connection_ref(c);
+				c->work_retry_pending = QB_TRUE;
+				if (c->service->poll_fns.job_add(QB_LOOP_LOW, c,
+						_work_flush_job) != 0) {
+					c->work_retry_pending = QB_FALSE;
+					qb_ipcs_connection_unref(c);
+				}
+			}
+			break;
+		}
+		qb_list_del(&work->list);
+		c->work_flush_seq++;
+		c->work_in_flight--;
+		_work_free(work);
+	}
+	if (c->work_fc && c->work_in_flight < w->max_in_flight &&
+	    c->state != QB_IPCS_CONNECTION_SHUTTING_DOWN &&
+	    c->state != QB_IPCS_CONNECTION_INACTIVE) {
+		_work_fc_set(c, QB_FALSE);
+	}
+	qb_ipcs_connection_unref(c);
+}
+
+/*
+ * Put a finished request on its connection's list, which is kept in
+ * sequence order, and answer as many requests as are now in order.
+ */
+static void
+_work_done(struct ipcs_work *work)
+{
+	struct qb_ipcs_connection *c = work->c;
+	struct qb_list_head *pos;
+	struct ipcs_work *prev;
+
+	if (work->ready_ns) {
+		qb_ipcs_latency_add(c, QB_IPCS_LATENCY_QUEUE,
+				    work->start_ns - work->ready_ns);
+	}
+	qb_ipcs_latency_add(c, QB_IPCS_LATENCY_PROCESS,
+			    work->end_ns - work->start_ns);
+	qb_ipcs_msg_account(work->entry, work->size,
+			    work->end_ns - work->start_ns);
+
+	for (pos = c->work_done.prev; pos != &c->work_done; pos = pos->prev) {
+		prev = qb_list_entry(pos, struct ipcs_work, list);
+		if ((int32_t)(work->seq - prev->seq) > 0) {
+			break;
+		}
+	}
+	qb_list_add(&work->list, pos);
+	_work_flush(c);
+}
+
+static int32_t
+_workers_done_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	struct qb_ipcs_service *s = data;
+	struct qb_ipcs_workers *w = s->workers;
+	struct ipcs_work *work;
+	struct ipcs_work *tmp;
+	struct qb_list_head done;
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		/* drain */
+	}
+
+	qb_list_init(&done);
+	pthread_mutex_lock(&w->lock);
+	qb_list_splice(&w->done, &done);
+	qb_list_init(&w->done);
+	pthread_mutex_unlock(&w->lock);
+
+	qb_list_for_each_entry_safe(work, tmp, &done, list) {
+		qb_list_del(&work->list);
+		_work_done(work);
+	}
+	return 0;
+}
+
+int32_t
+qb_ipcs_workers_set(struct qb_ipcs_service *s, uint32_t num_threads,
+		    uint32_t max_in_flight)
+{
+	struct qb_ipcs_workers *w;
+
+	if (s == NULL) {
+		return -EINVAL;
+	}
+	if (s->workers && s->workers->started) {
+		return -EBUSY;
+	}
+	if (num_threads == 0) {
+		free(s->workers);
+		s->workers = NULL;
+		return 0;
+	}
+	if (max_in_flight == 0) {
+		return -EINVAL;
+	}
+	if (s->workers == NULL) {
+		w = calloc(1, sizeof(struct qb_ipcs_workers));
+		if (w == NULL) {
+			return -ENOMEM;
+		}
+		w->pipe_fds[0] = -1;
+		w->pipe_fds[1] = -1;
+		qb_list_init(&w->queue);
+		qb_list_init(&w->done);
+		s->workers = w;
+	}
+	s->workers->num_threads = num_threads;
+	s->workers->max_in_flight = max_in_flight;
+	return 0;
+}
+
+int32_t
+qb_ipcs_workers_start(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_workers *w = s->workers;
+	int32_t res;
+	uint32_t i;
+
+	(void)pthread_once(&work_key_once, _work_key_create);
+
+	if (pipe(w->pipe_fds) == -1) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't create worker pipe");
+		return res;
+	}
+	(void)qb_sys_fd_nonblock_cloexec_set(w->pipe_fds[0]);
+	(void)qb_sys_fd_nonblock_cloexec_set(w->pipe_fds[1]);
+
+	res = s->poll_fns.dispatch_add(s->poll_priority, w->pipe_fds[0],
+				       POLLIN | POLLPRI | POLLNVAL,
+				       s, _workers_done_dispatch);
+	if (res < 0) {
+		goto cleanup_pipe;
+	}
+
+	w->threads = calloc(w->num_threads, sizeof(pthread_t));
+	if (w->threads == NULL) {
+		res = -ENOMEM;
+		goto cleanup_dispatch;
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->stopping = QB_FALSE;
+	for (i = 0; i < w->num_threads; i++) {
+		res = -pthread_create(&w->threads[i], NULL, _worker_thread, s);
+		if (res != 0) {
+			errno = -res;
+			qb_util_perror(LOG_ERR, "couldn't start ipc worker");
+			break;
+		}
+		w->started++;
+	}
+	if (w->started == 0) {
+		free(w->threads);
+		w->threads = NULL;
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		goto cleanup_dispatch;
+	}
+	return 0;
+
+cleanup_dispatch:
+	(void)s->poll_fns.dispatch_del(w->pipe_fds[0]);
+cleanup_pipe:
+	close(w->pipe_fds[0]);
+	close(w->pipe_fds[1]);
+	w->pipe_fds[0] = -1;
+	w->pipe_fds[1] = -1;
+	return res;
+}
+
+void
+qb_ipcs_workers_stop(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_workers *w = s->workers;
+	struct qb_ipcs_connection *c;
+	struct qb_ipcs_connection *n;
+	struct ipcs_work *work;
+	struct ipcs_work *tmp;
+	uint32_t i;
+
+	if (w == NULL) {
+		return;
+	}
+	if (w->started) {
+		pthread_mutex_lock(&w->lock);
+		w->stopping = QB_TRUE;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		for (i = 0; i < w->started; i++) {
+			pthread_join(w->threads[i], NULL);
+		}
+		free(w->threads);
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+
+		(void)s->poll_fns.dispatch_del(w->pipe_fds[0]);
+		close(w->pipe_fds[0]);
+		close(w->pipe_fds[1]);
+	}
+
+	/* nobody is going to answer these now */
+	qb_list_for_each_entry_safe(c, n, &s->connections, list) {
+		qb_list_for_each_entry_safe(work, tmp, &c->work_done, list) {
+			qb_list_del(&work->list);
+			_work_free(work);
+		}
+	}
+	qb_list_for_each_entry_safe(work, tmp, &w->queue, list) {
+		qb_list_del(&work->list);
+		_work_free(work);
+	}
+	qb_list_for_each_entry_safe(work, tmp, &w->done, list) {
+		qb_list_del(&work->list);
+		_work_free(work);
+	}
+	free(w);
+	s->workers = NULL;
+}
+
+int32_t
+qb_ipcs_work_queue(struct qb_ipcs_connection *c, void *msg, size_t size,
+		   size_t map_len, struct qb_ipcs_msg_entry *entry,
+		   int32_t error)
+{
+	struct qb_ipcs_workers *w = c->service->workers;
+	struct ipcs_work *work;
+
+	work = calloc(1, sizeof(struct ipcs_work));
+	if (work == NULL) {
+		return -ENOMEM;
+	}
+	if (map_len) {
+		/* the mapping is handed over as it is */
+		work->msg = msg;
+		work->map_len = map_len;
+	} else {
+		work->msg = malloc(size);
+		if (work->msg == NULL) {
+			free(work);
+			return -ENOMEM;
+		}
+		memcpy(work->msg, msg, size);
+	}
+	work->size = size;
+	work->entry = entry;
+	work->error = error;
+	qb_list_init(&work->outputs);
+	qb_ipcs_connection_ref(c);
+	work->c = c;
+	work->seq = c->work_seq++;
+	work->ready_ns = c->request_ready_ns;
+
+	c->work_in_flight++;
+	if (!c->work_fc && c->work_in_flight >= w->max_in_flight) {
+		_work_fc_set(c, QB_TRUE);
+	}
+
+	pthread_mutex_lock(&w->lock);
+	qb_list_add_tail(&work->list, &w->queue);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+int32_t
+qb_ipcs_work_running(struct qb_ipcs_connection *c)
+{
+	return c->service->workers != NULL &&
+	       c->service->workers->started &&
+	       pthread_getspecific(work_key) != NULL;
+}
+
+ssize_t
+qb_ipcs_work_output_add(struct qb_ipcs_connection *c,
+			const struct iovec *iov, size_t iov_len,
+			int32_t is_event)
+{
+	struct ipcs_work *work = pthread_getspecific(work_key);
+	struct ipcs_work_output *out;
+	size_t size = 0;
+	char *pos;
+	int32_t i;
+
+	for (i = 0; i < iov_len; i++) {
+		size += iov[i].iov_len;
+	}
+	out = malloc(sizeof(struct ipcs_work_output) + size);
+	if (out == NULL) {
+		return -ENOMEM;
+	}
+	pos = out->data;
+	for (i = 0; i < iov_len; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	out->size = size;
+	out->is_event = is_event;
+	out->since_ns = qb_util_nano_current_get();
+	qb_ipcs_connection_ref(c);
+	out->c = c;
+	qb_list_add_tail(&out->list, &work->outputs);
+	return size;
+}
@@ -20,14 +20,19 @@
  */
 #include "os_base.h"
 #include <poll.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "ipc_int.h"
 #include "util_int.h"
 #include <qb/qbdefs.h>
 #include <qb/qbipcc.h>
 
-qb_ipcc_connection_t *
-qb_ipcc_connect(const char *name, size_t max_msg_size)
+static qb_ipcc_connection_t *
+_ipcc_connect_start(const char *name, size_t max_msg_size,
+		    const struct qb_ipcc_connect_params *params)
 {
 	int32_t res;
 	qb_ipcc_connection_t *c = NULL;
@@ -41,18 +46,10 @@ qb_ipcc_connect(const char *name, size_t max_msg_size)
 	c->setup.max_msg_size = QB_MAX(max_msg_size,
 				       sizeof(struct qb_ipc_connection_response));
 	(void)strlcpy(c->name, name, NAME_MAX);
-	res = qb_ipcc_us_setup_connect(c, &response);
+	res = qb_ipcc_us_setup_connect(c, &response, params);
 	if (res < 0) {
 		goto disconnect_and_cleanup;
 	}
-	qb_ipc_us_ready(&c->setup, NULL, -1, POLLIN);
-	res = qb_ipcc_connect_continue(c);
-	if (res != 0) {
-		/* qb_ipcc_connect_continue() has cleaned up for us */
-		errno = -res;
-		return NULL;
-	}
-
 	return c;
 
 disconnect_and_cleanup:
@@ -65,37 +62,107 @@ disconnect_and_cleanup:
 	return NULL;
 }
 
-qb_ipcc_connection_t *
-qb_ipcc_connect_async(const char *name, size_t max_msg_size, int *connect_fd)
+/*
+ * Fill in the sizes left at 0 so the server gets an explicit value
+ * for every direction.
+ */
+static size_t
+_ipcc_connect_params_resolve(const struct qb_ipcc_connect_params *params,
+			     struct qb_ipcc_connect_params *resolved)
+{
+	*resolved = *params;
+	if (resolved->max_request_size == 0) {
+		resolved->max_request_size = params->max_msg_size;
+	}
+	if (resolved->max_response_size == 0) {
+		resolved->max_response_size = params->max_msg_size;
+	}
+	if (resolved->max_event_size == 0) {
+		resolved->max_event_size = params->max_msg_size;
+	}
+	return QB_MAX(resolved->max_request_size,
+		      QB_MAX(resolved->max_response_size,
+			     resolved->max_event_size));
+}
+
+static qb_ipcc_connection_t *
+_ipcc_connect(const char *name, size_t max_msg_size,
+	      const struct qb_ipcc_connect_params *params)
 {
 	int32_t res;
-	qb_ipcc_connection_t *c = NULL;
-	struct qb_ipc_connection_response response;
+	qb_ipcc_connection_t *c;
 
-	c = calloc(1, sizeof(struct qb_ipcc_connection));
+	c = _ipcc_connect_start(name, max_msg_size, params);
 	if (c == NULL) {
 		return NULL;
 	}
+	qb_ipc_us_ready(&c->setup, NULL, -1, POLLIN);
+	res = qb_ipcc_connect_continue(c);
+	if (res != 0) {
+		/* qb_ipcc_connect_continue() has cleaned up for us */
+		errno = -res;
+		return NULL;
+	}
 
-	c->setup.max_msg_size = QB_MAX(max_msg_size,
-				       sizeof(struct qb_ipc_connection_response));
-	(void)strlcpy(c->name, name, NAME_MAX);
-	res = qb_ipcc_us_setup_connect(c, &response);
-	if (res < 0) {
-		goto disconnect_and_cleanup;
+	return c;
+}
+
+qb_ipcc_connection_t *
+qb_ipcc_connect(const char *name, size_t max_msg_size)
+{
+	return _ipcc_connect(name, max_msg_size, NULL);
+}
+
+qb_ipcc_connection_t *
+qb_ipcc_connect_2(const char *name,
+		  const struct qb_ipcc_connect_params *params)
+{
+	struct qb_ipcc_connect_params resolved;
+	size_t max_msg_size;
+
+	if (params == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	max_msg_size = _ipcc_connect_params_resolve(params, &resolved);
+	return _ipcc_connect(name, max_msg_size, &resolved);
+}
+
+qb_ipcc_connection_t *
+qb_ipcc_connect_async(const char *name, size_t max_msg_size, int *connect_fd)
+{
+	qb_ipcc_connection_t *c;
+
+	c = _ipcc_connect_start(name, max_msg_size, NULL);
+	if (c == NULL) {
+		return NULL;
 	}
 
 	*connect_fd = c->setup.u.us.sock;
 	return c;
+}
 
-disconnect_and_cleanup:
-	if (c->setup.u.us.sock >= 0) {
-		qb_ipcc_us_sock_close(c->setup.u.us.sock);
+qb_ipcc_connection_t *
+qb_ipcc_connect_async_2(const char *name,
+			const struct qb_ipcc_connect_params *params,
+			int *connect_fd)
+{
+	struct qb_ipcc_connect_params resolved;
+	size_t max_msg_size;
+	qb_ipcc_connection_t *c;
+
+	if (params == NULL) {
+		errno = EINVAL;
+		return NULL;
 	}
-	free(c->receive_buf);
-	free(c);
-	errno = -res;
-	return NULL;
+	max_msg_size = _ipcc_connect_params_resolve(params, &resolved);
+	c = _ipcc_connect_start(name, max_msg_size, &resolved);
+	if (c == NULL) {
+		return NULL;
+	}
+
+	*connect_fd = c->setup.u.us.sock;
+	return c;
 }
 
 int qb_ipcc_connect_continue(struct qb_ipcc_connection * c)
@@ -113,11 +180,24 @@ int qb_ipcc_connect_continue(struct qb_ipcc_connection * c)
 	c->request.type = response.connection_type;
 	c->event.type = response.connection_type;
 	c->setup.type = response.connection_type;
+	c->request_hi.type = response.connection_type;
 
 	c->response.max_msg_size = response.max_msg_size;
 	c->request.max_msg_size = response.max_msg_size;
 	c->event.max_msg_size = response.max_msg_size;
-	c->receive_buf = calloc(1, response.max_msg_size);
+	if (response.hdr.size > QB_IPC_CONNECTION_RESPONSE_BASE_SIZE) {
+		c->request.max_msg_size = response.request_size;
+		c->response.max_msg_size = response.response_size;
+		c->event.max_msg_size = response.event_size;
+		if (response.large_msg_size > 0 &&
+		    qb_ipc_large_msg_template_set(c->large_msg_template,
+						  response.request) == 0) {
+			c->large_msg_max = response.large_msg_size;
+		}
+		c->request_hi.max_msg_size = response.hipri_size;
+		c->event_ranges_max = response.event_ranges_max;
+	}
+	c->receive_buf = calloc(1, c->response.max_msg_size);
 	c->fc_enable_max = 1;
 	if (c->receive_buf == NULL) {
 		res = -ENOMEM;
@@ -149,6 +229,7 @@ disconnect_and_cleanup:
 	if (c->setup.u.us.sock >= 0) {
 		qb_ipcc_us_sock_close(c->setup.u.us.sock);
 	}
+	qb_ipcc_doorbell_close(c);
 	free(c->receive_buf);
 	free(c);
 	errno = -res;
@@ -231,6 +312,10 @@ _response_sock_one_way_get(struct qb_ipcc_connection * c)
 	return &c->response;
 }
 
+static ssize_t _ipcc_sendv(struct qb_ipcc_connection *c,
+			   struct qb_ipc_one_way *one_way,
+			   const struct iovec *iov, size_t iov_len);
+
 ssize_t
 qb_ipcc_send(struct qb_ipcc_connection * c, const void *msg_ptr, size_t msg_len)
 {
@@ -240,8 +325,18 @@ qb_ipcc_send(struct qb_ipcc_connection * c, const void *msg_ptr, size_t msg_len)
 	if (c == NULL) {
 		return -EINVAL;
 	}
+	if (c->mt) {
+		return -EBUSY;
+	}
 	if (msg_len > c->request.max_msg_size) {
-		return -EMSGSIZE;
+		struct iovec iov;
+
+		if (msg_len > c->large_msg_max) {
+			return -EMSGSIZE;
+		}
+		iov.iov_base = (void *)msg_ptr;
+		iov.iov_len = msg_len;
+		return _ipcc_sendv(c, &c->request, &iov, 1);
 	}
 	if (c->funcs.fc_get) {
 		res = c->funcs.fc_get(&c->request);
@@ -257,7 +352,16 @@ qb_ipcc_send(struct qb_ipcc_connection * c, const void *msg_ptr, size_t msg_len)
 	}
 
 	res = c->funcs.send(&c->request, msg_ptr, msg_len);
-	if (res == msg_len && c->needs_sock_for_poll) {
+	if (res == msg_len) {
+		QB_IPC_TRACE(ipcc_request_send, c->name,
+			     qb_ipc_msg_id(msg_ptr, msg_len), msg_len);
+	}
+	if (res == msg_len && c->doorbell) {
+		res2 = qb_ipcc_doorbell_ring(c);
+		if (res2 < 0) {
+			res = res2;
+		}
+	} else if (res == msg_len && c->needs_sock_for_poll) {
 		do {
 			res2 = qb_ipc_us_send(&c->setup, msg_ptr, 1);
 		} while (res2 == -EAGAIN);
@@ -281,14 +385,19 @@ qb_ipcc_fc_enable_max_set(struct qb_ipcc_connection * c, uint32_t max)
 	return 0;
 }
 
-ssize_t
-qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
-	      size_t iov_len)
+static ssize_t
+_ipcc_sendv(struct qb_ipcc_connection * c, struct qb_ipc_one_way *one_way,
+	    const struct iovec * iov, size_t iov_len)
 {
 	int32_t total_size = 0;
 	int32_t i;
 	int32_t res;
 	int32_t res2;
+	struct qb_ipc_large_msg large;
+	struct iovec large_iov;
+	int32_t is_large = QB_FALSE;
+	const struct iovec *send_iov = iov;
+	size_t send_iov_len = iov_len;
 
 	for (i = 0; i < iov_len; i++) {
 		total_size += iov[i].iov_len;
@@ -296,11 +405,15 @@ qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
 	if (c == NULL) {
 		return -EINVAL;
 	}
-	if (total_size > c->request.max_msg_size) {
-		return -EMSGSIZE;
+	if (total_size > one_way->max_msg_size) {
+		if (total_size > c->large_msg_max) {
+			return -EMSGSIZE;
+		}
+		is_large = QB_TRUE;
 	}
 
-	if (c->funcs.fc_get) {
+	/* the high priority lane is not flow controlled */
+	if (c->funcs.fc_get && one_way == &c->request) {
 		res = c->funcs.fc_get(&c->request);
 		if (res < 0) {
 			return res;
@@ -313,8 +426,36 @@ qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
 		}
 	}
 
-	res = c->funcs.sendv(&c->request, iov, iov_len);
-	if (res > 0 && c->needs_sock_for_poll) {
+	if (is_large) {
+		res = qb_ipc_large_msg_create(c->large_msg_template, iov, iov_len,
+					      total_size, &large);
+		if (res < 0) {
+			return res;
+		}
+		large_iov.iov_base = &large;
+		large_iov.iov_len = sizeof(large);
+		send_iov = &large_iov;
+		send_iov_len = 1;
+	}
+
+	res = c->funcs.sendv(one_way, send_iov, send_iov_len);
+	if (is_large) {
+		if (res > 0) {
+			res = total_size;
+		} else {
+			unlink(large.name);
+		}
+	}
+	if (res > 0) {
+		QB_IPC_TRACE(ipcc_request_send, c->name,
+			     qb_ipc_iov_msg_id(iov, iov_len), total_size);
+	}
+	if (res > 0 && c->doorbell) {
+		res2 = qb_ipcc_doorbell_ring(c);
+		if (res2 < 0) {
+			res = res2;
+		}
+	} else if (res > 0 && c->needs_sock_for_poll) {
 		do {
 			res2 = qb_ipc_us_send(&c->setup, &res, 1);
 		} while (res2 == -EAGAIN);
@@ -329,19 +470,127 @@ qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
 }
 
 ssize_t
-qb_ipcc_recv(struct qb_ipcc_connection * c, void *msg_ptr,
-	     size_t msg_len, int32_t ms_timeout)
+qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
+	      size_t iov_len)
 {
-	int32_t res = 0;
-	int32_t connect_res = 0;
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (c->mt) {
+		return -EBUSY;
+	}
+	return _ipcc_sendv(c, &c->request, iov, iov_len);
+}
 
+ssize_t
+qb_ipcc_sendv_prio(struct qb_ipcc_connection * c, const struct iovec * iov,
+		   size_t iov_len, enum qb_ipcc_send_priority prio)
+{
 	if (c == NULL) {
 		return -EINVAL;
 	}
+	if (prio == QB_IPCC_SEND_NORMAL) {
+		return qb_ipcc_sendv(c, iov, iov_len);
+	}
+	if (prio != QB_IPCC_SEND_HIGH) {
+		return -EINVAL;
+	}
+	if (c->mt) {
+		return -EBUSY;
+	}
+	if (c->request_hi.max_msg_size == 0) {
+		return -ENOTSUP;
+	}
+	return _ipcc_sendv(c, &c->request_hi, iov, iov_len);
+}
+
+ssize_t
+qb_ipcc_send_prio(struct qb_ipcc_connection * c, const void *msg_ptr,
+		  size_t msg_len, enum qb_ipcc_send_priority prio)
+{
+	struct iovec iov;
+
+	if (prio == QB_IPCC_SEND_NORMAL) {
+		return qb_ipcc_send(c, msg_ptr, msg_len);
+	}
+	iov.iov_base = (void *)msg_ptr;
+	iov.iov_len = msg_len;
+	return qb_ipcc_sendv_prio(c, &iov, 1, prio);
+}
+
+/*
+ * Spin on the response channel until something is queued or
+ * busy_poll_usec has passed.  Whatever the outcome the caller goes on
+ * with the normal receive, which then finds the message without sleeping.
+ */
+static void
+_ipcc_busy_poll(struct qb_ipcc_connection *c)
+{
+	uint64_t deadline;
+
+	c->busy_poll_stats.polls++;
+	deadline = qb_util_nano_current_get() +
+		   c->busy_poll_usec * QB_TIME_NS_IN_USEC;
+	do {
+		if (c->funcs.data_pending(&c->response) > 0) {
+			c->busy_poll_stats.hits++;
+			return;
+		}
+	} while (qb_util_nano_current_get() < deadline);
+}
+
+/*
+ * If what was received is a large message descriptor, replace it with
+ * the message itself.
+ */
+static ssize_t
+_ipcc_large_msg_recv(struct qb_ipcc_connection *c, void *msg_ptr,
+		     size_t msg_len, ssize_t size)
+{
+	struct qb_ipc_response_header *hdr = msg_ptr;
+	struct qb_ipc_large_msg large;
+	void *data;
+	ssize_t res;
+
+	if (c->large_msg_max == 0 || size != sizeof(large) ||
+	    hdr->id != QB_IPC_MSG_LARGE) {
+		return size;
+	}
+	memcpy(&large, msg_ptr, sizeof(large));
+	res = qb_ipc_large_msg_map(c->large_msg_template, &large,
+				   c->large_msg_max, &data);
+	if (res < 0) {
+		errno = -res;
+		qb_util_perror(LOG_ERR, "couldn't receive large message");
+		return res;
+	}
+	if (res > msg_len) {
+		qb_util_log(LOG_ERR,
+			    "dropping large message of size %zd, buffer is %zu",
+			    res, msg_len);
+		munmap(data, res);
+		return -ENOBUFS;
+	}
+	memcpy(msg_ptr, data, res);
+	munmap(data, res);
+	return res;
+}
+
+static ssize_t
+_ipcc_recv(struct qb_ipcc_connection * c, void *msg_ptr,
+	   size_t msg_len, int32_t ms_timeout)
+{
+	int32_t res = 0;
+	int32_t connect_res = 0;
+
+	if (c->busy_poll_usec > 0 && ms_timeout != 0 &&
+	    c->funcs.data_pending) {
+		_ipcc_busy_poll(c);
+	}
 
 	res = c->funcs.recv(&c->response, msg_ptr, msg_len, ms_timeout);
 	if (res >= 0) {
-		return res;
+		return _ipcc_large_msg_recv(c, msg_ptr, msg_len, res);
 	}
 
 	/* if we didn't get a msg, check connection state */
@@ -356,6 +605,308 @@ qb_ipcc_recv(struct qb_ipcc_connection * c, void *msg_ptr,
 	return res;
 }
 
+ssize_t
+qb_ipcc_recv(struct qb_ipcc_connection * c, void *msg_ptr,
+	     size_t msg_len, int32_t ms_timeout)
+{
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (c->mt) {
+		return -EBUSY;
+	}
+	return _ipcc_recv(c, msg_ptr, msg_len, ms_timeout);
+}
+
+/*
+ * Thread-safe mode.
+ *
+ * Requests get a sequence number as they are sent (under the lock, so
+ * the numbers follow the order in the request channel) and the server
+ * answers them in that same order, so the n-th response belongs to the
+ * n-th request.  Whichever waiting thread finds nobody receiving takes
+ * over and receives the next response straight into the buffer of the
+ * thread it belongs to.  With a match function (see
+ * qb_ipcc_threadsafe_match_set()) the response goes to the oldest
+ * request it matches instead, and the requests before that one are
+ * failed, since the server has skipped them.
+ */
+struct qb_ipcc_waiter {
+	struct qb_list_head list;
+	uint64_t seq;
+	int32_t req_id;
+	void *buf;		/* NULL once the owner has given up */
+	size_t len;
+	uint64_t deadline;	/* 0 == none */
+	ssize_t res;
+	int32_t done;
+};
+
+struct qb_ipcc_mt {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t next_seq;
+	int32_t receiving;
+	uint64_t recv_attempts;	/* receives started so far */
+	uint64_t recv_missed;	/* the last one that timed out empty */
+	struct qb_ipcc_waiter *recv_target;
+	struct qb_list_head waiters;	/* in sequence order */
+	uint32_t callers;	/* threads in qb_ipcc_sendv_recv() */
+	int32_t closing;
+	qb_ipcc_response_match_fn match;	/* NULL == by order */
+};
+
+/*
+ * How long the receiving thread may block before somebody's timeout
+ * needs looking at.
+ */
+static int32_t
+_ipcc_mt_recv_timeout(struct qb_ipcc_mt *mt)
+{
+	struct qb_ipcc_waiter *w;
+	uint64_t now = qb_util_nano_current_get();
+	uint64_t first = 0;
+
+	qb_list_for_each_entry(w, &mt->waiters, list) {
+		if (w->buf && w->deadline &&
+		    (first == 0 || w->deadline < first)) {
+			first = w->deadline;
+		}
+	}
+	if (first == 0) {
+		return QB_IPC_MAX_WAIT_MS;
+	} else if (first <= now) {
+		return 0;
+	}
+	return QB_MIN((first - now) / QB_TIME_NS_IN_MSEC + 1,
+		      QB_IPC_MAX_WAIT_MS);
+}
+
+static void
+_ipcc_mt_waiter_done(struct qb_ipcc_waiter *w, ssize_t res)
+{
+	qb_list_del(&w->list);
+	if (w->buf == NULL) {
+		qb_util_log(LOG_DEBUG,
+			    "dropped response to timed out request %" PRIu64,
+			    w->seq);
+		free(w);
+		return;
+	}
+	w->res = res;
+	w->done = QB_TRUE;
+}
+
+/*
+ * Hand a response to the oldest request it matches.
+ * Called with the lock held.
+ */
+static void
+_ipcc_mt_route(struct qb_ipcc_mt *mt, const void *buf, ssize_t size)
+{
+	struct qb_ipcc_waiter *m;
+	struct qb_ipcc_waiter *w;
+	struct qb_ipcc_waiter *tmp;
+	int32_t id = qb_ipc_msg_id(buf, size);
+
+	qb_list_for_each_entry(m, &mt->waiters, list) {
+		if (mt->match(m->req_id, id)) {
+			break;
+		}
+	}
+	if (&m->list == &mt->waiters) {
+		qb_util_log(LOG_WARNING,
+			    "dropped response %d that matches no request", id);
+		return;
+	}
+	qb_list_for_each_entry_safe(w, tmp, &mt->waiters, list) {
+		if (w == m) {
+			break;
+		}
+		qb_util_log(LOG_WARNING,
+			    "no response to request %d (%" PRIu64
+			    "), got %d for a later one",
+			    w->req_id, w->seq, id);
+		_ipcc_mt_waiter_done(w, -ENOMSG);
+	}
+	if (m->buf && m->buf != buf) {
+		if (size > m->len) {
+			size = -EMSGSIZE;
+		} else {
+			memcpy(m->buf, buf, size);
+		}
+	}
+	_ipcc_mt_waiter_done(m, size);
+}
+
+/*
+ * Receive the response for the oldest request.
+ * Called with the lock held, drops it while receiving.
+ */
+static void
+_ipcc_mt_recv_one(struct qb_ipcc_connection *c)
+{
+	struct qb_ipcc_mt *mt = c->mt;
+	struct qb_ipcc_waiter *w;
+	struct qb_ipcc_waiter *tmp;
+	void *buf;
+	size_t len;
+	int32_t timeout;
+	uint64_t attempt;
+	ssize_t res;
+
+	w = qb_list_first_entry(&mt->waiters, struct qb_ipcc_waiter, list);
+	if (w->buf) {
+		buf = w->buf;
+		len = w->len;
+	} else {
+		/* nobody wants this one any more */
+		buf = c->receive_buf;
+		len = c->response.max_msg_size;
+	}
+	timeout = _ipcc_mt_recv_timeout(mt);
+	attempt = ++mt->recv_attempts;
+	mt->receiving = QB_TRUE;
+	mt->recv_target = w;
+	pthread_mutex_unlock(&mt->lock);
+
+	res = _ipcc_recv(c, buf, len, timeout);
+
+	pthread_mutex_lock(&mt->lock);
+	mt->receiving = QB_FALSE;
+	mt->recv_target = NULL;
+	if (mt->closing) {
+		/* every waiter has been answered already, w may be gone */
+	} else if (res == -ETIMEDOUT) {
+		/* not there yet */
+		mt->recv_missed = attempt;
+	} else if (res == -EAGAIN) {
+		/* not there yet, try again straight away */
+	} else if (res < 0 && !c->is_connected) {
+		qb_list_for_each_entry_safe(w, tmp, &mt->waiters, list) {
+			_ipcc_mt_waiter_done(w, res);
+		}
+	} else if (res > 0 && mt->match) {
+		_ipcc_mt_route(mt, buf, res);
+	} else {
+		_ipcc_mt_waiter_done(w, res);
+	}
+	pthread_cond_broadcast(&mt->cond);
+}
+
+static ssize_t
+_ipcc_mt_sendv_recv(struct qb_ipcc_connection *c,
+		    const struct iovec *iov, uint32_t iov_len,
+		    void *res_msg, size_t res_len, int32_t ms_timeout)
+{
+	struct qb_ipcc_mt *mt = c->mt;
+	struct qb_ipcc_waiter *w;
+	uint64_t attempts;
+	ssize_t res;
+
+	w = calloc(1, sizeof(struct qb_ipcc_waiter));
+	if (w == NULL) {
+		return -ENOMEM;
+	}
+	w->buf = res_msg;
+	w->len = res_len;
+	w->req_id = qb_ipc_iov_msg_id(iov, iov_len);
+	if (ms_timeout >= 0) {
+		w->deadline = qb_util_nano_current_get() +
+			      (uint64_t)ms_timeout * QB_TIME_NS_IN_MSEC;
+	}
+
+	pthread_mutex_lock(&mt->lock);
+	if (mt->closing) {
+		pthread_mutex_unlock(&mt->lock);
+		free(w);
+		return -ENOTCONN;
+	}
+	res = _ipcc_sendv(c, &c->request, iov, iov_len);
+	if (res < 0) {
+		pthread_mutex_unlock(&mt->lock);
+		free(w);
+		return res;
+	}
+	w->seq = mt->next_seq++;
+	mt->callers++;
+	qb_list_add_tail(&w->list, &mt->waiters);
+
+	/*
+	 * Like the single threaded path, give up only once a receive
+	 * started after the request went out has come back empty, so a
+	 * zero timeout still gets one try at the response.
+	 */
+	attempts = mt->recv_attempts;
+	while (!w->done) {
+		if (w->deadline && qb_util_nano_current_get() >= w->deadline &&
+		    mt->recv_missed > attempts && mt->recv_target != w) {
+			/* the response is still coming, it gets thrown away */
+			w->buf = NULL;
+			w = NULL;
+			res = -ETIMEDOUT;
+			goto leave;
+		}
+		if (!mt->receiving) {
+			_ipcc_mt_recv_one(c);
+		} else {
+			pthread_cond_wait(&mt->cond, &mt->lock);
+		}
+	}
+	res = w->res;
+leave:
+	mt->callers--;
+	/* let someone else take over receiving, or disconnect go on */
+	pthread_cond_broadcast(&mt->cond);
+	pthread_mutex_unlock(&mt->lock);
+	free(w);
+	return res;
+}
+
+static void
+_ipcc_mt_free(struct qb_ipcc_mt *mt)
+{
+	struct qb_ipcc_waiter *w;
+	struct qb_ipcc_waiter *tmp;
+
+	/* drop what timed out requests left behind */
+	qb_list_for_each_entry_safe(w, tmp, &mt->waiters, list) {
+		qb_list_del(&w->list);
+		free(w);
+	}
+	pthread_cond_destroy(&mt->cond);
+	pthread_mutex_destroy(&mt->lock);
+	free(mt);
+}
+
+/*
+ * Answer everybody still waiting with -ENOTCONN, wait for them (and a
+ * receive in progress) to let go of the connection, then free it all.
+ */
+static void
+_ipcc_mt_close(struct qb_ipcc_connection *c)
+{
+	struct qb_ipcc_mt *mt = c->mt;
+	struct qb_ipcc_waiter *w;
+	struct qb_ipcc_waiter *tmp;
+
+	if (mt == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&mt->lock);
+	mt->closing = QB_TRUE;
+	qb_list_for_each_entry_safe(w, tmp, &mt->waiters, list) {
+		_ipcc_mt_waiter_done(w, -ENOTCONN);
+	}
+	pthread_cond_broadcast(&mt->cond);
+	while (mt->receiving || mt->callers > 0) {
+		pthread_cond_wait(&mt->cond, &mt->lock);
+	}
+	pthread_mutex_unlock(&mt->lock);
+	_ipcc_mt_free(mt);
+	c->mt = NULL;
+}
+
 ssize_t
 qb_ipcc_sendv_recv(qb_ipcc_connection_t * c,
 		   const struct iovec * iov, uint32_t iov_len,
@@ -382,7 +933,12 @@ qb_ipcc_sendv_recv(qb_ipcc_connection_t * c,
 		}
 	}
 
-	res = qb_ipcc_sendv(c, iov, iov_len);
+	if (c->mt) {
+		return _ipcc_mt_sendv_recv(c, iov, iov_len, res_msg, res_len,
+					   ms_timeout);
+	}
+
+	res = _ipcc_sendv(c, &c->request, iov, iov_len);
 	if (res < 0) {
 		return res;
 	}
@@ -396,7 +952,7 @@ qb_ipcc_sendv_recv(qb_ipcc_connection_t * c,
 			timeout_now = timeout_rem;
 		}
 
-		res = qb_ipcc_recv(c, res_msg, res_len, timeout_now);
+		res = _ipcc_recv(c, res_msg, res_len, timeout_now);
 		if (res == -ETIMEDOUT) {
 			if (ms_timeout < 0) {
 				res = -EAGAIN;
@@ -417,6 +973,47 @@ qb_ipcc_sendv_recv(qb_ipcc_connection_t * c,
 	return res;
 }
 
+int32_t
+qb_ipcc_event_subscribe(struct qb_ipcc_connection *c,
+			const struct qb_ipc_event_range *ranges,
+			uint32_t num_ranges)
+{
+	struct qb_ipc_event_filter_request req;
+	struct iovec iov;
+	ssize_t res;
+	uint32_t i;
+
+	if (c == NULL || num_ranges > QB_IPC_EVENT_RANGES_MAX ||
+	    (ranges == NULL && num_ranges > 0)) {
+		return -EINVAL;
+	}
+	if (c->event_ranges_max < QB_MAX(num_ranges, 1)) {
+		return -ENOTSUP;
+	}
+	memset(&req, 0, sizeof(req));
+	req.hdr.id = QB_IPC_MSG_EVENT_FILTER;
+	req.hdr.size = sizeof(req);
+	req.num_ranges = num_ranges;
+	for (i = 0; i < num_ranges; i++) {
+		if (ranges[i].first > ranges[i].last) {
+			return -EINVAL;
+		}
+		req.ranges[i] = ranges[i];
+	}
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+
+	if (c->mt) {
+		/* no response, so nobody waits for one */
+		pthread_mutex_lock(&c->mt->lock);
+		res = _ipcc_sendv(c, &c->request, &iov, 1);
+		pthread_mutex_unlock(&c->mt->lock);
+	} else {
+		res = _ipcc_sendv(c, &c->request, &iov, 1);
+	}
+	return res < 0 ? res : 0;
+}
+
 int32_t
 qb_ipcc_fd_get(struct qb_ipcc_connection * c, int32_t * fd)
 {
@@ -465,6 +1062,12 @@ qb_ipcc_event_recv(struct qb_ipcc_connection * c, void *msg_pt,
 	if (res < 0) {
 		return res;
 	}
+	if (c->funcs.event_open) {
+		res = c->funcs.event_open(c);
+		if (res < 0) {
+			return _check_connection_state(c, res);
+		}
+	}
 	size = c->funcs.recv(&c->event, msg_pt, msg_len, ms_timeout);
 	if (size > 0 && c->needs_sock_for_poll) {
 		res = qb_ipc_us_recv(&c->setup, &one_byte, 1, -1);
@@ -472,6 +1075,13 @@ qb_ipcc_event_recv(struct qb_ipcc_connection * c, void *msg_pt,
 			size = res;
 		}
 	}
+	if (size > 0) {
+		size = _ipcc_large_msg_recv(c, msg_pt, msg_len, size);
+	}
+	if (size > 0) {
+		QB_IPC_TRACE(ipcc_event_recv, c->name,
+			     qb_ipc_msg_id(msg_pt, size), size);
+	}
 	return _check_connection_state(c, size);
 }
 
@@ -485,6 +1095,7 @@ qb_ipcc_disconnect(struct qb_ipcc_connection *c)
 	if (c == NULL) {
 		return;
 	}
+	_ipcc_mt_close(c);
 
 	ow = _event_sock_one_way_get(c);
 	(void)_check_connection_state_with(c, -EAGAIN, ow, 0, POLLIN);
@@ -492,6 +1103,7 @@ qb_ipcc_disconnect(struct qb_ipcc_connection *c)
 	if (c->funcs.disconnect) {
 		c->funcs.disconnect(c);
 	}
+	qb_ipcc_doorbell_close(c);
 	free(c->receive_buf);
 	free(c);
 }
@@ -537,3 +1149,103 @@ qb_ipcc_get_buffer_size(qb_ipcc_connection_t * c)
 
 	return c->event.max_msg_size;
 }
+
+int32_t
+qb_ipcc_busy_poll_set(qb_ipcc_connection_t * c, uint32_t usec)
+{
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	c->busy_poll_usec = usec;
+	return 0;
+}
+
+int32_t
+qb_ipcc_busy_poll_stats_get(qb_ipcc_connection_t * c,
+			    struct qb_ipcc_busy_poll_stats *stats,
+			    int32_t clear_after_read)
+{
+	if (c == NULL || stats == NULL) {
+		return -EINVAL;
+	}
+	memcpy(stats, &c->busy_poll_stats, sizeof(*stats));
+	if (clear_after_read) {
+		memset(&c->busy_poll_stats, 0, sizeof(c->busy_poll_stats));
+	}
+	return 0;
+}
+
+int32_t
+qb_ipcc_threadsafe_match_set(qb_ipcc_connection_t *c,
+			     qb_ipcc_response_match_fn match)
+{
+	if (c == NULL || c->mt == NULL) {
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&c->mt->lock);
+	c->mt->match = match;
+	pthread_mutex_unlock(&c->mt->lock);
+	return 0;
+}
+
+int32_t
+qb_ipcc_threadsafe_set(qb_ipcc_connection_t * c, int32_t enable)
+{
+	struct qb_ipcc_mt *mt;
+	struct qb_ipcc_waiter *w;
+	struct qb_ipcc_waiter *tmp;
+	ssize_t res;
+
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (enable && c->mt == NULL) {
+		mt = calloc(1, sizeof(struct qb_ipcc_mt));
+		if (mt == NULL) {
+			return -ENOMEM;
+		}
+		pthread_mutex_init(&mt->lock, NULL);
+		pthread_cond_init(&mt->cond, NULL);
+		qb_list_init(&mt->waiters);
+		c->mt = mt;
+	} else if (!enable && c->mt) {
+		mt = c->mt;
+		pthread_mutex_lock(&mt->lock);
+		if (mt->receiving) {
+			pthread_mutex_unlock(&mt->lock);
+			return -EBUSY;
+		}
+		qb_list_for_each_entry(w, &mt->waiters, list) {
+			if (w->buf) {
+				pthread_mutex_unlock(&mt->lock);
+				return -EBUSY;
+			}
+		}
+		/*
+		 * Calls that timed out are still owed their responses, which
+		 * must not turn up in qb_ipcc_recv() later: take in what has
+		 * arrived and stay in this mode while any are missing.
+		 */
+		while (!qb_list_empty(&mt->waiters)) {
+			w = qb_list_first_entry(&mt->waiters,
+						struct qb_ipcc_waiter, list);
+			res = _ipcc_recv(c, c->receive_buf,
+					 c->response.max_msg_size, 0);
+			if (res == -ETIMEDOUT || res == -EAGAIN) {
+				pthread_mutex_unlock(&mt->lock);
+				return -EBUSY;
+			} else if (res < 0 && !c->is_connected) {
+				qb_list_for_each_entry_safe(w, tmp,
+							    &mt->waiters, list) {
+					_ipcc_mt_waiter_done(w, res);
+				}
+			} else {
+				_ipcc_mt_waiter_done(w, res);
+			}
+		}
+		pthread_mutex_unlock(&mt->lock);
+		_ipcc_mt_free(mt);
+		c->mt = NULL;
+	}
+	return 0;
+}
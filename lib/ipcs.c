@@ -20,15 +20,17 @@
  */
 #include "os_base.h"
 #include <poll.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "util_int.h"
 #include "ipc_int.h"
 #include <qb/qbdefs.h>
 #include <qb/qbatomic.h>
 #include <qb/qbipcs.h>
+#include <qb/qbutil.h>
 
-static void qb_ipcs_flowcontrol_set(struct qb_ipcs_connection *c,
-				    int32_t fc_enable);
 static int32_t
 new_event_notification(struct qb_ipcs_connection * c);
 
@@ -71,6 +73,7 @@ qb_ipcs_create(const char *name,
 	s->serv_fns.connection_destroyed = handlers->connection_destroyed;
 
 	qb_list_init(&s->connections);
+	qb_list_init(&s->reap_list);
 
 	return s;
 }
@@ -131,6 +134,12 @@ qb_ipcs_run(struct qb_ipcs_service *s)
 		break;
 	}
 
+	if (res == 0 && s->workers) {
+		res = qb_ipcs_workers_start(s);
+	}
+	if (res == 0 && s->doorbell) {
+		res = qb_ipcs_doorbell_start(s);
+	}
 	if (res == 0) {
 		res = qb_ipcs_us_publish(s);
 		if (res < 0) {
@@ -141,6 +150,8 @@ qb_ipcs_run(struct qb_ipcs_service *s)
 
 run_cleanup:
 	if (res < 0) {
+		qb_ipcs_doorbell_stop(s);
+		qb_ipcs_workers_stop(s);
 		/* Failed to run services, removing initial alloc reference. */
 		qb_ipcs_unref(s);
 	}
@@ -148,8 +159,8 @@ run_cleanup:
 	return res;
 }
 
-static int32_t
-_modify_dispatch_descriptor_(struct qb_ipcs_connection *c)
+int32_t
+qb_ipcs_dispatch_descriptor_modify(struct qb_ipcs_connection *c)
 {
 	qb_ipcs_dispatch_mod_fn disp_mod = c->service->poll_fns.dispatch_mod;
 
@@ -204,7 +215,7 @@ qb_ipcs_request_rate_limit(struct qb_ipcs_service *s,
 			qb_ipcs_flowcontrol_set(c, QB_FALSE);
 		}
 		if (old_p != s->poll_priority) {
-			(void)_modify_dispatch_descriptor_(c);
+			(void)qb_ipcs_dispatch_descriptor_modify(c);
 		}
 		qb_ipcs_connection_unref(c);
 	}
@@ -225,10 +236,90 @@ qb_ipcs_unref(struct qb_ipcs_service *s)
 	free_it = qb_atomic_int_dec_and_test(&s->ref_count);
 	if (free_it) {
 		qb_util_log(LOG_DEBUG, "%s() - destroying", __func__);
+		free(s->msg_table);
 		free(s);
 	}
 }
 
+/*
+ * Unmapping a connection's buffers and removing its files is left until
+ * the last reference goes.  With qb_ipcs_deferred_teardown_set() that
+ * work is queued and done from a low priority job, a few connections at
+ * a time, so a burst of disconnects doesn't hold up everyone else.
+ */
+static void
+_connection_free(struct qb_ipcs_connection *c)
+{
+	struct qb_ipcs_service *s = c->service;
+
+	if (c->large_msg_max > 0) {
+		qb_ipc_large_msg_cleanup(c->large_msg_template);
+	}
+	s->funcs.disconnect(c);
+	/* Let go of the connection's reference to the service */
+	qb_ipcs_unref(s);
+	free(c->receive_buf);
+	free(c);
+}
+
+static void
+_connections_reap(struct qb_ipcs_service *s, uint32_t max)
+{
+	struct qb_ipcs_connection *c;
+	uint32_t reaped;
+
+	for (reaped = 0; reaped < max && !qb_list_empty(&s->reap_list);
+	     reaped++) {
+		c = qb_list_first_entry(&s->reap_list,
+					struct qb_ipcs_connection, list);
+		qb_list_del(&c->list);
+		_connection_free(c);
+	}
+}
+
+static void _connections_reap_schedule(struct qb_ipcs_service *s);
+
+static void
+_connections_reap_job(void *data)
+{
+	struct qb_ipcs_service *s = (struct qb_ipcs_service *)data;
+
+	s->reap_scheduled = QB_FALSE;
+	_connections_reap(s, s->reap_batch > 0 ? s->reap_batch : UINT32_MAX);
+	_connections_reap_schedule(s);
+	/* the job's reference */
+	qb_ipcs_unref(s);
+}
+
+static void
+_connections_reap_schedule(struct qb_ipcs_service *s)
+{
+	if (s->reap_scheduled || qb_list_empty(&s->reap_list)) {
+		return;
+	}
+	qb_ipcs_ref(s);
+	if (s->poll_fns.job_add(QB_LOOP_LOW, s, _connections_reap_job) == 0) {
+		s->reap_scheduled = QB_TRUE;
+		return;
+	}
+	_connections_reap(s, UINT32_MAX);
+	qb_ipcs_unref(s);
+}
+
+int32_t
+qb_ipcs_deferred_teardown_set(struct qb_ipcs_service *s,
+			      uint32_t max_per_iteration)
+{
+	if (s == NULL) {
+		return -EINVAL;
+	}
+	s->reap_batch = max_per_iteration;
+	if (max_per_iteration == 0) {
+		_connections_reap(s, UINT32_MAX);
+	}
+	return 0;
+}
+
 void
 qb_ipcs_destroy(struct qb_ipcs_service *s)
 {
@@ -239,6 +330,7 @@ qb_ipcs_destroy(struct qb_ipcs_service *s)
 	if (s == NULL) {
 		return;
 	}
+	qb_ipcs_workers_stop(s);
 	qb_list_for_each_safe(pos, n, &s->connections) {
 		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
 		if (c == NULL) {
@@ -248,6 +340,11 @@ qb_ipcs_destroy(struct qb_ipcs_service *s)
 	}
 	(void)qb_ipcs_us_withdraw(s);
 
+	/* nothing is left for the loop to clean up later */
+	s->reap_batch = 0;
+	_connections_reap(s, UINT32_MAX);
+	qb_ipcs_doorbell_stop(s);
+
 	/* service destroyed, remove initial alloc ref */
 	qb_ipcs_unref(s);
 }
@@ -279,6 +376,51 @@ _response_sock_one_way_get(struct qb_ipcs_connection * c)
 	return NULL;
 }
 
+/*
+ * Messages that do not fit the one_way's buffer but are within the
+ * negotiated large message size are written to a file of their own and
+ * iov is pointed at the descriptor instead.
+ */
+static int32_t
+_large_msg_wrap(struct qb_ipcs_connection *c, struct qb_ipc_one_way *ow,
+		const struct iovec **iov, size_t *iov_len, size_t size,
+		struct qb_ipc_large_msg *large, struct iovec *large_iov)
+{
+	int32_t res;
+
+	if (size <= ow->max_msg_size || size > c->large_msg_max) {
+		return QB_FALSE;
+	}
+	res = qb_ipc_large_msg_create(c->large_msg_template, *iov, *iov_len,
+				      size, large);
+	if (res < 0) {
+		return res;
+	}
+	/* Set correct ownership if qb_ipcs_connection_auth_set() has been used */
+	if (chown(large->name, c->auth.uid, c->auth.gid) != 0 ||
+	    chmod(large->name, c->auth.mode) != 0) {
+		qb_util_perror(LOG_DEBUG, "failed to set ownership of %s",
+			       large->name);
+	}
+	large_iov->iov_base = large;
+	large_iov->iov_len = sizeof(*large);
+	*iov = large_iov;
+	*iov_len = 1;
+	return QB_TRUE;
+}
+
+static size_t
+_iov_size(const struct iovec *iov, size_t iov_len)
+{
+	size_t size = 0;
+	int32_t i;
+
+	for (i = 0; i < iov_len; i++) {
+		size += iov[i].iov_len;
+	}
+	return size;
+}
+
 ssize_t
 qb_ipcs_response_send(struct qb_ipcs_connection *c, const void *data,
 		      size_t size)
@@ -288,9 +430,19 @@ qb_ipcs_response_send(struct qb_ipcs_connection *c, const void *data,
 	if (c == NULL) {
 		return -EINVAL;
 	}
+	if (qb_ipcs_work_running(c) ||
+	    (size > c->response.max_msg_size && size <= c->large_msg_max)) {
+		struct iovec iov;
+
+		iov.iov_base = (void *)data;
+		iov.iov_len = size;
+		return qb_ipcs_response_sendv(c, &iov, 1);
+	}
 	qb_ipcs_connection_ref(c);
 	res = c->service->funcs.send(&c->response, data, size);
 	if (res == size) {
+		QB_IPC_TRACE(ipcs_response_send, c->description,
+			     qb_ipc_msg_id(data, size), size);
 		c->stats.responses++;
 	} else if (res == -EAGAIN || res == -ETIMEDOUT) {
 		struct qb_ipc_one_way *ow = _response_sock_one_way_get(c);
@@ -312,13 +464,38 @@ qb_ipcs_response_sendv(struct qb_ipcs_connection * c, const struct iovec * iov,
 		       size_t iov_len)
 {
 	ssize_t res;
+	size_t size;
+	struct qb_ipc_large_msg large;
+	struct iovec large_iov;
+	int32_t is_large;
+	const struct iovec *send_iov = iov;
+	size_t send_iov_len = iov_len;
 
 	if (c == NULL) {
 		return -EINVAL;
 	}
+	if (qb_ipcs_work_running(c)) {
+		return qb_ipcs_work_output_add(c, iov, iov_len, QB_FALSE);
+	}
 	qb_ipcs_connection_ref(c);
-	res = c->service->funcs.sendv(&c->response, iov, iov_len);
+	size = _iov_size(iov, iov_len);
+	is_large = _large_msg_wrap(c, &c->response, &send_iov, &send_iov_len,
+				   size, &large, &large_iov);
+	if (is_large < 0) {
+		res = is_large;
+		goto cleanup;
+	}
+	res = c->service->funcs.sendv(&c->response, send_iov, send_iov_len);
+	if (is_large) {
+		if (res > 0) {
+			res = size;
+		} else {
+			unlink(large.name);
+		}
+	}
 	if (res > 0) {
+		QB_IPC_TRACE(ipcs_response_send, c->description,
+			     qb_ipc_iov_msg_id(iov, iov_len), size);
 		c->stats.responses++;
 	} else if (res == -EAGAIN || res == -ETIMEDOUT) {
 		struct qb_ipc_one_way *ow = _response_sock_one_way_get(c);
@@ -330,11 +507,41 @@ qb_ipcs_response_sendv(struct qb_ipcs_connection * c, const struct iovec * iov,
 		}
 		c->stats.send_retries++;
 	}
+cleanup:
 	qb_ipcs_connection_unref(c);
 
 	return res;
 }
 
+/*
+ * Whether the high priority lane is notified on the setup socket, along
+ * with the ordinary one (shm without the doorbell).
+ */
+static int32_t
+_hipri_notified_on_setup(struct qb_ipcs_connection *c)
+{
+	return c->request_hi.max_msg_size > 0 &&
+	       c->service->needs_sock_for_poll && !c->doorbell_slot;
+}
+
+/*
+ * Stop polling for requests while the workers have the connection flow
+ * controlled, unless high priority requests come in on the same socket.
+ * Then the notifications for ordinary requests are read ahead and kept
+ * (see _request_notifications_hold()), and _request_kick() comes back
+ * for them once flow control is off again.
+ */
+void
+qb_ipcs_work_fc_poll_events_set(struct qb_ipcs_connection *c)
+{
+	if (c->work_fc && (!_hipri_notified_on_setup(c) ||
+			   c->service->poll_fns.job_add == NULL)) {
+		c->poll_events &= ~POLLIN;
+	} else {
+		c->poll_events |= POLLIN;
+	}
+}
+
 static int32_t
 resend_event_notifications(struct qb_ipcs_connection *c)
 {
@@ -355,7 +562,8 @@ resend_event_notifications(struct qb_ipcs_connection *c)
 	assert(c->outstanding_notifiers >= 0);
 	if (c->outstanding_notifiers == 0) {
 		c->poll_events = POLLIN | POLLPRI | POLLNVAL;
-		(void)_modify_dispatch_descriptor_(c);
+		qb_ipcs_work_fc_poll_events_set(c);
+		(void)qb_ipcs_dispatch_descriptor_modify(c);
 	}
 	return res;
 }
@@ -381,28 +589,100 @@ new_event_notification(struct qb_ipcs_connection * c)
 			 */
 			c->outstanding_notifiers++;
 			c->poll_events = POLLOUT | POLLIN | POLLPRI | POLLNVAL;
-			(void)_modify_dispatch_descriptor_(c);
+			qb_ipcs_work_fc_poll_events_set(c);
+			(void)qb_ipcs_dispatch_descriptor_modify(c);
 		}
 	}
 	return res;
 }
 
+/*
+ * Whether the client subscribed to an event, see qb_ipcc_event_subscribe().
+ */
+static int32_t
+_event_wanted(struct qb_ipcs_connection *c, const void *data, size_t size)
+{
+	int32_t id;
+	uint32_t i;
+
+	if (c->event_ranges_len == 0 || size < sizeof(int32_t)) {
+		return QB_TRUE;
+	}
+	id = *(const int32_t *)data;
+	for (i = 0; i < c->event_ranges_len; i++) {
+		if (id >= c->event_ranges[i].first &&
+		    id <= c->event_ranges[i].last) {
+			return QB_TRUE;
+		}
+	}
+	return QB_FALSE;
+}
+
+static void
+_event_filter_set(struct qb_ipcs_connection *c,
+		  const struct qb_ipc_request_header *hdr)
+{
+	const struct qb_ipc_event_filter_request *req =
+		(const struct qb_ipc_event_filter_request *)hdr;
+	uint32_t i;
+
+	if (hdr->size < sizeof(*req) ||
+	    req->num_ranges > QB_IPC_EVENT_RANGES_MAX) {
+		qb_util_log(LOG_WARNING, "invalid event filter (%s)",
+			    c->description);
+		return;
+	}
+	for (i = 0; i < req->num_ranges; i++) {
+		c->event_ranges[i] = req->ranges[i];
+	}
+	c->event_ranges_len = req->num_ranges;
+	qb_util_log(LOG_DEBUG, "%u event ranges subscribed (%s)",
+		    req->num_ranges, c->description);
+}
+
 ssize_t
 qb_ipcs_event_send(struct qb_ipcs_connection * c, const void *data, size_t size)
 {
 	ssize_t res;
 	ssize_t resn;
+	uint64_t start;
 
 	if (c == NULL) {
 		return -EINVAL;
+	} else if (qb_ipcs_work_running(c)) {
+		struct iovec iov;
+
+		iov.iov_base = (void *)data;
+		iov.iov_len = size;
+		return qb_ipcs_event_sendv(c, &iov, 1);
+	} else if (!_event_wanted(c, data, size)) {
+		return size;
 	} else if (size > c->event.max_msg_size) {
-		return -EMSGSIZE;
+		struct iovec iov;
+
+		if (size > c->large_msg_max) {
+			return -EMSGSIZE;
+		}
+		iov.iov_base = (void *)data;
+		iov.iov_len = size;
+		return qb_ipcs_event_sendv(c, &iov, 1);
 	}
 
+	start = qb_util_nano_current_get();
 	qb_ipcs_connection_ref(c);
+	if (c->service->funcs.event_open) {
+		res = c->service->funcs.event_open(c);
+		if (res < 0) {
+			goto cleanup;
+		}
+	}
 	res = c->service->funcs.send(&c->event, data, size);
 	if (res == size) {
+		QB_IPC_TRACE(ipcs_event_send, c->description,
+			     qb_ipc_msg_id(data, size), size);
 		c->stats.events++;
+		qb_ipcs_latency_add(c, QB_IPCS_LATENCY_EVENT,
+				    qb_util_nano_current_get() - start);
 		resn = new_event_notification(c);
 		if (resn < 0 && resn != -EAGAIN && resn != -ENOBUFS) {
 			errno = -resn;
@@ -426,6 +706,7 @@ qb_ipcs_event_send(struct qb_ipcs_connection * c, const void *data, size_t size)
 		c->stats.send_retries++;
 	}
 
+cleanup:
 	qb_ipcs_connection_unref(c);
 	return res;
 }
@@ -433,18 +714,73 @@ qb_ipcs_event_send(struct qb_ipcs_connection * c, const void *data, size_t size)
 ssize_t
 qb_ipcs_event_sendv(struct qb_ipcs_connection * c,
 		    const struct iovec * iov, size_t iov_len)
+{
+	return qb_ipcs_event_sendv_since(c, iov, iov_len, 0);
+}
+
+/*
+ * Send an event that the caller has been holding on to since since_ns,
+ * 0 if it is sent straight away.
+ */
+ssize_t
+qb_ipcs_event_sendv_since(struct qb_ipcs_connection *c,
+			  const struct iovec *iov, size_t iov_len,
+			  uint64_t since_ns)
 {
 	ssize_t res;
 	ssize_t resn;
+	size_t size;
+	struct qb_ipc_large_msg large;
+	struct iovec large_iov;
+	int32_t is_large;
+	const struct iovec *send_iov = iov;
+	size_t send_iov_len = iov_len;
+	uint64_t start;
 
 	if (c == NULL) {
 		return -EINVAL;
 	}
+	if (qb_ipcs_work_running(c)) {
+		return qb_ipcs_work_output_add(c, iov, iov_len, QB_TRUE);
+	}
+	size = _iov_size(iov, iov_len);
+	if (iov_len > 0 &&
+	    !_event_wanted(c, iov[0].iov_base, iov[0].iov_len)) {
+		return size;
+	}
+	start = qb_util_nano_current_get();
 	qb_ipcs_connection_ref(c);
 
-	res = c->service->funcs.sendv(&c->event, iov, iov_len);
+	if (c->service->funcs.event_open) {
+		res = c->service->funcs.event_open(c);
+		if (res < 0) {
+			goto cleanup;
+		}
+	}
+	is_large = _large_msg_wrap(c, &c->event, &send_iov, &send_iov_len,
+				   size, &large, &large_iov);
+	if (is_large < 0) {
+		res = is_large;
+		goto cleanup;
+	}
+	res = c->service->funcs.sendv(&c->event, send_iov, send_iov_len);
+	if (is_large) {
+		if (res > 0) {
+			res = size;
+		} else {
+			unlink(large.name);
+		}
+	}
 	if (res > 0) {
+		QB_IPC_TRACE(ipcs_event_send, c->description,
+			     qb_ipc_iov_msg_id(iov, iov_len), size);
 		c->stats.events++;
+		qb_ipcs_latency_add(c, QB_IPCS_LATENCY_EVENT,
+				    qb_util_nano_current_get() - start);
+		if (since_ns) {
+			qb_ipcs_latency_add(c, QB_IPCS_LATENCY_EVENT_QUEUE,
+					    start - since_ns);
+		}
 		resn = new_event_notification(c);
 		if (resn < 0 && resn != -EAGAIN) {
 			errno = -resn;
@@ -468,6 +804,7 @@ qb_ipcs_event_sendv(struct qb_ipcs_connection * c,
 		c->stats.send_retries++;
 	}
 
+cleanup:
 	qb_ipcs_connection_unref(c);
 	return res;
 }
@@ -538,6 +875,7 @@ qb_ipcs_connection_alloc(struct qb_ipcs_service *s)
 	c->request.type = s->type;
 	c->response.type = s->type;
 	c->event.type = s->type;
+	c->request_hi.type = s->type;
 	(void)strlcpy(c->description, "not set yet", CONNECTION_DESCRIPTION);
 
 	/* initial alloc ref */
@@ -551,6 +889,7 @@ qb_ipcs_connection_alloc(struct qb_ipcs_service *s)
 	qb_ipcs_ref(s);
 	c->service = s;
 	qb_list_init(&c->list);
+	qb_list_init(&c->work_done);
 
 	return c;
 }
@@ -582,11 +921,12 @@ qb_ipcs_connection_unref(struct qb_ipcs_connection *c)
 		if (c->service->serv_fns.connection_destroyed) {
 			c->service->serv_fns.connection_destroyed(c);
 		}
-		c->service->funcs.disconnect(c);
-		/* Let go of the connection's reference to the service */
-		qb_ipcs_unref(c->service);
-		free(c->receive_buf);
-		free(c);
+		if (c->service->reap_batch > 0) {
+			qb_list_add_tail(&c->list, &c->service->reap_list);
+			_connections_reap_schedule(c->service);
+		} else {
+			_connection_free(c);
+		}
 	}
 }
 
@@ -639,7 +979,6 @@ qb_ipcs_disconnect(struct qb_ipcs_connection *c)
 				scheduled_retry = 1;
 			}
 		}
-		remove_tempdir(c->description);
 		if (scheduled_retry == 0) {
 			/* This removes the initial alloc ref */
 			qb_ipcs_connection_unref(c);
@@ -648,7 +987,9 @@ qb_ipcs_disconnect(struct qb_ipcs_connection *c)
 
 }
 
-static void
+static void _request_kick(struct qb_ipcs_connection *c);
+
+void
 qb_ipcs_flowcontrol_set(struct qb_ipcs_connection *c, int32_t fc_enable)
 {
 	if (c == NULL) {
@@ -659,24 +1000,165 @@ qb_ipcs_flowcontrol_set(struct qb_ipcs_connection *c, int32_t fc_enable)
 		c->fc_enabled = fc_enable;
 		c->stats.flow_control_state = fc_enable;
 		c->stats.flow_control_count++;
+		QB_IPC_TRACE(ipcs_flow_control, c->description, fc_enable, 0);
+		if (!fc_enable) {
+			_request_kick(c);
+			qb_ipcs_doorbell_ring(c);
+		}
+	}
+}
+
+/*
+ * Map the message a large message descriptor points at.
+ */
+static ssize_t
+_large_request_map(struct qb_ipcs_connection *c,
+		   struct qb_ipc_request_header *desc, ssize_t size,
+		   struct qb_ipc_request_header **hdr)
+{
+	ssize_t len;
+
+	if (size < sizeof(struct qb_ipc_large_msg)) {
+		return -EINVAL;
+	}
+	len = qb_ipc_large_msg_map(c->large_msg_template,
+				   (struct qb_ipc_large_msg *)desc,
+				   c->large_msg_max, (void **)hdr);
+	if (len < 0) {
+		errno = -len;
+		qb_util_perror(LOG_WARNING,
+			       "invalid large message from client %s",
+			       c->description);
+		return -EINVAL;
+	}
+	if (len < sizeof(**hdr) || (*hdr)->size <= 0 || (*hdr)->size > len) {
+		qb_util_log(LOG_WARNING,
+			    "invalid message size %d (max: %zd) from client %s",
+			    (*hdr)->size, len, c->description);
+		munmap(*hdr, len);
+		return -EINVAL;
+	}
+	return len;
+}
+
+/*
+ * Find what handles a request, on the loop thread.  A request that is
+ * to be refused gets no entry and the error to answer it with.
+ */
+int32_t
+qb_ipcs_msg_lookup(struct qb_ipcs_connection *c,
+		   struct qb_ipc_request_header *hdr,
+		   struct qb_ipcs_msg_entry **entry)
+{
+	struct qb_ipcs_service *s = c->service;
+	struct qb_ipcs_msg_entry *e = NULL;
+	uint32_t i = (uint32_t)hdr->id - (uint32_t)s->msg_id_base;
+
+	*entry = NULL;
+	if (i < s->msg_table_len && s->msg_table[i].fn) {
+		e = &s->msg_table[i];
+	}
+	if (e == NULL) {
+		return s->serv_fns.msg_process ? 0 : -ENOSYS;
+	}
+	if ((uint32_t)hdr->size < e->min_size ||
+	    (e->max_size && (uint32_t)hdr->size > e->max_size)) {
+		qb_util_log(LOG_WARNING,
+			    "request %d of size %d out of bounds (%s)",
+			    hdr->id, hdr->size, c->description);
+		e->stats.rejected++;
+		return -EINVAL;
+	}
+	*entry = e;
+	return 0;
+}
+
+/*
+ * Hand a request to its handler, or refuse it.  Called on the loop
+ * thread or on a worker.
+ */
+int32_t
+qb_ipcs_msg_call(struct qb_ipcs_connection *c,
+		 struct qb_ipcs_msg_entry *entry, int32_t error,
+		 void *msg, size_t size)
+{
+	struct qb_ipc_request_header *hdr = msg;
+	struct qb_ipc_response_header response;
+	ssize_t res;
+
+	if (entry) {
+		return entry->fn(c, msg, size);
+	}
+	if (error == 0) {
+		return c->service->serv_fns.msg_process(c, msg, size);
+	}
+	response.id = hdr->id;
+	response.size = sizeof(response);
+	response.error = error;
+	res = qb_ipcs_response_send(c, &response, sizeof(response));
+	return res < 0 ? res : 0;
+}
+
+void
+qb_ipcs_msg_account(struct qb_ipcs_msg_entry *entry, size_t size,
+		    uint64_t ns)
+{
+	if (entry) {
+		entry->stats.count++;
+		entry->stats.bytes += size;
+		entry->stats.total_ns += ns;
 	}
 }
 
 static int32_t
-_process_request_(struct qb_ipcs_connection *c, int32_t ms_timeout)
+_msg_process(struct qb_ipcs_connection *c,
+	     struct qb_ipc_request_header *hdr, size_t size)
+{
+	struct qb_ipcs_msg_entry *entry;
+	uint64_t start = qb_util_nano_current_get();
+	uint64_t ns;
+	int32_t error;
+	int32_t res;
+
+	if (c->request_ready_ns) {
+		qb_ipcs_latency_add(c, QB_IPCS_LATENCY_QUEUE,
+				    start - c->request_ready_ns);
+	}
+	error = qb_ipcs_msg_lookup(c, hdr, &entry);
+	res = qb_ipcs_msg_call(c, entry, error, hdr, size);
+	ns = qb_util_nano_current_get() - start;
+	qb_ipcs_latency_add(c, QB_IPCS_LATENCY_PROCESS, ns);
+	qb_ipcs_msg_account(entry, size, ns);
+	return res;
+}
+
+static int32_t
+_msg_queue(struct qb_ipcs_connection *c,
+	   struct qb_ipc_request_header *hdr, size_t size, size_t map_len)
+{
+	struct qb_ipcs_msg_entry *entry;
+	int32_t error;
+
+	error = qb_ipcs_msg_lookup(c, hdr, &entry);
+	return qb_ipcs_work_queue(c, hdr, size, map_len, entry, error);
+}
+
+static int32_t
+_process_request_(struct qb_ipcs_connection *c,
+		  struct qb_ipc_one_way *one_way, int32_t ms_timeout)
 {
 	int32_t res = 0;
 	ssize_t size;
 	struct qb_ipc_request_header *hdr;
 
 	if (c->service->funcs.peek && c->service->funcs.reclaim) {
-		size = c->service->funcs.peek(&c->request, (void **)&hdr,
+		size = c->service->funcs.peek(one_way, (void **)&hdr,
 					      ms_timeout);
 	} else {
 		hdr = c->receive_buf;
-		size = c->service->funcs.recv(&c->request,
+		size = c->service->funcs.recv(one_way,
 					      hdr,
-					      c->request.max_msg_size,
+					      one_way->max_msg_size,
 					      ms_timeout);
 	}
 	if (size < 0) {
@@ -696,15 +1178,50 @@ _process_request_(struct qb_ipcs_connection *c, int32_t ms_timeout)
 		goto cleanup;
 	} else {
 		/* Validate message size to prevent integer overflow attacks */
-		if (hdr->size <= 0 || hdr->size > c->request.max_msg_size) {
+		if (hdr->size <= 0 || hdr->size > one_way->max_msg_size) {
 			qb_util_log(LOG_WARNING,
 				    "invalid message size %d (max: %zu) from client %s",
-				    hdr->size, c->request.max_msg_size, c->description);
+				    hdr->size, one_way->max_msg_size, c->description);
 			res = -EINVAL;
 			goto cleanup;
 		}
 		c->stats.requests++;
-		res = c->service->serv_fns.msg_process(c, hdr, hdr->size);
+		if (hdr->id == QB_IPC_MSG_EVENT_FILTER) {
+			_event_filter_set(c, hdr);
+			res = 0;
+		} else if (hdr->id == QB_IPC_MSG_LARGE &&
+			   c->large_msg_max > 0) {
+			struct qb_ipc_request_header *large_hdr;
+			ssize_t large_len;
+
+			large_len = _large_request_map(c, hdr, size, &large_hdr);
+			if (large_len < 0) {
+				res = large_len;
+				goto cleanup;
+			}
+			QB_IPC_TRACE(ipcs_request_recv, c->description,
+				     large_hdr->id, large_hdr->size);
+			if (c->service->workers && one_way != &c->request_hi) {
+				res = _msg_queue(c, large_hdr, large_hdr->size,
+						 large_len);
+				if (res < 0) {
+					munmap(large_hdr, large_len);
+				}
+			} else {
+				res = _msg_process(c, large_hdr,
+						   large_hdr->size);
+				munmap(large_hdr, large_len);
+			}
+		} else {
+			QB_IPC_TRACE(ipcs_request_recv, c->description,
+				     hdr->id, hdr->size);
+			/* high priority requests don't queue behind the rest */
+			if (c->service->workers && one_way != &c->request_hi) {
+				res = _msg_queue(c, hdr, hdr->size, 0);
+			} else {
+				res = _msg_process(c, hdr, hdr->size);
+			}
+		}
 		/* 0 == good, negative == backoff */
 		if (res < 0) {
 			res = -ENOBUFS;
@@ -714,7 +1231,7 @@ _process_request_(struct qb_ipcs_connection *c, int32_t ms_timeout)
 	}
 
 	if (c->service->funcs.peek && c->service->funcs.reclaim) {
-		c->service->funcs.reclaim(&c->request);
+		c->service->funcs.reclaim(one_way);
 	}
 
 cleanup:
@@ -746,6 +1263,110 @@ _request_q_len_get(struct qb_ipcs_connection *c)
 	return q_len;
 }
 
+/*
+ * Drain the high priority lane, if the client negotiated one.
+ * Returns how many messages were taken off it or -ESHUTDOWN.
+ */
+static int32_t
+_process_hipri_requests(struct qb_ipcs_connection *c)
+{
+	ssize_t avail;
+	int32_t res;
+	int32_t recvd = 0;
+
+	if (c->request_hi.max_msg_size == 0 ||
+	    c->service->funcs.q_len_get == NULL) {
+		return 0;
+	}
+	avail = QB_MIN(c->service->funcs.q_len_get(&c->request_hi),
+		       MAX_RECV_MSGS);
+	while (avail > 0) {
+		c->request_hi.recv_hint = avail;
+		res = _process_request_(c, &c->request_hi, 0);
+		if (res == -ESHUTDOWN) {
+			return res;
+		}
+		if (res > 0 || res == -ENOBUFS || res == -EINVAL) {
+			recvd++;
+		}
+		if (res <= 0) {
+			break;
+		}
+		avail--;
+	}
+	return recvd;
+}
+
+/*
+ * With needs_sock_for_poll the client writes a byte to the setup socket
+ * for every message it sends (unless it rings the doorbell instead),
+ * take as many as we handled messages.
+ */
+static int32_t
+_request_notifications_take(struct qb_ipcs_connection *c, int32_t recvd)
+{
+	char bytes[MAX_RECV_MSGS];
+	int32_t res;
+
+	int32_t held;
+
+	if (!c->service->needs_sock_for_poll || c->doorbell_slot ||
+	    recvd <= 0) {
+		return 0;
+	}
+	held = QB_MIN(recvd, c->notifications_held);
+	c->notifications_held -= held;
+	recvd -= held;
+	if (recvd == 0) {
+		return 0;
+	}
+	res = qb_ipc_us_recv(&c->setup, bytes, recvd, -1);
+	if (qb_ipc_us_sock_error_is_disconnected(res)) {
+		errno = -res;
+		qb_util_perror(LOG_ERR, "error receiving from setup sock (%s)",
+			       c->description);
+		return -ESHUTDOWN;
+	}
+	return 0;
+}
+
+/*
+ * The setup socket stays readable while the workers have the connection
+ * flow controlled, if high priority requests are notified on it too.
+ * Read the notifications for the ordinary requests ahead, so it doesn't
+ * wake us up again for nothing, and keep count of them.
+ */
+static int32_t
+_request_notifications_hold(struct qb_ipcs_connection *c)
+{
+	char bytes[MAX_RECV_MSGS];
+	ssize_t res;
+
+	if (!c->work_fc || !(c->poll_events & POLLIN)) {
+		return 0;
+	}
+	do {
+		res = recv(c->setup.u.us.sock, bytes, sizeof(bytes),
+			   MSG_DONTWAIT);
+		if (res > 0) {
+			c->notifications_held += res;
+		}
+	} while (res == sizeof(bytes));
+
+	if (res == 0) {
+		res = -ENOTCONN;
+	} else if (res < 0) {
+		res = -errno;
+	}
+	if (qb_ipc_us_sock_error_is_disconnected(res)) {
+		errno = -res;
+		qb_util_perror(LOG_ERR, "error receiving from setup sock (%s)",
+			       c->description);
+		return -ESHUTDOWN;
+	}
+	return 0;
+}
+
 int32_t
 qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 {
@@ -754,6 +1375,7 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 	int32_t res = 0;
 	int32_t res2;
 	int32_t recvd = 0;
+	int32_t hi_recvd;
 	ssize_t avail;
 
 	if (c == NULL) {
@@ -787,12 +1409,28 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 			goto dispatch_cleanup;
 		}
 	}
+
+	/* the high priority lane is not subject to flow control */
+	hi_recvd = _process_hipri_requests(c);
+	if (hi_recvd < 0) {
+		res = hi_recvd;
+		goto dispatch_cleanup;
+	}
+	res = _request_notifications_take(c, hi_recvd);
+	if (res < 0) {
+		goto dispatch_cleanup;
+	}
+
 	if (c->fc_enabled) {
-		res = 0;
+		res = _request_notifications_hold(c);
 		goto dispatch_cleanup;
 	}
 	avail = _request_q_len_get(c);
 
+	if (avail == 0 && hi_recvd > 0) {
+		res = 0;
+		goto dispatch_cleanup;
+	}
 	if (c->service->needs_sock_for_poll && avail == 0) {
 		res2 = qb_ipc_us_recv(&c->setup, bytes, 1, 0);
 		if (qb_ipc_us_sock_error_is_disconnected(res2)) {
@@ -802,6 +1440,8 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 			res = -ESHUTDOWN;
 			goto dispatch_cleanup;
 		} else {
+			/* whatever was held had no request behind it */
+			c->notifications_held = 0;
 			qb_util_log(LOG_WARNING,
 				    "conn (%s) Nothing in q but got POLLIN on fd:%d (res2:%d)",
 				    c->description, fd, res2);
@@ -810,8 +1450,24 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 		}
 	}
 
+	if (c->request_ready_ns == 0) {
+		c->request_ready_ns = qb_util_nano_current_get();
+	}
 	do {
-		res = _process_request_(c, IPC_REQUEST_TIMEOUT);
+		if (recvd > 0) {
+			hi_recvd = _process_hipri_requests(c);
+			if (hi_recvd < 0) {
+				res = hi_recvd;
+				goto dispatch_cleanup;
+			}
+			res = _request_notifications_take(c, hi_recvd);
+			if (res < 0) {
+				goto dispatch_cleanup;
+			}
+		}
+		/* only read ahead if _request_kick() can pick up the rest */
+		c->request.recv_hint = c->service->poll_fns.job_add ? avail : 1;
+		res = _process_request_(c, &c->request, IPC_REQUEST_TIMEOUT);
 
 		if (res == -ESHUTDOWN) {
 			goto dispatch_cleanup;
@@ -825,15 +1481,17 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 		}
 	} while (avail > 0 && res > 0 && !c->fc_enabled);
 
-	if (c->service->needs_sock_for_poll && recvd > 0) {
-		res2 = qb_ipc_us_recv(&c->setup, bytes, recvd, -1);
-		if (qb_ipc_us_sock_error_is_disconnected(res2)) {
-			errno = -res2;
-			qb_util_perror(LOG_ERR, "error receiving from setup sock (%s)", c->description);
+	/* whatever is left has been waiting since this dispatch started */
+	if (c->service->funcs.q_len_get == NULL ||
+	    c->service->funcs.q_len_get(&c->request) <= 0) {
+		c->request_ready_ns = 0;
+	}
+	_request_kick(c);
 
-			res = -ESHUTDOWN;
-			goto dispatch_cleanup;
-		}
+	res2 = _request_notifications_take(c, recvd);
+	if (res2 < 0) {
+		res = res2;
+		goto dispatch_cleanup;
 	}
 
 	res = QB_MIN(0, res);
@@ -858,6 +1516,48 @@ dispatch_cleanup:
 	return res;
 }
 
+static int32_t
+_request_kick_needed(struct qb_ipcs_connection *c)
+{
+	return ((c->request.recv_buffered > 0 || c->notifications_held > 0) &&
+		!c->fc_enabled) ||
+	       c->request_hi.recv_buffered > 0;
+}
+
+static void
+_request_kick_job(void *data)
+{
+	struct qb_ipcs_connection *c = data;
+
+	c->request_kick_pending = QB_FALSE;
+	if (c->state == QB_IPCS_CONNECTION_ESTABLISHED &&
+	    _request_kick_needed(c)) {
+		(void)qb_ipcs_dispatch_connection_request(-1, POLLIN, c);
+	}
+	qb_ipcs_connection_unref(c);
+}
+
+/*
+ * Requests the transport has already read off the descriptor, or whose
+ * notifications were held while flow controlled, won't make it poll
+ * readable again, so come back for them from a job.
+ */
+static void
+_request_kick(struct qb_ipcs_connection *c)
+{
+	if (!_request_kick_needed(c) ||
+	    c->request_kick_pending || c->service->poll_fns.job_add == NULL) {
+		return;
+	}
+	qb_ipcs_connection_ref(c);
+	c->request_kick_pending = QB_TRUE;
+	if (c->service->poll_fns.job_add(c->service->poll_priority, c,
+					 _request_kick_job) != 0) {
+		c->request_kick_pending = QB_FALSE;
+		qb_ipcs_connection_unref(c);
+	}
+}
+
 void
 qb_ipcs_context_set(struct qb_ipcs_connection *c, void *context)
 {
@@ -895,7 +1595,7 @@ qb_ipcs_connection_stats_get(qb_ipcs_connection_t * c,
 	}
 	memcpy(stats, &c->stats, sizeof(struct qb_ipcs_connection_stats));
 	if (clear_after_read) {
-		memset(&c->stats, 0, sizeof(struct qb_ipcs_connection_stats_2));
+		memset(&c->stats, 0, sizeof(c->stats));
 		c->stats.client_pid = c->pid;
 	}
 	return 0;
@@ -918,13 +1618,44 @@ qb_ipcs_connection_stats_get_2(qb_ipcs_connection_t *c,
 
 	memcpy(stats, &c->stats, sizeof(struct qb_ipcs_connection_stats_2));
 
+	stats->event_q_length = 0;
 	if (c->service->funcs.q_len_get) {
-		stats->event_q_length = c->service->funcs.q_len_get(&c->event);
-	} else {
-		stats->event_q_length = 0;
+		ssize_t q_len = c->service->funcs.q_len_get(&c->event);
+
+		/* the event channel may not have been created yet */
+		if (q_len > 0) {
+			stats->event_q_length = q_len;
+		}
 	}
 	if (clear_after_read) {
-		memset(&c->stats, 0, sizeof(struct qb_ipcs_connection_stats_2));
+		memset(&c->stats, 0, sizeof(c->stats));
+		c->stats.client_pid = c->pid;
+	}
+	return stats;
+}
+
+struct qb_ipcs_connection_stats_3*
+qb_ipcs_connection_stats_get_3(qb_ipcs_connection_t *c,
+			       int32_t clear_after_read)
+{
+	struct qb_ipcs_connection_stats_3 *stats;
+	struct qb_ipcs_connection_stats_2 *stats_2;
+
+	stats_2 = qb_ipcs_connection_stats_get_2(c, QB_FALSE);
+	if (stats_2 == NULL) {
+		return NULL;
+	}
+	stats = malloc(sizeof(struct qb_ipcs_connection_stats_3));
+	if (stats == NULL) {
+		free(stats_2);
+		return NULL;
+	}
+	memcpy(stats, &c->stats, sizeof(struct qb_ipcs_connection_stats_3));
+	stats->event_q_length = stats_2->event_q_length;
+	free(stats_2);
+
+	if (clear_after_read) {
+		memset(&c->stats, 0, sizeof(c->stats));
 		c->stats.client_pid = c->pid;
 	}
 	return stats;
@@ -944,6 +1675,173 @@ qb_ipcs_stats_get(struct qb_ipcs_service * s,
 	return 0;
 }
 
+int32_t
+qb_ipcs_stats_get_2(struct qb_ipcs_service *s,
+		    struct qb_ipcs_stats_2 *stats, int32_t clear_after_read)
+{
+	uint32_t active;
+
+	if (s == NULL || stats == NULL) {
+		return -EINVAL;
+	}
+	memcpy(stats, &s->stats, sizeof(struct qb_ipcs_stats_2));
+	if (clear_after_read) {
+		active = s->stats.active_connections;
+		memset(&s->stats, 0, sizeof(s->stats));
+		s->stats.active_connections = active;
+	}
+	return 0;
+}
+
+int32_t
+qb_ipcs_msg_handlers_set(struct qb_ipcs_service *s,
+			 const struct qb_ipcs_msg_handler *handlers,
+			 uint32_t num_handlers)
+{
+	struct qb_ipcs_msg_entry *table;
+	struct qb_ipcs_msg_entry *e;
+	int32_t lo = INT32_MAX;
+	int32_t hi = QB_IPC_MSG_USER_START;
+	uint32_t i;
+
+	if (s == NULL || (handlers == NULL && num_handlers > 0)) {
+		return -EINVAL;
+	}
+	/* qb_ipcs_run() has set up the transport */
+	if (s->funcs.connect) {
+		return -EBUSY;
+	}
+	for (i = 0; i < num_handlers; i++) {
+		if (handlers[i].id < QB_IPC_MSG_USER_START ||
+		    handlers[i].fn == NULL ||
+		    (handlers[i].max_size &&
+		     handlers[i].max_size < handlers[i].min_size)) {
+			return -EINVAL;
+		}
+		lo = QB_MIN(lo, handlers[i].id);
+		hi = QB_MAX(hi, handlers[i].id);
+	}
+	if (num_handlers > 0 &&
+	    (int64_t)hi - lo >= QB_IPCS_MSG_HANDLERS_SPAN) {
+		return -E2BIG;
+	}
+
+	table = NULL;
+	if (num_handlers > 0) {
+		table = calloc(hi - lo + 1, sizeof(struct qb_ipcs_msg_entry));
+		if (table == NULL) {
+			return -ENOMEM;
+		}
+	}
+	for (i = 0; i < num_handlers; i++) {
+		e = &table[handlers[i].id - lo];
+		if (e->fn) {
+			free(table);
+			return -EEXIST;
+		}
+		e->fn = handlers[i].fn;
+		e->min_size = handlers[i].min_size;
+		e->max_size = handlers[i].max_size;
+	}
+
+	free(s->msg_table);
+	s->msg_table = table;
+	s->msg_id_base = num_handlers > 0 ? lo : 0;
+	s->msg_table_len = num_handlers > 0 ? hi - lo + 1 : 0;
+	return 0;
+}
+
+int32_t
+qb_ipcs_msg_stats_get(struct qb_ipcs_service *s, int32_t id,
+		      struct qb_ipcs_msg_stats *stats,
+		      int32_t clear_after_read)
+{
+	uint32_t i;
+
+	if (s == NULL || stats == NULL) {
+		return -EINVAL;
+	}
+	i = (uint32_t)id - (uint32_t)s->msg_id_base;
+	if (i >= s->msg_table_len || s->msg_table[i].fn == NULL) {
+		return -ENOENT;
+	}
+	memcpy(stats, &s->msg_table[i].stats, sizeof(struct qb_ipcs_msg_stats));
+	if (clear_after_read) {
+		memset(&s->msg_table[i].stats, 0,
+		       sizeof(struct qb_ipcs_msg_stats));
+	}
+	return 0;
+}
+
+static void
+_latency_histogram_add(struct qb_ipcs_latency_histogram *h, uint64_t ns)
+{
+	uint32_t i = 0;
+	uint64_t v = ns;
+
+	while (v > 1 && i < QB_IPCS_LATENCY_BUCKETS - 1) {
+		v >>= 1;
+		i++;
+	}
+	h->buckets[i]++;
+	h->count++;
+	h->total_ns += ns;
+	if (ns > h->max_ns) {
+		h->max_ns = ns;
+	}
+}
+
+void
+qb_ipcs_latency_add(struct qb_ipcs_connection *c,
+		    enum qb_ipcs_latency which, uint64_t ns)
+{
+	struct qb_ipcs_stats_2 *ss = &c->service->stats;
+
+	switch (which) {
+	case QB_IPCS_LATENCY_QUEUE:
+		_latency_histogram_add(&c->stats.queue_latency, ns);
+		_latency_histogram_add(&ss->queue_latency, ns);
+		break;
+	case QB_IPCS_LATENCY_PROCESS:
+		_latency_histogram_add(&c->stats.process_latency, ns);
+		_latency_histogram_add(&ss->process_latency, ns);
+		break;
+	case QB_IPCS_LATENCY_EVENT:
+		_latency_histogram_add(&c->stats.event_latency, ns);
+		_latency_histogram_add(&ss->event_latency, ns);
+		break;
+	case QB_IPCS_LATENCY_EVENT_QUEUE:
+		_latency_histogram_add(&c->stats.event_queue_latency, ns);
+		_latency_histogram_add(&ss->event_queue_latency, ns);
+		break;
+	}
+}
+
+uint64_t
+qb_ipcs_latency_percentile_get(const struct qb_ipcs_latency_histogram *h,
+			       float percentile)
+{
+	uint64_t wanted;
+	uint64_t seen = 0;
+	uint32_t i;
+
+	if (h == NULL || h->count == 0) {
+		return 0;
+	}
+	percentile = QB_MAX(QB_MIN(percentile, 100.0), 0.0);
+	wanted = (uint64_t)(h->count * (percentile / 100.0));
+	if (wanted == 0) {
+		wanted = 1;
+	}
+	for (i = 0; i < QB_IPCS_LATENCY_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= wanted) {
+			return QB_MIN((2ULL << i) - 1, h->max_ns);
+		}
+	}
+	return h->max_ns;
+}
+
 void
 qb_ipcs_connection_auth_set(qb_ipcs_connection_t *c, uid_t uid,
 			    gid_t gid, mode_t mode)
@@ -962,9 +1860,9 @@ qb_ipcs_connection_get_buffer_size(qb_ipcs_connection_t *c)
 		return -EINVAL;
 	}
 
-	/* request, response, and event shoud all have the same
-	 * buffer size allocated. It doesn't matter which we return
-	 * here. */
+	/* request, response, and event have the same buffer size
+	 * unless the client negotiated per-direction sizes, in which
+	 * case the response size is the one the caller cares about. */
 	return c->response.max_msg_size;
 }
 
@@ -975,3 +1873,11 @@ void qb_ipcs_enforce_buffer_size(qb_ipcs_service_t *s, uint32_t buf_size)
 	}
 	s->max_buffer_size = buf_size;
 }
+
+void qb_ipcs_large_msg_max_set(qb_ipcs_service_t *s, uint32_t max_size)
+{
+	if (s == NULL) {
+		return;
+	}
+	s->large_msg_max = max_size;
+}
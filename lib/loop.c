@@ -28,8 +28,8 @@
 
 static struct qb_loop *default_instance = NULL;
 
-static void
-qb_loop_run_level(struct qb_loop_level *level)
+static int32_t
+qb_loop_run_level(struct qb_loop_level *level, int32_t quantum)
 {
 	struct qb_loop_item *job;
 	int32_t processed = 0;
@@ -44,12 +44,75 @@ Ill_have_another:
 		level->todo--;
 		processed++;
 		if (level->l->stop_requested) {
-			return;
+			return processed;
 		}
-		if (processed < level->to_process) {
+		if (processed < quantum) {
 			goto Ill_have_another;
 		}
 	}
+	return processed;
+}
+
+/*
+ * Track how long each level's pending work waits for its turn: from the
+ * pass that finds it waiting until the pass that serves the level.
+ */
+static void
+qb_loop_level_served(struct qb_loop_level *level, int32_t processed,
+		     uint64_t now)
+{
+	uint64_t wait;
+
+	if (processed == 0) {
+		return;
+	}
+	level->dispatched += processed;
+	wait = now - level->waiting_since;
+	if (wait > level->wait_max) {
+		level->wait_max = wait;
+	}
+	level->waiting_since = (level->todo > 0) ? now : 0;
+}
+
+/*
+ * One pass over the levels, returns the number of items left over
+ */
+static int32_t
+qb_loop_run_levels(struct qb_loop *l)
+{
+	struct qb_loop_level *level;
+	int32_t remaining_todo = 0;
+	int32_t processed;
+	int32_t p;
+	uint64_t now = 0;
+
+	for (p = QB_LOOP_HIGH; p >= QB_LOOP_LOW; p--) {
+		level = &l->level[p];
+		if (level->todo > 0) {
+			if (now == 0) {
+				now = qb_util_nano_current_get();
+			}
+			if (level->waiting_since == 0) {
+				level->waiting_since = now;
+			}
+		}
+	}
+	if (now == 0) {
+		return 0;
+	}
+
+	for (p = QB_LOOP_HIGH; p >= QB_LOOP_LOW; p--) {
+		level = &l->level[p];
+		if (l->scheduler == QB_LOOP_SCHED_WEIGHTED || p >= l->p_stop) {
+			processed = qb_loop_run_level(level, level->to_process);
+			qb_loop_level_served(level, processed, now);
+			if (l->stop_requested) {
+				return 0;
+			}
+		}
+		remaining_todo += level->todo;
+	}
+	return remaining_todo;
 }
 
 void
@@ -93,6 +156,9 @@ qb_loop_create(void)
 		l->level[p].priority = p;
 		l->level[p].to_process = 4;
 		l->level[p].todo = 0;
+		l->level[p].dispatched = 0;
+		l->level[p].waiting_since = 0;
+		l->level[p].wait_max = 0;
 		l->level[p].l = l;
 
 		qb_list_init(&l->level[p].job_head);
@@ -100,10 +166,15 @@ qb_loop_create(void)
 	}
 
 	l->stop_requested = QB_FALSE;
+	l->scheduler = QB_LOOP_SCHED_ROTATE;
+	l->p_stop = QB_LOOP_LOW;
+	l->item_cache_max = QB_LOOP_ITEM_CACHE_MAX_DEFAULT;
+	l->timer_hires = QB_FALSE;
 	l->timer_source = qb_loop_timer_create(l);
 	l->job_source = qb_loop_jobs_create(l);
 	l->fd_source = qb_loop_poll_create(l);
 	l->signal_source = qb_loop_signals_create(l);
+	(void)qb_loop_jobs_threadsafe_init(l);
 
 	if (default_instance == NULL) {
 		default_instance = l;
@@ -125,6 +196,87 @@ qb_loop_destroy(struct qb_loop *l)
 	free(l);
 }
 
+int32_t
+qb_loop_item_cache_max_set(struct qb_loop *lp, uint32_t max)
+{
+	struct qb_loop *l = lp;
+
+	if (l == NULL) {
+		l = qb_loop_default_get();
+	}
+	if (l == NULL) {
+		return -EINVAL;
+	}
+	l->item_cache_max = max;
+	qb_loop_jobs_cache_trim(l);
+	qb_loop_timer_cache_trim(l);
+	return 0;
+}
+
+int32_t
+qb_loop_scheduler_set(struct qb_loop *lp, enum qb_loop_scheduler scheduler)
+{
+	struct qb_loop *l = lp;
+
+	if (l == NULL) {
+		l = qb_loop_default_get();
+	}
+	if (l == NULL) {
+		return -EINVAL;
+	}
+	if (scheduler != QB_LOOP_SCHED_ROTATE &&
+	    scheduler != QB_LOOP_SCHED_WEIGHTED) {
+		return -EINVAL;
+	}
+	l->scheduler = scheduler;
+	return 0;
+}
+
+int32_t
+qb_loop_level_quantum_set(struct qb_loop *lp, enum qb_loop_priority p,
+			  uint32_t quantum)
+{
+	struct qb_loop *l = lp;
+
+	if (l == NULL) {
+		l = qb_loop_default_get();
+	}
+	if (l == NULL || p < QB_LOOP_LOW || p > QB_LOOP_HIGH ||
+	    quantum == 0 || quantum > INT32_MAX) {
+		return -EINVAL;
+	}
+	l->level[p].to_process = quantum;
+	return 0;
+}
+
+int32_t
+qb_loop_stats_get(struct qb_loop *lp, struct qb_loop_stats *stats)
+{
+	struct qb_loop *l = lp;
+	uint64_t now;
+	int32_t p;
+
+	if (l == NULL) {
+		l = qb_loop_default_get();
+	}
+	if (l == NULL || stats == NULL) {
+		return -EINVAL;
+	}
+	memset(stats, 0, sizeof(struct qb_loop_stats));
+	stats->item_cache_max = l->item_cache_max;
+	now = qb_util_nano_current_get();
+	for (p = QB_LOOP_LOW; p <= QB_LOOP_HIGH; p++) {
+		stats->level_dispatched[p] = l->level[p].dispatched;
+		if (l->level[p].waiting_since) {
+			stats->level_wait_ns[p] = now - l->level[p].waiting_since;
+		}
+		stats->level_wait_max_ns[p] = l->level[p].wait_max;
+	}
+	qb_loop_jobs_stats_get(l, stats);
+	qb_loop_timer_stats_get(l, stats);
+	return 0;
+}
+
 void
 qb_loop_stop(struct qb_loop *l)
 {
@@ -139,27 +291,29 @@ qb_loop_stop(struct qb_loop *l)
 void
 qb_loop_run(struct qb_loop *lp)
 {
-	int32_t p;
-	int32_t p_stop = QB_LOOP_LOW;
 	int32_t rc;
 	int32_t remaining_todo = 0;
 	int32_t job_todo;
 	int32_t timer_todo;
 	int32_t ms_timeout;
+	int64_t ns_timeout = -1;
+	int32_t hires;
 	struct qb_loop *l = lp;
 
 	if (l == NULL) {
 		l = default_instance;
 	}
 	l->stop_requested = QB_FALSE;
+	l->p_stop = QB_LOOP_LOW;
 
 	do {
-		if (p_stop == QB_LOOP_LOW) {
-			p_stop = QB_LOOP_HIGH;
+		if (l->p_stop == QB_LOOP_LOW) {
+			l->p_stop = QB_LOOP_HIGH;
 		} else {
-			p_stop--;
+			l->p_stop--;
 		}
 
+		hires = QB_FALSE;
 		job_todo = 0;
 		if (l->job_source && l->job_source->poll) {
 			rc = l->job_source->poll(l->job_source, 0);
@@ -192,6 +346,20 @@ qb_loop_run(struct qb_loop *lp)
 			 * control if someone keeps adding them.
 			 */
 			ms_timeout = 50;
+			if (l->timer_source && l->timer_hires) {
+				/*
+				 * but don't hold up a sub-ms timer for it
+				 */
+				ns_timeout = qb_loop_timer_nsec_duration_to_expire(l->timer_source);
+				if (ns_timeout < 0 ||
+				    ns_timeout > ms_timeout * QB_TIME_NS_IN_MSEC) {
+					ns_timeout = ms_timeout * QB_TIME_NS_IN_MSEC;
+				}
+				hires = QB_TRUE;
+			}
+		} else if (l->timer_source && l->timer_hires) {
+			ns_timeout = qb_loop_timer_nsec_duration_to_expire(l->timer_source);
+			hires = QB_TRUE;
 		} else {
 			if (l->timer_source) {
 				ms_timeout = qb_loop_timer_msec_duration_to_expire(l->timer_source);
@@ -199,21 +367,16 @@ qb_loop_run(struct qb_loop *lp)
 				ms_timeout = -1;
 			}
 		}
-		rc = l->fd_source->poll(l->fd_source, ms_timeout);
+		if (hires) {
+			rc = qb_loop_poll_wait_ns(l, ns_timeout);
+		} else {
+			rc = l->fd_source->poll(l->fd_source, ms_timeout);
+		}
 		if (rc < 0) {
 			errno = -rc;
 			qb_util_perror(LOG_WARNING, "fd->poll");
 		}
 
-		remaining_todo = 0;
-		for (p = QB_LOOP_HIGH; p >= QB_LOOP_LOW; p--) {
-			if (p >= p_stop) {
-				qb_loop_run_level(&l->level[p]);
-				if (l->stop_requested) {
-					return;
-				}
-			}
-			remaining_todo += l->level[p].todo;
-		}
+		remaining_todo = qb_loop_run_levels(l);
 	} while (!l->stop_requested);
 }
@@ -32,6 +32,7 @@ enum qb_loop_type {
 	QB_LOOP_JOB,
 	QB_LOOP_TIMER,
 	QB_LOOP_SIG,
+	QB_LOOP_INTERNAL,	/* qb_loop_poll_internal_add(), never dispatched */
 };
 
 struct qb_loop_item {
@@ -43,8 +44,11 @@ struct qb_loop_item {
 
 struct qb_loop_level {
 	enum qb_loop_priority priority;
-	int32_t to_process;
+	int32_t to_process;	/* quantum: most jobs run per pass */
 	int32_t todo;
+	uint64_t dispatched;
+	uint64_t waiting_since;	/* 0 when not waiting to be served */
+	uint64_t wait_max;
 	struct qb_list_head wait_head;
 	struct qb_list_head job_head;
 	struct qb_loop *l;
@@ -57,13 +61,23 @@ struct qb_loop_source {
 	int32_t (*poll)(struct qb_loop_source* s, int32_t ms_timeout);
 };
 
+/* default cap on each of the job and timer item caches */
+#define QB_LOOP_ITEM_CACHE_MAX_DEFAULT 1024
+
 struct qb_loop {
 	struct qb_loop_level level[3];
 	int32_t stop_requested;
+	enum qb_loop_scheduler scheduler;
+	int32_t p_stop;		/* QB_LOOP_SCHED_ROTATE: lowest level to run */
+	uint32_t item_cache_max;
+	int32_t timer_hires;	/* qb_loop_timer_hires_set() */
 	struct qb_loop_source * timer_source;
 	struct qb_loop_source * job_source;
 	struct qb_loop_source * fd_source;
 	struct qb_loop_source * signal_source;
+	/* qb_loop_job_add_threadsafe(): pushed by any thread, newest first */
+	volatile void *ts_jobs;
+	int32_t ts_wake_fds[2];	/* the same eventfd twice, or a pipe */
 };
 
 struct qb_loop *
@@ -81,8 +95,18 @@ qb_loop_poll_create(struct qb_loop *l);
 struct qb_loop_source *
 qb_loop_signals_create(struct qb_loop *l);
 
+int32_t qb_loop_jobs_threadsafe_init(struct qb_loop *l);
+
 void qb_loop_jobs_destroy(struct qb_loop *l);
 
+void qb_loop_jobs_cache_trim(struct qb_loop *l);
+
+void qb_loop_jobs_stats_get(struct qb_loop *l, struct qb_loop_stats *stats);
+
+void qb_loop_timer_cache_trim(struct qb_loop *l);
+
+void qb_loop_timer_stats_get(struct qb_loop *l, struct qb_loop_stats *stats);
+
 void qb_loop_timer_destroy(struct qb_loop *l);
 
 void qb_loop_poll_destroy(struct qb_loop *l);
@@ -91,6 +115,10 @@ void qb_loop_signals_destroy(struct qb_loop *l);
 
 int32_t qb_loop_timer_msec_duration_to_expire(struct qb_loop_source *timer_source);
 
+int64_t qb_loop_timer_nsec_duration_to_expire(struct qb_loop_source *timer_source);
+
+int32_t qb_loop_poll_wait_ns(struct qb_loop *l, int64_t ns_timeout);
+
 void qb_loop_level_item_add(struct qb_loop_level *level,
 			    struct qb_loop_item *job);
 
@@ -20,24 +20,76 @@
  */
 #include "os_base.h"
 
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif /* HAVE_SYS_EVENTFD_H */
+
 #include <qb/qbdefs.h>
 #include <qb/qblist.h>
 #include <qb/qbloop.h>
+#include <qb/qbatomic.h>
 #include "loop_int.h"
+#include "loop_poll_int.h"
 #include "util_int.h"
 
 struct qb_loop_job {
 	struct qb_loop_item item;
 	qb_loop_job_dispatch_fn dispatch_fn;
+	/* qb_loop_job_add_threadsafe() only */
+	enum qb_loop_priority p;
+	struct qb_loop_job *ts_next;	/* also links the item cache */
+};
+
+struct qb_job_source {
+	struct qb_loop_source s;
+	struct qb_loop_job *cache;
+	uint32_t cached;
+	uint64_t allocs;
+	uint64_t reuses;
 };
 
+/*
+ * Jobs are recycled through a per-loop cache of up to item_cache_max
+ * items, instead of a malloc()/free() pair per job.  Only the loop
+ * thread uses the cache.
+ */
+static struct qb_loop_job *
+_job_alloc(struct qb_job_source *js)
+{
+	struct qb_loop_job *job = js->cache;
+
+	if (job) {
+		js->cache = job->ts_next;
+		js->cached--;
+		js->reuses++;
+		return job;
+	}
+	job = malloc(sizeof(struct qb_loop_job));
+	if (job) {
+		js->allocs++;
+	}
+	return job;
+}
+
+static void
+_job_release(struct qb_job_source *js, struct qb_loop_job *job)
+{
+	if (js->cached >= js->s.l->item_cache_max) {
+		free(job);
+		return;
+	}
+	job->ts_next = js->cache;
+	js->cache = job;
+	js->cached++;
+}
+
 static void
 job_dispatch(struct qb_loop_item *item, enum qb_loop_priority p)
 {
 	struct qb_loop_job *job = qb_list_entry(item, struct qb_loop_job, item);
 
 	job->dispatch_fn(job->item.user_data);
-	free(job);
+	_job_release((struct qb_job_source *)item->source, job);
 
 	/*
 	 * this is a one-shot so don't re-add
@@ -70,20 +122,162 @@ get_more_jobs(struct qb_loop_source *s, int32_t ms_timeout)
 struct qb_loop_source *
 qb_loop_jobs_create(struct qb_loop *l)
 {
-	struct qb_loop_source *s = malloc(sizeof(struct qb_loop_source));
-	if (s == NULL) {
+	struct qb_job_source *js = malloc(sizeof(struct qb_job_source));
+	if (js == NULL) {
 		return NULL;
 	}
-	s->l = l;
-	s->dispatch_and_take_back = job_dispatch;
-	s->poll = get_more_jobs;
+	js->s.l = l;
+	js->s.dispatch_and_take_back = job_dispatch;
+	js->s.poll = get_more_jobs;
+	js->cache = NULL;
+	js->cached = 0;
+	js->allocs = 0;
+	js->reuses = 0;
+
+	return (struct qb_loop_source *)js;
+}
+
+void
+qb_loop_jobs_cache_trim(struct qb_loop *l)
+{
+	struct qb_job_source *js = (struct qb_job_source *)l->job_source;
+	struct qb_loop_job *job;
+
+	while (js->cached > l->item_cache_max) {
+		job = js->cache;
+		js->cache = job->ts_next;
+		js->cached--;
+		free(job);
+	}
+}
+
+void
+qb_loop_jobs_stats_get(struct qb_loop *l, struct qb_loop_stats *stats)
+{
+	struct qb_job_source *js = (struct qb_job_source *)l->job_source;
+
+	stats->job_allocs = js->allocs;
+	stats->job_reuses = js->reuses;
+	stats->job_cached = js->cached;
+}
+
+/*
+ * Jobs from other threads are pushed onto a lock-free stack.  Only the
+ * loop thread takes them off, always all at once, so there is no ABA
+ * problem to worry about.  Whoever pushes onto an empty stack wakes the
+ * loop up; the loop clears the wakeup before emptying the stack, so a
+ * push can't get lost in between.
+ */
+static struct qb_loop_job *
+_threadsafe_jobs_take(struct qb_loop *l)
+{
+	struct qb_loop_job *head;
+
+	do {
+		head = qb_atomic_pointer_get(&l->ts_jobs);
+	} while (head != NULL &&
+		 !qb_atomic_pointer_compare_and_exchange(&l->ts_jobs,
+							 head, NULL));
+	return head;
+}
+
+static void
+_threadsafe_wake_clear(struct qb_loop *l)
+{
+	char buf[64];
+
+	while (read(l->ts_wake_fds[0], buf, sizeof(buf)) > 0) {
+		/* an eventfd is cleared by a single read */
+		if (l->ts_wake_fds[0] == l->ts_wake_fds[1]) {
+			break;
+		}
+	}
+}
+
+static int32_t
+_threadsafe_jobs_add_to_jobs(struct qb_loop *l, struct qb_poll_entry *pe)
+{
+	struct qb_loop_job *job;
+	struct qb_loop_job *fifo = NULL;
+	struct qb_loop_job *next;
+	int32_t new_jobs = 0;
+
+	pe->ufd.revents = 0;
+	_threadsafe_wake_clear(l);
+
+	/* newest first, so turn them around */
+	for (job = _threadsafe_jobs_take(l); job; job = next) {
+		next = job->ts_next;
+		job->ts_next = fifo;
+		fifo = job;
+	}
+	for (job = fifo; job; job = next) {
+		next = job->ts_next;
+		qb_loop_level_item_add(&l->level[job->p], &job->item);
+		new_jobs++;
+	}
+	return new_jobs;
+}
+
+int32_t
+qb_loop_jobs_threadsafe_init(struct qb_loop *l)
+{
+	int32_t res;
 
-	return s;
+	l->ts_jobs = NULL;
+#ifdef HAVE_SYS_EVENTFD_H
+	l->ts_wake_fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	l->ts_wake_fds[1] = l->ts_wake_fds[0];
+	if (l->ts_wake_fds[0] < 0) {
+		res = -errno;
+		goto error;
+	}
+#else
+	if (pipe(l->ts_wake_fds) != 0) {
+		res = -errno;
+		l->ts_wake_fds[0] = -1;
+		l->ts_wake_fds[1] = -1;
+		goto error;
+	}
+	(void)qb_sys_fd_nonblock_cloexec_set(l->ts_wake_fds[0]);
+	(void)qb_sys_fd_nonblock_cloexec_set(l->ts_wake_fds[1]);
+#endif /* HAVE_SYS_EVENTFD_H */
+
+	res = qb_loop_poll_internal_add(l, l->ts_wake_fds[0],
+					_threadsafe_jobs_add_to_jobs);
+	if (res == 0) {
+		return 0;
+	}
+	close(l->ts_wake_fds[0]);
+	if (l->ts_wake_fds[1] != l->ts_wake_fds[0]) {
+		close(l->ts_wake_fds[1]);
+	}
+	l->ts_wake_fds[0] = -1;
+	l->ts_wake_fds[1] = -1;
+error:
+	errno = -res;
+	qb_util_perror(LOG_ERR, "can't wake the loop from other threads");
+	return res;
 }
 
 void
 qb_loop_jobs_destroy(struct qb_loop *l)
 {
+	struct qb_loop_job *job;
+	struct qb_loop_job *next;
+
+	for (job = _threadsafe_jobs_take(l); job; job = next) {
+		next = job->ts_next;
+		free(job);
+	}
+	l->item_cache_max = 0;
+	qb_loop_jobs_cache_trim(l);
+	if (l->ts_wake_fds[0] >= 0) {
+		close(l->ts_wake_fds[0]);
+	}
+	if (l->ts_wake_fds[1] >= 0 && l->ts_wake_fds[1] != l->ts_wake_fds[0]) {
+		close(l->ts_wake_fds[1]);
+	}
 	free(l->job_source);
 }
 
@@ -104,7 +298,7 @@ qb_loop_job_add(struct qb_loop *lp,
 	if (p < QB_LOOP_LOW || p > QB_LOOP_HIGH) {
 		return -EINVAL;
 	}
-	job = malloc(sizeof(struct qb_loop_job));
+	job = _job_alloc((struct qb_job_source *)l->job_source);
 	if (job == NULL) {
 		return -ENOMEM;
 	}
@@ -120,6 +314,63 @@ qb_loop_job_add(struct qb_loop *lp,
 	return 0;
 }
 
+int32_t
+qb_loop_job_add_threadsafe(struct qb_loop *lp,
+			   enum qb_loop_priority p,
+			   void *data, qb_loop_job_dispatch_fn dispatch_fn)
+{
+	struct qb_loop_job *job;
+	struct qb_loop_job *head;
+	struct qb_loop *l = lp;
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif /* HAVE_SYS_EVENTFD_H */
+
+	if (l == NULL) {
+		l = qb_loop_default_get();
+	}
+	if (l == NULL || dispatch_fn == NULL) {
+		return -EINVAL;
+	}
+	if (p < QB_LOOP_LOW || p > QB_LOOP_HIGH) {
+		return -EINVAL;
+	}
+	if (l->ts_wake_fds[1] < 0) {
+		return -ENOTSUP;
+	}
+	job = malloc(sizeof(struct qb_loop_job));
+	if (job == NULL) {
+		return -ENOMEM;
+	}
+
+	job->dispatch_fn = dispatch_fn;
+	job->item.user_data = data;
+	job->item.source = l->job_source;
+	job->item.type = QB_LOOP_JOB;
+	job->p = p;
+	qb_list_init(&job->item.list);
+
+	do {
+		head = qb_atomic_pointer_get(&l->ts_jobs);
+		job->ts_next = head;
+	} while (!qb_atomic_pointer_compare_and_exchange(&l->ts_jobs,
+							 head, job));
+
+	/*
+	 * The loop already has a wakeup coming for a non-empty stack.  The
+	 * job is queued either way and runs the next time the loop wakes
+	 * up, so a failed wakeup is only worth a log message.
+	 */
+	if (head == NULL &&
+	    write(l->ts_wake_fds[1], &one, sizeof(one)) < 0 &&
+	    errno != EAGAIN) {
+		qb_util_perror(LOG_WARNING, "can't wake the loop for a job");
+	}
+	return 0;
+}
+
 int32_t
 qb_loop_job_del(struct qb_loop *lp,
 		enum qb_loop_priority p,
@@ -145,7 +396,7 @@ qb_loop_job_del(struct qb_loop *lp,
 		    job->item.user_data == data &&
 		    job->item.type == QB_LOOP_JOB) {
 			qb_list_del(&job->item.list);
-			free(job);
+			_job_release((struct qb_job_source *)l->job_source, job);
 			return 0;
 		}
 	}
@@ -159,6 +410,7 @@ qb_loop_job_del(struct qb_loop *lp,
 		if (job->dispatch_fn == dispatch_fn &&
 		    job->item.user_data == data) {
 			qb_loop_level_item_del(&l->level[p], item);
+			_job_release((struct qb_job_source *)l->job_source, job);
 			qb_util_log(LOG_DEBUG, "deleting job in JOBLIST");
 			return 0;
 		}
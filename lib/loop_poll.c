@@ -94,6 +94,7 @@ _poll_dispatch_and_take_back_(struct qb_loop_item *item,
 			      enum qb_loop_priority p)
 {
 	struct qb_poll_entry *pe = (struct qb_poll_entry *)item;
+	struct qb_poll_source *s = (struct qb_poll_source *)item->source;
 	int32_t res;
 #ifdef DEBUG_DISPATCH_TIME
 	uint64_t start;
@@ -110,6 +111,14 @@ _poll_dispatch_and_take_back_(struct qb_loop_item *item,
 				   pe->ufd.revents,
 				   pe->item.user_data);
 	if (res < 0) {
+		if (pe->state != QB_POLL_ENTRY_DELETED) {
+			/*
+			 * unregister it like qb_loop_poll_del() would, or the
+			 * driver keeps reporting a descriptor that is still
+			 * ready (or keeps it pinned, for io_uring)
+			 */
+			(void)s->driver.del(s, pe, pe->ufd.fd, pe->install_pos);
+		}
 		_poll_entry_mark_deleted_(pe);
 	} else if (pe->state != QB_POLL_ENTRY_DELETED) {
 		pe->state = QB_POLL_ENTRY_ACTIVE;
@@ -169,6 +178,7 @@ qb_poll_fds_usage_check_(struct qb_poll_source *s)
 		}
 		if (pe->state == QB_POLL_ENTRY_DELETED) {
 			_poll_entry_empty_(pe);
+			(void)qb_array_free_slot_put(s->poll_entries, i);
 		}
 	}
 
@@ -208,8 +218,19 @@ qb_loop_poll_create(struct qb_loop *l)
 	s->poll_entry_count = 0;
 	s->low_fds_event_fn = NULL;
 	s->not_enough_fds = QB_FALSE;
+	s->driver_data = NULL;
+	s->driver.poll_ns = NULL;
 
 #ifdef USE_EPOLL
+#ifdef HAVE_IO_URING
+	/*
+	 * io_uring may be missing, too old or disabled by a seccomp
+	 * filter or the io_uring_disabled sysctl; epoll always works.
+	 */
+	if (qb_uring_init(s) == 0) {
+		return (struct qb_loop_source *)s;
+	}
+#endif /* HAVE_IO_URING */
 	(void)qb_epoll_init(s);
 #endif
 #ifdef USE_KQUEUE
@@ -233,6 +254,28 @@ qb_loop_poll_destroy(struct qb_loop *l)
 	free(s);
 }
 
+int32_t
+qb_loop_poll_wait_ns(struct qb_loop *l, int64_t ns_timeout)
+{
+	struct qb_poll_source *s = (struct qb_poll_source *)l->fd_source;
+	int64_t ms_timeout = -1;
+
+	if (s->driver.poll_ns) {
+		return s->driver.poll_ns(s, ns_timeout);
+	}
+	if (ns_timeout >= 0) {
+		/*
+		 * round up, waking early would only find nothing to expire
+		 */
+		ms_timeout = (ns_timeout + QB_TIME_NS_IN_MSEC - 1) /
+		    QB_TIME_NS_IN_MSEC;
+		if (ms_timeout > INT32_MAX) {
+			ms_timeout = INT32_MAX;
+		}
+	}
+	return s->s.poll(&s->s, (int32_t)ms_timeout);
+}
+
 int32_t
 qb_loop_poll_low_fds_event_set(struct qb_loop *l,
 			       qb_loop_poll_low_fds_event_fn fn)
@@ -246,22 +289,11 @@ qb_loop_poll_low_fds_event_set(struct qb_loop *l,
 static int32_t
 _get_empty_array_position_(struct qb_poll_source *s)
 {
-	int32_t found = QB_FALSE;
-	uint32_t install_pos;
+	int32_t install_pos;
 	int32_t res = 0;
-	struct qb_poll_entry *pe;
-
-	for (install_pos = 0;
-	     install_pos < s->poll_entry_count; install_pos++) {
-		assert(qb_array_index
-		       (s->poll_entries, install_pos, (void **)&pe) == 0);
-		if (pe->state == QB_POLL_ENTRY_EMPTY) {
-			found = QB_TRUE;
-			break;
-		}
-	}
 
-	if (found == QB_FALSE) {
+	install_pos = qb_array_free_slot_get(s->poll_entries);
+	if (install_pos < 0) {
 #ifdef USE_POLL
 		struct pollfd *ufds;
 		int32_t new_size = (s->poll_entry_count + 1) * sizeof(struct pollfd);
@@ -291,7 +323,7 @@ _poll_add_(struct qb_loop *l,
 	   int32_t fd, int32_t events, void *data, struct qb_poll_entry **pe_pt)
 {
 	struct qb_poll_entry *pe;
-	uint32_t install_pos;
+	int32_t install_pos;
 	int32_t res = 0;
 	struct qb_poll_source *s;
 
@@ -302,12 +334,17 @@ _poll_add_(struct qb_loop *l,
 	s = (struct qb_poll_source *)l->fd_source;
 
 	install_pos = _get_empty_array_position_(s);
+	if (install_pos < 0) {
+		return install_pos;
+	}
 
 	assert(qb_array_index(s->poll_entries, install_pos, (void **)&pe) == 0);
 	pe->state = QB_POLL_ENTRY_ACTIVE;
 	pe->install_pos = install_pos;
 	_poll_entry_check_generate_(pe);
 	pe->ufd.fd = fd;
+	pe->edge = (events & QB_LOOP_POLL_EDGE_TRIGGERED) ? QB_TRUE : QB_FALSE;
+	events &= ~QB_LOOP_POLL_EDGE_TRIGGERED;
 	pe->ufd.events = events;
 	pe->ufd.revents = 0;
 	pe->item.user_data = data;
@@ -320,6 +357,7 @@ _poll_add_(struct qb_loop *l,
 		return 0;
 	} else {
 		pe->state = QB_POLL_ENTRY_EMPTY;
+		(void)qb_array_free_slot_put(s->poll_entries, install_pos);
 		return res;
 	}
 }
@@ -333,6 +371,28 @@ _qb_poll_add_to_jobs_(struct qb_loop *l, struct qb_poll_entry *pe)
 	return 1;
 }
 
+/*
+ * Watch a descriptor for another loop source: add_to_jobs() is called
+ * when it is readable and queues whatever it wants; the entry itself is
+ * never dispatched and qb_loop_poll_del() doesn't see it.
+ */
+int32_t
+qb_loop_poll_internal_add(struct qb_loop *l, int32_t fd,
+			  qb_poll_add_to_jobs_fn add_to_jobs)
+{
+	struct qb_poll_entry *pe;
+	int32_t res;
+
+	res = _poll_add_(l, QB_LOOP_HIGH, fd, POLLIN, NULL, &pe);
+	if (res != 0) {
+		return res;
+	}
+	pe->poll_dispatch_fn = NULL;
+	pe->item.type = QB_LOOP_INTERNAL;
+	pe->add_to_jobs = add_to_jobs;
+	return 0;
+}
+
 int32_t
 qb_loop_poll_add(struct qb_loop * lp,
 		 enum qb_loop_priority p,
@@ -380,6 +440,7 @@ qb_loop_poll_mod(struct qb_loop * lp,
 {
 	uint32_t i;
 	int32_t res = 0;
+	int32_t edge;
 	struct qb_poll_entry *pe;
 	struct qb_poll_source *s;
 	struct qb_loop *l = lp;
@@ -388,6 +449,8 @@ qb_loop_poll_mod(struct qb_loop * lp,
 		l = qb_loop_default_get();
 	}
 	s = (struct qb_poll_source *)l->fd_source;
+	edge = (events & QB_LOOP_POLL_EDGE_TRIGGERED) ? QB_TRUE : QB_FALSE;
+	events &= ~QB_LOOP_POLL_EDGE_TRIGGERED;
 
 	/*
 	 * Find file descriptor to modify events and dispatch function
@@ -405,7 +468,8 @@ qb_loop_poll_mod(struct qb_loop * lp,
 		pe->poll_dispatch_fn = dispatch_fn;
 		pe->item.user_data = data;
 		pe->p = p;
-		if (pe->ufd.events != events) {
+		if (pe->ufd.events != events || pe->edge != edge) {
+			pe->edge = edge;
 			res = s->driver.mod(s, pe, fd, events);
 			pe->ufd.events = events;
 		}
@@ -28,8 +28,29 @@
 int epoll_create1(int flags);
 #endif /* workaround a set of sparc and alpha broken headers */
 #endif /* HAVE_SYS_EPOLL_H */
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif /* HAVE_SYS_TIMERFD_H */
 
-#define MAX_EVENTS 12
+/*
+ * epoll_wait() batch size: doubled whenever a wait fills the whole
+ * batch, halved again after EVENTS_SHRINK_AFTER waits in a row that
+ * used less than a quarter of it.
+ */
+#define EVENTS_MIN 12
+#define EVENTS_MAX 1024
+#define EVENTS_SHRINK_AFTER 64
+
+/* epoll data of the timerfd, never a valid poll handle */
+#define EPOLL_TIMERFD_DATA UINT64_MAX
+
+struct qb_epoll {
+	struct epoll_event *events;
+	int32_t max_events;
+	int32_t underused;
+	int32_t no_pwait2;
+	int32_t timerfd;
+};
 
 static int32_t
 _poll_to_epoll_event_(int32_t event)
@@ -70,10 +91,52 @@ _epoll_to_poll_event_(int32_t event)
 static void
 _fini(struct qb_poll_source *s)
 {
+	struct qb_epoll *e = s->driver_data;
+
 	if (s->epollfd != -1) {
 		close(s->epollfd);
 		s->epollfd = -1;
 	}
+	if (e) {
+		if (e->timerfd != -1) {
+			close(e->timerfd);
+		}
+		free(e->events);
+		free(e);
+		s->driver_data = NULL;
+	}
+}
+
+static void
+_events_resize_(struct qb_epoll *e, int32_t max_events)
+{
+	struct epoll_event *events;
+
+	events = realloc(e->events, max_events * sizeof(struct epoll_event));
+	if (events == NULL) {
+		return;
+	}
+	e->events = events;
+	e->max_events = max_events;
+}
+
+static void
+_events_adapt_(struct qb_epoll *e, int32_t event_count)
+{
+	if (event_count == e->max_events) {
+		e->underused = 0;
+		if (e->max_events < EVENTS_MAX) {
+			_events_resize_(e, QB_MIN(e->max_events * 2, EVENTS_MAX));
+		}
+	} else if (event_count < e->max_events / 4 &&
+		   e->max_events > EVENTS_MIN) {
+		if (++e->underused >= EVENTS_SHRINK_AFTER) {
+			e->underused = 0;
+			_events_resize_(e, QB_MAX(e->max_events / 2, EVENTS_MIN));
+		}
+	} else {
+		e->underused = 0;
+	}
 }
 
 static int32_t
@@ -83,6 +146,9 @@ _add(struct qb_poll_source *s, struct qb_poll_entry *pe, int32_t fd, int32_t eve
 	int32_t res = 0;
 
 	ev.events = _poll_to_epoll_event_(events);
+	if (pe->edge) {
+		ev.events |= EPOLLET;
+	}
 	ev.data.u64 = (((uint64_t) (pe->check)) << 32) | pe->install_pos;
 	if (epoll_ctl(s->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
 		res = -errno;
@@ -99,6 +165,9 @@ _mod(struct qb_poll_source *s, struct qb_poll_entry *pe, int32_t fd, int32_t eve
 	int32_t res = 0;
 
 	ev.events = _poll_to_epoll_event_(events);
+	if (pe->edge) {
+		ev.events |= EPOLLET;
+	}
 	ev.data.u64 = (((uint64_t) (pe->check)) << 32) | pe->install_pos;
 	if (epoll_ctl(s->epollfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
 		res = -errno;
@@ -139,35 +208,103 @@ _poll_entry_from_handle_(struct qb_poll_source *s,
 	return 0;
 }
 
+#ifdef HAVE_SYS_TIMERFD_H
 static int32_t
-_poll_and_add_to_jobs_(struct qb_loop_source *src, int32_t ms_timeout)
+_timerfd_arm_(struct qb_poll_source *s, struct qb_epoll *e, int64_t ns_timeout)
 {
-	int32_t i;
-	int32_t res;
-	int32_t event_count;
-	int32_t new_jobs = 0;
-	struct qb_poll_entry *pe = NULL;
-	struct qb_poll_source *s = (struct qb_poll_source *)src;
-	struct epoll_event events[MAX_EVENTS];
-
-	qb_poll_fds_usage_check_(s);
+	struct itimerspec its;
+	struct epoll_event ev;
 
-retry_poll:
+	if (e->timerfd == -1) {
+		e->timerfd = timerfd_create(CLOCK_MONOTONIC,
+					    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (e->timerfd == -1) {
+			return -errno;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u64 = EPOLL_TIMERFD_DATA;
+		if (epoll_ctl(s->epollfd, EPOLL_CTL_ADD, e->timerfd, &ev) == -1) {
+			close(e->timerfd);
+			e->timerfd = -1;
+			return -errno;
+		}
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns_timeout / QB_TIME_NS_IN_SEC;
+	its.it_value.tv_nsec = ns_timeout % QB_TIME_NS_IN_SEC;
+	if (timerfd_settime(e->timerfd, 0, &its, NULL) == -1) {
+		return -errno;
+	}
+	return 0;
+}
+#endif /* HAVE_SYS_TIMERFD_H */
 
-	event_count = epoll_wait(s->epollfd, events, MAX_EVENTS, ms_timeout);
+/*
+ * epoll_wait() with a nanosecond timeout: epoll_pwait2() where the
+ * kernel has it (5.11), otherwise a timerfd in the set wakes us up and
+ * failing that the timeout is rounded up to milliseconds.
+ */
+static int32_t
+_epoll_wait_ns_(struct qb_poll_source *s, struct qb_epoll *e, int64_t ns_timeout)
+{
+	int64_t ms_timeout;
+#ifdef HAVE_EPOLL_PWAIT2
+	struct timespec ts;
+	int32_t res;
 
-	if (errno == EINTR && event_count == -1) {
-		goto retry_poll;
-	} else if (event_count == -1) {
-		return -errno;
+	if (!e->no_pwait2) {
+		ts.tv_sec = ns_timeout / QB_TIME_NS_IN_SEC;
+		ts.tv_nsec = ns_timeout % QB_TIME_NS_IN_SEC;
+		res = epoll_pwait2(s->epollfd, e->events, e->max_events,
+				   &ts, NULL);
+		if (res != -1 || errno != ENOSYS) {
+			return res;
+		}
+		e->no_pwait2 = QB_TRUE;
 	}
+#endif /* HAVE_EPOLL_PWAIT2 */
+	ms_timeout = (ns_timeout + QB_TIME_NS_IN_MSEC - 1) / QB_TIME_NS_IN_MSEC;
+	if (ms_timeout > INT32_MAX) {
+		ms_timeout = INT32_MAX;
+	}
+#ifdef HAVE_SYS_TIMERFD_H
+	if (ns_timeout % QB_TIME_NS_IN_MSEC != 0 &&
+	    _timerfd_arm_(s, e, ns_timeout) == 0) {
+		ms_timeout = -1;
+	}
+#endif /* HAVE_SYS_TIMERFD_H */
+	return epoll_wait(s->epollfd, e->events, e->max_events, ms_timeout);
+}
+
+static int32_t
+_events_to_jobs_(struct qb_poll_source *s, int32_t event_count)
+{
+	int32_t i;
+	int32_t res;
+	int32_t new_jobs = 0;
+	struct qb_poll_entry *pe = NULL;
+	struct qb_epoll *e = s->driver_data;
+	struct epoll_event *events = e->events;
+	uint64_t expirations;
 
 	for (i = 0; i < event_count; i++) {
+		if (events[i].data.u64 == EPOLL_TIMERFD_DATA) {
+			/*
+			 * only here to wake us up
+			 */
+			(void)read(e->timerfd, &expirations, sizeof(expirations));
+			continue;
+		}
 		res = _poll_entry_from_handle_(s, events[i].data.u64, &pe);
 		if (res != 0) {
-			qb_util_log(LOG_WARNING,
+			/*
+			 * stale event: the entry was deleted (and its slot
+			 * maybe reused) after epoll_wait() collected it, or
+			 * the descriptor is still registered under an old
+			 * handle through a dup()ed fd
+			 */
+			qb_util_log(LOG_DEBUG,
 				    "can't find poll entry for new event.");
-			usleep(100000);
 			continue;
 		}
 		if (pe->ufd.fd == -1 || pe->state == QB_POLL_ENTRY_DELETED) {
@@ -182,24 +319,92 @@ retry_poll:
 		pe->ufd.revents |= _epoll_to_poll_event_(events[i].events);
 
 		if (pe->state != QB_POLL_ENTRY_JOBLIST) {
-			new_jobs += pe->add_to_jobs(src->l, pe);
+			new_jobs += pe->add_to_jobs(s->s.l, pe);
 		}
 	}
+	_events_adapt_(e, event_count);
 
 	return new_jobs;
 }
 
+static int32_t
+_poll_and_add_to_jobs_(struct qb_loop_source *src, int32_t ms_timeout)
+{
+	int32_t event_count;
+	struct qb_poll_source *s = (struct qb_poll_source *)src;
+	struct qb_epoll *e = s->driver_data;
+
+	qb_poll_fds_usage_check_(s);
+
+retry_poll:
+
+	event_count = epoll_wait(s->epollfd, e->events, e->max_events, ms_timeout);
+
+	if (errno == EINTR && event_count == -1) {
+		goto retry_poll;
+	} else if (event_count == -1) {
+		return -errno;
+	}
+
+	return _events_to_jobs_(s, event_count);
+}
+
+static int32_t
+_poll_ns(struct qb_poll_source *s, int64_t ns_timeout)
+{
+	int32_t event_count;
+	struct qb_epoll *e = s->driver_data;
+
+	if (ns_timeout <= 0) {
+		return _poll_and_add_to_jobs_(&s->s, ns_timeout < 0 ? -1 : 0);
+	}
+
+	qb_poll_fds_usage_check_(s);
+
+retry_poll:
+
+	event_count = _epoll_wait_ns_(s, e, ns_timeout);
+
+	if (errno == EINTR && event_count == -1) {
+		goto retry_poll;
+	} else if (event_count == -1) {
+		return -errno;
+	}
+
+	return _events_to_jobs_(s, event_count);
+}
+
 int32_t
 qb_epoll_init(struct qb_poll_source *s)
 {
+	struct qb_epoll *e;
+	int32_t res;
+
+	e = calloc(1, sizeof(struct qb_epoll));
+	if (e == NULL) {
+		return -ENOMEM;
+	}
+	e->events = calloc(EVENTS_MIN, sizeof(struct epoll_event));
+	if (e->events == NULL) {
+		free(e);
+		return -ENOMEM;
+	}
+	e->max_events = EVENTS_MIN;
+	e->timerfd = -1;
+
 	s->epollfd = epoll_create1(EPOLL_CLOEXEC);
 	if (s->epollfd < 0) {
-		return -errno;
+		res = -errno;
+		free(e->events);
+		free(e);
+		return res;
 	}
+	s->driver_data = e;
 	s->driver.fini = _fini;
 	s->driver.add = _add;
 	s->driver.mod = _mod;
 	s->driver.del = _del;
+	s->driver.poll_ns = _poll_ns;
 	s->s.poll = _poll_and_add_to_jobs_;
 	return 0;
 }
@@ -50,6 +50,8 @@ struct qb_poll_entry {
 	uint32_t runs;
 	enum qb_poll_entry_state state;
 	uint32_t check;
+	int32_t edge;		/* QB_LOOP_POLL_EDGE_TRIGGERED */
+	int32_t armed;		/* io_uring: a poll request is outstanding */
 };
 
 struct qb_poll_source;
@@ -60,6 +62,8 @@ struct qb_loop_driver {
 	int32_t (*add)(struct qb_poll_source *s, struct qb_poll_entry *pe, int32_t fd, int32_t events);
 	int32_t (*mod)(struct qb_poll_source *s, struct qb_poll_entry *pe, int32_t fd, int32_t events);
 	int32_t (*del)(struct qb_poll_source *s, struct qb_poll_entry *pe, int32_t fd, int32_t arr_index);
+	/* optional, like s.poll() but with a nanosecond timeout */
+	int32_t (*poll_ns)(struct qb_poll_source *s, int64_t ns_timeout);
 };
 
 struct qb_poll_source {
@@ -73,15 +77,23 @@ struct qb_poll_source {
 #else
 	struct pollfd *ufds;
 #endif /* HAVE_EPOLL */
+	void *driver_data;
 	struct qb_loop_driver driver;
 };
 
 void
 qb_poll_fds_usage_check_(struct qb_poll_source *s);
 
+int32_t
+qb_loop_poll_internal_add(struct qb_loop *l, int32_t fd,
+			  qb_poll_add_to_jobs_fn add_to_jobs);
+
 int32_t
 qb_epoll_init(struct qb_poll_source *s);
 
+int32_t
+qb_uring_init(struct qb_poll_source *s);
+
 int32_t
 qb_poll_init(struct qb_poll_source *s);
 
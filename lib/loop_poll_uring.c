@@ -0,0 +1,599 @@
+/*
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "os_base.h"
+#include "loop_poll_int.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <endian.h>
+#include <linux/io_uring.h>
+
+/*
+ * io_uring poll driver.
+ *
+ * Every poll entry owns at most one one-shot IORING_OP_POLL_ADD request
+ * keyed by the same (check << 32 | install_pos) handle the epoll driver
+ * uses.  A completion queues the entry as a job; once it has been
+ * dispatched the request is re-armed, and a descriptor that is still
+ * ready completes again straight away, so the loop keeps its level
+ * triggered semantics.  Multishot polls are edge triggered only and
+ * would lose events for handlers that don't drain their descriptor, so
+ * they are used for QB_LOOP_POLL_EDGE_TRIGGERED entries alone.
+ *
+ * Registrations, re-arms and qb_loop_poll_mod() updates only fill
+ * submission queue entries; they reach the kernel together with the
+ * wait in the next io_uring_enter().  Removals are the exception: an
+ * armed request holds a reference on the file, so they are submitted
+ * at once to let a following close() really close it.
+ */
+
+#define URING_SQ_ENTRIES	256
+#define URING_CQ_ENTRIES	4096
+/* never a valid poll handle: check is neither 0 nor UINT32_MAX */
+#define URING_INTERNAL_DATA	UINT64_MAX
+
+/* qb_poll_entry.armed */
+#define URING_ARMED_ONESHOT	1
+#define URING_ARMED_MULTI	2
+
+struct qb_uring {
+	int32_t fd;
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *sq_flags;
+	uint32_t *sq_array;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	uint32_t sq_entries;
+	uint32_t to_submit;
+
+	uint64_t *rearm;
+	uint32_t rearm_len;
+	uint32_t rearm_max;
+};
+
+static int32_t _rearm_push_(struct qb_uring *u, uint64_t handle);
+
+static int32_t
+_io_uring_setup_(uint32_t entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int32_t
+_io_uring_enter_(int32_t fd, uint32_t to_submit, uint32_t min_complete,
+		 uint32_t flags, int64_t ns_timeout)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+
+	memset(&arg, 0, sizeof(arg));
+	if (ns_timeout >= 0) {
+		ts.tv_sec = ns_timeout / QB_TIME_NS_IN_SEC;
+		ts.tv_nsec = ns_timeout % QB_TIME_NS_IN_SEC;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+static int32_t
+_submit_(struct qb_uring *u, uint32_t min_complete, int64_t ns_timeout)
+{
+	uint32_t flags = 0;
+	int32_t res;
+
+	if (min_complete > 0 ||
+	    (*u->sq_flags & IORING_SQ_CQ_OVERFLOW)) {
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+	res = _io_uring_enter_(u->fd, u->to_submit, min_complete,
+			       flags, ns_timeout);
+	if (res < 0) {
+		return -errno;
+	}
+	u->to_submit -= QB_MIN((uint32_t)res, u->to_submit);
+	return 0;
+}
+
+static struct io_uring_sqe *
+_sqe_get_(struct qb_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t tail = *u->sq_tail;
+	uint32_t idx;
+
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+	    u->sq_entries) {
+		if (_submit_(u, 0, 0) != 0 ||
+		    tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+		    u->sq_entries) {
+			return NULL;
+		}
+	}
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	return sqe;
+}
+
+static uint32_t
+_poll_events_(int32_t events)
+{
+	uint32_t out = (uint32_t)events & (POLLIN | POLLOUT | POLLPRI);
+#if __BYTE_ORDER == __BIG_ENDIAN
+	out = (out << 16) | (out >> 16);
+#endif
+	return out;
+}
+
+static uint64_t
+_handle_(struct qb_poll_entry *pe)
+{
+	return (((uint64_t) (pe->check)) << 32) | pe->install_pos;
+}
+
+static int32_t
+_arm_(struct qb_uring *u, struct qb_poll_entry *pe, int32_t events)
+{
+	struct io_uring_sqe *sqe = _sqe_get_(u);
+
+	if (sqe == NULL) {
+		return -EAGAIN;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = pe->ufd.fd;
+	sqe->poll32_events = _poll_events_(events);
+	sqe->user_data = _handle_(pe);
+	if (pe->edge) {
+		sqe->len = IORING_POLL_ADD_MULTI;
+		pe->armed = URING_ARMED_MULTI;
+	} else {
+		pe->armed = URING_ARMED_ONESHOT;
+	}
+	return 0;
+}
+
+static int32_t
+_cancel_(struct qb_uring *u, struct qb_poll_entry *pe)
+{
+	struct io_uring_sqe *sqe = _sqe_get_(u);
+	int32_t res;
+
+	if (sqe == NULL) {
+		return -EAGAIN;
+	}
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = _handle_(pe);
+	sqe->user_data = URING_INTERNAL_DATA;
+	pe->armed = QB_FALSE;
+
+	res = _submit_(u, 0, 0);
+	if (res != 0) {
+		qb_util_perror(LOG_DEBUG, "io_uring_enter(poll remove)");
+	}
+	return res;
+}
+
+static void
+_fini(struct qb_poll_source *s)
+{
+	struct qb_uring *u = s->driver_data;
+
+	if (u == NULL) {
+		return;
+	}
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_sz);
+	}
+	if (u->cq_ring && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_ring_sz);
+	}
+	if (u->sq_ring) {
+		munmap(u->sq_ring, u->sq_ring_sz);
+	}
+	if (u->fd != -1) {
+		close(u->fd);
+	}
+	free(u->rearm);
+	free(u);
+	s->driver_data = NULL;
+}
+
+static int32_t
+_add(struct qb_poll_source *s, struct qb_poll_entry *pe, int32_t fd, int32_t events)
+{
+	/*
+	 * epoll_ctl() rejects a bad descriptor synchronously, keep
+	 * doing that rather than reporting it as POLLNVAL later.
+	 */
+	if (fcntl(fd, F_GETFD) == -1) {
+		return -errno;
+	}
+	return _arm_(s->driver_data, pe, events);
+}
+
+static int32_t
+_mod(struct qb_poll_source *s, struct qb_poll_entry *pe, int32_t fd, int32_t events)
+{
+	struct qb_uring *u = s->driver_data;
+	struct io_uring_sqe *sqe;
+	int32_t res;
+
+	if (!pe->armed) {
+		/*
+		 * Fired and not re-armed yet; the re-arm picks up the
+		 * new pe->ufd.events.
+		 */
+		return 0;
+	}
+	if ((pe->armed == URING_ARMED_MULTI) != (pe->edge != QB_FALSE)) {
+		/*
+		 * An update can't switch between one-shot and multishot:
+		 * cancel now, whatever the old request posts is reaped
+		 * before the entry is armed again in the new mode.
+		 */
+		res = _cancel_(u, pe);
+		if (res == 0) {
+			res = _rearm_push_(u, _handle_(pe));
+		}
+		return res;
+	}
+	/*
+	 * If the request completes before this update is seen the update
+	 * fails with -ENOENT and the pending completion re-arms the
+	 * entry with the new events anyway.
+	 */
+	sqe = _sqe_get_(u);
+	if (sqe == NULL) {
+		return -EAGAIN;
+	}
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->len = IORING_POLL_UPDATE_EVENTS;
+	sqe->addr = _handle_(pe);
+	sqe->poll32_events = _poll_events_(events);
+	sqe->user_data = URING_INTERNAL_DATA;
+	return 0;
+}
+
+static int32_t
+_del(struct qb_poll_source *s, struct qb_poll_entry *pe, int32_t fd, int32_t arr_index)
+{
+	if (!pe->armed) {
+		return 0;
+	}
+	return _cancel_(s->driver_data, pe);
+}
+
+static int32_t
+_poll_entry_from_handle_(struct qb_poll_source *s,
+			 uint64_t handle_in, struct qb_poll_entry **pe_pt)
+{
+	int32_t res = 0;
+	uint32_t check = ((uint32_t) (((uint64_t) handle_in) >> 32));
+	uint32_t handle = handle_in & UINT32_MAX;
+	struct qb_poll_entry *pe;
+
+	res = qb_array_index(s->poll_entries, handle, (void **)&pe);
+	if (res != 0) {
+		return res;
+	}
+	if (pe->check != check) {
+		return -EINVAL;
+	}
+	*pe_pt = pe;
+	return 0;
+}
+
+static int32_t
+_rearm_push_(struct qb_uring *u, uint64_t handle)
+{
+	uint64_t *rearm;
+	uint32_t new_max;
+
+	if (u->rearm_len == u->rearm_max) {
+		new_max = u->rearm_max ? u->rearm_max * 2 : 64;
+		rearm = realloc(u->rearm, new_max * sizeof(uint64_t));
+		if (rearm == NULL) {
+			return -ENOMEM;
+		}
+		u->rearm = rearm;
+		u->rearm_max = new_max;
+	}
+	u->rearm[u->rearm_len++] = handle;
+	return 0;
+}
+
+/*
+ * Re-arm the entries whose request fired and that have been dispatched
+ * since; the ones still waiting on a job list stay on the list.
+ */
+static void
+_rearm_(struct qb_poll_source *s)
+{
+	struct qb_uring *u = s->driver_data;
+	struct qb_poll_entry *pe;
+	uint32_t i;
+	uint32_t kept = 0;
+
+	for (i = 0; i < u->rearm_len; i++) {
+		if (_poll_entry_from_handle_(s, u->rearm[i], &pe) != 0 ||
+		    pe->armed ||
+		    pe->ufd.fd == -1 || pe->state == QB_POLL_ENTRY_DELETED) {
+			continue;
+		}
+		if (pe->state == QB_POLL_ENTRY_JOBLIST ||
+		    _arm_(u, pe, pe->ufd.events) != 0) {
+			u->rearm[kept++] = u->rearm[i];
+		}
+	}
+	u->rearm_len = kept;
+}
+
+static int32_t
+_reap_(struct qb_poll_source *s)
+{
+	struct qb_uring *u = s->driver_data;
+	struct io_uring_cqe *cqe;
+	struct qb_poll_entry *pe = NULL;
+	uint32_t head = *u->cq_head;
+	int32_t new_jobs = 0;
+
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &u->cqes[head & *u->cq_mask];
+		head++;
+
+		if (cqe->user_data == URING_INTERNAL_DATA ||
+		    cqe->res == -ECANCELED) {
+			continue;
+		}
+		if (_poll_entry_from_handle_(s, cqe->user_data, &pe) != 0) {
+			/*
+			 * completion racing a qb_loop_poll_del()
+			 */
+			continue;
+		}
+		if (pe->ufd.fd == -1 || pe->state == QB_POLL_ENTRY_DELETED) {
+			continue;
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			pe->armed = QB_FALSE;
+			if (_rearm_push_(u, cqe->user_data) != 0) {
+				qb_util_log(LOG_ERR,
+					    "can't re-arm poll entry for FD %d",
+					    pe->ufd.fd);
+			}
+		}
+		if (cqe->res < 0) {
+			/*
+			 * e.g. the descriptor was closed before the request
+			 * was submitted, report it the way poll() would.
+			 */
+			pe->ufd.revents |= POLLNVAL;
+		} else {
+			pe->ufd.revents |= cqe->res &
+			    (POLLIN | POLLOUT | POLLPRI | POLLERR | POLLHUP);
+		}
+
+		if (pe->state != QB_POLL_ENTRY_JOBLIST) {
+			new_jobs += pe->add_to_jobs(s->s.l, pe);
+		}
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+	return new_jobs;
+}
+
+static int32_t
+_poll_ns(struct qb_poll_source *s, int64_t ns_timeout)
+{
+	int32_t res;
+	int32_t new_jobs;
+	struct qb_uring *u = s->driver_data;
+
+	qb_poll_fds_usage_check_(s);
+
+	new_jobs = _reap_(s);
+	_rearm_(s);
+
+	if (new_jobs > 0) {
+		ns_timeout = 0;
+	}
+	if (ns_timeout == 0 && u->to_submit == 0 &&
+	    !(*u->sq_flags & IORING_SQ_CQ_OVERFLOW) &&
+	    new_jobs > 0) {
+		return new_jobs;
+	}
+
+retry_poll:
+	res = _submit_(u, ns_timeout == 0 ? 0 : 1, ns_timeout);
+	if (res == -EINTR) {
+		goto retry_poll;
+	} else if (res != 0 && res != -ETIME &&
+		   res != -EBUSY && res != -EAGAIN) {
+		return res;
+	}
+
+	return new_jobs + _reap_(s);
+}
+
+static int32_t
+_poll_and_add_to_jobs_(struct qb_loop_source *src, int32_t ms_timeout)
+{
+	int64_t ns_timeout = -1;
+
+	if (ms_timeout >= 0) {
+		ns_timeout = ms_timeout * QB_TIME_NS_IN_MSEC;
+	}
+	return _poll_ns((struct qb_poll_source *)src, ns_timeout);
+}
+
+static int32_t
+_ring_map_(struct qb_uring *u, struct io_uring_params *p)
+{
+	u->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+	u->cq_ring_sz = p->cq_off.cqes +
+	    p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		u->sq_ring_sz = QB_MAX(u->sq_ring_sz, u->cq_ring_sz);
+		u->cq_ring_sz = u->sq_ring_sz;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		return -errno;
+	}
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			return -errno;
+		}
+	}
+	u->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return -errno;
+	}
+
+	u->sq_head = (uint32_t *)((char *)u->sq_ring + p->sq_off.head);
+	u->sq_tail = (uint32_t *)((char *)u->sq_ring + p->sq_off.tail);
+	u->sq_mask = (uint32_t *)((char *)u->sq_ring + p->sq_off.ring_mask);
+	u->sq_flags = (uint32_t *)((char *)u->sq_ring + p->sq_off.flags);
+	u->sq_array = (uint32_t *)((char *)u->sq_ring + p->sq_off.array);
+	u->cq_head = (uint32_t *)((char *)u->cq_ring + p->cq_off.head);
+	u->cq_tail = (uint32_t *)((char *)u->cq_ring + p->cq_off.tail);
+	u->cq_mask = (uint32_t *)((char *)u->cq_ring + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p->cq_off.cqes);
+	u->sq_entries = p->sq_entries;
+	return 0;
+}
+
+/*
+ * In-place poll updates (5.13) are what qb_loop_poll_mod() relies on:
+ * updating a request that doesn't exist fails with -ENOENT where they
+ * are supported and with -EINVAL where they are not.
+ */
+static int32_t
+_probe_(struct qb_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int32_t res;
+
+	sqe = _sqe_get_(u);
+	if (sqe == NULL) {
+		return -EAGAIN;
+	}
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->len = IORING_POLL_UPDATE_EVENTS;
+	sqe->addr = URING_INTERNAL_DATA - 1;
+	sqe->poll32_events = _poll_events_(POLLIN);
+	sqe->user_data = URING_INTERNAL_DATA;
+
+	res = _submit_(u, 1, -1);
+	if (res != 0) {
+		return res;
+	}
+	if (*u->cq_head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		return -EIO;
+	}
+	cqe = &u->cqes[*u->cq_head & *u->cq_mask];
+	res = cqe->res;
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+	return res == -ENOENT ? 0 : -EOPNOTSUPP;
+}
+
+int32_t
+qb_uring_init(struct qb_poll_source *s)
+{
+	struct io_uring_params p;
+	struct qb_uring *u;
+	int32_t res;
+
+	u = calloc(1, sizeof(struct qb_uring));
+	if (u == NULL) {
+		return -ENOMEM;
+	}
+	s->driver_data = u;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+	u->fd = _io_uring_setup_(URING_SQ_ENTRIES, &p);
+	if (u->fd < 0) {
+		res = -errno;
+		goto cleanup;
+	}
+	/*
+	 * EXT_ARG for wait timeouts, NODROP so completions are never lost
+	 * when there are more armed descriptors than the CQ holds.
+	 */
+	if ((p.features & (IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP)) !=
+	    (IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP)) {
+		res = -EOPNOTSUPP;
+		goto cleanup;
+	}
+	res = _ring_map_(u, &p);
+	if (res != 0) {
+		goto cleanup;
+	}
+	res = _probe_(u);
+	if (res != 0) {
+		goto cleanup;
+	}
+
+	s->driver.fini = _fini;
+	s->driver.add = _add;
+	s->driver.mod = _mod;
+	s->driver.del = _del;
+	s->driver.poll_ns = _poll_ns;
+	s->s.poll = _poll_and_add_to_jobs_;
+	return 0;
+
+cleanup:
+	_fini(s);
+	return res;
+}
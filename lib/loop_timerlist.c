@@ -37,6 +37,9 @@ struct qb_loop_timer {
 	enum qb_poll_entry_state state;
 	int32_t check;
 	uint32_t install_pos;
+	uint64_t period;		/* 0 for one-shot timers */
+	enum qb_loop_timer_overrun overrun;
+	int32_t dispatching;
 };
 
 struct qb_timer_source {
@@ -47,15 +50,69 @@ struct qb_timer_source {
 	pthread_mutex_t lock;
 };
 
+static void
+_timer_entry_release_(struct qb_timer_source *s, struct qb_loop_timer *t)
+{
+	t->state = QB_POLL_ENTRY_EMPTY;
+	(void)qb_array_free_slot_put(s->timers, t->install_pos);
+}
+
+/*
+ * Schedule the next expiration of a periodic timer a whole period after
+ * the last one, so the dispatch latency does not add up over time.
+ */
+static void
+_timer_periodic_rearm_(struct qb_timer_source *s, struct qb_loop_timer *t)
+{
+	uint64_t expire_time;
+	uint64_t now;
+
+	expire_time = timerlist_expire_time(&s->timerlist, t->timerlist_handle) +
+	    t->period;
+	if (t->overrun == QB_LOOP_TIMER_OVERRUN_SKIP) {
+		now = qb_util_nano_current_get();
+		if (expire_time <= now) {
+			expire_time += ((now - expire_time) / t->period + 1) *
+			    t->period;
+		}
+	}
+
+	t->state = QB_POLL_ENTRY_ACTIVE;
+	if (timerlist_rearm(&s->timerlist, t->timerlist_handle,
+			    expire_time) != 0) {
+		qb_util_log(LOG_ERR, "Could not rearm periodic timer");
+		timerlist_release(&s->timerlist, t->timerlist_handle);
+		_timer_entry_release_(s, t);
+	}
+}
+
 static void
 timer_dispatch(struct qb_loop_item *item, enum qb_loop_priority p)
 {
 	struct qb_loop_timer *timer = (struct qb_loop_timer *)item;
+	struct qb_timer_source *s = (struct qb_timer_source *)item->source;
 
 	assert(timer->state == QB_POLL_ENTRY_JOBLIST);
-	timer->check = 0;
+	if (timer->period == 0) {
+		timer->check = 0;
+		timer->dispatch_fn(timer->item.user_data);
+		_timer_entry_release_(s, timer);
+		return;
+	}
+
+	/*
+	 * The handle stays valid, the callback may delete its own timer
+	 */
+	timer->dispatching = QB_TRUE;
 	timer->dispatch_fn(timer->item.user_data);
-	timer->state = QB_POLL_ENTRY_EMPTY;
+	timer->dispatching = QB_FALSE;
+
+	if (timer->state == QB_POLL_ENTRY_DELETED) {
+		timerlist_release(&s->timerlist, timer->timerlist_handle);
+		_timer_entry_release_(s, timer);
+		return;
+	}
+	_timer_periodic_rearm_(s, timer);
 }
 
 static int32_t expired_timers;
@@ -93,6 +150,17 @@ qb_loop_timer_msec_duration_to_expire(struct qb_loop_source * timer_source)
 	return left;
 }
 
+int64_t
+qb_loop_timer_nsec_duration_to_expire(struct qb_loop_source * timer_source)
+{
+	struct qb_timer_source *my_src = (struct qb_timer_source *)timer_source;
+	uint64_t left = timerlist_nsec_duration_to_expire(&my_src->timerlist);
+	if (left != -1 && left > INT64_MAX) {
+		left = INT64_MAX;
+	}
+	return left;
+}
+
 struct qb_loop_source *
 qb_loop_timer_create(struct qb_loop *l)
 {
@@ -105,6 +173,7 @@ qb_loop_timer_create(struct qb_loop *l)
 	my_src->s.poll = expire_the_timers;
 
 	timerlist_init(&my_src->timerlist);
+	(void)timerlist_cache_max_set(&my_src->timerlist, l->item_cache_max);
 	my_src->timers = qb_array_create_2(16, sizeof(struct qb_loop_timer), 16);
 	my_src->timer_entry_count = 0;
 	pthread_mutex_init(&my_src->lock, NULL);
@@ -118,11 +187,49 @@ qb_loop_timer_destroy(struct qb_loop *l)
 	struct qb_timer_source *my_src =
 	    (struct qb_timer_source *)l->timer_source;
 
+	struct qb_loop_timer *t;
+	size_t i;
+
+	/*
+	 * Expired periodic timers waiting on a job list are no longer
+	 * in the timerlist
+	 */
+	for (i = 0; i < my_src->timer_entry_count; i++) {
+		if (qb_array_index(my_src->timers, i, (void **)&t) == 0 &&
+		    t->state == QB_POLL_ENTRY_JOBLIST && t->period) {
+			free(t->timerlist_handle);
+		}
+	}
 	timerlist_destroy(&my_src->timerlist);
 	qb_array_free(my_src->timers);
 	free(l->timer_source);
 }
 
+void
+qb_loop_timer_cache_trim(struct qb_loop *l)
+{
+	struct qb_timer_source *my_src =
+	    (struct qb_timer_source *)l->timer_source;
+
+	(void)timerlist_cache_max_set(&my_src->timerlist, l->item_cache_max);
+}
+
+void
+qb_loop_timer_stats_get(struct qb_loop *l, struct qb_loop_stats *stats)
+{
+	struct qb_timer_source *my_src =
+	    (struct qb_timer_source *)l->timer_source;
+	struct timerlist *tl = &my_src->timerlist;
+
+	if (pthread_mutex_lock(&tl->list_mutex) != 0) {
+		return;
+	}
+	stats->timer_allocs = tl->allocs;
+	stats->timer_reuses = tl->reuses;
+	stats->timer_cached = tl->cache_len;
+	pthread_mutex_unlock(&tl->list_mutex);
+}
+
 static int32_t
 _timer_from_handle_(struct qb_timer_source *s,
 		    qb_loop_timer_handle handle_in,
@@ -156,14 +263,10 @@ _get_empty_array_position_(struct qb_timer_source *s)
 {
 	int32_t install_pos;
 	int32_t res = 0;
-	struct qb_loop_timer *timer;
 
-	for (install_pos = 0; install_pos < s->timer_entry_count; install_pos++) {
-		assert(qb_array_index(s->timers, install_pos, (void **)&timer)
-		       == 0);
-		if (timer->state == QB_POLL_ENTRY_EMPTY) {
-			return install_pos;
-		}
+	install_pos = qb_array_free_slot_get(s->timers);
+	if (install_pos >= 0) {
+		return install_pos;
 	}
 
 	res = qb_array_grow(s->timers, s->timer_entry_count + 1);
@@ -176,13 +279,16 @@ _get_empty_array_position_(struct qb_timer_source *s)
 	return install_pos;
 }
 
-int32_t
-qb_loop_timer_add(struct qb_loop * lp,
-		  enum qb_loop_priority p,
-		  uint64_t nsec_duration,
-		  void *data,
-		  qb_loop_timer_dispatch_fn timer_fn,
-		  qb_loop_timer_handle * timer_handle_out)
+static int32_t
+_timer_add_(struct qb_loop * lp,
+	    enum qb_loop_priority p,
+	    uint64_t nsec_duration,
+	    uint64_t nsec_slack,
+	    uint64_t nsec_period,
+	    enum qb_loop_timer_overrun overrun,
+	    void *data,
+	    qb_loop_timer_dispatch_fn timer_fn,
+	    qb_loop_timer_handle * timer_handle_out)
 {
 	struct qb_loop_timer *t;
 	struct qb_timer_source *my_src;
@@ -203,6 +309,10 @@ qb_loop_timer_add(struct qb_loop * lp,
 		return -res;
 	}
 	i = _get_empty_array_position_(my_src);
+	if (i < 0) {
+		pthread_mutex_unlock(&my_src->lock);
+		return i;
+	}
 	assert(qb_array_index(my_src->timers, i, (void **)&t) >= 0);
 	t->state = QB_POLL_ENTRY_ACTIVE;
 	t->install_pos = i;
@@ -210,6 +320,9 @@ qb_loop_timer_add(struct qb_loop * lp,
 	t->item.source = (struct qb_loop_source *)my_src;
 	t->dispatch_fn = timer_fn;
 	t->p = p;
+	t->period = nsec_period;
+	t->overrun = overrun;
+	t->dispatching = QB_FALSE;
 	qb_list_init(&t->item.list);
 
 	/* Unlock here to stop anyone else changing the state while we're initializing */
@@ -229,12 +342,68 @@ qb_loop_timer_add(struct qb_loop * lp,
 		}
 	}
 
+	if (nsec_period) {
+		res = timerlist_add_periodic(&my_src->timerlist,
+					     make_job_from_tmo, t,
+					     nsec_period, &t->timerlist_handle);
+	} else {
+		res = timerlist_add_duration_slack(&my_src->timerlist,
+						   make_job_from_tmo, t,
+						   nsec_duration, nsec_slack,
+						   &t->timerlist_handle);
+	}
+	if (res != 0) {
+		_timer_entry_release_(my_src, t);
+		return res;
+	}
+
 	if (timer_handle_out) {
 		*timer_handle_out = (((uint64_t) (t->check)) << 32) | t->install_pos;
 	}
-	return timerlist_add_duration(&my_src->timerlist,
-				      make_job_from_tmo, t,
-				      nsec_duration, &t->timerlist_handle);
+	return 0;
+}
+
+int32_t
+qb_loop_timer_add(struct qb_loop * lp,
+		  enum qb_loop_priority p,
+		  uint64_t nsec_duration,
+		  void *data,
+		  qb_loop_timer_dispatch_fn timer_fn,
+		  qb_loop_timer_handle * timer_handle_out)
+{
+	return _timer_add_(lp, p, nsec_duration, 0, 0, 0, data, timer_fn,
+			   timer_handle_out);
+}
+
+int32_t
+qb_loop_timer_add_with_slack(struct qb_loop * lp,
+			     enum qb_loop_priority p,
+			     uint64_t nsec_duration,
+			     uint64_t nsec_slack,
+			     void *data,
+			     qb_loop_timer_dispatch_fn timer_fn,
+			     qb_loop_timer_handle * timer_handle_out)
+{
+	return _timer_add_(lp, p, nsec_duration, nsec_slack, 0, 0, data,
+			   timer_fn, timer_handle_out);
+}
+
+int32_t
+qb_loop_timer_add_periodic(struct qb_loop * lp,
+			   enum qb_loop_priority p,
+			   uint64_t nsec_period,
+			   enum qb_loop_timer_overrun overrun,
+			   void *data,
+			   qb_loop_timer_dispatch_fn timer_fn,
+			   qb_loop_timer_handle * timer_handle_out)
+{
+	if (nsec_period == 0 ||
+	    (overrun != QB_LOOP_TIMER_OVERRUN_CATCH_UP &&
+	     overrun != QB_LOOP_TIMER_OVERRUN_SKIP)) {
+		return -EINVAL;
+	}
+	return _timer_add_(lp, p, 0, 0, nsec_period, overrun, data,
+			   timer_fn, timer_handle_out);
 }
 
 int32_t
@@ -263,8 +432,17 @@ qb_loop_timer_del(struct qb_loop * lp, qb_loop_timer_handle th)
 	    t->state != QB_POLL_ENTRY_JOBLIST) {
 		return -EINVAL;
 	}
+	if (t->dispatching) {
+		/* released by timer_dispatch() once the callback returns */
+		t->state = QB_POLL_ENTRY_DELETED;
+		return 0;
+	}
 	if (t->state == QB_POLL_ENTRY_JOBLIST) {
 		qb_loop_level_item_del(&l->level[t->p], &t->item);
+		if (t->period) {
+			/* expired, so no longer in the timerlist */
+			timerlist_release(&s->timerlist, t->timerlist_handle);
+		}
 	}
 
 	if (t->timerlist_handle) {
@@ -272,7 +450,7 @@ qb_loop_timer_del(struct qb_loop * lp, qb_loop_timer_handle th)
 			qb_util_log(LOG_ERR, "Could not delete timer from timerlist");
 		}
 	}
-	t->state = QB_POLL_ENTRY_EMPTY;
+	_timer_entry_release_(s, t);
 	return 0;
 }
 
@@ -346,8 +524,64 @@ qb_loop_timer_expire_time_remaining(struct qb_loop * lp, qb_loop_timer_handle th
 
 }
 
+int32_t
+qb_loop_timer_backend_set(struct qb_loop * lp,
+			  enum qb_loop_timer_backend backend)
+{
+	struct qb_timer_source *s;
+	struct qb_loop *l = lp;
+
+	if (l == NULL) {
+		l = qb_loop_default_get();
+	}
+	if (l == NULL) {
+		return -EINVAL;
+	}
+	s = (struct qb_timer_source *)l->timer_source;
+
+	switch (backend) {
+	case QB_LOOP_TIMER_WHEEL:
+		return timerlist_wheel_enable(&s->timerlist);
+	case QB_LOOP_TIMER_HEAP:
+		return timerlist_wheel_disable(&s->timerlist);
+	default:
+		return -EINVAL;
+	}
+}
+
+int32_t
+qb_loop_timer_hires_set(struct qb_loop * lp, int32_t enabled)
+{
+	struct qb_loop *l = lp;
+
+	if (l == NULL) {
+		l = qb_loop_default_get();
+	}
+	if (l == NULL) {
+		return -EINVAL;
+	}
+	l->timer_hires = enabled ? QB_TRUE : QB_FALSE;
+	return 0;
+}
+
 int32_t
 qb_loop_timer_is_running(qb_loop_t *l, qb_loop_timer_handle th)
 {
+	struct qb_timer_source *s;
+	struct qb_loop_timer *t;
+
+	if (l == NULL) {
+		l = qb_loop_default_get();
+	}
+	s = (struct qb_timer_source *)l->timer_source;
+
+	/*
+	 * A periodic timer keeps running until deleted, also while its
+	 * expiration waits to be dispatched
+	 */
+	if (_timer_from_handle_(s, th, &t) == 0 && t->period &&
+	    t->state == QB_POLL_ENTRY_JOBLIST) {
+		return QB_TRUE;
+	}
 	return (qb_loop_timer_expire_time_get(l, th) > 0);
 }
@@ -22,6 +22,7 @@
 
 #include "os_base.h"
 #include <qb/qblog.h>
+#include <qb/qbarray.h>
 
 #if !defined (va_copy)
 #if defined (__va_copy)
@@ -118,6 +119,26 @@ void qb_sigpipe_ctl(enum qb_sigpipe_ctl ctl);
  */
 void qb_socket_nosigpipe(int32_t s);
 
+/**
+ * Hand an element of the array back for reuse.
+ *
+ * Arrays used as slot tables keep their unused elements on a stack,
+ * so that finding one does not need a scan.
+ *
+ * @param a array instance
+ * @param idx index of the element that is no longer used
+ * @return 0 (success) or -errno
+ */
+int32_t qb_array_free_slot_put(qb_array_t *a, int32_t idx);
+
+/**
+ * Take an element handed back with qb_array_free_slot_put().
+ *
+ * @param a array instance
+ * @return the index of the element or -ENOENT if there is none
+ */
+int32_t qb_array_free_slot_get(qb_array_t *a);
+
 #define SERVER_BACKLOG 128
 
 #ifndef UNIX_PATH_MAX
@@ -27,6 +27,8 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
 
 #ifdef HAVE_GLIB
 #include <glib.h>
@@ -72,6 +74,10 @@ static int CALCULATED_DGRAM_MAX_MSG_SIZE = 0;
 #define GIANT_MSG_DATA_SIZE (MAX_MSG_SIZE - sizeof(struct qb_ipc_response_header) - 8)
 
 static int enforce_server_buffer;
+static int use_workers;
+static int use_doorbell;
+static int use_deferred_teardown;
+static int use_msg_handlers;
 static qb_ipcc_connection_t *conn;
 static enum qb_ipc_type ipc_type;
 static enum qb_loop_priority global_loop_prio = QB_LOOP_MED;
@@ -93,8 +99,50 @@ enum my_msg_ids {
 	IPC_MSG_RES_SERVER_FAIL,
 	IPC_MSG_REQ_SERVER_DISCONNECT,
 	IPC_MSG_RES_SERVER_DISCONNECT,
+	IPC_MSG_REQ_LARGE,
+	IPC_MSG_RES_LARGE,
+	IPC_MSG_REQ_WORKER_SEQ,
+	IPC_MSG_RES_WORKER_SEQ,
+	IPC_MSG_REQ_STATS,
+	IPC_MSG_RES_STATS,
+	IPC_MSG_REQ_SLOW,
+	IPC_MSG_RES_SLOW,
+	IPC_MSG_REQ_HIPRI,
+	IPC_MSG_RES_HIPRI,
+	IPC_MSG_REQ_ECHO,
+	IPC_MSG_RES_ECHO,
+	IPC_MSG_REQ_MSG_STATS,
+	IPC_MSG_RES_MSG_STATS,
+	IPC_MSG_REQ_EVENT_IDS,
+	IPC_MSG_RES_EVENT_IDS,
 };
 
+/* IPC_MSG_REQ_EVENT_IDS sends events with these ids */
+#define EVENT_IDS_FIRST 1000
+#define EVENT_IDS_COUNT 10
+
+/* bounds of IPC_MSG_REQ_ECHO */
+#define ECHO_MIN_SIZE (sizeof(struct qb_ipc_request_header) + 8)
+#define ECHO_MAX_SIZE (sizeof(struct qb_ipc_request_header) + 64)
+
+struct msg_stats_res {
+	struct qb_ipc_response_header hdr __attribute__ ((aligned(8)));
+	struct qb_ipcs_msg_stats stats;
+} __attribute__ ((aligned(8)));
+
+struct latency_stats_res {
+	struct qb_ipc_response_header hdr __attribute__ ((aligned(8)));
+	uint64_t queue_count;
+	uint64_t process_count;
+	uint64_t event_count;
+	uint64_t event_queue_count;
+	uint64_t service_process_count;
+	uint64_t bucket_total;
+	uint64_t p99_ns;
+	uint64_t p100_ns;
+	uint64_t max_ns;
+} __attribute__ ((aligned(8)));
+
 
 /* these 2 functions from pacemaker code */
 static enum qb_ipcs_rate_limit
@@ -204,6 +252,7 @@ static int32_t num_stress_events = 30000;
 static int32_t reference_count_test = QB_FALSE;
 static int32_t multiple_connections = QB_FALSE;
 static int32_t set_perms_on_socket = QB_FALSE;
+static int32_t defer_accept = QB_FALSE;
 
 
 static int32_t
@@ -323,6 +372,97 @@ s1_msg_process_fn(qb_ipcs_connection_t *c,
 		if (turn_on_fc) {
 			qb_ipcs_request_rate_limit(s1, QB_IPCS_RATE_OFF);
 		}
+	} else if (req_pt->id == IPC_MSG_REQ_LARGE) {
+		struct iovec iov[2];
+
+		/* echo the payload back, both as a response and as an event */
+		response.size = sizeof(response) + req_pt->size - sizeof(*req_pt);
+		response.id = IPC_MSG_RES_LARGE;
+		response.error = 0;
+		iov[0].iov_base = &response;
+		iov[0].iov_len = sizeof(response);
+		iov[1].iov_base = (char *)data + sizeof(*req_pt);
+		iov[1].iov_len = req_pt->size - sizeof(*req_pt);
+		res = qb_ipcs_response_sendv(c, iov, 2);
+		ck_assert_int_eq(res, response.size);
+		res = qb_ipcs_event_sendv(c, iov, 2);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_WORKER_SEQ) {
+		struct iovec iov[2];
+		uint32_t *seq = (uint32_t *)(req_pt + 1);
+
+		/* finish out of order; the responses must not */
+		usleep((*seq % 3) * 300);
+		response.size = sizeof(response) + sizeof(*seq);
+		response.id = IPC_MSG_RES_WORKER_SEQ;
+		response.error = 0;
+		iov[0].iov_base = &response;
+		iov[0].iov_len = sizeof(response);
+		iov[1].iov_base = seq;
+		iov[1].iov_len = sizeof(*seq);
+		res = qb_ipcs_response_sendv(c, iov, 2);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_STATS) {
+		struct latency_stats_res stats_res;
+		struct qb_ipcs_connection_stats_3 *stats;
+		struct qb_ipcs_stats_2 srv_stats;
+		int32_t i;
+
+		response.size = sizeof(response);
+		response.id = IPC_MSG_RES_DISPATCH;
+		response.error = 0;
+		res = qb_ipcs_event_send(c, &response, sizeof(response));
+		ck_assert_int_eq(res, sizeof(response));
+
+		stats = qb_ipcs_connection_stats_get_3(c, QB_FALSE);
+		ck_assert(stats != NULL);
+		res = qb_ipcs_stats_get_2(s1, &srv_stats, QB_FALSE);
+		ck_assert_int_eq(res, 0);
+
+		memset(&stats_res, 0, sizeof(stats_res));
+		stats_res.hdr.size = sizeof(stats_res);
+		stats_res.hdr.id = IPC_MSG_RES_STATS;
+		stats_res.queue_count = stats->queue_latency.count;
+		stats_res.process_count = stats->process_latency.count;
+		stats_res.event_count = stats->event_latency.count;
+		stats_res.event_queue_count = stats->event_queue_latency.count;
+		stats_res.service_process_count = srv_stats.process_latency.count;
+		for (i = 0; i < QB_IPCS_LATENCY_BUCKETS; i++) {
+			stats_res.bucket_total += stats->process_latency.buckets[i];
+		}
+		stats_res.p99_ns = qb_ipcs_latency_percentile_get(
+			&stats->process_latency, 99.0);
+		stats_res.p100_ns = qb_ipcs_latency_percentile_get(
+			&stats->process_latency, 100.0);
+		stats_res.max_ns = stats->process_latency.max_ns;
+		free(stats);
+
+		res = qb_ipcs_response_send(c, &stats_res, sizeof(stats_res));
+		ck_assert_int_eq(res, sizeof(stats_res));
+	} else if (req_pt->id == IPC_MSG_REQ_SLOW ||
+		   req_pt->id == IPC_MSG_REQ_HIPRI) {
+		if (req_pt->id == IPC_MSG_REQ_SLOW) {
+			/* let the client queue up more behind this one */
+			usleep(300000);
+		}
+		response.size = sizeof(response);
+		response.id = req_pt->id + 1;
+		response.error = 0;
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, response.size);
+	} else if (req_pt->id == IPC_MSG_REQ_EVENT_IDS) {
+		int32_t i;
+
+		response.size = sizeof(response);
+		response.error = 0;
+		for (i = 0; i < EVENT_IDS_COUNT; i++) {
+			response.id = EVENT_IDS_FIRST + i;
+			res = qb_ipcs_event_send(c, &response, sizeof(response));
+			ck_assert_int_eq(res, sizeof(response));
+		}
+		response.id = IPC_MSG_RES_EVENT_IDS;
+		res = qb_ipcs_response_send(c, &response, sizeof(response));
+		ck_assert_int_eq(res, sizeof(response));
 	} else if (req_pt->id == IPC_MSG_REQ_DISPATCH) {
 		response.size = sizeof(struct qb_ipc_response_header);
 		response.id = IPC_MSG_RES_DISPATCH;
@@ -673,12 +813,32 @@ s1_connection_destroyed(qb_ipcs_connection_t *c)
 	qb_leave();
 }
 
+static void
+s1_accept_later(void *data)
+{
+	static int32_t deferred = 0;
+	qb_ipcs_connection_t *c = data;
+	int32_t res;
+
+	/* every other client is turned away */
+	res = qb_ipcs_connection_accept_complete(c,
+		(deferred++ % 2) ? -EACCES : 0);
+	qb_log(LOG_DEBUG, "deferred accept %d: %d", deferred, res);
+	assert(qb_ipcs_connection_accept_complete(c, 0) == -EINVAL);
+}
+
 static int32_t
 s1_connection_accept(qb_ipcs_connection_t *c, uid_t uid, gid_t gid)
 {
 	if (set_perms_on_socket) {
 		qb_ipcs_connection_auth_set(c, 555, 741, S_IRWXU|S_IRWXG|S_IROTH|S_IWOTH);
 	}
+	if (defer_accept) {
+		qb_loop_timer_add(my_loop, QB_LOOP_MED,
+				  50 * QB_TIME_NS_IN_MSEC, c,
+				  s1_accept_later, NULL);
+		return -EINPROGRESS;
+	}
 	return 0;
 }
 
@@ -740,6 +900,62 @@ READY_SIGNALLER(usr1_signaller, parent_target)
 	      void *signaller_data_arg, void *data_arg)
 typedef NEW_PROCESS_RUNNER(new_process_runner_fn, , , );
 
+static int32_t
+s1_echo_fn(qb_ipcs_connection_t *c, void *data, size_t size)
+{
+	struct qb_ipc_response_header response;
+
+	ck_assert(size >= ECHO_MIN_SIZE && size <= ECHO_MAX_SIZE);
+	response.size = sizeof(response);
+	response.id = IPC_MSG_RES_ECHO;
+	response.error = 0;
+	(void)qb_ipcs_response_send(c, &response, response.size);
+	return 0;
+}
+
+static int32_t
+s1_msg_stats_fn(qb_ipcs_connection_t *c, void *data, size_t size)
+{
+	struct msg_stats_res stats_res;
+
+	memset(&stats_res, 0, sizeof(stats_res));
+	stats_res.hdr.size = sizeof(stats_res);
+	stats_res.hdr.id = IPC_MSG_RES_MSG_STATS;
+	stats_res.hdr.error = qb_ipcs_msg_stats_get(s1, IPC_MSG_REQ_ECHO,
+						    &stats_res.stats,
+						    QB_FALSE);
+	(void)qb_ipcs_response_send(c, &stats_res, sizeof(stats_res));
+	return 0;
+}
+
+static void
+msg_handlers_set(void)
+{
+	struct qb_ipcs_msg_handler handlers[] = {
+		{ IPC_MSG_REQ_ECHO, ECHO_MIN_SIZE, ECHO_MAX_SIZE, s1_echo_fn },
+		{ IPC_MSG_REQ_MSG_STATS, 0, 0, s1_msg_stats_fn },
+		{ IPC_MSG_REQ_ECHO, 0, 0, s1_echo_fn },
+	};
+	struct qb_ipcs_msg_handler far[] = {
+		{ IPC_MSG_REQ_ECHO, 0, 0, s1_echo_fn },
+		{ IPC_MSG_REQ_ECHO + QB_IPCS_MSG_HANDLERS_SPAN, 0, 0,
+		  s1_echo_fn },
+	};
+	struct qb_ipcs_msg_handler reserved = {
+		QB_IPC_MSG_DISCONNECT, 0, 0, s1_echo_fn
+	};
+	int32_t res;
+
+	res = qb_ipcs_msg_handlers_set(s1, handlers, 3);
+	ck_assert_int_eq(res, -EEXIST);
+	res = qb_ipcs_msg_handlers_set(s1, far, 2);
+	ck_assert_int_eq(res, -E2BIG);
+	res = qb_ipcs_msg_handlers_set(s1, &reserved, 1);
+	ck_assert_int_eq(res, -EINVAL);
+	res = qb_ipcs_msg_handlers_set(s1, handlers, 2);
+	ck_assert_int_eq(res, 0);
+}
+
 static
 NEW_PROCESS_RUNNER(run_ipc_server, ready_signaller, signaller_data, data)
 {
@@ -795,10 +1011,37 @@ NEW_PROCESS_RUNNER(run_ipc_server, ready_signaller, signaller_data, data)
 	if (enforce_server_buffer) {
 		qb_ipcs_enforce_buffer_size(s1, max_size);
 	}
+	qb_ipcs_large_msg_max_set(s1, 4 * max_size);
+	if (use_workers) {
+		res = qb_ipcs_workers_set(s1, 4, 8);
+		ck_assert_int_eq(res, 0);
+		/* no threads turns the pool off, whatever max_in_flight is */
+		res = qb_ipcs_workers_set(s1, 0, 0);
+		ck_assert_int_eq(res, 0);
+		res = qb_ipcs_workers_set(s1, 4, 0);
+		ck_assert_int_eq(res, -EINVAL);
+		res = qb_ipcs_workers_set(s1, 4, 8);
+		ck_assert_int_eq(res, 0);
+	}
+	if (use_doorbell) {
+		res = qb_ipcs_doorbell_set(s1, 2);
+		ck_assert_int_eq(res, ipc_type == QB_IPC_SHM ? 0 : -ENOTSUP);
+	}
+	if (use_deferred_teardown) {
+		res = qb_ipcs_deferred_teardown_set(s1, 1);
+		ck_assert_int_eq(res, 0);
+	}
+	if (use_msg_handlers) {
+		msg_handlers_set();
+	}
 	qb_ipcs_poll_handlers_set(s1, &ph);
 
 	res = qb_ipcs_run(s1);
 	ck_assert_int_eq(res, 0);
+	if (use_msg_handlers) {
+		res = qb_ipcs_msg_handlers_set(s1, NULL, 0);
+		ck_assert_int_eq(res, -EBUSY);
+	}
 
 	if (ready_signaller != NULL) {
 		ready_signaller(signaller_data);
@@ -1254,155 +1497,1712 @@ test_ipc_exit(void)
 	qb_ipcc_disconnect(conn);
 }
 
-START_TEST(test_ipc_exit_us)
+static void
+test_ipc_txrx_asymmetric(void)
 {
-	qb_enter();
-	ipc_type = QB_IPC_SOCKET;
-	set_ipc_name(__func__);
-	recv_timeout = 5000;
-	test_ipc_exit();
-	qb_leave();
-}
-END_TEST
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	struct qb_ipcc_connect_params params;
+	struct iovec iov[1];
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
 
-START_TEST(test_ipc_exit_shm)
-{
-	qb_enter();
-	ipc_type = QB_IPC_SHM;
-	set_ipc_name(__func__);
-	recv_timeout = 1000;
-	test_ipc_exit();
-	qb_leave();
-}
-END_TEST
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
 
-START_TEST(test_ipc_txrx_shm_timeout)
-{
-	qb_enter();
-	ipc_type = QB_IPC_SHM;
-	set_ipc_name(__func__);
-	test_ipc_txrx_timeout();
-	qb_leave();
-}
-END_TEST
+	memset(&params, 0, sizeof(params));
+	params.max_request_size = max_size / 2;
+	params.max_response_size = max_size;
+	params.max_event_size = max_size / 4;
 
+	do {
+		conn = qb_ipcc_connect_2(ipc_name, &params);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
 
-START_TEST(test_ipc_txrx_us_timeout)
-{
-	qb_enter();
-	ipc_type = QB_IPC_SOCKET;
-	set_ipc_name(__func__);
-	test_ipc_txrx_timeout();
-	qb_leave();
-}
-END_TEST
+	/* the event size is what the client gets told about */
+	ck_assert_int_eq(qb_ipcc_get_buffer_size(conn), max_size / 4);
 
-START_TEST(test_ipc_shm_connect_async)
-{
-	qb_enter();
-	ipc_type = QB_IPC_SHM;
-	set_ipc_name(__func__);
-	test_ipc_connect_async();
-	qb_leave();
+	/* requests are bounded by the request size only */
+	request.hdr.id = IPC_MSG_REQ_TX_RX;
+	request.hdr.size = max_size / 2 + 1;
+	res = qb_ipcc_send(conn, &request, request.hdr.size);
+	ck_assert_int_eq(res, -EMSGSIZE);
+
+	req_header.id = IPC_MSG_REQ_TX_RX;
+	req_header.size = sizeof(struct qb_ipc_request_header);
+	iov[0].iov_len = req_header.size;
+	iov[0].iov_base = (void*)&req_header;
+
+	res = qb_ipcc_sendv_recv(conn, iov, 1,
+				 &res_header,
+				 sizeof(struct qb_ipc_response_header), 5000);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_TX_RX);
+
+	/* first event, which creates the event channel on demand */
+	res = send_and_check(IPC_MSG_REQ_DISPATCH, 0, 5000, QB_TRUE);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	res = send_and_check(IPC_MSG_REQ_DISPATCH, 0, 5000, QB_TRUE);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
 }
-END_TEST
 
-START_TEST(test_ipc_us_connect_async)
+START_TEST(test_ipc_txrx_us_asymmetric)
 {
 	qb_enter();
 	ipc_type = QB_IPC_SOCKET;
 	set_ipc_name(__func__);
-	test_ipc_connect_async();
+	test_ipc_txrx_asymmetric();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_txrx_shm_getauth)
+START_TEST(test_ipc_txrx_shm_asymmetric)
 {
 	qb_enter();
 	ipc_type = QB_IPC_SHM;
 	set_ipc_name(__func__);
-	test_ipc_getauth();
+	test_ipc_txrx_asymmetric();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_txrx_us_getauth)
+static void
+test_ipc_busy_poll(void)
 {
-	qb_enter();
-	ipc_type = QB_IPC_SOCKET;
-	set_ipc_name(__func__);
-	test_ipc_getauth();
-	qb_leave();
+	struct qb_ipcc_busy_poll_stats stats;
+	int32_t res;
+	int32_t j;
+	int32_t c = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	res = qb_ipcc_busy_poll_set(conn, 1000);
+	ck_assert_int_eq(res, 0);
+
+	for (j = 0; j < 10; j++) {
+		res = send_and_check(IPC_MSG_REQ_TX_RX, 64, 5000, QB_TRUE);
+		ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	}
+	res = qb_ipcc_busy_poll_stats_get(conn, &stats, QB_TRUE);
+	ck_assert_int_eq(res, 0);
+	ck_assert_int_eq(stats.polls, 10);
+	ck_assert(stats.hits <= stats.polls);
+
+	/* disabled again: nothing is counted */
+	qb_ipcc_busy_poll_set(conn, 0);
+	res = send_and_check(IPC_MSG_REQ_TX_RX, 64, 5000, QB_TRUE);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	qb_ipcc_busy_poll_stats_get(conn, &stats, QB_FALSE);
+	ck_assert_int_eq(stats.polls, 0);
+	ck_assert_int_eq(stats.hits, 0);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
 }
-END_TEST
 
-START_TEST(test_ipc_txrx_shm_tmo)
+START_TEST(test_ipc_busy_poll_us)
 {
 	qb_enter();
-	turn_on_fc = QB_FALSE;
-	ipc_type = QB_IPC_SHM;
+	ipc_type = QB_IPC_SOCKET;
 	set_ipc_name(__func__);
-	recv_timeout = 1000;
-	test_ipc_txrx();
+	test_ipc_busy_poll();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_txrx_shm_block)
+START_TEST(test_ipc_busy_poll_shm)
 {
 	qb_enter();
-	turn_on_fc = QB_FALSE;
 	ipc_type = QB_IPC_SHM;
 	set_ipc_name(__func__);
-	recv_timeout = -1;
-	test_ipc_txrx();
+	test_ipc_busy_poll();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_fc_shm)
+static void
+test_ipc_large_msg(void)
 {
-	qb_enter();
-	turn_on_fc = QB_TRUE;
-	ipc_type = QB_IPC_SHM;
-	recv_timeout = 500;
-	set_ipc_name(__func__);
-	test_ipc_txrx();
-	qb_leave();
+	struct qb_ipcc_connect_params params;
+	struct qb_ipc_request_header *req;
+	struct qb_ipc_response_header *res_hdr;
+	char *res_buf;
+	uint8_t *payload;
+	size_t size;
+	size_t res_size;
+	ssize_t res;
+	int32_t i;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+
+	memset(&params, 0, sizeof(params));
+	params.max_msg_size = max_size;
+	params.max_large_msg_size = 4 * max_size;
+
+	do {
+		conn = qb_ipcc_connect_2(ipc_name, &params);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	size = 2 * max_size;
+	req = calloc(1, size);
+	ck_assert(req != NULL);
+	req->id = IPC_MSG_REQ_LARGE;
+	req->size = size;
+	payload = (uint8_t *)(req + 1);
+	for (i = 0; i < size - sizeof(*req); i++) {
+		payload[i] = i & 0xff;
+	}
+
+	/* beyond the negotiated large message size */
+	res = qb_ipcc_send(conn, req, 5 * max_size);
+	ck_assert_int_eq(res, -EMSGSIZE);
+
+	res = qb_ipcc_send(conn, req, size);
+	ck_assert_int_eq(res, size);
+
+	res_size = sizeof(*res_hdr) + size - sizeof(*req);
+	res_buf = calloc(1, res_size);
+	ck_assert(res_buf != NULL);
+	res_hdr = (struct qb_ipc_response_header *)res_buf;
+
+	res = qb_ipcc_recv(conn, res_buf, res_size, 5000);
+	ck_assert_int_eq(res, res_size);
+	ck_assert_int_eq(res_hdr->id, IPC_MSG_RES_LARGE);
+	ck_assert_int_eq(res_hdr->size, res_size);
+	ck_assert(memcmp(res_hdr + 1, payload, size - sizeof(*req)) == 0);
+
+	memset(res_buf, 0, res_size);
+	res = qb_ipcc_event_recv(conn, res_buf, res_size, 5000);
+	ck_assert_int_eq(res, res_size);
+	ck_assert_int_eq(res_hdr->id, IPC_MSG_RES_LARGE);
+	ck_assert(memcmp(res_hdr + 1, payload, size - sizeof(*req)) == 0);
+
+	free(res_buf);
+	free(req);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
 }
-END_TEST
 
-START_TEST(test_ipc_txrx_us_block)
+START_TEST(test_ipc_large_msg_us)
 {
 	qb_enter();
-	turn_on_fc = QB_FALSE;
 	ipc_type = QB_IPC_SOCKET;
 	set_ipc_name(__func__);
-	recv_timeout = -1;
-	test_ipc_txrx();
+	test_ipc_large_msg();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_txrx_us_tmo)
+START_TEST(test_ipc_large_msg_shm)
 {
 	qb_enter();
-	turn_on_fc = QB_FALSE;
-	ipc_type = QB_IPC_SOCKET;
+	ipc_type = QB_IPC_SHM;
 	set_ipc_name(__func__);
-	recv_timeout = 1000;
-	test_ipc_txrx();
+	test_ipc_large_msg();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_fc_us)
+static void
+test_ipc_workers(void)
 {
-	qb_enter();
-	turn_on_fc = QB_TRUE;
-	ipc_type = QB_IPC_SOCKET;
-	recv_timeout = 500;
+	struct {
+		struct qb_ipc_request_header hdr __attribute__ ((aligned(8)));
+		uint32_t seq __attribute__ ((aligned(8)));
+	} req;
+	struct {
+		struct qb_ipc_response_header hdr __attribute__ ((aligned(8)));
+		uint32_t seq;
+	} rsp;
+	struct latency_stats_res stats_res;
+	ssize_t res;
+	uint32_t i;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+	const uint32_t num_reqs = 40;
+
+	use_workers = QB_TRUE;
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	use_workers = QB_FALSE;
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	/* more than max_in_flight, so flow control has to let go again */
+	for (i = 0; i < num_reqs; i++) {
+		req.hdr.id = IPC_MSG_REQ_WORKER_SEQ;
+		req.hdr.size = sizeof(req);
+		req.seq = i;
+		do {
+			res = qb_ipcc_send(conn, &req, sizeof(req));
+			if (res == -EAGAIN) {
+				poll(NULL, 0, 1);
+			}
+		} while (res == -EAGAIN);
+		ck_assert_int_eq(res, sizeof(req));
+	}
+
+	for (i = 0; i < num_reqs; i++) {
+		res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+		ck_assert_int_eq(res, sizeof(rsp.hdr) + sizeof(rsp.seq));
+		ck_assert_int_eq(rsp.hdr.id, IPC_MSG_RES_WORKER_SEQ);
+		ck_assert_int_eq(rsp.seq, i);
+	}
+
+	/*
+	 * The event of the first stats request waits for the main loop,
+	 * the second one sees it counted as queued.
+	 */
+	for (i = 0; i < 2; i++) {
+		req.hdr.id = IPC_MSG_REQ_STATS;
+		req.hdr.size = sizeof(req.hdr);
+		res = qb_ipcc_send(conn, &req, req.hdr.size);
+		ck_assert_int_eq(res, req.hdr.size);
+		res = qb_ipcc_recv(conn, &stats_res, sizeof(stats_res), 5000);
+		ck_assert_int_eq(res, sizeof(stats_res));
+		ck_assert_int_eq(stats_res.hdr.id, IPC_MSG_RES_STATS);
+		ck_assert_int_eq(stats_res.event_count, i);
+		ck_assert_int_eq(stats_res.event_queue_count, i);
+		res = qb_ipcc_event_recv(conn, &rsp.hdr, sizeof(rsp.hdr), 5000);
+		ck_assert_int_eq(res, sizeof(rsp.hdr));
+	}
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+#define MT_THREADS 4
+#define MT_REQS 25
+
+static void *
+threadsafe_sender(void *arg)
+{
+	uintptr_t t = (uintptr_t)arg;
+	struct {
+		struct qb_ipc_request_header hdr __attribute__ ((aligned(8)));
+		uint32_t seq __attribute__ ((aligned(8)));
+	} req;
+	struct {
+		struct qb_ipc_response_header hdr __attribute__ ((aligned(8)));
+		uint32_t seq;
+	} rsp;
+	struct iovec iov;
+	ssize_t res;
+	uint32_t i;
+
+	for (i = 0; i < MT_REQS; i++) {
+		req.hdr.id = IPC_MSG_REQ_WORKER_SEQ;
+		req.hdr.size = sizeof(req);
+		req.seq = t * 1000 + i;
+		iov.iov_base = &req;
+		iov.iov_len = sizeof(req);
+		do {
+			res = qb_ipcc_sendv_recv(conn, &iov, 1,
+						 &rsp, sizeof(rsp), 5000);
+			if (res == -EAGAIN) {
+				poll(NULL, 0, 1);
+			}
+		} while (res == -EAGAIN);
+		if (res != sizeof(rsp.hdr) + sizeof(rsp.seq) ||
+		    rsp.seq != req.seq) {
+			return (void *)1;
+		}
+	}
+	return NULL;
+}
+
+static void
+test_ipc_threadsafe(void)
+{
+	struct qb_ipc_request_header req;
+	pthread_t threads[MT_THREADS];
+	void *retval;
+	ssize_t res;
+	uintptr_t t;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	use_workers = QB_TRUE;
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	use_workers = QB_FALSE;
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	res = qb_ipcc_threadsafe_set(conn, QB_TRUE);
+	ck_assert_int_eq(res, 0);
+
+	/* only the request/response call is allowed now */
+	req.id = IPC_MSG_REQ_TX_RX;
+	req.size = sizeof(req);
+	res = qb_ipcc_send(conn, &req, sizeof(req));
+	ck_assert_int_eq(res, -EBUSY);
+	res = qb_ipcc_recv(conn, &req, sizeof(req), 0);
+	ck_assert_int_eq(res, -EBUSY);
+
+	for (t = 0; t < MT_THREADS; t++) {
+		res = pthread_create(&threads[t], NULL, threadsafe_sender,
+				     (void *)t);
+		ck_assert_int_eq(res, 0);
+	}
+	for (t = 0; t < MT_THREADS; t++) {
+		pthread_join(threads[t], &retval);
+		ck_assert(retval == NULL);
+	}
+
+	res = qb_ipcc_threadsafe_set(conn, QB_FALSE);
+	ck_assert_int_eq(res, 0);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_threadsafe_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_threadsafe();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_threadsafe_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_threadsafe();
+	qb_leave();
+}
+END_TEST
+
+static void *
+threadsafe_slow_sender(void *arg)
+{
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	struct iovec iov;
+	ssize_t res;
+
+	req.id = IPC_MSG_REQ_SLOW;
+	req.size = sizeof(req);
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	res = qb_ipcc_sendv_recv(conn, &iov, 1, &rsp, sizeof(rsp), 5000);
+	if (res != sizeof(rsp) || rsp.id != IPC_MSG_RES_SLOW) {
+		return (void *)1;
+	}
+	return NULL;
+}
+
+static void
+test_ipc_threadsafe_nowait(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov[1];
+	pthread_t thread;
+	void *retval;
+	ssize_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	int32_t i;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	res = qb_ipcc_threadsafe_set(conn, QB_TRUE);
+	ck_assert_int_eq(res, 0);
+
+	/*
+	 * a zero timeout still gets a try at the response, the same as
+	 * without thread-safe mode: queued behind a slow request it waits
+	 * for that one's receive and then picks up its own response, which
+	 * the server sends straight after
+	 */
+	req_header.id = IPC_MSG_REQ_TX_RX;
+	req_header.size = sizeof(struct qb_ipc_request_header);
+	iov[0].iov_len = req_header.size;
+	iov[0].iov_base = (void*)&req_header;
+	for (i = 0; i < 5; i++) {
+		res = pthread_create(&thread, NULL, threadsafe_slow_sender, NULL);
+		ck_assert_int_eq(res, 0);
+		poll(NULL, 0, 50);
+
+		res = qb_ipcc_sendv_recv(conn, iov, 1, &res_header,
+					 sizeof(res_header), 0);
+
+		pthread_join(thread, &retval);
+		ck_assert(retval == NULL);
+		if (res != -ETIMEDOUT) {
+			break;
+		}
+	}
+	ck_assert_int_eq(res, sizeof(res_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_TX_RX);
+
+	res = qb_ipcc_threadsafe_set(conn, QB_FALSE);
+	ck_assert_int_eq(res, 0);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_threadsafe_nowait_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_threadsafe_nowait();
+	qb_leave();
+}
+END_TEST
+
+static void
+test_ipc_threadsafe_timeout_disable(void)
+{
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	struct iovec iov;
+	ssize_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	res = qb_ipcc_threadsafe_set(conn, QB_TRUE);
+	ck_assert_int_eq(res, 0);
+
+	req.id = IPC_MSG_REQ_SLOW;
+	req.size = sizeof(req);
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	res = qb_ipcc_sendv_recv(conn, &iov, 1, &rsp, sizeof(rsp), 50);
+	ck_assert_int_eq(res, -ETIMEDOUT);
+
+	/* the slow response is still to come */
+	res = qb_ipcc_threadsafe_set(conn, QB_FALSE);
+	ck_assert_int_eq(res, -EBUSY);
+	poll(NULL, 0, 500);
+	res = qb_ipcc_threadsafe_set(conn, QB_FALSE);
+	ck_assert_int_eq(res, 0);
+
+	/* and it was thrown away, not left for the next call */
+	req.id = IPC_MSG_REQ_TX_RX;
+	res = qb_ipcc_sendv_recv(conn, &iov, 1, &rsp, sizeof(rsp), 5000);
+	ck_assert_int_eq(res, sizeof(rsp));
+	ck_assert_int_eq(rsp.id, IPC_MSG_RES_TX_RX);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_threadsafe_timeout_disable_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_threadsafe_timeout_disable();
+	qb_leave();
+}
+END_TEST
+
+/* the test server answers request n with n + 1 */
+static int32_t
+threadsafe_match(int32_t request_id, int32_t response_id)
+{
+	return response_id == request_id + 1;
+}
+
+/* the test server doesn't answer ids it doesn't know */
+#define IPC_MSG_REQ_UNANSWERED 9999
+
+static void *
+threadsafe_unanswered_sender(void *arg)
+{
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	struct iovec iov;
+	ssize_t *res = arg;
+
+	req.id = IPC_MSG_REQ_UNANSWERED;
+	req.size = sizeof(req);
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	*res = qb_ipcc_sendv_recv(conn, &iov, 1, &rsp, sizeof(rsp), 5000);
+	return NULL;
+}
+
+static void
+test_ipc_threadsafe_match(void)
+{
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	struct iovec iov;
+	pthread_t thread;
+	ssize_t thread_res = 0;
+	ssize_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	res = qb_ipcc_threadsafe_match_set(conn, threadsafe_match);
+	ck_assert_int_eq(res, -EINVAL);
+	res = qb_ipcc_threadsafe_set(conn, QB_TRUE);
+	ck_assert_int_eq(res, 0);
+	res = qb_ipcc_threadsafe_match_set(conn, threadsafe_match);
+	ck_assert_int_eq(res, 0);
+
+	/*
+	 * the first request is never answered: rather than taking the
+	 * response to the second one, it finds out
+	 */
+	res = pthread_create(&thread, NULL, threadsafe_unanswered_sender,
+			     &thread_res);
+	ck_assert_int_eq(res, 0);
+	poll(NULL, 0, 100);
+
+	req.id = IPC_MSG_REQ_TX_RX;
+	req.size = sizeof(req);
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	res = qb_ipcc_sendv_recv(conn, &iov, 1, &rsp, sizeof(rsp), 5000);
+	ck_assert_int_eq(res, sizeof(rsp));
+	ck_assert_int_eq(rsp.id, IPC_MSG_RES_TX_RX);
+
+	pthread_join(thread, NULL);
+	ck_assert_int_eq(thread_res, -ENOMSG);
+
+	res = qb_ipcc_threadsafe_set(conn, QB_FALSE);
+	ck_assert_int_eq(res, 0);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_threadsafe_match_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_threadsafe_match();
+	qb_leave();
+}
+END_TEST
+
+static void *
+threadsafe_orphan_sender(void *arg)
+{
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	struct iovec iov;
+	ssize_t *res = arg;
+
+	req.id = IPC_MSG_REQ_SLOW;
+	req.size = sizeof(req);
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	*res = qb_ipcc_sendv_recv(conn, &iov, 1, &rsp, sizeof(rsp), 5000);
+	return NULL;
+}
+
+static void
+test_ipc_threadsafe_disconnect(void)
+{
+	pthread_t thread;
+	ssize_t thread_res = 0;
+	ssize_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	res = qb_ipcc_threadsafe_set(conn, QB_TRUE);
+	ck_assert_int_eq(res, 0);
+
+	/* pull the connection from under a call still waiting */
+	res = pthread_create(&thread, NULL, threadsafe_orphan_sender,
+			     &thread_res);
+	ck_assert_int_eq(res, 0);
+	poll(NULL, 0, 100);
+	res = qb_ipcc_threadsafe_set(conn, QB_FALSE);
+	ck_assert_int_eq(res, -EBUSY);
+	qb_ipcc_disconnect(conn);
+	pthread_join(thread, NULL);
+	ck_assert_int_eq(thread_res, -ENOTCONN);
+
+	/* the server stops once its only client is gone */
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_threadsafe_disconnect_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_threadsafe_disconnect();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_workers_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_workers();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_workers_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_workers();
+	qb_leave();
+}
+END_TEST
+
+static void
+test_ipc_stats_latency(void)
+{
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	struct latency_stats_res stats_res;
+	ssize_t res;
+	int32_t i;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	for (i = 0; i < 5; i++) {
+		req.id = IPC_MSG_REQ_TX_RX;
+		req.size = sizeof(req);
+		res = qb_ipcc_send(conn, &req, req.size);
+		ck_assert_int_eq(res, sizeof(req));
+		res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+		ck_assert_int_eq(res, sizeof(rsp));
+	}
+
+	req.id = IPC_MSG_REQ_STATS;
+	req.size = sizeof(req);
+	res = qb_ipcc_send(conn, &req, req.size);
+	ck_assert_int_eq(res, sizeof(req));
+	res = qb_ipcc_recv(conn, &stats_res, sizeof(stats_res), 5000);
+	ck_assert_int_eq(res, sizeof(stats_res));
+	ck_assert_int_eq(stats_res.hdr.id, IPC_MSG_RES_STATS);
+
+	/* the stats request itself is still being processed */
+	ck_assert_int_eq(stats_res.process_count, 5);
+	ck_assert_int_eq(stats_res.bucket_total, 5);
+	ck_assert_int_eq(stats_res.queue_count, 6);
+	ck_assert_int_eq(stats_res.event_count, 1);
+	/* sent straight away, it never waited in a queue */
+	ck_assert_int_eq(stats_res.event_queue_count, 0);
+	ck_assert(stats_res.service_process_count >= stats_res.process_count);
+	ck_assert(stats_res.p99_ns <= stats_res.max_ns);
+	ck_assert_int_eq(stats_res.p100_ns, stats_res.max_ns);
+
+	res = qb_ipcc_event_recv(conn, &rsp, sizeof(rsp), 5000);
+	ck_assert_int_eq(res, sizeof(rsp));
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_stats_latency_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_stats_latency();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_stats_latency_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_stats_latency();
+	qb_leave();
+}
+END_TEST
+
+static void
+test_ipc_hipri(void)
+{
+	struct qb_ipcc_connect_params params;
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	char big[2048];
+	ssize_t res;
+	int32_t i;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+
+	memset(&params, 0, sizeof(params));
+	params.max_msg_size = max_size;
+	params.max_hipri_msg_size = 1024;
+
+	do {
+		conn = qb_ipcc_connect_2(ipc_name, &params);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	req.id = IPC_MSG_REQ_SLOW;
+	req.size = sizeof(req);
+	res = qb_ipcc_send_prio(conn, &req, req.size, QB_IPCC_SEND_NORMAL);
+	ck_assert_int_eq(res, sizeof(req));
+	/* make sure the server is busy with it before queueing the rest */
+	poll(NULL, 0, 100);
+	for (i = 0; i < 5; i++) {
+		req.id = IPC_MSG_REQ_TX_RX;
+		res = qb_ipcc_send(conn, &req, req.size);
+		ck_assert_int_eq(res, sizeof(req));
+	}
+	req.id = IPC_MSG_REQ_HIPRI;
+	res = qb_ipcc_send_prio(conn, &req, req.size, QB_IPCC_SEND_HIGH);
+	ck_assert_int_eq(res, sizeof(req));
+
+	/* the high priority request overtakes everything still queued */
+	res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+	ck_assert_int_eq(res, sizeof(rsp));
+	ck_assert_int_eq(rsp.id, IPC_MSG_RES_SLOW);
+	res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+	ck_assert_int_eq(res, sizeof(rsp));
+	ck_assert_int_eq(rsp.id, IPC_MSG_RES_HIPRI);
+	for (i = 0; i < 5; i++) {
+		res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+		ck_assert_int_eq(res, sizeof(rsp));
+		ck_assert_int_eq(rsp.id, IPC_MSG_RES_TX_RX);
+	}
+
+	/* bigger than the negotiated lane and no large messages */
+	memset(big, 0, sizeof(big));
+	memcpy(big, &req, sizeof(req));
+	res = qb_ipcc_send_prio(conn, big, sizeof(big), QB_IPCC_SEND_HIGH);
+	ck_assert_int_eq(res, -EMSGSIZE);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+
+	/* no lane asked for, none granted */
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+	c = 0;
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	res = qb_ipcc_send_prio(conn, &req, req.size, QB_IPCC_SEND_HIGH);
+	ck_assert_int_eq(res, -ENOTSUP);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_hipri_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_hipri();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_hipri_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_hipri();
+	qb_leave();
+}
+END_TEST
+
+static void
+test_ipc_hipri_workers(void)
+{
+	struct qb_ipcc_connect_params params;
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	ssize_t res;
+	int32_t i;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint64_t start;
+	const int32_t num_slow = 8;	/* max_in_flight of the server */
+
+	use_workers = QB_TRUE;
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	use_workers = QB_FALSE;
+	ck_assert(pid != -1);
+
+	memset(&params, 0, sizeof(params));
+	params.max_msg_size = MAX_MSG_SIZE;
+	params.max_hipri_msg_size = 1024;
+
+	do {
+		conn = qb_ipcc_connect_2(ipc_name, &params);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	/* the last one has the workers flow control the connection */
+	req.id = IPC_MSG_REQ_SLOW;
+	req.size = sizeof(req);
+	for (i = 0; i < num_slow; i++) {
+		res = qb_ipcc_send(conn, &req, req.size);
+		ck_assert_int_eq(res, sizeof(req));
+	}
+	poll(NULL, 0, 100);
+
+	start = qb_util_nano_current_get();
+	req.id = IPC_MSG_REQ_HIPRI;
+	res = qb_ipcc_send_prio(conn, &req, req.size, QB_IPCC_SEND_HIGH);
+	ck_assert_int_eq(res, sizeof(req));
+
+	/* answered before the first slow one is done, let alone the rest */
+	res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+	ck_assert_int_eq(res, sizeof(rsp));
+	ck_assert_int_eq(rsp.id, IPC_MSG_RES_HIPRI);
+	ck_assert(qb_util_nano_current_get() - start < 150 * QB_TIME_NS_IN_MSEC);
+
+	for (i = 0; i < num_slow; i++) {
+		res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+		ck_assert_int_eq(res, sizeof(rsp));
+		ck_assert_int_eq(rsp.id, IPC_MSG_RES_SLOW);
+	}
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_hipri_workers_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_hipri_workers();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_hipri_workers_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_hipri_workers();
+	qb_leave();
+}
+END_TEST
+
+static qb_ipcc_connection_t *
+doorbell_connect(pid_t pid, int32_t with_params)
+{
+	struct qb_ipcc_connect_params params;
+	qb_ipcc_connection_t *c;
+	int32_t tries = 0;
+	int32_t j;
+
+	memset(&params, 0, sizeof(params));
+	params.max_msg_size = MAX_MSG_SIZE;
+	do {
+		if (with_params) {
+			c = qb_ipcc_connect_2(ipc_name, &params);
+		} else {
+			c = qb_ipcc_connect(ipc_name, MAX_MSG_SIZE);
+		}
+		if (c == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			tries++;
+		}
+	} while (c == NULL && tries < 5);
+	ck_assert(c != NULL);
+	return c;
+}
+
+static void
+doorbell_txrx(qb_ipcc_connection_t *c, int32_t count)
+{
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	ssize_t res;
+	int32_t i;
+
+	req.id = IPC_MSG_REQ_TX_RX;
+	req.size = sizeof(req);
+	for (i = 0; i < count; i++) {
+		res = qb_ipcc_send(c, &req, req.size);
+		ck_assert_int_eq(res, sizeof(req));
+	}
+	for (i = 0; i < count; i++) {
+		res = qb_ipcc_recv(c, &rsp, sizeof(rsp), 5000);
+		ck_assert_int_eq(res, sizeof(rsp));
+		ck_assert_int_eq(rsp.id, IPC_MSG_RES_TX_RX);
+	}
+}
+
+static void
+test_ipc_doorbell(void)
+{
+	qb_ipcc_connection_t *c2;
+	qb_ipcc_connection_t *c3;
+	qb_ipcc_connection_t *c4;
+	pid_t pid;
+	int32_t i;
+
+	multiple_connections = QB_TRUE;
+	use_doorbell = QB_TRUE;
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	use_doorbell = QB_FALSE;
+	multiple_connections = QB_FALSE;
+	ck_assert(pid != -1);
+
+	/* two doorbell slots, then one that has to do without */
+	conn = doorbell_connect(pid, QB_TRUE);
+	c2 = doorbell_connect(pid, QB_TRUE);
+	c3 = doorbell_connect(pid, QB_TRUE);
+	c4 = doorbell_connect(pid, QB_FALSE);
+
+	for (i = 0; i < 10; i++) {
+		doorbell_txrx(conn, 1);
+		doorbell_txrx(c2, 3);
+		doorbell_txrx(c3, 2);
+		doorbell_txrx(c4, 1);
+	}
+	/* more than the server takes in one dispatch */
+	doorbell_txrx(c2, 200);
+
+	/* a freed slot goes to the next client */
+	qb_ipcc_disconnect(c2);
+	c2 = doorbell_connect(pid, QB_TRUE);
+	doorbell_txrx(c2, 5);
+	doorbell_txrx(conn, 5);
+
+	qb_ipcc_disconnect(c2);
+	qb_ipcc_disconnect(c3);
+	qb_ipcc_disconnect(c4);
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+static void
+test_ipc_accept_async(void)
+{
+	qb_ipcc_connection_t *c2;
+	qb_ipcc_connection_t *c3;
+	int fd2;
+	int fd3;
+	struct pollfd pfd;
+	pid_t pid;
+
+	multiple_connections = QB_TRUE;
+	defer_accept = QB_TRUE;
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	defer_accept = QB_FALSE;
+	multiple_connections = QB_FALSE;
+	ck_assert(pid != -1);
+
+	conn = doorbell_connect(pid, QB_FALSE);
+
+	/* both wait on the server at the same time */
+	c2 = qb_ipcc_connect_async(ipc_name, MAX_MSG_SIZE, &fd2);
+	ck_assert(c2 != NULL);
+	c3 = qb_ipcc_connect_async(ipc_name, MAX_MSG_SIZE, &fd3);
+	ck_assert(c3 != NULL);
+
+	pfd.fd = fd2;
+	pfd.events = POLLIN;
+	ck_assert_int_eq(poll(&pfd, 1, 5000), 1);
+	ck_assert_int_eq(qb_ipcc_connect_continue(c2), -EACCES);
+	pfd.fd = fd3;
+	ck_assert_int_eq(poll(&pfd, 1, 5000), 1);
+	ck_assert_int_eq(qb_ipcc_connect_continue(c3), 0);
+
+	doorbell_txrx(conn, 5);
+	doorbell_txrx(c3, 5);
+
+	qb_ipcc_disconnect(c3);
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+#define TEARDOWN_CONNECTIONS 8
+
+/*
+ * Count the connection directories servers still have for us.
+ */
+static int32_t
+connection_dirs_count(void)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int client;
+	int32_t count = 0;
+
+	dir = opendir("/dev/shm");
+	if (dir == NULL) {
+		return -errno;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (sscanf(entry->d_name, "qb-%*d-%d-", &client) == 1 &&
+		    client == getpid()) {
+			count++;
+		}
+	}
+	closedir(dir);
+	return count;
+}
+
+static void
+test_ipc_deferred_teardown(void)
+{
+	qb_ipcc_connection_t *conns[TEARDOWN_CONNECTIONS];
+	pid_t pid;
+	int32_t i;
+	int32_t dirs = -1;
+
+	multiple_connections = QB_TRUE;
+	use_deferred_teardown = QB_TRUE;
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	use_deferred_teardown = QB_FALSE;
+	multiple_connections = QB_FALSE;
+	ck_assert(pid != -1);
+
+	conn = doorbell_connect(pid, QB_FALSE);
+	for (i = 0; i < TEARDOWN_CONNECTIONS; i++) {
+		conns[i] = doorbell_connect(pid, QB_TRUE);
+		doorbell_txrx(conns[i], 1);
+	}
+	for (i = 0; i < TEARDOWN_CONNECTIONS; i++) {
+		qb_ipcc_disconnect(conns[i]);
+	}
+
+	/* the server keeps serving while it cleans up */
+	for (i = 0; i < 5; i++) {
+		doorbell_txrx(conn, 4);
+	}
+
+#if defined(QB_LINUX)
+	for (i = 0; i < 50; i++) {
+		dirs = connection_dirs_count();
+		if (dirs == 1) {
+			break;
+		}
+		poll(NULL, 0, 100);
+	}
+	ck_assert_int_eq(dirs, 1);
+#endif
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_deferred_teardown_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_deferred_teardown();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_deferred_teardown_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_deferred_teardown();
+	qb_leave();
+}
+END_TEST
+
+static void
+echo_check(int32_t size, int32_t expected_id, int32_t expected_error)
+{
+	char buf[ECHO_MAX_SIZE * 2];
+	struct qb_ipc_request_header *req = (struct qb_ipc_request_header *)buf;
+	struct qb_ipc_response_header rsp;
+	ssize_t res;
+
+	memset(buf, 0, sizeof(buf));
+	req->id = IPC_MSG_REQ_ECHO;
+	req->size = size;
+	res = qb_ipcc_send(conn, req, size);
+	ck_assert_int_eq(res, size);
+	res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+	ck_assert_int_eq(res, sizeof(rsp));
+	ck_assert_int_eq(rsp.id, expected_id);
+	ck_assert_int_eq(rsp.error, expected_error);
+}
+
+static void
+test_ipc_msg_handlers(void)
+{
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	struct msg_stats_res stats_res;
+	ssize_t res;
+	int32_t i;
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+
+	use_msg_handlers = QB_TRUE;
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	use_msg_handlers = QB_FALSE;
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, MAX_MSG_SIZE);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	/* ids without a handler still go to msg_process */
+	req.id = IPC_MSG_REQ_TX_RX;
+	req.size = sizeof(req);
+	res = qb_ipcc_send(conn, &req, req.size);
+	ck_assert_int_eq(res, sizeof(req));
+	res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+	ck_assert_int_eq(res, sizeof(rsp));
+	ck_assert_int_eq(rsp.id, IPC_MSG_RES_TX_RX);
+
+	for (i = 0; i < 3; i++) {
+		echo_check(ECHO_MIN_SIZE + 8 * i, IPC_MSG_RES_ECHO, 0);
+	}
+	echo_check(ECHO_MIN_SIZE - 8, IPC_MSG_REQ_ECHO, -EINVAL);
+	echo_check(ECHO_MAX_SIZE + 8, IPC_MSG_REQ_ECHO, -EINVAL);
+
+	req.id = IPC_MSG_REQ_MSG_STATS;
+	req.size = sizeof(req);
+	res = qb_ipcc_send(conn, &req, req.size);
+	ck_assert_int_eq(res, sizeof(req));
+	res = qb_ipcc_recv(conn, &stats_res, sizeof(stats_res), 5000);
+	ck_assert_int_eq(res, sizeof(stats_res));
+	ck_assert_int_eq(stats_res.hdr.id, IPC_MSG_RES_MSG_STATS);
+	ck_assert_int_eq(stats_res.hdr.error, 0);
+	ck_assert_int_eq(stats_res.stats.count, 3);
+	ck_assert_int_eq(stats_res.stats.bytes, 3 * ECHO_MIN_SIZE + 24);
+	ck_assert_int_eq(stats_res.stats.rejected, 2);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+/*
+ * Ask for the EVENT_IDS_COUNT events and check which ones arrive.
+ */
+static void
+event_ids_check(const int32_t *expected, int32_t num_expected)
+{
+	struct qb_ipc_request_header req;
+	struct qb_ipc_response_header rsp;
+	ssize_t res;
+	int32_t i;
+
+	req.id = IPC_MSG_REQ_EVENT_IDS;
+	req.size = sizeof(req);
+	res = qb_ipcc_send(conn, &req, req.size);
+	ck_assert_int_eq(res, sizeof(req));
+	res = qb_ipcc_recv(conn, &rsp, sizeof(rsp), 5000);
+	ck_assert_int_eq(res, sizeof(rsp));
+	ck_assert_int_eq(rsp.id, IPC_MSG_RES_EVENT_IDS);
+
+	for (i = 0; i < num_expected; i++) {
+		res = qb_ipcc_event_recv(conn, &rsp, sizeof(rsp), 5000);
+		ck_assert_int_eq(res, sizeof(rsp));
+		ck_assert_int_eq(rsp.id, expected[i]);
+	}
+	res = qb_ipcc_event_recv(conn, &rsp, sizeof(rsp), 100);
+	ck_assert(res == -EAGAIN || res == -ETIMEDOUT);
+}
+
+static void
+test_ipc_event_subscribe(void)
+{
+	struct qb_ipc_event_range ranges[QB_IPC_EVENT_RANGES_MAX + 1] = {
+		{ EVENT_IDS_FIRST + 2, EVENT_IDS_FIRST + 3 },
+		{ EVENT_IDS_FIRST + 7, EVENT_IDS_FIRST + 7 },
+		{ EVENT_IDS_FIRST + EVENT_IDS_COUNT, INT32_MAX },
+	};
+	const int32_t some[] = {
+		EVENT_IDS_FIRST + 2, EVENT_IDS_FIRST + 3, EVENT_IDS_FIRST + 7
+	};
+	int32_t all[EVENT_IDS_COUNT];
+	struct qb_ipc_event_range backwards = { 5, 4 };
+	qb_ipcc_connection_t *old_conn;
+	int32_t res;
+	int32_t i;
+	pid_t pid;
+
+	multiple_connections = QB_TRUE;
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	multiple_connections = QB_FALSE;
+	ck_assert(pid != -1);
+
+	/* the server only says it can filter to qb_ipcc_connect_2() */
+	old_conn = doorbell_connect(pid, QB_FALSE);
+	res = qb_ipcc_event_subscribe(old_conn, ranges, 1);
+	ck_assert_int_eq(res, -ENOTSUP);
+	qb_ipcc_disconnect(old_conn);
+
+	conn = doorbell_connect(pid, QB_TRUE);
+
+	for (i = 0; i < EVENT_IDS_COUNT; i++) {
+		all[i] = EVENT_IDS_FIRST + i;
+	}
+	event_ids_check(all, EVENT_IDS_COUNT);
+
+	res = qb_ipcc_event_subscribe(conn, &backwards, 1);
+	ck_assert_int_eq(res, -EINVAL);
+	res = qb_ipcc_event_subscribe(conn, ranges,
+				      QB_IPC_EVENT_RANGES_MAX + 1);
+	ck_assert_int_eq(res, -EINVAL);
+
+	res = qb_ipcc_event_subscribe(conn, ranges, 3);
+	ck_assert_int_eq(res, 0);
+	event_ids_check(some, 3);
+
+	res = qb_ipcc_event_subscribe(conn, NULL, 0);
+	ck_assert_int_eq(res, 0);
+	event_ids_check(all, EVENT_IDS_COUNT);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_event_subscribe_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_event_subscribe();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_event_subscribe_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_event_subscribe();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_msg_handlers_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_msg_handlers();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_msg_handlers_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_msg_handlers();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_msg_handlers_workers_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	use_workers = QB_TRUE;
+	test_ipc_msg_handlers();
+	use_workers = QB_FALSE;
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_accept_async_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_accept_async();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_accept_async_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_accept_async();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_doorbell_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_doorbell();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_doorbell_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_doorbell();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_exit_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	recv_timeout = 5000;
+	test_ipc_exit();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_exit_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	recv_timeout = 1000;
+	test_ipc_exit();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_txrx_shm_timeout)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_txrx_timeout();
+	qb_leave();
+}
+END_TEST
+
+
+START_TEST(test_ipc_txrx_us_timeout)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_txrx_timeout();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_shm_connect_async)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_connect_async();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_us_connect_async)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_connect_async();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_txrx_shm_getauth)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_getauth();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_txrx_us_getauth)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_getauth();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_txrx_shm_tmo)
+{
+	qb_enter();
+	turn_on_fc = QB_FALSE;
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	recv_timeout = 1000;
+	test_ipc_txrx();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_txrx_shm_block)
+{
+	qb_enter();
+	turn_on_fc = QB_FALSE;
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	recv_timeout = -1;
+	test_ipc_txrx();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_fc_shm)
+{
+	qb_enter();
+	turn_on_fc = QB_TRUE;
+	ipc_type = QB_IPC_SHM;
+	recv_timeout = 500;
+	set_ipc_name(__func__);
+	test_ipc_txrx();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_txrx_us_block)
+{
+	qb_enter();
+	turn_on_fc = QB_FALSE;
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	recv_timeout = -1;
+	test_ipc_txrx();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_txrx_us_tmo)
+{
+	qb_enter();
+	turn_on_fc = QB_FALSE;
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	recv_timeout = 1000;
+	test_ipc_txrx();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_fc_us)
+{
+	qb_enter();
+	turn_on_fc = QB_TRUE;
+	ipc_type = QB_IPC_SOCKET;
+	recv_timeout = 500;
 	set_ipc_name(__func__);
 	test_ipc_txrx();
 	qb_leave();
@@ -2120,6 +3920,80 @@ START_TEST(test_ipc_server_perms)
 }
 END_TEST
 
+/*
+ * A server that predates the trailing fields of the connection request
+ * reads only QB_IPC_CONNECTION_REQUEST_BASE_SIZE and leaves the rest on
+ * the setup socket. Play that server: connect with a legacy sized
+ * request and push the trailing fields after it, then check the stray
+ * bytes don't get in the way of requests, events or the disconnect.
+ */
+static void
+test_ipc_legacy_reader(void)
+{
+	struct qb_ipc_connection_request trailing;
+	size_t base = QB_IPC_CONNECTION_REQUEST_BASE_SIZE;
+	int32_t res;
+	int32_t c = 0;
+	int32_t j = 0;
+	int32_t i;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process("server", run_ipc_server, NULL);
+	ck_assert(pid != -1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			poll(NULL, 0, 400);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	ck_assert(conn != NULL);
+
+	memset(&trailing, 0, sizeof(trailing));
+	trailing.request_size = max_size;
+	trailing.response_size = max_size;
+	trailing.event_size = max_size;
+	trailing.doorbell = QB_TRUE;
+	res = send(conn->setup.u.us.sock, (char *)&trailing + base,
+		   sizeof(trailing) - base, MSG_NOSIGNAL);
+	ck_assert_int_eq(res, sizeof(trailing) - base);
+
+	for (i = 0; i < 8; i++) {
+		res = send_and_check(IPC_MSG_REQ_TX_RX, 0, 5000, QB_TRUE);
+		ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+	}
+	res = send_and_check(IPC_MSG_REQ_DISPATCH, 0, 5000, QB_TRUE);
+	ck_assert_int_eq(res, sizeof(struct qb_ipc_response_header));
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_legacy_reader_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	set_ipc_name(__func__);
+	test_ipc_legacy_reader();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_legacy_reader_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	set_ipc_name(__func__);
+	test_ipc_legacy_reader();
+	qb_leave();
+}
+END_TEST
+
 START_TEST(test_ipc_disp_shm_native_prio_dlock)
 {
 	pid_t server_pid, alphaclient_pid;
@@ -2363,6 +4237,21 @@ make_shm_suite(void)
 	add_tcase(s, tc, test_ipc_shm_connect_async, 7);
 
 	add_tcase(s, tc, test_ipc_txrx_shm_getauth, 7);
+	add_tcase(s, tc, test_ipc_txrx_shm_asymmetric, 7);
+	add_tcase(s, tc, test_ipc_legacy_reader_shm, 7);
+	add_tcase(s, tc, test_ipc_busy_poll_shm, 7);
+	add_tcase(s, tc, test_ipc_large_msg_shm, 7);
+	add_tcase(s, tc, test_ipc_workers_shm, 7);
+	add_tcase(s, tc, test_ipc_stats_latency_shm, 7);
+	add_tcase(s, tc, test_ipc_threadsafe_shm, 7);
+	add_tcase(s, tc, test_ipc_hipri_shm, 7);
+	add_tcase(s, tc, test_ipc_hipri_workers_shm, 8);
+	add_tcase(s, tc, test_ipc_doorbell_shm, 7);
+	add_tcase(s, tc, test_ipc_accept_async_shm, 7);
+	add_tcase(s, tc, test_ipc_deferred_teardown_shm, 7);
+	add_tcase(s, tc, test_ipc_msg_handlers_shm, 7);
+	add_tcase(s, tc, test_ipc_msg_handlers_workers_shm, 7);
+	add_tcase(s, tc, test_ipc_event_subscribe_shm, 7);
 	add_tcase(s, tc, test_ipc_txrx_shm_timeout, 28);
 	add_tcase(s, tc, test_ipc_server_fail_shm, 7);
 	add_tcase(s, tc, test_ipc_txrx_shm_block, 7);
@@ -2396,6 +4285,24 @@ make_soc_suite(void)
 	add_tcase(s, tc, test_ipc_us_connect_async, 7);
 
 	add_tcase(s, tc, test_ipc_txrx_us_getauth, 7);
+	add_tcase(s, tc, test_ipc_txrx_us_asymmetric, 7);
+	add_tcase(s, tc, test_ipc_legacy_reader_us, 7);
+	add_tcase(s, tc, test_ipc_busy_poll_us, 7);
+	add_tcase(s, tc, test_ipc_large_msg_us, 7);
+	add_tcase(s, tc, test_ipc_workers_us, 7);
+	add_tcase(s, tc, test_ipc_stats_latency_us, 7);
+	add_tcase(s, tc, test_ipc_threadsafe_us, 7);
+	add_tcase(s, tc, test_ipc_threadsafe_nowait_us, 8);
+	add_tcase(s, tc, test_ipc_threadsafe_disconnect_us, 8);
+	add_tcase(s, tc, test_ipc_threadsafe_timeout_disable_us, 8);
+	add_tcase(s, tc, test_ipc_threadsafe_match_us, 8);
+	add_tcase(s, tc, test_ipc_hipri_us, 7);
+	add_tcase(s, tc, test_ipc_hipri_workers_us, 8);
+	add_tcase(s, tc, test_ipc_doorbell_us, 7);
+	add_tcase(s, tc, test_ipc_accept_async_us, 7);
+	add_tcase(s, tc, test_ipc_deferred_teardown_us, 7);
+	add_tcase(s, tc, test_ipc_msg_handlers_us, 7);
+	add_tcase(s, tc, test_ipc_event_subscribe_us, 7);
 	add_tcase(s, tc, test_ipc_txrx_us_timeout, 28);
 /* Commented out for the moment as space in /dev/shm on the CI machines
    causes random failures */
@@ -27,6 +27,7 @@
 
 #include <qb/qbdefs.h>
 #include <qb/qbutil.h>
+#include <qb/qbarray.h>
 #include <qb/qbloop.h>
 #include <qb/qblog.h>
 
@@ -326,6 +327,506 @@ START_TEST(test_job_add_del)
 }
 END_TEST
 
+#define TS_THREADS 4
+#define TS_JOBS_PER_THREAD 2000
+
+struct ts_job {
+	qb_loop_t *l;
+	int32_t thread;
+	int32_t seq;
+};
+
+static int32_t ts_last_seq[TS_THREADS];
+static int32_t ts_run_count;
+
+static void
+ts_job_run(void *data)
+{
+	struct ts_job *job = (struct ts_job *)data;
+
+	/* jobs of one priority run in the order they were added */
+	ck_assert_int_eq(job->seq, ts_last_seq[job->thread] + 1);
+	ts_last_seq[job->thread] = job->seq;
+	if (++ts_run_count == TS_THREADS * TS_JOBS_PER_THREAD) {
+		qb_loop_stop(job->l);
+	}
+}
+
+static void *
+ts_job_thread(void *data)
+{
+	struct ts_job *jobs = (struct ts_job *)data;
+	enum qb_loop_priority p = jobs[0].thread % 2 ? QB_LOOP_LOW : QB_LOOP_HIGH;
+	int32_t res;
+	int32_t i;
+
+	for (i = 0; i < TS_JOBS_PER_THREAD; i++) {
+		res = qb_loop_job_add_threadsafe(jobs[i].l, p,
+						 &jobs[i], ts_job_run);
+		ck_assert_int_eq(res, 0);
+		if (i % 100 == 0) {
+			/* let the loop go back to sleep now and then */
+			usleep(1000);
+		}
+	}
+	return NULL;
+}
+
+#define SCHED_FLOOD_JOBS 16
+#define SCHED_LOW_JOBS 100
+
+static int32_t sched_low_left;
+
+static void
+sched_flood_job(void *data)
+{
+	qb_loop_t *l = (qb_loop_t *)data;
+
+	ck_assert_int_eq(qb_loop_job_add(l, QB_LOOP_HIGH, l, sched_flood_job), 0);
+}
+
+static void
+sched_low_job(void *data)
+{
+	qb_loop_t *l = (qb_loop_t *)data;
+
+	if (--sched_low_left == 0) {
+		qb_loop_stop(l);
+	}
+}
+
+static void
+sched_run(enum qb_loop_scheduler scheduler, struct qb_loop_stats *stats)
+{
+	int32_t i;
+	qb_loop_t *l = qb_loop_create();
+
+	ck_assert(l != NULL);
+	ck_assert_int_eq(qb_loop_scheduler_set(l, scheduler), 0);
+	ck_assert_int_eq(qb_loop_level_quantum_set(l, QB_LOOP_HIGH, 8), 0);
+	ck_assert_int_eq(qb_loop_level_quantum_set(l, QB_LOOP_LOW, 2), 0);
+
+	for (i = 0; i < SCHED_FLOOD_JOBS; i++) {
+		ck_assert_int_eq(qb_loop_job_add(l, QB_LOOP_HIGH, l, sched_flood_job), 0);
+	}
+	sched_low_left = SCHED_LOW_JOBS;
+	for (i = 0; i < SCHED_LOW_JOBS; i++) {
+		ck_assert_int_eq(qb_loop_job_add(l, QB_LOOP_LOW, l, sched_low_job), 0);
+	}
+	qb_loop_run(l);
+	ck_assert_int_eq(sched_low_left, 0);
+
+	ck_assert_int_eq(qb_loop_stats_get(l, stats), 0);
+	ck_assert_int_eq(stats->level_dispatched[QB_LOOP_LOW], SCHED_LOW_JOBS);
+	ck_assert_int_eq(stats->level_dispatched[QB_LOOP_MED], 0);
+	ck_assert_int_eq(stats->level_wait_ns[QB_LOOP_MED], 0);
+	/* the flood is still waiting */
+	ck_assert(stats->level_wait_ns[QB_LOOP_HIGH] > 0);
+	qb_loop_destroy(l);
+}
+
+START_TEST(test_loop_job_scheduler)
+{
+	struct qb_loop_stats rotate;
+	struct qb_loop_stats weighted;
+	qb_loop_t *l = qb_loop_create();
+
+	ck_assert(l != NULL);
+	ck_assert_int_eq(qb_loop_scheduler_set(l, 7), -EINVAL);
+	ck_assert_int_eq(qb_loop_level_quantum_set(l, QB_LOOP_LOW, 0), -EINVAL);
+	ck_assert_int_eq(qb_loop_level_quantum_set(l, 7, 1), -EINVAL);
+	qb_loop_destroy(l);
+
+	/*
+	 * the low level only runs on every third pass, 2 jobs a time,
+	 * while the high level runs 8 on every pass
+	 */
+	sched_run(QB_LOOP_SCHED_ROTATE, &rotate);
+	ck_assert(rotate.level_dispatched[QB_LOOP_HIGH] >=
+		  10 * SCHED_LOW_JOBS);
+	ck_assert(rotate.level_wait_max_ns[QB_LOOP_LOW] > 0);
+
+	/*
+	 * weighted, the levels share the passes 8 to 2
+	 */
+	sched_run(QB_LOOP_SCHED_WEIGHTED, &weighted);
+	ck_assert(weighted.level_dispatched[QB_LOOP_HIGH] >=
+		  4 * SCHED_LOW_JOBS - 8);
+	ck_assert(weighted.level_dispatched[QB_LOOP_HIGH] <=
+		  4 * SCHED_LOW_JOBS);
+}
+END_TEST
+
+START_TEST(test_loop_job_threadsafe)
+{
+	static struct ts_job jobs[TS_THREADS][TS_JOBS_PER_THREAD];
+	pthread_t threads[TS_THREADS];
+	qb_loop_timer_handle th;
+	uint64_t start;
+	int32_t res;
+	int32_t t;
+	int32_t i;
+	qb_loop_t *l = qb_loop_create();
+	ck_assert(l != NULL);
+
+	res = qb_loop_job_add_threadsafe(l, 89, NULL, job_1);
+	ck_assert_int_eq(res, -EINVAL);
+	res = qb_loop_job_add_threadsafe(l, QB_LOOP_LOW, NULL, NULL);
+	ck_assert_int_eq(res, -EINVAL);
+
+	for (t = 0; t < TS_THREADS; t++) {
+		ts_last_seq[t] = -1;
+		for (i = 0; i < TS_JOBS_PER_THREAD; i++) {
+			jobs[t][i].l = l;
+			jobs[t][i].thread = t;
+			jobs[t][i].seq = i;
+		}
+	}
+	ts_run_count = 0;
+
+	/* nothing else wakes the loop before this */
+	res = qb_loop_timer_add(l, QB_LOOP_LOW, 10 * QB_TIME_NS_IN_SEC, l,
+				job_stop, &th);
+	ck_assert_int_eq(res, 0);
+
+	start = qb_util_nano_current_get();
+	for (t = 0; t < TS_THREADS; t++) {
+		res = pthread_create(&threads[t], NULL, ts_job_thread, jobs[t]);
+		ck_assert_int_eq(res, 0);
+	}
+	qb_loop_run(l);
+	for (t = 0; t < TS_THREADS; t++) {
+		pthread_join(threads[t], NULL);
+	}
+
+	ck_assert_int_eq(ts_run_count, TS_THREADS * TS_JOBS_PER_THREAD);
+	ck_assert(qb_util_nano_current_get() - start < 5 * QB_TIME_NS_IN_SEC);
+	qb_loop_destroy(l);
+}
+END_TEST
+
+static int32_t cache_jobs_left;
+
+static void
+cache_job(void *data)
+{
+	qb_loop_t *l = (qb_loop_t *)data;
+	int32_t res;
+	int32_t i;
+
+	if (--cache_jobs_left == 0) {
+		qb_loop_stop(l);
+		return;
+	}
+	if (cache_jobs_left % 100 != 0) {
+		return;
+	}
+	for (i = 0; i < 100; i++) {
+		res = qb_loop_job_add(l, QB_LOOP_MED, l, cache_job);
+		ck_assert_int_eq(res, 0);
+	}
+}
+
+START_TEST(test_loop_item_cache)
+{
+	struct qb_loop_stats stats;
+	qb_loop_timer_handle th;
+	int32_t res;
+	int32_t i;
+	qb_loop_t *l = qb_loop_create();
+	ck_assert(l != NULL);
+
+	res = qb_loop_stats_get(l, NULL);
+	ck_assert_int_eq(res, -EINVAL);
+
+	/* rounds of 100 jobs keep reusing the items of the previous round */
+	cache_jobs_left = 2001;
+	res = qb_loop_job_add(l, QB_LOOP_MED, l, cache_job);
+	ck_assert_int_eq(res, 0);
+	qb_loop_run(l);
+
+	res = qb_loop_stats_get(l, &stats);
+	ck_assert_int_eq(res, 0);
+	ck_assert(stats.job_allocs <= 102);
+	ck_assert(stats.job_reuses >= 1900);
+	ck_assert(stats.job_cached == stats.job_allocs);
+	ck_assert_int_eq(stats.item_cache_max, 1024);
+
+	for (i = 0; i < 100; i++) {
+		res = qb_loop_timer_add(l, QB_LOOP_LOW, QB_TIME_NS_IN_SEC, NULL, job_1, &th);
+		ck_assert_int_eq(res, 0);
+		res = qb_loop_timer_del(l, th);
+		ck_assert_int_eq(res, 0);
+	}
+	qb_loop_stats_get(l, &stats);
+	ck_assert(stats.timer_allocs == 1);
+	ck_assert(stats.timer_reuses == 99);
+	ck_assert(stats.timer_cached == 1);
+
+	/* no caching: every item comes from the heap */
+	res = qb_loop_item_cache_max_set(l, 0);
+	ck_assert_int_eq(res, 0);
+	qb_loop_stats_get(l, &stats);
+	ck_assert_int_eq(stats.job_cached, 0);
+	ck_assert_int_eq(stats.timer_cached, 0);
+
+	cache_jobs_left = 101;
+	res = qb_loop_job_add(l, QB_LOOP_MED, l, cache_job);
+	ck_assert_int_eq(res, 0);
+	qb_loop_run(l);
+
+	qb_loop_stats_get(l, &stats);
+	ck_assert(stats.job_allocs >= 100);
+	ck_assert_int_eq(stats.job_cached, 0);
+
+	qb_loop_destroy(l);
+}
+END_TEST
+
+static int32_t poll_reads;
+static int32_t poll_writes;
+
+static int32_t
+poll_level_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	qb_loop_t *l = (qb_loop_t *)data;
+	char c;
+
+	if (revents & POLLIN) {
+		/*
+		 * one byte per dispatch: the rest must be reported again
+		 */
+		ck_assert_int_eq(read(fd, &c, 1), 1);
+		poll_reads++;
+		if (poll_reads == 5) {
+			ck_assert_int_eq(qb_loop_poll_mod(l, QB_LOOP_MED, fd,
+							  POLLOUT, l,
+							  poll_level_dispatch), 0);
+		}
+		return 0;
+	}
+	if (revents & POLLOUT) {
+		poll_writes++;
+		ck_assert_int_eq(qb_loop_poll_del(l, fd), 0);
+		close(fd);
+		qb_loop_stop(l);
+	}
+	return 0;
+}
+
+START_TEST(test_loop_poll_level)
+{
+	qb_loop_t *l = qb_loop_create();
+	int32_t sv[2];
+	char c;
+
+	ck_assert(l != NULL);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	ck_assert_int_eq(write(sv[1], "abcde", 5), 5);
+
+	ck_assert_int_eq(qb_loop_poll_add(l, QB_LOOP_MED, -1, POLLIN, l,
+					  poll_level_dispatch), -EBADF);
+	ck_assert_int_eq(qb_loop_poll_add(l, QB_LOOP_MED, sv[0], POLLIN, l,
+					  poll_level_dispatch), 0);
+	qb_loop_run(l);
+
+	ck_assert_int_eq(poll_reads, 5);
+	ck_assert_int_eq(poll_writes, 1);
+	/*
+	 * the peer sees the close as soon as the entry is deleted
+	 */
+	ck_assert_int_eq(read(sv[1], &c, 1), 0);
+	close(sv[1]);
+
+	qb_loop_destroy(l);
+}
+END_TEST
+
+#ifdef HAVE_EPOLL
+static uint64_t
+cpu_time_get(void)
+{
+	struct timespec ts;
+
+	ck_assert_int_eq(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts), 0);
+	return (ts.tv_sec * QB_TIME_NS_IN_SEC) + ts.tv_nsec;
+}
+
+static int32_t edge_reads;
+static int32_t edge_writer_ran;
+static int32_t edge_peer = -1;
+
+static void
+edge_writer(void *data)
+{
+	edge_writer_ran = QB_TRUE;
+	ck_assert_int_eq(write(edge_peer, "z", 1), 1);
+}
+
+static int32_t
+poll_edge_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	qb_loop_t *l = (qb_loop_t *)data;
+	qb_loop_timer_handle th;
+	char c;
+
+	ck_assert(revents & POLLIN);
+	/*
+	 * deliberately leave data behind: no new edge, no new call
+	 */
+	ck_assert_int_eq(read(fd, &c, 1), 1);
+	edge_reads++;
+	if (edge_reads == 1) {
+		ck_assert_int_eq(qb_loop_timer_add(l, QB_LOOP_MED,
+						   100 * QB_TIME_NS_IN_MSEC,
+						   l, edge_writer, &th), 0);
+	} else {
+		ck_assert_int_eq(edge_writer_ran, QB_TRUE);
+		qb_loop_stop(l);
+	}
+	return 0;
+}
+
+START_TEST(test_loop_poll_edge)
+{
+	qb_loop_t *l = qb_loop_create();
+	int32_t sv[2];
+
+	ck_assert(l != NULL);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	edge_peer = sv[1];
+	ck_assert_int_eq(write(sv[1], "abcde", 5), 5);
+
+	ck_assert_int_eq(qb_loop_poll_add(l, QB_LOOP_MED, sv[0],
+					  POLLIN | QB_LOOP_POLL_EDGE_TRIGGERED,
+					  l, poll_edge_dispatch), 0);
+	qb_loop_run(l);
+	ck_assert_int_eq(edge_reads, 2);
+
+	ck_assert_int_eq(qb_loop_poll_del(l, sv[0]), 0);
+	close(sv[0]);
+	close(sv[1]);
+	qb_loop_destroy(l);
+}
+END_TEST
+
+static int32_t poll_error_dispatched;
+static int32_t poll_error_fds[2][2];
+
+static int32_t
+poll_error_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	poll_error_dispatched++;
+	return -1;
+}
+
+static void
+poll_error_close(void *data)
+{
+	qb_loop_t *l = (qb_loop_t *)data;
+
+	close(poll_error_fds[0][0]);
+	close(poll_error_fds[1][0]);
+	qb_loop_stop(l);
+}
+
+START_TEST(test_loop_poll_dispatch_error)
+{
+	qb_loop_t *l = qb_loop_create();
+	qb_loop_timer_handle th;
+	uint64_t cpu_start;
+	uint64_t wall_start;
+	uint64_t cpu;
+	uint64_t wall;
+	ssize_t res;
+	int32_t i;
+	char c;
+
+	ck_assert(l != NULL);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, poll_error_fds[0]), 0);
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, poll_error_fds[1]), 0);
+	ck_assert_int_eq(write(poll_error_fds[0][1], "x", 1), 1);
+	ck_assert_int_eq(write(poll_error_fds[1][1], "x", 1), 1);
+
+	/*
+	 * a handler returning an error gets its descriptor unregistered:
+	 * the level triggered one stays readable but must not keep the
+	 * loop busy, and the edge triggered one must not stay pinned once
+	 * closed
+	 */
+	ck_assert_int_eq(qb_loop_poll_add(l, QB_LOOP_MED, poll_error_fds[0][0],
+					  POLLIN, l, poll_error_dispatch), 0);
+	ck_assert_int_eq(qb_loop_poll_add(l, QB_LOOP_MED, poll_error_fds[1][0],
+					  POLLIN | QB_LOOP_POLL_EDGE_TRIGGERED,
+					  l, poll_error_dispatch), 0);
+	ck_assert_int_eq(qb_loop_timer_add(l, QB_LOOP_LOW,
+					   100 * QB_TIME_NS_IN_MSEC, l,
+					   poll_error_close, &th), 0);
+	cpu_start = cpu_time_get();
+	wall_start = qb_util_nano_current_get();
+	qb_loop_run(l);
+	cpu = cpu_time_get() - cpu_start;
+	wall = qb_util_nano_current_get() - wall_start;
+
+	ck_assert_int_eq(poll_error_dispatched, 2);
+	ck_assert(cpu < wall / 2);
+
+	/* the peers see the descriptors closed, the unread data reset */
+	ck_assert_int_eq(fcntl(poll_error_fds[0][1], F_SETFL, O_NONBLOCK), 0);
+	ck_assert_int_eq(fcntl(poll_error_fds[1][1], F_SETFL, O_NONBLOCK), 0);
+	for (i = 0; i < 2; i++) {
+		res = read(poll_error_fds[i][1], &c, 1);
+		ck_assert(res == 0 || (res == -1 && errno == ECONNRESET));
+	}
+
+	close(poll_error_fds[0][1]);
+	close(poll_error_fds[1][1]);
+	qb_loop_destroy(l);
+}
+END_TEST
+#endif /* HAVE_EPOLL */
+
+#define POLL_MANY_FDS 300
+static int32_t poll_many_seen;
+
+static int32_t
+poll_many_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	qb_loop_t *l = (qb_loop_t *)data;
+	char c;
+
+	ck_assert_int_eq(read(fd, &c, 1), 1);
+	ck_assert_int_eq(qb_loop_poll_del(l, fd), 0);
+	if (++poll_many_seen == POLL_MANY_FDS) {
+		qb_loop_stop(l);
+	}
+	return 0;
+}
+
+START_TEST(test_loop_poll_many)
+{
+	qb_loop_t *l = qb_loop_create();
+	int32_t sv[POLL_MANY_FDS][2];
+	int32_t i;
+
+	ck_assert(l != NULL);
+	for (i = 0; i < POLL_MANY_FDS; i++) {
+		ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]), 0);
+		ck_assert_int_eq(write(sv[i][1], "x", 1), 1);
+		ck_assert_int_eq(qb_loop_poll_add(l, QB_LOOP_MED, sv[i][0],
+						  POLLIN, l,
+						  poll_many_dispatch), 0);
+	}
+	qb_loop_run(l);
+	ck_assert_int_eq(poll_many_seen, POLL_MANY_FDS);
+
+	for (i = 0; i < POLL_MANY_FDS; i++) {
+		close(sv[i][0]);
+		close(sv[i][1]);
+	}
+	qb_loop_destroy(l);
+}
+END_TEST
 
 static Suite *loop_job_suite(void)
 {
@@ -339,6 +840,9 @@ static Suite *loop_job_suite(void)
 	add_tcase(s, tc, test_job_rate_limit, 5);
 	add_tcase(s, tc, test_job_add_del, 0);
 	add_tcase(s, tc, test_loop_job_order, 0);
+	add_tcase(s, tc, test_loop_job_scheduler, 10);
+	add_tcase(s, tc, test_loop_job_threadsafe, 10);
+	add_tcase(s, tc, test_loop_item_cache, 5);
 
 	return s;
 }
@@ -566,6 +1070,373 @@ START_TEST(test_loop_timer_precision)
 }
 END_TEST
 
+START_TEST(test_loop_timer_hires)
+{
+	struct qb_stop_watch sw;
+	uint64_t wall;
+	uint64_t cpu;
+	int32_t res;
+	qb_loop_t *l = qb_loop_create();
+
+	ck_assert(l != NULL);
+
+	res = qb_loop_timer_hires_set(l, QB_TRUE);
+	ck_assert_int_eq(res, 0);
+
+	/*
+	 * sub-ms timers: with millisecond waits the loop spins until
+	 * they expire
+	 */
+	wall = qb_util_nano_current_get();
+	cpu = cpu_time_get();
+	start_timer(l, &sw, 200 * QB_TIME_NS_IN_USEC, QB_TRUE);
+	qb_loop_run(l);
+	wall = qb_util_nano_current_get() - wall;
+	cpu = cpu_time_get() - cpu;
+
+	ck_assert_int_eq(sw.count, 50);
+	ck_assert(sw.total / sw.count < 500 * QB_TIME_NS_IN_USEC);
+	ck_assert(cpu < wall / 2);
+
+	qb_loop_destroy(l);
+}
+END_TEST
+
+#define SLACK_NUM_TIMERS 1000
+
+struct slack_timer {
+	qb_loop_t *l;
+	uint64_t earliest;
+	uint64_t fired;
+};
+static int32_t slack_fired;
+
+static void
+slack_tmo(void *data)
+{
+	struct slack_timer *st = (struct slack_timer *)data;
+
+	st->fired = qb_util_nano_current_get();
+	ck_assert(st->fired >= st->earliest);
+	if (++slack_fired == SLACK_NUM_TIMERS) {
+		qb_loop_stop(st->l);
+	}
+}
+
+static int
+uint64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+slack_timers_run(enum qb_loop_timer_backend backend)
+{
+	static struct slack_timer st[SLACK_NUM_TIMERS];
+	static uint64_t fired[SLACK_NUM_TIMERS];
+	qb_loop_timer_handle th;
+	uint64_t tmo;
+	int32_t bursts;
+	int32_t res;
+	int32_t i;
+	qb_loop_t *l = qb_loop_create();
+
+	ck_assert(l != NULL);
+	ck_assert_int_eq(qb_loop_timer_backend_set(l, backend), 0);
+
+	/*
+	 * expire times spread over 10ms with windows that all overlap
+	 */
+	slack_fired = 0;
+	for (i = 0; i < SLACK_NUM_TIMERS; i++) {
+		tmo = 10 * QB_TIME_NS_IN_MSEC + i * 10 * QB_TIME_NS_IN_USEC;
+		st[i].l = l;
+		st[i].earliest = qb_util_nano_current_get() + tmo;
+		res = qb_loop_timer_add_with_slack(l, QB_LOOP_LOW, tmo,
+						   20 * QB_TIME_NS_IN_MSEC,
+						   &st[i], slack_tmo, &th);
+		ck_assert_int_eq(res, 0);
+	}
+	qb_loop_run(l);
+	ck_assert_int_eq(slack_fired, SLACK_NUM_TIMERS);
+
+	/*
+	 * without slack they would fire over 10ms: the heap fires them in
+	 * one burst, the wheel aligns each timer on its own and may split
+	 * them into a few
+	 */
+	for (i = 0; i < SLACK_NUM_TIMERS; i++) {
+		fired[i] = st[i].fired;
+	}
+	qsort(fired, SLACK_NUM_TIMERS, sizeof(uint64_t), uint64_cmp);
+	bursts = 1;
+	for (i = 1; i < SLACK_NUM_TIMERS; i++) {
+		if (fired[i] - fired[i - 1] > 500 * QB_TIME_NS_IN_USEC) {
+			bursts++;
+		}
+	}
+	if (backend == QB_LOOP_TIMER_HEAP) {
+		ck_assert(fired[SLACK_NUM_TIMERS - 1] - fired[0] <
+			  5 * QB_TIME_NS_IN_MSEC);
+	} else {
+		ck_assert_int_le(bursts, 4);
+	}
+
+	qb_loop_destroy(l);
+}
+
+START_TEST(test_loop_timer_slack)
+{
+	slack_timers_run(QB_LOOP_TIMER_HEAP);
+	slack_timers_run(QB_LOOP_TIMER_WHEEL);
+}
+END_TEST
+
+#define PERIODIC_FIRES 40
+#define PERIODIC_PERIOD (5 * QB_TIME_NS_IN_MSEC)
+
+struct periodic_timer {
+	qb_loop_t *l;
+	qb_loop_timer_handle th;
+	uint64_t stall;
+	int32_t count;
+	uint64_t fired[PERIODIC_FIRES];
+};
+
+static void
+periodic_tmo(void *data)
+{
+	struct periodic_timer *pt = (struct periodic_timer *)data;
+
+	pt->fired[pt->count++] = qb_util_nano_current_get();
+	ck_assert_int_eq(qb_loop_timer_is_running(pt->l, pt->th), QB_TRUE);
+	if (pt->count == 1 && pt->stall) {
+		usleep(pt->stall / QB_TIME_NS_IN_USEC);
+	}
+	if (pt->count == PERIODIC_FIRES) {
+		ck_assert_int_eq(qb_loop_timer_del(pt->l, pt->th), 0);
+		ck_assert_int_eq(qb_loop_timer_is_running(pt->l, pt->th), QB_FALSE);
+		qb_loop_stop(pt->l);
+	}
+}
+
+static qb_loop_timer_handle periodic_th;
+
+static void
+periodic_never_tmo(void *data)
+{
+	ck_abort_msg("deleted periodic timer dispatched");
+}
+
+static void
+periodic_del_tmo(void *data)
+{
+	qb_loop_t *l = (qb_loop_t *)data;
+
+	ck_assert_int_eq(qb_loop_timer_is_running(l, periodic_th), QB_TRUE);
+	ck_assert_int_eq(qb_loop_timer_del(l, periodic_th), 0);
+	ck_assert_int_eq(qb_loop_timer_is_running(l, periodic_th), QB_FALSE);
+	ck_assert_int_eq(qb_loop_timer_add(l, QB_LOOP_LOW,
+		10 * QB_TIME_NS_IN_MSEC, l, job_stop, &test_th), 0);
+}
+
+static uint64_t
+periodic_timer_run(struct periodic_timer *pt,
+		   enum qb_loop_timer_backend backend,
+		   enum qb_loop_timer_overrun overrun)
+{
+	uint64_t start;
+	int32_t res;
+	qb_loop_t *l = qb_loop_create();
+
+	ck_assert(l != NULL);
+	ck_assert_int_eq(qb_loop_timer_backend_set(l, backend), 0);
+
+	pt->l = l;
+	pt->count = 0;
+	start = qb_util_nano_current_get();
+	res = qb_loop_timer_add_periodic(l, QB_LOOP_HIGH, PERIODIC_PERIOD,
+					 overrun, pt, periodic_tmo, &pt->th);
+	ck_assert_int_eq(res, 0);
+	qb_loop_run(l);
+	ck_assert_int_eq(pt->count, PERIODIC_FIRES);
+
+	/* stopped and deleted from its own callback */
+	ck_assert_int_eq(qb_loop_timer_is_running(l, pt->th), QB_FALSE);
+	ck_assert_int_eq(qb_loop_timer_del(l, pt->th), -EINVAL);
+
+	qb_loop_destroy(l);
+	return start;
+}
+
+START_TEST(test_loop_timer_periodic)
+{
+	static struct periodic_timer pt;
+	qb_loop_timer_handle th;
+	uint64_t start;
+	int32_t i;
+	qb_loop_t *l = qb_loop_create();
+
+	ck_assert(l != NULL);
+	ck_assert_int_eq(qb_loop_timer_add_periodic(l, QB_LOOP_LOW, 0,
+		QB_LOOP_TIMER_OVERRUN_SKIP, NULL, one_shot_tmo, &th), -EINVAL);
+	ck_assert_int_eq(qb_loop_timer_add_periodic(l, QB_LOOP_LOW,
+		PERIODIC_PERIOD, 7, NULL, one_shot_tmo, &th), -EINVAL);
+
+	/* deleted while expired and waiting to be dispatched */
+	ck_assert_int_eq(qb_loop_timer_add_periodic(l, QB_LOOP_LOW,
+		QB_TIME_NS_IN_MSEC, QB_LOOP_TIMER_OVERRUN_SKIP, NULL,
+		periodic_never_tmo, &periodic_th), 0);
+	ck_assert_int_eq(qb_loop_timer_add(l, QB_LOOP_HIGH,
+		QB_TIME_NS_IN_MSEC, l, periodic_del_tmo, &th), 0);
+	usleep(3000);
+	qb_loop_run(l);
+	ck_assert_int_eq(qb_loop_timer_is_running(l, periodic_th), QB_FALSE);
+	qb_loop_destroy(l);
+
+	/*
+	 * every dispatch is due a whole number of periods after the start,
+	 * however late the previous one ran
+	 */
+	pt.stall = 0;
+	start = periodic_timer_run(&pt, QB_LOOP_TIMER_HEAP,
+				   QB_LOOP_TIMER_OVERRUN_CATCH_UP);
+	for (i = 0; i < PERIODIC_FIRES; i++) {
+		ck_assert(pt.fired[i] >= start + (i + 1) * PERIODIC_PERIOD);
+	}
+	ck_assert(pt.fired[PERIODIC_FIRES - 1] - start <
+		  (PERIODIC_FIRES + 2) * PERIODIC_PERIOD);
+
+	start = periodic_timer_run(&pt, QB_LOOP_TIMER_WHEEL,
+				   QB_LOOP_TIMER_OVERRUN_CATCH_UP);
+	for (i = 0; i < PERIODIC_FIRES; i++) {
+		ck_assert(pt.fired[i] >= start + (i + 1) * PERIODIC_PERIOD);
+	}
+	ck_assert(pt.fired[PERIODIC_FIRES - 1] - start <
+		  (PERIODIC_FIRES + 2) * PERIODIC_PERIOD);
+
+	/*
+	 * a 17.5ms stall in the first dispatch misses three periods: they
+	 * get dispatched straight away, or skipped
+	 */
+	pt.stall = 3 * PERIODIC_PERIOD + PERIODIC_PERIOD / 2;
+	start = periodic_timer_run(&pt, QB_LOOP_TIMER_HEAP,
+				   QB_LOOP_TIMER_OVERRUN_CATCH_UP);
+	for (i = 1; i < 4; i++) {
+		ck_assert(pt.fired[i] < start + 5 * PERIODIC_PERIOD);
+	}
+	ck_assert(pt.fired[4] >= start + 5 * PERIODIC_PERIOD);
+
+	start = periodic_timer_run(&pt, QB_LOOP_TIMER_HEAP,
+				   QB_LOOP_TIMER_OVERRUN_SKIP);
+	ck_assert(pt.fired[1] >= start + 5 * PERIODIC_PERIOD);
+	for (i = 1; i < PERIODIC_FIRES; i++) {
+		ck_assert(pt.fired[i] >= start + (i + 4) * PERIODIC_PERIOD);
+	}
+}
+END_TEST
+
+#define WHEEL_NUM_TIMERS 10000
+
+START_TEST(test_loop_timer_wheel)
+{
+	static qb_loop_timer_handle th[WHEEL_NUM_TIMERS];
+	struct qb_stop_watch sw[11];
+	uint64_t tmo;
+	int32_t res;
+	int32_t i;
+	qb_loop_t *l = qb_loop_create();
+
+	ck_assert(l != NULL);
+
+	res = qb_loop_timer_backend_set(l, 7);
+	ck_assert_int_eq(res, -EINVAL);
+	res = qb_loop_timer_backend_set(l, QB_LOOP_TIMER_WHEEL);
+	ck_assert_int_eq(res, 0);
+
+	/*
+	 * timeouts that get deleted before they expire, some of them
+	 * beyond the reach of the wheel
+	 */
+	for (i = 0; i < WHEEL_NUM_TIMERS; i++) {
+		tmo = (1 + i % 600) * QB_TIME_NS_IN_SEC;
+		if (i % 1000 == 0) {
+			tmo *= 1000000;
+		}
+		res = qb_loop_timer_add(l, QB_LOOP_LOW, tmo, NULL, one_shot_tmo, &th[i]);
+		ck_assert_int_eq(res, 0);
+	}
+
+	res = qb_loop_timer_backend_set(l, QB_LOOP_TIMER_HEAP);
+	ck_assert_int_eq(res, -EBUSY);
+
+	for (i = 0; i < WHEEL_NUM_TIMERS; i++) {
+		ck_assert_int_eq(qb_loop_timer_is_running(l, th[i]), QB_TRUE);
+		ck_assert(qb_loop_timer_expire_time_remaining(l, th[i]) > 0);
+		res = qb_loop_timer_del(l, th[i]);
+		ck_assert_int_eq(res, 0);
+		ck_assert_int_eq(qb_loop_timer_is_running(l, th[i]), QB_FALSE);
+	}
+
+	/* same as test_loop_timer_precision */
+	for (i = 0; i < 10; i++) {
+		tmo = ((1 + i * 9) * QB_TIME_NS_IN_MSEC) + 500000;
+		start_timer(l, &sw[i], tmo, QB_FALSE);
+	}
+	start_timer(l, &sw[i], 100 * QB_TIME_NS_IN_MSEC, QB_TRUE);
+
+	res = qb_loop_timer_add(l, QB_LOOP_LOW, 500*QB_TIME_NS_IN_MSEC, l, job_stop, &test_th);
+	ck_assert_int_eq(res, 0);
+	res = qb_loop_timer_add(l, QB_LOOP_HIGH, 5*QB_TIME_NS_IN_MSEC, l, check_time_left, &test_th2);
+	ck_assert_int_eq(res, 0);
+
+	qb_loop_run(l);
+	qb_loop_destroy(l);
+}
+END_TEST
+
+START_TEST(test_loop_timer_slots)
+{
+	static qb_loop_timer_handle th[QB_ARRAY_MAX_ELEMENTS];
+	qb_loop_timer_handle extra;
+	uint64_t start;
+	int32_t res;
+	int32_t i;
+	qb_loop_t *l = qb_loop_create();
+
+	ck_assert(l != NULL);
+
+	start = qb_util_nano_current_get();
+	for (i = 0; i < QB_ARRAY_MAX_ELEMENTS; i++) {
+		res = qb_loop_timer_add(l, QB_LOOP_LOW, 60 * QB_TIME_NS_IN_SEC, NULL, one_shot_tmo, &th[i]);
+		ck_assert_int_eq(res, 0);
+	}
+
+	/* the timer table is full, that is an error, not a crash */
+	res = qb_loop_timer_add(l, QB_LOOP_LOW, 60 * QB_TIME_NS_IN_SEC, NULL, one_shot_tmo, &extra);
+	ck_assert(res < 0);
+
+	/* freed slots get reused without searching the table */
+	for (i = 0; i < QB_ARRAY_MAX_ELEMENTS; i += 2) {
+		res = qb_loop_timer_del(l, th[i]);
+		ck_assert_int_eq(res, 0);
+	}
+	for (i = 0; i < QB_ARRAY_MAX_ELEMENTS; i += 2) {
+		res = qb_loop_timer_add(l, QB_LOOP_LOW, 60 * QB_TIME_NS_IN_SEC, NULL, one_shot_tmo, &th[i]);
+		ck_assert_int_eq(res, 0);
+	}
+	for (i = 0; i < QB_ARRAY_MAX_ELEMENTS; i++) {
+		ck_assert_int_eq(qb_loop_timer_is_running(l, th[i]), QB_TRUE);
+	}
+	ck_assert(qb_util_nano_current_get() - start < 10 * QB_TIME_NS_IN_SEC);
+
+	qb_loop_destroy(l);
+}
+END_TEST
+
 static int expire_leak_counter = 0;
 #define EXPIRE_NUM_RUNS 10
 static int expire_leak_runs = 0;
@@ -791,8 +1662,13 @@ loop_timer_suite(void)
 	add_tcase(s, tc, test_loop_timer_input, 0);
 	add_tcase(s, tc, test_loop_timer_basic, 30);
 	add_tcase(s, tc, test_loop_timer_precision, 30);
+	add_tcase(s, tc, test_loop_timer_hires, 30);
+	add_tcase(s, tc, test_loop_timer_slack, 30);
+	add_tcase(s, tc, test_loop_timer_periodic, 30);
 	add_tcase(s, tc, test_loop_timer_expire_leak, 30);
 	add_tcase(s, tc, test_loop_timer_threads, 30);
+	add_tcase(s, tc, test_loop_timer_wheel, 30);
+	add_tcase(s, tc, test_loop_timer_slots, 30);
 
 	return s;
 }
@@ -811,6 +1687,22 @@ loop_signal_suite(void)
 	return s;
 }
 
+static Suite *
+loop_poll_suite(void)
+{
+	TCase *tc;
+	Suite *s = suite_create("loop_poll");
+
+	add_tcase(s, tc, test_loop_poll_level, 5);
+#ifdef HAVE_EPOLL
+	add_tcase(s, tc, test_loop_poll_edge, 5);
+	add_tcase(s, tc, test_loop_poll_dispatch_error, 5);
+#endif /* HAVE_EPOLL */
+	add_tcase(s, tc, test_loop_poll_many, 10);
+
+	return s;
+}
+
 int32_t
 main(void)
 {
@@ -818,6 +1710,7 @@ main(void)
 	SRunner *sr = srunner_create(loop_job_suite());
 	srunner_add_suite (sr, loop_timer_suite());
 	srunner_add_suite (sr, loop_signal_suite());
+	srunner_add_suite (sr, loop_poll_suite());
 
 	qb_log_init("check", LOG_USER, LOG_EMERG);
 	atexit(qb_log_fini);
@@ -44,6 +44,8 @@
  */
 #define HEAP_SPEED_TEST_NO_ITEMS	1000
 
+#define WHEEL_TEST_NO_ITEMS		500
+
 static int timer_list_fn1_called = 0;
 
 static void
@@ -261,6 +263,109 @@ START_TEST(test_check_heap)
 }
 END_TEST
 
+static void
+timer_list_not_early_fn(void *data)
+{
+	uint64_t *expire_time = (uint64_t *)data;
+
+	ck_assert(qb_util_nano_current_get() > *expire_time);
+	*expire_time = 0;
+	timer_list_fn1_called++;
+}
+
+START_TEST(test_check_wheel)
+{
+	struct timerlist tlist;
+	timer_handle thandle[SPEED_TEST_NO_ITEMS];
+	uint64_t expire_time[WHEEL_TEST_NO_ITEMS];
+	int res;
+	uint64_t u64;
+	int i;
+
+	timerlist_init(&tlist);
+	res = timerlist_wheel_enable(&tlist);
+	ck_assert_int_eq(res, 0);
+
+	/*
+	 * Same as the basic check
+	 */
+	res = timerlist_add_duration(&tlist, timer_list_fn1, &timer_list_fn1_called, SHORT_TIMEOUT / 2, &thandle[0]);
+	ck_assert_int_eq(res, 0);
+
+	res = timerlist_wheel_disable(&tlist);
+	ck_assert_int_eq(res, -EBUSY);
+
+	sleep_ns(SHORT_TIMEOUT);
+	u64 = timerlist_msec_duration_to_expire(&tlist);
+	ck_assert(u64 == 0);
+
+	timer_list_fn1_called = 0;
+	timerlist_expire(&tlist);
+	ck_assert_int_eq(timer_list_fn1_called, 1);
+
+	u64 = timerlist_msec_duration_to_expire(&tlist);
+	ck_assert(u64 == -1);
+
+	res = timerlist_add_duration(&tlist, timer_list_fn1, &timer_list_fn1_called, LONG_TIMEOUT / 2, &thandle[0]);
+	ck_assert_int_eq(res, 0);
+
+	sleep_ns(SHORT_TIMEOUT);
+	u64 = timerlist_msec_duration_to_expire(&tlist);
+	ck_assert(u64 > 0);
+	ck_assert(u64 <= LONG_TIMEOUT / 2 / QB_TIME_NS_IN_MSEC);
+
+	timer_list_fn1_called = 0;
+	timerlist_expire(&tlist);
+	ck_assert_int_eq(timer_list_fn1_called, 0);
+
+	timerlist_del(&tlist, thandle[0]);
+	u64 = timerlist_msec_duration_to_expire(&tlist);
+	ck_assert(u64 == -1);
+
+	/*
+	 * Lots of timers on every level, deleted before they expire,
+	 * including ones beyond the reach of the wheel (shifts of 30 and
+	 * up); 36 is as far as it goes without overflowing
+	 */
+	for (i = 0; i < SPEED_TEST_NO_ITEMS; i++) {
+		res = timerlist_add_duration(&tlist, timer_list_fn1, &timer_list_fn1_called,
+		    SHORT_TIMEOUT << (i % 37), &thandle[i]);
+		ck_assert_int_eq(res, 0);
+	}
+	ck_assert(timerlist_msec_duration_to_expire(&tlist) <= SHORT_TIMEOUT / QB_TIME_NS_IN_MSEC);
+	for (i = 0; i < SPEED_TEST_NO_ITEMS; i++) {
+		timerlist_del(&tlist, thandle[i]);
+	}
+	ck_assert(timerlist_msec_duration_to_expire(&tlist) == -1);
+
+	/*
+	 * Timers spread over the first levels expire, and none too early
+	 */
+	for (i = 0; i < WHEEL_TEST_NO_ITEMS; i++) {
+		res = timerlist_add_duration(&tlist, timer_list_not_early_fn, &expire_time[i],
+		    (i * 997 % (2 * SHORT_TIMEOUT / QB_TIME_NS_IN_MSEC)) * QB_TIME_NS_IN_MSEC + i, &thandle[i]);
+		ck_assert_int_eq(res, 0);
+		expire_time[i] = timerlist_expire_time(&tlist, thandle[i]);
+	}
+
+	timer_list_fn1_called = 0;
+	while ((u64 = timerlist_msec_duration_to_expire(&tlist)) != -1) {
+		ck_assert(u64 <= 2 * SHORT_TIMEOUT / QB_TIME_NS_IN_MSEC);
+		sleep_ns(u64 * QB_TIME_NS_IN_MSEC);
+		timerlist_expire(&tlist);
+	}
+	ck_assert_int_eq(timer_list_fn1_called, WHEEL_TEST_NO_ITEMS);
+	for (i = 0; i < WHEEL_TEST_NO_ITEMS; i++) {
+		ck_assert(expire_time[i] == 0);
+	}
+
+	res = timerlist_wheel_disable(&tlist);
+	ck_assert_int_eq(res, 0);
+
+	timerlist_destroy(&tlist);
+}
+END_TEST
+
 static Suite *tlist_suite(void)
 {
 	TCase *tc;
@@ -269,6 +374,7 @@ static Suite *tlist_suite(void)
 	add_tcase(s, tc, test_check_basic, 0);
 	add_tcase(s, tc, test_check_speed, 30);
 	add_tcase(s, tc, test_check_heap, 30);
+	add_tcase(s, tc, test_check_wheel, 30);
 
 	return s;
 }
@@ -0,0 +1,1002 @@
+/*
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * IPC benchmark.
+ *
+ * Runs every combination of the given transports, message sizes, client
+ * counts, threads per client, pipelining depths and event fan-outs and
+ * prints the throughput and round trip latencies of each as a JSON array.
+ *
+ * Every client is a separate process.  The threads of a client share one
+ * connection (see qb_ipcc_threadsafe_set()); a single threaded client may
+ * instead keep several requests in flight.  For each request the server
+ * sends fan-out events back to the client, then the response.
+ *
+ * Without -S or -C a server is started for each transport and the whole
+ * matrix is run against it.  -S only runs a server, -C only runs clients
+ * against a server started elsewhere.
+ */
+#include "os_base.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#include <qb/qbdefs.h>
+#include <qb/qbatomic.h>
+#include <qb/qblog.h>
+#include <qb/qbutil.h>
+#include <qb/qbloop.h>
+#include <qb/qbipcc.h>
+#include <qb/qbipcs.h>
+
+#define BENCH_MSG_REQUEST	(QB_IPC_MSG_USER_START + 1)
+#define BENCH_MSG_RESPONSE	(QB_IPC_MSG_USER_START + 2)
+#define BENCH_MSG_EVENT		(QB_IPC_MSG_USER_START + 3)
+
+#define BENCH_MAX_VALUES	16
+#define BENCH_RECV_TIMEOUT	5000
+#define BENCH_MIN_BUFFER	(64 * 1024)
+
+struct bench_request {
+	struct qb_ipc_request_header hdr;
+	uint32_t fanout;
+} __attribute__ ((aligned(8)));
+
+struct bench_point {
+	enum qb_ipc_type type;
+	const char *transport;
+	uint32_t size;
+	uint32_t clients;
+	uint32_t threads;
+	uint32_t depth;
+	uint32_t fanout;
+	uint32_t iterations;
+};
+
+/* what a client process reports back */
+struct bench_result {
+	int32_t error;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t events;
+	uint64_t samples;
+};
+
+struct bench_client {
+	qb_ipcc_connection_t *conn;
+	const struct bench_point *p;
+	int32_t workers_running;
+	uint64_t events;
+	int32_t error;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct bench_client *client;
+	uint64_t *latencies;
+	int32_t error;
+};
+
+static const char *service_name = "ipcbench";
+static qb_loop_t *bench_loop;
+static qb_ipcs_service_t *bench_service;
+
+/*
+ **************************************************************************
+ * SERVER
+ */
+
+static ssize_t
+bench_server_send(qb_ipcs_connection_t *c, int32_t is_event,
+		  struct iovec *iov, size_t iov_len)
+{
+	ssize_t res;
+
+	/* the client drains its events on a thread of its own */
+	while (QB_TRUE) {
+		if (is_event) {
+			res = qb_ipcs_event_sendv(c, iov, iov_len);
+		} else {
+			res = qb_ipcs_response_sendv(c, iov, iov_len);
+		}
+		if (res != -EAGAIN) {
+			return res;
+		}
+		(void)poll(NULL, 0, 1);
+	}
+}
+
+static int32_t
+bench_msg_process(qb_ipcs_connection_t *c, void *data, size_t size)
+{
+	struct bench_request *req = (struct bench_request *)data;
+	struct qb_ipc_response_header hdr;
+	struct iovec iov[2];
+	uint32_t i;
+	ssize_t res;
+
+	if (size < sizeof(*req)) {
+		return 0;
+	}
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (char *)data + sizeof(*req);
+	iov[1].iov_len = size - sizeof(*req);
+	hdr.size = sizeof(hdr) + iov[1].iov_len;
+	hdr.error = 0;
+
+	hdr.id = BENCH_MSG_EVENT;
+	for (i = 0; i < req->fanout; i++) {
+		res = bench_server_send(c, QB_TRUE, iov, 2);
+		if (res < 0) {
+			errno = -res;
+			qb_perror(LOG_ERR, "qb_ipcs_event_sendv");
+			return 0;
+		}
+	}
+	hdr.id = BENCH_MSG_RESPONSE;
+	res = bench_server_send(c, QB_FALSE, iov, 2);
+	if (res < 0) {
+		errno = -res;
+		qb_perror(LOG_ERR, "qb_ipcs_response_sendv");
+	}
+	return 0;
+}
+
+static int32_t
+bench_connection_accept(qb_ipcs_connection_t *c, uid_t uid, gid_t gid)
+{
+	return 0;
+}
+
+static int32_t
+bench_job_add(enum qb_loop_priority p, void *data, qb_loop_job_dispatch_fn fn)
+{
+	return qb_loop_job_add(bench_loop, p, data, fn);
+}
+
+static int32_t
+bench_dispatch_add(enum qb_loop_priority p, int32_t fd, int32_t evts,
+		   void *data, qb_ipcs_dispatch_fn_t fn)
+{
+	return qb_loop_poll_add(bench_loop, p, fd, evts, data, fn);
+}
+
+static int32_t
+bench_dispatch_mod(enum qb_loop_priority p, int32_t fd, int32_t evts,
+		   void *data, qb_ipcs_dispatch_fn_t fn)
+{
+	return qb_loop_poll_mod(bench_loop, p, fd, evts, data, fn);
+}
+
+static int32_t
+bench_dispatch_del(int32_t fd)
+{
+	return qb_loop_poll_del(bench_loop, fd);
+}
+
+static int32_t
+bench_server_stop(int32_t rsignal, void *data)
+{
+	qb_ipcs_destroy(bench_service);
+	qb_loop_stop(bench_loop);
+	return 0;
+}
+
+static int32_t
+bench_server_run(enum qb_ipc_type type, const char *name)
+{
+	int32_t res;
+	struct qb_ipcs_service_handlers sh = {
+		.connection_accept = bench_connection_accept,
+		.msg_process = bench_msg_process,
+	};
+	struct qb_ipcs_poll_handlers ph = {
+		.job_add = bench_job_add,
+		.dispatch_add = bench_dispatch_add,
+		.dispatch_mod = bench_dispatch_mod,
+		.dispatch_del = bench_dispatch_del,
+	};
+
+	bench_loop = qb_loop_create();
+	if (bench_loop == NULL) {
+		qb_perror(LOG_ERR, "qb_loop_create");
+		return -1;
+	}
+	qb_loop_signal_add(bench_loop, QB_LOOP_HIGH, SIGTERM, NULL,
+			   bench_server_stop, NULL);
+	qb_loop_signal_add(bench_loop, QB_LOOP_HIGH, SIGINT, NULL,
+			   bench_server_stop, NULL);
+
+	bench_service = qb_ipcs_create(name, 0, type, &sh);
+	if (bench_service == NULL) {
+		qb_perror(LOG_ERR, "qb_ipcs_create");
+		return -1;
+	}
+	qb_ipcs_poll_handlers_set(bench_service, &ph);
+	res = qb_ipcs_run(bench_service);
+	if (res != 0) {
+		errno = -res;
+		qb_perror(LOG_ERR, "qb_ipcs_run");
+		return -1;
+	}
+	qb_loop_run(bench_loop);
+	qb_loop_destroy(bench_loop);
+	return 0;
+}
+
+static pid_t
+bench_server_start(enum qb_ipc_type type, const char *name)
+{
+	pid_t pid;
+
+	fflush(NULL);
+	pid = fork();
+	if (pid == 0) {
+		exit(bench_server_run(type, name) == 0 ? EXIT_SUCCESS :
+		     EXIT_FAILURE);
+	}
+	return pid;
+}
+
+/*
+ **************************************************************************
+ * CLIENT
+ */
+
+static void *
+bench_events_thread(void *data)
+{
+	struct bench_client *client = (struct bench_client *)data;
+	const struct bench_point *p = client->p;
+	uint64_t expected = (uint64_t)p->threads * p->iterations * p->fanout;
+	size_t len = sizeof(struct qb_ipc_response_header) + p->size;
+	char *buf;
+	ssize_t res;
+
+	buf = malloc(len);
+	if (buf == NULL) {
+		client->error = -ENOMEM;
+		return NULL;
+	}
+	while (client->events < expected) {
+		res = qb_ipcc_event_recv(client->conn, buf, len, 1000);
+		if (res == -ETIMEDOUT || res == -EAGAIN) {
+			if (qb_atomic_int_get(&client->workers_running)) {
+				continue;
+			}
+			/* the last events can't be far behind the responses */
+			res = qb_ipcc_event_recv(client->conn, buf, len,
+						 BENCH_RECV_TIMEOUT);
+		}
+		if (res < 0) {
+			client->error = res;
+			break;
+		}
+		client->events++;
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * One thread on its own connection: keep up to depth requests in flight.
+ */
+static int32_t
+bench_pipelined(struct bench_thread *t, struct iovec *iov, void *rsp,
+		size_t rsp_len)
+{
+	const struct bench_point *p = t->client->p;
+	qb_ipcc_connection_t *conn = t->client->conn;
+	uint64_t *sent_at;
+	uint32_t sent = 0;
+	uint32_t recvd = 0;
+	ssize_t res;
+
+	sent_at = calloc(p->depth, sizeof(uint64_t));
+	if (sent_at == NULL) {
+		return -ENOMEM;
+	}
+	while (recvd < p->iterations) {
+		while (sent < p->iterations && sent - recvd < p->depth) {
+			sent_at[sent % p->depth] = qb_util_nano_current_get();
+			res = qb_ipcc_sendv(conn, iov, 2);
+			if (res == -EAGAIN) {
+				if (sent > recvd) {
+					break;
+				}
+				(void)poll(NULL, 0, 1);
+				continue;
+			}
+			if (res < 0) {
+				goto done;
+			}
+			sent++;
+		}
+		res = qb_ipcc_recv(conn, rsp, rsp_len, BENCH_RECV_TIMEOUT);
+		if (res < 0) {
+			goto done;
+		}
+		t->latencies[recvd] = qb_util_nano_current_get() -
+			sent_at[recvd % p->depth];
+		recvd++;
+	}
+	res = 0;
+done:
+	free(sent_at);
+	return res;
+}
+
+/*
+ * Several threads sharing the connection, one request each at a time.
+ */
+static int32_t
+bench_shared(struct bench_thread *t, struct iovec *iov, void *rsp,
+	     size_t rsp_len)
+{
+	const struct bench_point *p = t->client->p;
+	uint64_t start;
+	uint32_t i;
+	ssize_t res;
+
+	for (i = 0; i < p->iterations; i++) {
+		do {
+			start = qb_util_nano_current_get();
+			res = qb_ipcc_sendv_recv(t->client->conn, iov, 2,
+						 rsp, rsp_len,
+						 BENCH_RECV_TIMEOUT);
+		} while (res == -EAGAIN);
+		if (res < 0) {
+			return res;
+		}
+		t->latencies[i] = qb_util_nano_current_get() - start;
+	}
+	return 0;
+}
+
+static void *
+bench_worker_thread(void *data)
+{
+	struct bench_thread *t = (struct bench_thread *)data;
+	const struct bench_point *p = t->client->p;
+	struct bench_request req;
+	struct iovec iov[2];
+	size_t rsp_len = sizeof(struct qb_ipc_response_header) + p->size;
+	char *payload;
+	char *rsp;
+
+	payload = malloc(p->size + 1);
+	rsp = malloc(rsp_len);
+	if (payload == NULL || rsp == NULL) {
+		t->error = -ENOMEM;
+		goto cleanup;
+	}
+	memset(payload, 0xa5, p->size);
+
+	req.hdr.id = BENCH_MSG_REQUEST;
+	req.hdr.size = sizeof(req) + p->size;
+	req.fanout = p->fanout;
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = payload;
+	iov[1].iov_len = p->size;
+
+	if (p->threads > 1) {
+		t->error = bench_shared(t, iov, rsp, rsp_len);
+	} else {
+		t->error = bench_pipelined(t, iov, rsp, rsp_len);
+	}
+
+cleanup:
+	free(payload);
+	free(rsp);
+	return NULL;
+}
+
+static qb_ipcc_connection_t *
+bench_connect(const struct bench_point *p)
+{
+	struct qb_ipcc_connect_params params;
+	qb_ipcc_connection_t *conn;
+	size_t msg_len = sizeof(struct qb_ipc_response_header) + p->size;
+	size_t in_flight = (size_t)p->depth * p->threads;
+	int32_t tries;
+
+	memset(&params, 0, sizeof(params));
+	/* room for everything that can be in flight, with chunk headers */
+	params.max_msg_size = QB_MAX((msg_len + 64) * (in_flight + 1),
+				     BENCH_MIN_BUFFER);
+	params.max_event_size = QB_MAX((msg_len + 64) *
+				       (in_flight * p->fanout + 1),
+				       BENCH_MIN_BUFFER);
+	for (tries = 0; tries < 50; tries++) {
+		conn = qb_ipcc_connect_2(service_name, &params);
+		if (conn != NULL) {
+			return conn;
+		}
+		(void)poll(NULL, 0, 100);
+	}
+	return NULL;
+}
+
+static ssize_t
+bench_write_all(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+	ssize_t res;
+
+	while (len > 0) {
+		res = write(fd, pos, len);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res < 0) {
+			return -errno;
+		}
+		pos += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static ssize_t
+bench_read_all(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+	ssize_t res;
+
+	while (len > 0) {
+		res = read(fd, pos, len);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res < 0) {
+			return -errno;
+		}
+		if (res == 0) {
+			return -EPIPE;
+		}
+		pos += res;
+		len -= res;
+	}
+	return 0;
+}
+
+/*
+ * A client process: say when connected, wait for the start signal
+ * (start_fd being closed), run and write the latencies to result_fd.
+ */
+static int32_t
+bench_client_run(const struct bench_point *p, int start_fd, int result_fd)
+{
+	struct bench_client client;
+	struct bench_thread *threads;
+	struct bench_result result;
+	pthread_t events_thread;
+	uint64_t *latencies;
+	int32_t ready = QB_FALSE;
+	uint32_t i;
+	char c = 'r';
+
+	memset(&result, 0, sizeof(result));
+	memset(&client, 0, sizeof(client));
+	client.p = p;
+	threads = calloc(p->threads, sizeof(struct bench_thread));
+	latencies = calloc((size_t)p->threads * p->iterations,
+			   sizeof(uint64_t));
+	if (threads == NULL || latencies == NULL) {
+		result.error = -ENOMEM;
+		goto report;
+	}
+	client.conn = bench_connect(p);
+	if (client.conn == NULL) {
+		result.error = errno ? -errno : -ECONNREFUSED;
+		goto report;
+	}
+	if (p->threads > 1) {
+		result.error = qb_ipcc_threadsafe_set(client.conn, QB_TRUE);
+		if (result.error < 0) {
+			goto report;
+		}
+	}
+	if (bench_write_all(result_fd, &c, 1) < 0) {
+		goto disconnect;
+	}
+	ready = QB_TRUE;
+	if (read(start_fd, &c, 1) != 0) {
+		goto disconnect;
+	}
+
+	result.start_ns = qb_util_nano_current_get();
+	qb_atomic_int_set(&client.workers_running, QB_TRUE);
+	if (p->fanout > 0 &&
+	    pthread_create(&events_thread, NULL, bench_events_thread,
+			   &client) != 0) {
+		result.error = -errno;
+		goto disconnect;
+	}
+	for (i = 0; i < p->threads; i++) {
+		threads[i].client = &client;
+		threads[i].latencies = latencies + (size_t)i * p->iterations;
+		if (pthread_create(&threads[i].thread, NULL,
+				   bench_worker_thread, &threads[i]) != 0) {
+			threads[i].error = -errno;
+			break;
+		}
+	}
+	while (i > 0) {
+		pthread_join(threads[--i].thread, NULL);
+	}
+	qb_atomic_int_set(&client.workers_running, QB_FALSE);
+	if (p->fanout > 0) {
+		pthread_join(events_thread, NULL);
+	}
+	result.end_ns = qb_util_nano_current_get();
+
+	for (i = 0; i < p->threads; i++) {
+		if (threads[i].error < 0) {
+			result.error = threads[i].error;
+		}
+	}
+	if (client.error < 0) {
+		result.error = client.error;
+	}
+	result.events = client.events;
+	if (result.error == 0) {
+		result.samples = (uint64_t)p->threads * p->iterations;
+	}
+
+disconnect:
+	qb_ipcc_disconnect(client.conn);
+report:
+	if (!ready) {
+		c = 'e';
+		(void)bench_write_all(result_fd, &c, 1);
+	}
+	if (result.error == 0 && result.start_ns == 0) {
+		result.error = -ECONNABORTED;
+	}
+	(void)bench_write_all(result_fd, &result, sizeof(result));
+	(void)bench_write_all(result_fd, latencies,
+			      result.samples * sizeof(uint64_t));
+	free(latencies);
+	free(threads);
+	return result.error;
+}
+
+/*
+ **************************************************************************
+ * RESULTS
+ */
+
+static int
+bench_u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest rank percentile of sorted samples, in microseconds */
+static double
+bench_percentile_us(const uint64_t *sorted, uint64_t n, double q)
+{
+	uint64_t rank;
+
+	if (n == 0) {
+		return 0.0;
+	}
+	rank = (uint64_t)(q * n + 0.999999);
+	if (rank == 0) {
+		rank = 1;
+	}
+	if (rank > n) {
+		rank = n;
+	}
+	return sorted[rank - 1] / 1000.0;
+}
+
+static void
+bench_report(const struct bench_point *p, int32_t error, uint64_t elapsed_ns,
+	     uint64_t *latencies, uint64_t samples, uint64_t events,
+	     int32_t *first)
+{
+	double secs = elapsed_ns / (double)QB_TIME_NS_IN_SEC;
+	double bytes;
+	double sum = 0.0;
+	uint64_t i;
+
+	printf("%s  {\"transport\": \"%s\", \"msg_size\": %u, "
+	       "\"clients\": %u, \"threads\": %u, \"depth\": %u, "
+	       "\"fanout\": %u, \"iterations\": %u",
+	       *first ? "" : ",\n", p->transport, p->size, p->clients,
+	       p->threads, p->depth, p->fanout, p->iterations);
+	*first = QB_FALSE;
+	if (error < 0 || samples == 0 || elapsed_ns == 0) {
+		printf(", \"error\": \"%s\"}",
+		       error < 0 ? strerror(-error) :
+		       samples == 0 ? "no samples" : "no time elapsed");
+		fflush(stdout);
+		return;
+	}
+
+	qsort(latencies, samples, sizeof(uint64_t), bench_u64_cmp);
+	for (i = 0; i < samples; i++) {
+		sum += latencies[i];
+	}
+	/* payload carried by requests, responses and events */
+	bytes = (double)p->size * (2 * samples + events);
+	printf(", \"requests\": %" PRIu64 ", \"events\": %" PRIu64
+	       ", \"elapsed_sec\": %.6f, \"requests_per_sec\": %.1f"
+	       ", \"events_per_sec\": %.1f, \"mb_per_sec\": %.3f"
+	       ", \"latency_us\": {\"mean\": %.3f, \"p50\": %.3f"
+	       ", \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}}",
+	       samples, events, secs, samples / secs, events / secs,
+	       bytes / secs / (1024.0 * 1024.0),
+	       sum / samples / 1000.0,
+	       bench_percentile_us(latencies, samples, 0.50),
+	       bench_percentile_us(latencies, samples, 0.99),
+	       bench_percentile_us(latencies, samples, 0.999),
+	       latencies[samples - 1] / 1000.0);
+	fflush(stdout);
+}
+
+static void
+bench_point_run(const struct bench_point *p, int32_t *first)
+{
+	int start_pipe[2];
+	int *result_fds;
+	pid_t *pids;
+	struct bench_result result;
+	uint64_t *latencies;
+	uint64_t samples = 0;
+	uint64_t events = 0;
+	uint64_t start_ns = UINT64_MAX;
+	uint64_t end_ns = 0;
+	int32_t error = 0;
+	uint32_t started;
+	uint32_t i;
+	char c;
+
+	qb_log(LOG_INFO, "%s: size %u, %u clients x %u threads, depth %u, "
+	       "fan-out %u", p->transport, p->size, p->clients, p->threads,
+	       p->depth, p->fanout);
+
+	result_fds = calloc(p->clients, sizeof(int));
+	pids = calloc(p->clients, sizeof(pid_t));
+	latencies = calloc((size_t)p->clients * p->threads * p->iterations,
+			   sizeof(uint64_t));
+	if (result_fds == NULL || pids == NULL || latencies == NULL ||
+	    pipe(start_pipe) != 0) {
+		bench_report(p, -ENOMEM, 0, NULL, 0, 0, first);
+		goto cleanup;
+	}
+
+	fflush(NULL);
+	for (started = 0; started < p->clients; started++) {
+		int result_pipe[2];
+
+		if (pipe(result_pipe) != 0) {
+			error = -errno;
+			break;
+		}
+		pids[started] = fork();
+		if (pids[started] == 0) {
+			close(start_pipe[1]);
+			close(result_pipe[0]);
+			for (i = 0; i < started; i++) {
+				close(result_fds[i]);
+			}
+			exit(bench_client_run(p, start_pipe[0],
+					      result_pipe[1]) == 0 ?
+			     EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		close(result_pipe[1]);
+		if (pids[started] < 0) {
+			error = -errno;
+			close(result_pipe[0]);
+			break;
+		}
+		result_fds[started] = result_pipe[0];
+	}
+	close(start_pipe[0]);
+
+	/* everyone connected (or given up) before the clock starts */
+	for (i = 0; i < started; i++) {
+		if (bench_read_all(result_fds[i], &c, 1) < 0 || c != 'r') {
+			error = error ? error : -ECONNREFUSED;
+		}
+	}
+	close(start_pipe[1]);
+
+	for (i = 0; i < started; i++) {
+		if (bench_read_all(result_fds[i], &result,
+				   sizeof(result)) < 0) {
+			error = error ? error : -EPIPE;
+			continue;
+		}
+		if (result.error < 0) {
+			error = error ? error : result.error;
+			continue;
+		}
+		if (bench_read_all(result_fds[i], latencies + samples,
+				   result.samples * sizeof(uint64_t)) < 0) {
+			error = error ? error : -EPIPE;
+			continue;
+		}
+		samples += result.samples;
+		events += result.events;
+		start_ns = QB_MIN(start_ns, result.start_ns);
+		end_ns = QB_MAX(end_ns, result.end_ns);
+	}
+	for (i = 0; i < started; i++) {
+		close(result_fds[i]);
+		waitpid(pids[i], NULL, 0);
+	}
+
+	bench_report(p, error, end_ns > start_ns ? end_ns - start_ns : 0,
+		     latencies, samples, events, first);
+
+cleanup:
+	free(latencies);
+	free(pids);
+	free(result_fds);
+}
+
+/*
+ **************************************************************************
+ * MAIN
+ */
+
+static int32_t
+bench_list_parse(const char *arg, uint32_t *values)
+{
+	char *copy = strdup(arg);
+	char *tok;
+	char *save = NULL;
+	char *end;
+	int32_t n = 0;
+
+	if (copy == NULL) {
+		return -ENOMEM;
+	}
+	for (tok = strtok_r(copy, ",", &save); tok != NULL;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (n == BENCH_MAX_VALUES) {
+			n = -E2BIG;
+			break;
+		}
+		errno = 0;
+		values[n] = strtoul(tok, &end, 0);
+		if (errno != 0 || *end != '\0' || end == tok) {
+			n = -EINVAL;
+			break;
+		}
+		n++;
+	}
+	free(copy);
+	return n;
+}
+
+static int32_t
+bench_transports_parse(const char *arg, enum qb_ipc_type *types,
+		       const char **names)
+{
+	char *copy = strdup(arg);
+	char *tok;
+	char *save = NULL;
+	int32_t n = 0;
+
+	if (copy == NULL) {
+		return -ENOMEM;
+	}
+	for (tok = strtok_r(copy, ",", &save); tok != NULL && n < 2;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (strcmp(tok, "shm") == 0) {
+			types[n] = QB_IPC_SHM;
+			names[n] = "shm";
+		} else if (strcmp(tok, "socket") == 0) {
+			types[n] = QB_IPC_SOCKET;
+			names[n] = "socket";
+		} else {
+			n = -EINVAL;
+			break;
+		}
+		n++;
+	}
+	if (tok != NULL && n > 0) {
+		n = -E2BIG;
+	}
+	free(copy);
+	return n;
+}
+
+static void
+show_usage(const char *name)
+{
+	printf("usage: %s [options]\n", name);
+	printf("\n");
+	printf("Lists are comma separated; every combination is run and\n");
+	printf("reported as one element of a JSON array on stdout.\n");
+	printf("\n");
+	printf("  -S             only run a server (first transport)\n");
+	printf("  -C             only run clients, against a running server\n");
+	printf("  -n <name>      service name (default ipcbench)\n");
+	printf("  -t <list>      transports: shm, socket (default shm,socket)\n");
+	printf("  -s <list>      payload sizes in bytes (default 64,1024,65536)\n");
+	printf("  -c <list>      client processes (default 1)\n");
+	printf("  -T <list>      threads per client, sharing its connection (default 1)\n");
+	printf("  -d <list>      requests in flight per single threaded client (default 1)\n");
+	printf("  -e <list>      events sent back per request (default 0)\n");
+	printf("  -i <count>     requests per thread (default 10000)\n");
+	printf("  -v             verbose\n");
+	printf("  -h             show this help text\n");
+	printf("\n");
+}
+
+int32_t
+main(int32_t argc, char *argv[])
+{
+	const char *options = "SCn:t:s:c:T:d:e:i:vh";
+	enum qb_ipc_type types[2] = { QB_IPC_SHM, QB_IPC_SOCKET };
+	const char *transports[2] = { "shm", "socket" };
+	uint32_t sizes[BENCH_MAX_VALUES] = { 64, 1024, 65536 };
+	uint32_t clients[BENCH_MAX_VALUES] = { 1 };
+	uint32_t threads[BENCH_MAX_VALUES] = { 1 };
+	uint32_t depths[BENCH_MAX_VALUES] = { 1 };
+	uint32_t fanouts[BENCH_MAX_VALUES] = { 0 };
+	int32_t n_types = 2;
+	int32_t n_sizes = 3;
+	int32_t n_clients = 1;
+	int32_t n_threads = 1;
+	int32_t n_depths = 1;
+	int32_t n_fanouts = 1;
+	uint32_t iterations = 10000;
+	int32_t server_only = QB_FALSE;
+	int32_t client_only = QB_FALSE;
+	int32_t verbose = 0;
+	int32_t bad = QB_FALSE;
+	int32_t first = QB_TRUE;
+	struct bench_point p;
+	char name[NAME_MAX];
+	int32_t t, s, c, th, d, e;
+	pid_t server = 0;
+	int32_t opt;
+
+	while ((opt = getopt(argc, argv, options)) != -1) {
+		switch (opt) {
+		case 'S':
+			server_only = QB_TRUE;
+			break;
+		case 'C':
+			client_only = QB_TRUE;
+			break;
+		case 'n':
+			service_name = optarg;
+			break;
+		case 't':
+			n_types = bench_transports_parse(optarg, types,
+							 transports);
+			bad |= (n_types <= 0);
+			break;
+		case 's':
+			n_sizes = bench_list_parse(optarg, sizes);
+			bad |= (n_sizes <= 0);
+			break;
+		case 'c':
+			n_clients = bench_list_parse(optarg, clients);
+			bad |= (n_clients <= 0);
+			break;
+		case 'T':
+			n_threads = bench_list_parse(optarg, threads);
+			bad |= (n_threads <= 0);
+			break;
+		case 'd':
+			n_depths = bench_list_parse(optarg, depths);
+			bad |= (n_depths <= 0);
+			break;
+		case 'e':
+			n_fanouts = bench_list_parse(optarg, fanouts);
+			bad |= (n_fanouts <= 0);
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			bad |= (iterations == 0);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+	if (bad || (server_only && client_only)) {
+		show_usage(argv[0]);
+		exit(1);
+	}
+
+	qb_log_init("ipcbench", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_NOTICE + verbose);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (server_only) {
+		return bench_server_run(types[0], service_name) == 0 ?
+			EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (client_only) {
+		/* whatever the server uses; the first one is only a label */
+		n_types = 1;
+	}
+
+	printf("[\n");
+	for (t = 0; t < n_types; t++) {
+		if (!client_only) {
+			snprintf(name, sizeof(name), "ipcbench-%d-%s",
+				 getpid(), transports[t]);
+			service_name = name;
+			server = bench_server_start(types[t], service_name);
+			if (server < 0) {
+				qb_perror(LOG_ERR, "fork");
+				continue;
+			}
+		}
+		memset(&p, 0, sizeof(p));
+		p.type = types[t];
+		p.transport = transports[t];
+		p.iterations = iterations;
+		for (s = 0; s < n_sizes; s++)
+		for (c = 0; c < n_clients; c++)
+		for (th = 0; th < n_threads; th++)
+		for (d = 0; d < n_depths; d++)
+		for (e = 0; e < n_fanouts; e++) {
+			p.size = sizes[s];
+			p.clients = clients[c];
+			p.threads = threads[th];
+			p.depth = depths[d];
+			p.fanout = fanouts[e];
+			if (p.clients == 0 || p.threads == 0 || p.depth == 0) {
+				continue;
+			}
+			if (p.threads > 1 && p.depth > 1) {
+				qb_log(LOG_NOTICE, "skipping depth %u with %u "
+				       "threads: shared connections keep one "
+				       "request in flight per thread",
+				       p.depth, p.threads);
+				continue;
+			}
+			bench_point_run(&p, &first);
+		}
+		if (server > 0) {
+			kill(server, SIGTERM);
+			waitpid(server, NULL, 0);
+			server = 0;
+		}
+	}
+	printf("\n]\n");
+	return EXIT_SUCCESS;
+}